@@ -0,0 +1,219 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/arena.h"
+#include "phenom/sysutil.h"
+#include <ck_cc.h>
+
+#define DEFAULT_CHUNK_SIZE (16 * 1024)
+#define ARENA_ALIGN 16
+
+// Allocations are carved out of the memory that follows the header
+struct arena_chunk {
+  struct arena_chunk *next;
+  uint64_t size;
+  char *ptr, *end;
+} CK_CC_ALIGN(ARENA_ALIGN);
+
+struct arena_defer {
+  struct arena_defer *next;
+  void (*func)(void *arg);
+  void *arg;
+};
+
+// The first chunk is the one we're carving up; the others are full, or
+// were made for a single large allocation
+struct ph_arena {
+  struct arena_chunk *chunks;
+  struct arena_defer *defers;
+  uint64_t chunk_size;
+  uint64_t used;
+};
+
+static struct {
+  ph_memtype_t arena, chunk;
+} mt;
+
+static struct ph_memtype_def defs[] = {
+  { "arena", "arena", sizeof(ph_arena_t), PH_MEM_FLAGS_ZERO },
+  { "arena", "chunk", 0, 0 },
+};
+
+#ifdef HAVE___THREAD
+static __thread ph_arena_t *current_arena;
+#else
+static pthread_key_t current_key;
+#endif
+
+static void init_arena(void)
+{
+  ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.arena);
+#ifndef HAVE___THREAD
+  pthread_key_create(&current_key, NULL);
+#endif
+}
+PH_LIBRARY_INIT(init_arena, 0)
+
+ph_arena_t *ph_arena_new(uint64_t chunk_size)
+{
+  ph_arena_t *arena;
+
+  arena = ph_mem_alloc(mt.arena);
+  if (!arena) {
+    return NULL;
+  }
+  arena->chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE;
+  return arena;
+}
+
+static struct arena_chunk *new_chunk(uint64_t size)
+{
+  struct arena_chunk *chunk;
+
+  chunk = ph_mem_alloc_size(mt.chunk, sizeof(*chunk) + size);
+  if (!chunk) {
+    return NULL;
+  }
+  chunk->size = size;
+  chunk->ptr = (char*)(chunk + 1);
+  chunk->end = chunk->ptr + size;
+  return chunk;
+}
+
+void *ph_arena_alloc(ph_arena_t *arena, uint64_t size)
+{
+  struct arena_chunk *chunk = arena->chunks;
+  void *ptr;
+
+  size = (MAX(size, 1) + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+
+  if (ph_unlikely(!chunk || (uint64_t)(chunk->end - chunk->ptr) < size)) {
+    if (size > arena->chunk_size / 4) {
+      // Too big to share a chunk.  Put it behind the one we're carving
+      // up, so that we can keep going with that
+      chunk = new_chunk(size);
+      if (!chunk) {
+        return NULL;
+      }
+      if (arena->chunks) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+      } else {
+        chunk->next = NULL;
+        arena->chunks = chunk;
+      }
+      chunk->ptr = chunk->end;
+      arena->used += size;
+      return chunk + 1;
+    }
+
+    chunk = new_chunk(arena->chunk_size);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  ptr = chunk->ptr;
+  chunk->ptr += size;
+  arena->used += size;
+  return ptr;
+}
+
+ph_result_t ph_arena_defer(ph_arena_t *arena,
+    void (*func)(void *arg), void *arg)
+{
+  struct arena_defer *defer;
+
+  defer = ph_arena_alloc(arena, sizeof(*defer));
+  if (!defer) {
+    return PH_NOMEM;
+  }
+  defer->func = func;
+  defer->arg = arg;
+  defer->next = arena->defers;
+  arena->defers = defer;
+  return PH_OK;
+}
+
+void ph_arena_reset(ph_arena_t *arena)
+{
+  struct arena_chunk *chunk, *keep = NULL;
+  struct arena_defer *defer;
+
+  while ((defer = arena->defers) != NULL) {
+    arena->defers = defer->next;
+    defer->func(defer->arg);
+  }
+
+  while ((chunk = arena->chunks) != NULL) {
+    arena->chunks = chunk->next;
+    if (!keep && chunk->size == arena->chunk_size) {
+      keep = chunk;
+      continue;
+    }
+    ph_mem_free(mt.chunk, chunk);
+  }
+
+  if (keep) {
+    keep->next = NULL;
+    keep->ptr = (char*)(keep + 1);
+  }
+  arena->chunks = keep;
+  arena->used = 0;
+}
+
+void ph_arena_free(ph_arena_t *arena)
+{
+  ph_arena_reset(arena);
+  if (arena->chunks) {
+    ph_mem_free(mt.chunk, arena->chunks);
+  }
+  if (ph_arena_current() == arena) {
+    ph_arena_set_current(NULL);
+  }
+  ph_mem_free(mt.arena, arena);
+}
+
+uint64_t ph_arena_used(ph_arena_t *arena)
+{
+  return arena->used;
+}
+
+ph_arena_t *ph_arena_set_current(ph_arena_t *arena)
+{
+  ph_arena_t *prev = ph_arena_current();
+
+#ifdef HAVE___THREAD
+  current_arena = arena;
+#else
+  pthread_setspecific(current_key, arena);
+#endif
+  return prev;
+}
+
+ph_arena_t *ph_arena_current(void)
+{
+#ifdef HAVE___THREAD
+  return current_arena;
+#else
+  return pthread_getspecific(current_key);
+#endif
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -21,8 +21,23 @@
 #include "phenom/log.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
+#include "phenom/counter.h"
 #include <ctype.h>
 
+// How many buffers ph_bufq_stm_write() hands to a single writev; large
+// enough that a flush of a typical socket write queue is one syscall
+#define BUFQ_MAX_IOV 64
+
+// Bounds on how much ph_bufq_stm_read() asks for in a single read.
+// The read size doubles each time a read fills the space offered and
+// halves when a read uses less than a quarter of it
+#define BUFQ_MIN_READ_SIZE (8 * 1024)
+#define BUFQ_MAX_READ_SIZE (256 * 1024)
+// Fresh buffers for a read are allocated in pieces of up to this size
+#define BUFQ_READ_CHUNK (64 * 1024)
+#define BUFQ_MAX_READ_IOV \
+  (1 + (BUFQ_MAX_READ_SIZE + BUFQ_READ_CHUNK - 1) / BUFQ_READ_CHUNK)
+
 struct ph_buf {
   ph_refcnt_t ref;
   ph_buf_t *slice;
@@ -45,6 +60,22 @@ struct ph_bufq {
   // Maximum amount of storage to allow
   uint64_t max_size;
   uint64_t max_record_size;
+  // How much to ask for in the next read; adapts to the stream
+  uint64_t read_size;
+  // Bytes of buffer storage held by the queue, consumed or not
+  uint64_t resident;
+  // Bytes waiting to be consumed
+  uint64_t len;
+
+  // See ph_bufq_set_watermarks()
+  uint64_t low_watermark, high_watermark;
+  bool above_high;
+  ph_bufq_watermark_func watermark_func;
+  void *watermark_arg;
+
+  // An error that ended a ph_bufq_stm_read_bytes() that had already
+  // read some data, reported by the next read
+  int read_err;
 
   bool last_overflow;
   uint64_t last_search_index;
@@ -55,23 +86,40 @@ struct ph_bufq {
 };
 
 static ph_memtype_def_t defs[] = {
-  { "buffer", "object", sizeof(ph_buf_t), PH_MEM_FLAGS_ZERO },
-  { "buffer", "8k", 8*1024, 0 },
-  { "buffer", "16k", 16*1024, 0 },
-  { "buffer", "32k", 32*1024, 0 },
-  { "buffer", "64k", 64*1024, 0 },
+  { "buffer", "object", sizeof(ph_buf_t),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED },
+  { "buffer", "8k", 8*1024, PH_MEM_FLAGS_CACHED },
+  { "buffer", "16k", 16*1024, PH_MEM_FLAGS_CACHED },
+  { "buffer", "32k", 32*1024, PH_MEM_FLAGS_CACHED },
+  { "buffer", "64k", 64*1024, PH_MEM_FLAGS_CACHED },
   { "buffer", "vsize", 0, 0 },
-  { "buffer", "queue", sizeof(ph_bufq_t), PH_MEM_FLAGS_ZERO },
-  { "buffer", "queue_ent", sizeof(struct ph_bufq_ent), PH_MEM_FLAGS_ZERO },
+  { "buffer", "queue", sizeof(ph_bufq_t),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED },
+  { "buffer", "queue_ent", sizeof(struct ph_bufq_ent),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED },
 };
 
 static struct {
   ph_memtype_t obj, f8k, f16k, f32k, f64k, vsize, queue, queue_ent;
 } mt;
 
+static ph_counter_scope_t *bufq_counters;
+static const char *counter_names[] = {
+  "queues",           // buffer queues in existence
+  "resident_bytes",   // storage held by those queues
+  "released_bytes",   // storage given back by ph_bufq_shrink()
+};
+#define SLOT_QUEUES 0
+#define SLOT_RESIDENT 1
+#define SLOT_RELEASED 2
+
 static void buffer_init(void)
 {
   ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.obj);
+
+  bufq_counters = ph_counter_scope_define(NULL, "buffer", 4);
+  ph_counter_scope_register_counter_block(bufq_counters,
+      sizeof(counter_names)/sizeof(counter_names[0]), 0, counter_names);
 }
 
 PH_LIBRARY_INIT(buffer_init, 0)
@@ -132,16 +180,16 @@ static inline uint64_t select_size(uint64_t size, ph_memtype_t *mtp)
 {
   ph_memtype_t t;
 
-  if (size < 8192) {
+  if (size <= 8192) {
     t = mt.f8k;
     size = 8192;
-  } else if (size < 16 * 1024) {
+  } else if (size <= 16 * 1024) {
     t = mt.f16k;
     size = 16 * 1024;
-  } else if (size < 32 * 1024) {
+  } else if (size <= 32 * 1024) {
     t = mt.f32k;
     size = 32 * 1024;
-  } else if (size < 64 * 1024) {
+  } else if (size <= 64 * 1024) {
     t = mt.f64k;
     size = 64 * 1024;
   } else {
@@ -332,7 +380,7 @@ ph_buf_t *ph_buf_concat(uint64_t total_length, uint32_t num_buffers,
   return buf;
 }
 
-static struct ph_bufq_ent *q_add_new_buf(ph_bufq_t *q, uint64_t bufsize)
+static struct ph_bufq_ent *new_ent(uint64_t bufsize)
 {
   struct ph_bufq_ent *ent;
 
@@ -347,7 +395,47 @@ static struct ph_bufq_ent *q_add_new_buf(ph_bufq_t *q, uint64_t bufsize)
     return NULL;
   }
 
+  return ent;
+}
+
+static void free_ent(struct ph_bufq_ent *ent)
+{
+  ph_buf_delref(ent->buf);
+  ph_mem_free(mt.queue_ent, ent);
+}
+
+static void q_adjust_resident(ph_bufq_t *q, int64_t delta)
+{
+  q->resident += delta;
+  ph_counter_scope_add(bufq_counters, SLOT_RESIDENT, delta);
+}
+
+static void q_insert_tail(ph_bufq_t *q, struct ph_bufq_ent *ent)
+{
   PH_STAILQ_INSERT_TAIL(&q->fifo, ent, ent);
+  q_adjust_resident(q, ph_buf_len(ent->buf));
+}
+
+static void q_free_head(ph_bufq_t *q)
+{
+  struct ph_bufq_ent *ent = PH_STAILQ_FIRST(&q->fifo);
+
+  PH_STAILQ_REMOVE_HEAD(&q->fifo, ent);
+  q_adjust_resident(q, -(int64_t)ph_buf_len(ent->buf));
+  q->len -= ent->wpos - ent->rpos;
+  free_ent(ent);
+}
+
+static struct ph_bufq_ent *q_add_new_buf(ph_bufq_t *q, uint64_t bufsize)
+{
+  struct ph_bufq_ent *ent;
+
+  ent = new_ent(bufsize);
+  if (!ent) {
+    return NULL;
+  }
+
+  q_insert_tail(q, ent);
 
   return ent;
 }
@@ -363,12 +451,10 @@ ph_bufq_t *ph_bufq_new(uint64_t max_size)
 
   PH_STAILQ_INIT(&q->fifo);
   q->max_size = max_size;
+  q->read_size = BUFQ_MIN_READ_SIZE;
+  ph_counter_scope_add(bufq_counters, SLOT_QUEUES, 1);
 
-  if (!q_add_new_buf(q, 0)) {
-    ph_mem_free(mt.queue, q);
-    return NULL;
-  }
-
+  // Storage is allocated by the first append or read
   return q;
 }
 
@@ -380,7 +466,77 @@ uint64_t ph_bufq_get_max_record_size(ph_bufq_t *q) {
   return q->max_record_size;
 }
 
-ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
+uint64_t ph_bufq_len(ph_bufq_t *q)
+{
+  return q->len;
+}
+
+// Notify the watermark function if the length of the queue has
+// crossed a watermark
+static void check_watermarks(ph_bufq_t *q)
+{
+  uint64_t len;
+
+  if (!q->watermark_func) {
+    return;
+  }
+  if (!q->high_watermark) {
+    // Disabled; don't leave anyone waiting for the low watermark
+    if (q->above_high) {
+      q->above_high = false;
+      q->watermark_func(q, false, q->watermark_arg);
+    }
+    return;
+  }
+
+  len = q->len;
+  if (!q->above_high && len >= q->high_watermark) {
+    q->above_high = true;
+    q->watermark_func(q, true, q->watermark_arg);
+  } else if (q->above_high && len <= q->low_watermark) {
+    q->above_high = false;
+    q->watermark_func(q, false, q->watermark_arg);
+  }
+}
+
+void ph_bufq_set_watermarks(ph_bufq_t *q, uint64_t low, uint64_t high)
+{
+  q->low_watermark = MIN(low, high);
+  q->high_watermark = high;
+  check_watermarks(q);
+}
+
+void ph_bufq_set_watermark_func(ph_bufq_t *q, ph_bufq_watermark_func func,
+    void *arg)
+{
+  q->watermark_func = func;
+  q->watermark_arg = arg;
+  q->above_high = false;
+  if (q->high_watermark) {
+    check_watermarks(q);
+  }
+}
+
+bool ph_bufq_above_watermark(ph_bufq_t *q)
+{
+  return q->above_high;
+}
+
+uint64_t ph_bufq_get_max_size(ph_bufq_t *q)
+{
+  return q->max_size;
+}
+
+// How many more bytes the queue may hold
+static uint64_t bufq_room(ph_bufq_t *q)
+{
+  if (!q->max_size) {
+    return UINT64_MAX;
+  }
+  return q->len < q->max_size ? q->max_size - q->len : 0;
+}
+
+static ph_result_t do_append(ph_bufq_t *q, const void *buf, uint64_t len,
     uint64_t *added_bytes)
 {
   struct ph_bufq_ent *last, *append;
@@ -388,6 +544,16 @@ ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
   uint64_t avail = 0;
   uint64_t consumed = 0;
 
+  if (len > 0) {
+    len = MIN(len, bufq_room(q));
+    if (len == 0) {
+      if (added_bytes) {
+        *added_bytes = 0;
+      }
+      return PH_BUSY;
+    }
+  }
+
   last = PH_STAILQ_LAST(&q->fifo, ph_bufq_ent, ent);
   if (last) {
     avail = ph_buf_len(last->buf) - last->wpos;
@@ -404,16 +570,19 @@ ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
   }
 
   if (len == 0) {
+    q->len += consumed;
     if (added_bytes) {
       *added_bytes = consumed;
     }
     return PH_OK;
   }
 
-  // We need more storage
-  append = q_add_new_buf(q, len);
+  // We need more storage.  The first buffer of an empty queue gets at
+  // least the default size so that later appends can top it off
+  append = q_add_new_buf(q, !last && len < BUFQ_MIN_READ_SIZE ? 0 : len);
 
   if (!append) {
+    q->len += consumed;
     if (added_bytes) {
       *added_bytes = consumed;
     }
@@ -426,6 +595,7 @@ ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
   ph_buf_copy_mem(append->buf, cbuf, len, 0);
   append->wpos = len;
   consumed += len;
+  q->len += consumed;
 
   if (added_bytes) {
     *added_bytes = consumed;
@@ -434,27 +604,13 @@ ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
   return PH_OK;
 }
 
-static uint64_t bufq_len(ph_bufq_t *q, uint32_t *num_ents)
+ph_result_t ph_bufq_append(ph_bufq_t *q, const void *buf, uint64_t len,
+    uint64_t *added_bytes)
 {
-  uint64_t avail = 0;
-  struct ph_bufq_ent *ent;
-  uint32_t n = 0;
-
-  PH_STAILQ_FOREACH(ent, &q->fifo, ent) {
-    avail += ent->wpos - ent->rpos;
-    n++;
-  }
-
-  if (num_ents) {
-    *num_ents = n;
-  }
+  ph_result_t res = do_append(q, buf, len, added_bytes);
 
-  return avail;
-}
-
-uint64_t ph_bufq_len(ph_bufq_t *q)
-{
-  return bufq_len(q, NULL);
+  check_watermarks(q);
+  return res;
 }
 
 static void gc_bufq(ph_bufq_t *q)
@@ -480,26 +636,26 @@ static void gc_bufq(ph_bufq_t *q)
     }
 
     // We don't need this one
-    PH_STAILQ_REMOVE_HEAD(&q->fifo, ent);
-    ph_buf_delref(ent->buf);
-    ph_mem_free(mt.queue_ent, ent);
+    q_free_head(q);
   }
+
+  // We're called after data has been consumed
+  check_watermarks(q);
 }
 
 static ph_buf_t *slice_bufq(ph_bufq_t *q, uint64_t len, bool consume)
 {
   struct ph_bufq_ent *ent;
   uint64_t copy_len, next = 0;
-  uint32_t n;
   ph_buf_t *buf = NULL;
 
-  if (len == 0 || len > bufq_len(q, &n)) {
+  if (len == 0 || len > q->len) {
     return NULL;
   }
 
-  if (n == 1) {
+  ent = PH_STAILQ_FIRST(&q->fifo);
+  if (ent->wpos - ent->rpos >= len) {
     // We can simply slice the first one
-    ent = PH_STAILQ_FIRST(&q->fifo);
     buf = ph_buf_slice(ent->buf, ent->rpos, len);
 
     if (!buf) {
@@ -508,6 +664,7 @@ static ph_buf_t *slice_bufq(ph_bufq_t *q, uint64_t len, bool consume)
 
     if (consume) {
       ent->rpos += len;
+      q->len -= len;
       gc_bufq(q);
     }
 
@@ -532,6 +689,7 @@ static ph_buf_t *slice_bufq(ph_bufq_t *q, uint64_t len, bool consume)
   }
 
   if (consume) {
+    q->len -= len;
     gc_bufq(q);
   }
 
@@ -548,6 +706,63 @@ ph_buf_t *ph_bufq_peek_bytes(ph_bufq_t *q, uint64_t len)
   return slice_bufq(q, len, false);
 }
 
+uint64_t ph_bufq_consume_iov(ph_bufq_t *q, const struct iovec *iov,
+    int iovcnt)
+{
+  struct ph_bufq_ent *ent;
+  uint64_t copy_len, off = 0, total = 0;
+  int i = 0;
+
+  ent = PH_STAILQ_FIRST(&q->fifo);
+  while (ent && i < iovcnt) {
+    copy_len = MIN(ent->wpos - ent->rpos, iov[i].iov_len - off);
+    if (copy_len) {
+      memcpy((char*)iov[i].iov_base + off,
+          ph_buf_mem(ent->buf) + ent->rpos, copy_len);
+      ent->rpos += copy_len;
+      off += copy_len;
+      total += copy_len;
+    }
+
+    if (off == iov[i].iov_len) {
+      i++;
+      off = 0;
+    }
+    if (ent->rpos == ent->wpos) {
+      ent = PH_STAILQ_NEXT(ent, ent);
+    }
+  }
+
+  if (total) {
+    q->len -= total;
+    gc_bufq(q);
+  }
+
+  return total;
+}
+
+uint64_t ph_bufq_discard(ph_bufq_t *q, uint64_t len)
+{
+  struct ph_bufq_ent *ent;
+  uint64_t n, total = 0;
+
+  PH_STAILQ_FOREACH(ent, &q->fifo, ent) {
+    if (total == len) {
+      break;
+    }
+    n = MIN(ent->wpos - ent->rpos, len - total);
+    ent->rpos += n;
+    total += n;
+  }
+
+  if (total) {
+    q->len -= total;
+    gc_bufq(q);
+  }
+
+  return total;
+}
+
 // If the end of ent->buf is occupied by a prefix string of delim, return
 // the number of suffix bytes that we need to search into the next ent
 static uint32_t partial_match(struct ph_bufq_ent *ent, const char *delim,
@@ -681,9 +896,7 @@ static uint64_t find_record(ph_bufq_t *q, const char *delim, uint32_t delim_len,
 
           searched -= (first->wpos - first->rpos);
 
-          PH_STAILQ_REMOVE_HEAD(&q->fifo, ent);
-          ph_buf_delref(first->buf);
-          ph_mem_free(mt.queue_ent, first);
+          q_free_head(q);
         }
       }
     }
@@ -750,9 +963,10 @@ ph_buf_t *ph_bufq_peek_record(ph_bufq_t *q, const char *delim,
   return result;
 }
 
-bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
+bool ph_bufq_stm_write_bytes(ph_bufq_t *q, ph_stream_t *stm, uint64_t max,
+    uint64_t *nwrotep)
 {
-  struct iovec iov[16];
+  struct iovec iov[BUFQ_MAX_IOV];
   uint32_t nio = 0;
   struct ph_bufq_ent *ent;
   uint64_t nwrote;
@@ -762,7 +976,7 @@ bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
     uint8_t *buf = ph_buf_mem(ent->buf) + ent->rpos;
     uint64_t len = ent->wpos - ent->rpos;
 
-    if (nio >= sizeof(iov)/sizeof(iov[0])) {
+    if (nio >= sizeof(iov)/sizeof(iov[0]) || max == 0) {
       break;
     }
 
@@ -771,6 +985,9 @@ bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
       continue;
     }
 
+    len = MIN(len, max);
+    max -= len;
+
     iov[nio].iov_base = buf;
     iov[nio].iov_len = len;
     nio++;
@@ -791,6 +1008,7 @@ bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
   }
 
   if (res && nwrote > 0) {
+    q->len -= nwrote;
     // Mark them as being consumed
     PH_STAILQ_FOREACH(ent, &q->fifo, ent) {
       uint64_t ate, len = ent->wpos - ent->rpos;
@@ -814,54 +1032,212 @@ bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
   return res;
 }
 
-bool ph_bufq_stm_read(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nreadp)
+bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrotep)
+{
+  return ph_bufq_stm_write_bytes(q, stm, UINT64_MAX, nwrotep);
+}
+
+// Reads up to `max` bytes with a single ph_stm_readv(), filling the
+// room left in the last buffer and as many fresh buffers as the current
+// read size calls for.  If the stream fails, its error goes in `errp`
+static bool read_once(ph_bufq_t *q, ph_stream_t *stm, uint64_t max,
+    uint64_t *nreadp, int *errp)
 {
-  struct ph_bufq_ent *last;
-  uint64_t avail = 0, nread = 0;
+  struct iovec iov[BUFQ_MAX_READ_IOV];
+  struct ph_bufq_ent *last, *fresh[BUFQ_MAX_READ_IOV];
+  uint32_t nio = 0, nfresh = 0, i;
+  uint64_t want, offered = 0, got = 0, nread, len;
   bool res;
 
+  *errp = 0;
+  if (ph_unlikely(q->read_err)) {
+    errno = stm->last_err = q->read_err;
+    q->read_err = 0;
+    if (nreadp) {
+      *nreadp = 0;
+    }
+    return false;
+  }
+
+  want = MIN(MIN(q->read_size, max), bufq_room(q));
+  if (want == 0) {
+    errno = ENOBUFS;
+    return false;
+  }
+
   last = PH_STAILQ_LAST(&q->fifo, ph_bufq_ent, ent);
+  if (last && last->wpos < ph_buf_len(last->buf)) {
+    len = MIN(ph_buf_len(last->buf) - last->wpos, want);
+    iov[nio].iov_base = ph_buf_mem(last->buf) + last->wpos;
+    iov[nio].iov_len = len;
+    nio++;
+    offered += len;
+  } else {
+    last = NULL;
+  }
+
+  while (offered < want && nio < BUFQ_MAX_READ_IOV) {
+    len = MIN(want - offered, BUFQ_READ_CHUNK);
+    // Small requests get a whole default sized buffer so that its
+    // remaining space can take later reads
+    fresh[nfresh] = new_ent(len < BUFQ_MIN_READ_SIZE ? 0 : len);
+    if (!fresh[nfresh]) {
+      break;
+    }
+    len = MIN(ph_buf_len(fresh[nfresh]->buf), want - offered);
+    iov[nio].iov_base = ph_buf_mem(fresh[nfresh]->buf);
+    iov[nio].iov_len = len;
+    nio++;
+    nfresh++;
+    offered += len;
+  }
+
+  if (nio == 0) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  res = ph_stm_readv(stm, iov, nio, &got);
+  if (!res) {
+    *errp = ph_stm_errno(stm);
+    got = 0;
+  }
+  if (nreadp) {
+    *nreadp = got;
+  }
+
+  // Account for what landed where
+  q->len += got;
+  nread = got;
   if (last) {
-    avail = ph_buf_len(last->buf) - last->wpos;
+    len = MIN(nread, iov[0].iov_len);
+    last->wpos += len;
+    nread -= len;
   }
+  for (i = 0; i < nfresh; i++) {
+    len = MIN(nread, iov[nio - nfresh + i].iov_len);
+    // Fresh buffers that got nothing are released, except that we keep
+    // one if there is nowhere else for the next read to go
+    if (len || (i == 0 && !last)) {
+      fresh[i]->wpos = len;
+      nread -= len;
+      q_insert_tail(q, fresh[i]);
+    } else {
+      free_ent(fresh[i]);
+    }
+  }
+
+  check_watermarks(q);
 
-  if (!avail) {
-    last = q_add_new_buf(q, 0);
-    if (!last) {
-      return false;
+  // Adapt to how much the stream has been giving us; reads that were
+  // capped or that found nothing tell us nothing
+  if (got && want == q->read_size) {
+    if (got == offered) {
+      q->read_size = MIN(q->read_size * 2, BUFQ_MAX_READ_SIZE);
+    } else if (got < q->read_size / 4) {
+      q->read_size = MAX(q->read_size / 2, BUFQ_MIN_READ_SIZE);
     }
-    avail = ph_buf_len(last->buf);
   }
 
-  res = ph_stm_read(stm, ph_buf_mem(last->buf) + last->wpos, avail, &nread);
-  if (res) {
-    last->wpos += nread;
+  return res;
+}
+
+bool ph_bufq_stm_read(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nreadp)
+{
+  int err;
+
+  return read_once(q, stm, UINT64_MAX, nreadp, &err);
+}
+
+bool ph_bufq_stm_read_bytes(ph_bufq_t *q, ph_stream_t *stm, uint64_t max,
+    uint64_t *nreadp)
+{
+  uint64_t total = 0, n;
+  bool res = true;
+  int err;
+
+  while (total < max) {
+    n = 0;
+    if (!read_once(q, stm, max - total, &n, &err)) {
+      res = total > 0;
+      // We report success for the data that we already have.  Running
+      // out of room, or of data for now, will happen again on the next
+      // call, but other errors have been consumed by the stream and
+      // are held for that call to report
+      if (res && err && err != EAGAIN && err != EINTR) {
+        q->read_err = err;
+      }
+      break;
+    }
+    total += n;
+    if (n == 0) {
+      // EOF
+      break;
+    }
   }
 
   if (nreadp) {
-    *nreadp = nread;
+    *nreadp = total;
   }
 
   return res;
 }
 
-void ph_bufq_free(ph_bufq_t *q)
+uint64_t ph_bufq_get_resident_size(ph_bufq_t *q)
 {
-  struct ph_bufq_ent *ent;
+  return q->resident;
+}
 
-  while (true) {
-    ent = PH_STAILQ_FIRST(&q->fifo);
-    if (!ent) {
-      // Nothing to prune
+uint64_t ph_bufq_shrink(ph_bufq_t *q)
+{
+  uint64_t before = q->resident;
+
+  // gc_bufq() holds on to a consumed tail that has room for appends;
+  // let that go too
+  while (!PH_STAILQ_EMPTY(&q->fifo)) {
+    struct ph_bufq_ent *ent = PH_STAILQ_FIRST(&q->fifo);
+
+    if (ent->rpos != ent->wpos) {
       break;
     }
+    q_free_head(q);
+  }
 
-    // We don't need this one
-    PH_STAILQ_REMOVE_HEAD(&q->fifo, ent);
-    ph_buf_delref(ent->buf);
-    ph_mem_free(mt.queue_ent, ent);
+  if (PH_STAILQ_EMPTY(&q->fifo)) {
+    // The saved search position is gone
+    clear_searchstate(q);
+  }
+
+  if (before > q->resident) {
+    ph_counter_scope_add(bufq_counters, SLOT_RELEASED,
+        before - q->resident);
+  }
+  return before - q->resident;
+}
+
+void ph_bufq_reset(ph_bufq_t *q)
+{
+  while (!PH_STAILQ_EMPTY(&q->fifo)) {
+    q_free_head(q);
+  }
+
+  clear_searchstate(q);
+  q->max_record_size = 0;
+  q->read_size = BUFQ_MIN_READ_SIZE;
+  q->low_watermark = 0;
+  q->high_watermark = 0;
+  q->above_high = false;
+  q->watermark_func = NULL;
+  q->watermark_arg = NULL;
+}
+
+void ph_bufq_free(ph_bufq_t *q)
+{
+  while (!PH_STAILQ_EMPTY(&q->fifo)) {
+    q_free_head(q);
   }
 
+  ph_counter_scope_add(bufq_counters, SLOT_QUEUES, -1);
   ph_mem_free(mt.queue, q);
 }
 
@@ -19,9 +19,11 @@
 #include "phenom/json.h"
 #include "phenom/log.h"
 #include "phenom/printf.h"
+#include "corelib/memprof.h"
 
 static ph_variant_t *global_config = NULL;
 static ck_rwlock_t lock = CK_RWLOCK_INITIALIZER;
+static uint32_t generation = 1;
 
 void ph_config_set_global(ph_variant_t *cfg)
 {
@@ -34,6 +36,10 @@ void ph_config_set_global(ph_variant_t *cfg)
   {
     old = ck_pr_load_ptr(&global_config);
     ck_pr_store_ptr(&global_config, cfg);
+    // Skip 0 when it wraps
+    if (ck_pr_faa_32(&generation, 1) == UINT32_MAX) {
+      ck_pr_inc_32(&generation);
+    }
   }
   ck_rwlock_write_unlock(&lock);
 
@@ -41,6 +47,13 @@ void ph_config_set_global(ph_variant_t *cfg)
     // We took the ref owned by global_config
     ph_var_delref(old);
   }
+
+  ph_mem_load_config();
+}
+
+uint32_t ph_config_get_generation(void)
+{
+  return ck_pr_load_32(&generation);
 }
 
 ph_variant_t *ph_config_get_global(void)
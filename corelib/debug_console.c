@@ -49,16 +49,17 @@ typedef void (*console_cmd)(ph_sock_t *sock);
 static void cmd_memory(ph_sock_t *sock)
 {
   ph_mem_stats_t stats[1];
+  ph_mem_facility_stats_t fac_stats[16];
   ph_memtype_t base = PH_MEMTYPE_FIRST;
   char name[29];
+  int n, i;
 
   ph_stm_printf(sock->stream,
-      "%28s %9s %9s %9s %9s %9s\r\n",
-      "WHAT", "BYTES", "OOM", "ALLOCS", "FREES", "REALLOC");
+      "%28s %9s %9s %9s %9s %9s %9s %9s\r\n",
+      "WHAT", "BYTES", "OOM", "ALLOCS", "FREES", "REALLOC", "CACHED",
+      "LIMIT");
 
   while (1) {
-    int n, i;
-
     n = ph_mem_stat_range(base,
           base + (sizeof(stats) / sizeof(stats[0])), stats);
 
@@ -73,10 +74,13 @@ static void cmd_memory(ph_sock_t *sock)
           "%9"PRIu64" "
           "%9"PRIu64" "
           "%9"PRIu64" "
+          "%9"PRIu64" "
+          "%9"PRIu64" "
           "\r\n",
           name,
           stats[i].bytes, stats[i].oom, stats[i].allocs,
-          stats[i].frees, stats[i].reallocs);
+          stats[i].frees, stats[i].reallocs, stats[i].cached,
+          stats[i].limit);
     }
 
     if ((uint32_t)n < sizeof(stats) / sizeof(stats[0])) {
@@ -85,6 +89,18 @@ static void cmd_memory(ph_sock_t *sock)
 
     base += n;
   }
+
+  n = ph_mem_stat_facility_limits(
+      sizeof(fac_stats) / sizeof(fac_stats[0]), fac_stats);
+  if (n == 0) {
+    return;
+  }
+  ph_stm_printf(sock->stream, "\r\n%28s %9s %9s\r\n",
+      "FACILITY", "BYTES", "LIMIT");
+  for (i = 0; i < n; i++) {
+    ph_stm_printf(sock->stream, "%28s %9"PRIu64" %9"PRIu64"\r\n",
+        fac_stats[i].facility, fac_stats[i].bytes, fac_stats[i].limit);
+  }
 }
 
 struct counter_name_val {
@@ -177,12 +193,62 @@ static void cmd_counters(ph_sock_t *sock)
   }
 }
 
+// List the busiest connections
+#define NUM_TOP_SOCKS 20
+static void cmd_socks(ph_sock_t *sock)
+{
+  ph_sock_stats_entry_t top[NUM_TOP_SOCKS];
+  uint64_t now = ph_time_now_ns();
+  uint32_t n, i;
+
+  n = ph_sock_stats_top(top, NUM_TOP_SOCKS);
+
+  ph_stm_printf(sock->stream,
+      "%5s %-28s %12s %12s %8s %8s %8s %9s %9s %9s\r\n",
+      "FD", "PEER", "BYTES_IN", "BYTES_OUT", "READS", "WRITES",
+      "DISPATCH", "MAX_WBUF", "IDLE_MS", "AGE_MS");
+
+  for (i = 0; i < n; i++) {
+    ph_sock_stats_t *st = &top[i].stats;
+    char peer[29];
+
+    ph_snprintf(peer, sizeof(peer), "`P{sockaddr:%p}",
+        (void*)&top[i].peername);
+    ph_stm_printf(sock->stream,
+        "%5d %-28s "
+        "%12"PRIu64" "
+        "%12"PRIu64" "
+        "%8"PRIu64" "
+        "%8"PRIu64" "
+        "%8"PRIu64" "
+        "%9"PRIu64" "
+        "%9"PRIu64" "
+        "%9"PRIu64""
+        "\r\n",
+        top[i].fd, peer,
+        st->bytes_in, st->bytes_out, st->reads, st->writes,
+        st->dispatches, st->max_wbuf,
+        (now - MIN(now, st->last_activity_ns)) / PH_NSEC_PER_MSEC,
+        (now - MIN(now, st->created_ns)) / PH_NSEC_PER_MSEC);
+  }
+}
+
+// Dump the heap profile, for pprof
+static void cmd_heapprof(ph_sock_t *sock)
+{
+  if (!ph_mem_prof_dump(sock->stream)) {
+    ph_stm_printf(sock->stream, "heap profiling is not enabled\r\n");
+  }
+}
+
 static struct {
   const char *name;
   console_cmd func;
 } funcs[] = {
   { "memory", cmd_memory },
+  { "heapprof", cmd_heapprof },
   { "counters", cmd_counters },
+  { "socks", cmd_socks },
 };
 
 static void debug_con_processor(ph_sock_t *sock, ph_iomask_t why, void *arg)
@@ -22,7 +22,7 @@ static struct {
 } mt;
 static ph_memtype_def_t defs[] = {
   { "dns", "addrinfo", sizeof(ph_dns_addrinfo_t), PH_MEM_FLAGS_ZERO },
-  { "dns", "string", 0, 0 },
+  { "dns", "string", 0, PH_MEM_FLAGS_SIZE_CLASSES },
 };
 
 static ph_thread_pool_t *dns_pool = NULL;
@@ -63,7 +63,8 @@ static void dns_addrinfo(ph_job_t *job, ph_iomask_t why, void *data)
 static struct ph_job_def addrinfo_job_def = {
   dns_addrinfo,
   PH_MEMTYPE_INVALID,
-  do_free_addrinfo
+  do_free_addrinfo,
+  NULL
 };
 
 static void do_dns_init(void)
@@ -23,7 +23,7 @@
 
 static ph_memtype_t mt_table;
 static struct ph_memtype_def table_def = {
-  "hashtable", "table", 0, PH_MEM_FLAGS_ZERO
+  "hashtable", "table", 0, PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SIZE_CLASSES
 };
 
 static void init_hashtable(void)
@@ -68,6 +68,9 @@ ph_result_t ph_ht_init(ph_ht_t *ht, uint32_t size_hint,
 
 void ph_ht_destroy(ph_ht_t *ht)
 {
+  if (!ht->table) {
+    return;
+  }
   ph_ht_free_entries(ht);
   ph_mem_free(mt_table, ht->table);
   ht->table = 0;
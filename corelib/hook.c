@@ -33,7 +33,7 @@ static ck_rwlock_t rwlock = CK_RWLOCK_INITIALIZER;
 static ph_memtype_def_t defs[] = {
   { "hook", "hook", sizeof(ph_hook_point_t), PH_MEM_FLAGS_ZERO },
   { "hook", "head", 0, 0 },
-  { "hook", "string", 0, 0 },
+  { "hook", "string", 0, PH_MEM_FLAGS_SIZE_CLASSES },
   { "hook", "unreg", sizeof(struct ph_hook_item_free), 0 },
 };
 static struct {
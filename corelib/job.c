@@ -127,7 +127,7 @@ void ph_job_collector_call(ph_thread_t *me)
 {
   uint8_t i;
 
-  me->refresh_time = true;
+  ph_thread_refresh_time(me);
   for (i = 0; i < next_collector_id; i++) {
     collector_funcs[i](me);
   }
@@ -410,7 +410,7 @@ void ph_job_dispatch_now(ph_job_t *job)
 {
   ph_thread_t *me = ph_thread_self();
 
-  me->refresh_time = true;
+  ph_thread_refresh_time(me);
   ph_thread_epoch_begin();
   job->callback(job, PH_IOMASK_NONE, job->data);
   ph_thread_epoch_end();
@@ -450,7 +450,7 @@ static void *worker_thread(void *arg)
 
     ph_counter_block_add(cblock, SLOT_NUM_PENDING, -1);
 
-    me->refresh_time = true;
+    ph_thread_refresh_time(me);
     ph_thread_epoch_begin();
     job->callback(job, PH_IOMASK_NONE, job->data);
     ph_thread_epoch_end();
@@ -636,6 +636,10 @@ static void deferred_job_free(ck_epoch_entry_t *e)
     job->def->dtor(job);
   }
 
+  if (job->def->recycle) {
+    job->def->recycle(job);
+    return;
+  }
   ph_mem_free(job->def->memtype, job);
 }
 
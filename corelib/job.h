@@ -57,7 +57,7 @@ struct ph_nbio_emitter {
   ph_timerwheel_t wheel;
   ph_job_t timer_job;
   uint32_t emitter_id;
-  struct timeval last_dispatch;
+  uint64_t last_dispatch;
   int io_fd, timer_fd;
   ph_nbio_affine_job_stailq_t affine_jobs;
   ph_job_t affine_job;
@@ -122,6 +122,11 @@ static inline bool has_pending_affine_jobs(struct ph_nbio_emitter *e) {
 }
 void ph_nbio_process_affine_jobs(struct ph_nbio_emitter *e);
 
+static inline bool ph_nbio_have_batch_items(ph_thread_t *me) {
+  return !PH_STAILQ_EMPTY(&me->pending_batch);
+}
+void ph_nbio_run_batch_end(ph_thread_t *me);
+
 #define SLOT_DISP 0
 #define SLOT_TIMER_TICK 1
 #define SLOT_BUSY 2
@@ -15,22 +15,194 @@
  */
 
 #include "phenom/memory.h"
+#include "phenom/arena.h"
 #include "phenom/counter.h"
-#include "phenom/log.h"
+#include "phenom/configuration.h"
 #include "phenom/thread.h"
+#include "phenom/hook.h"
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "corelib/memprof.h"
 #include <ck_pr.h>
 
+struct mem_depot;
+struct mem_limit;
+
 struct mem_type {
   ph_memtype_def_t def;
   ph_counter_scope_t *scope;
   uint8_t first_slot;
+  // Set for PH_MEM_FLAGS_CACHED types; cache_idx is our slot in each
+  // thread's cache
+  struct mem_depot *depot;
+  uint32_t cache_idx;
+  // Our limit and that of our facility, if any.  limited is set while
+  // either of them is in force
+  struct mem_limit *limit, *fac_limit;
+  bool limited;
+};
+
+/* A memtype or a facility may be given a limit.  The counters are
+ * per-thread and only summed when they are read, so while a limit is in
+ * force we also keep a running total of the bytes allocated against it
+ * for allocations to check.  The total starts out from the counters at
+ * the time the limit is set.
+ *
+ * level tracks how many of the soft thresholds usage has crossed, or
+ * that an allocation was refused; the pressure hook is invoked when it
+ * changes */
+struct mem_limit {
+  const char *facility, *name;
+  int64_t bytes;
+  uint64_t limit;
+  uint8_t soft[PH_MEM_MAX_SOFT_LIMITS];
+  uint8_t num_soft;
+  uint32_t level;
+  bool from_config;
+  // Links facility limits together
+  struct mem_limit *next;
+};
+
+#define LEVEL_REFUSED (PH_MEM_MAX_SOFT_LIMITS + 1)
+static const uint8_t default_soft_limits[] = { 75, 90 };
+
+/* PH_MEM_FLAGS_CACHED memtypes keep freed objects in per-thread
+ * magazines, after Bonwick & Adams' "Magazines and Vmem".  Each thread
+ * has a loaded and a previous magazine per type; an allocation pops from
+ * one of them and a free pushes to one of them, so that only when both
+ * are empty (or full) does the thread swap one with the type's depot,
+ * under its lock.  Objects belong to nobody in particular: a free on
+ * another thread lands in that thread's magazines and makes its way to
+ * the allocating thread through the depot.
+ *
+ * The depot frees the full magazines that went unused for a whole
+ * CACHE_TRIM_NS interval, and threads give back the magazines of types
+ * they haven't touched for that long when they next visit a depot.
+ * Both also happen from a job collector, so that a process that has
+ * gone idle returns its cache without waiting for an allocation.
+ *
+ * Counters see allocations and frees as the caller made them; the
+ * memory waiting in magazines is counted as `cached` */
+struct mem_mag {
+  struct mem_mag *next;
+  uint32_t count;
+  void *objs[];
+};
+
+struct mem_depot {
+  pthread_mutex_t lock;
+  struct mem_mag *full, *empty;
+  uint32_t nfull, nempty;
+  // Fewest full magazines seen since the last trim; that many were
+  // not needed during the interval
+  uint32_t min_full;
+  uint64_t trim_at;
+  uint32_t mag_size;
+};
+
+struct mem_thread_type {
+  struct mem_mag *loaded, *prev;
+  // Borrowed from the thread's blocks
+  ph_counter_block_t *block;
+  bool active;
 };
 
+/* Small allocations of PH_MEM_FLAGS_SIZE_CLASSES memtypes are rounded up
+ * to one of a set of size classes and carved out of SLAB_SIZE slabs that
+ * each hold objects of a single class.  Slabs are aligned to their size
+ * and slab_map records the class of each of them, so that a free finds
+ * the size of the object from its address instead of from a header.
+ *
+ * Free objects are linked through their first word.  Each thread keeps a
+ * list per class, and exchanges batches with the class's shared list
+ * when its own runs dry or grows past CLASS_CACHE_BYTES.  Slabs stay with
+ * their class for reuse rather than going back to the system; they are
+ * counted against the pool/slab memtype */
+#define NUM_CLASSES 24
+#define MAX_CLASS_SIZE 2048
+#define CLASS_CACHE_BYTES (16 * 1024)
+#define SLAB_SHIFT 16
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+// Slabs at addresses beyond these many bits aren't used
+#if UINTPTR_MAX > 0xffffffff
+# define SLAB_ADDR_BITS 48
+#else
+# define SLAB_ADDR_BITS 32
+#endif
+#define SLAB_LEAF_BITS 16
+#define SLAB_ROOT_BITS (SLAB_ADDR_BITS - SLAB_SHIFT - SLAB_LEAF_BITS)
+
+struct size_class {
+  pthread_mutex_t lock;
+  void *free;
+  // The slab being carved up
+  char *next, *end;
+};
+
+struct class_cache {
+  void *head;
+  uint32_t count;
+};
+
+/* Each thread keeps the counter blocks of the memtypes it has used in an
+ * array indexed by memtype, so that accounting for an allocation is a
+ * couple of stores rather than a lookup in the thread's counter hash.
+ * The blocks are held until the thread exits */
+struct mem_thread_cache {
+  uint64_t swept_at;
+  ph_counter_block_t **blocks;
+  uint32_t num_blocks;
+  struct class_cache classes[NUM_CLASSES];
+  struct mem_thread_type types[];
+};
+
+#define MAX_CACHED_TYPES 64
+// Magazines hold about this much, within MAG_MIN and MAG_MAX objects
+#define MAG_BYTES (128 * 1024)
+#define MAG_MIN 4
+#define MAG_MAX 64
+#define DEPOT_MAX_EMPTY 16
+#define CACHE_TRIM_NS PH_NSEC_PER_SEC
+
+static struct mem_depot depots[MAX_CACHED_TYPES];
+static uint32_t next_cache_idx;
+static pthread_key_t cache_key;
+#ifdef HAVE___THREAD
+static __thread struct mem_thread_cache *thread_cache;
+#endif
+
+static const uint16_t class_sizes[NUM_CLASSES] = {
+  16, 32, 48, 64, 80, 96, 112, 128,
+  160, 192, 224, 256, 320, 384, 448, 512,
+  640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+// Indexed by the size in 16 byte units, rounded up
+static uint8_t size_classes[MAX_CLASS_SIZE / 16 + 1];
+static struct size_class classes[NUM_CLASSES];
+static uint8_t **slab_map;
+static ph_memtype_t mt_slab;
+
 #define HEADER_RESERVATION 16
 struct sized_header {
   ph_memtype_t mt;
+  // Set if this came from an arena, which is where it goes back to
+  uint32_t arena;
   uint64_t size;
 } CK_CC_ALIGN(HEADER_RESERVATION);
+// Arena allocations are preceded by the arena they came from, so that
+// growing them doesn't move them into another
+struct arena_header {
+  ph_arena_t *arena;
+} CK_CC_ALIGN(HEADER_RESERVATION);
+
+static pthread_mutex_t limits_lock;
+static struct mem_limit *facility_limits;
+// The configuration generation that the limits and the heap profiler
+// were last configured from
+static uint32_t config_generation = 1;
+static bool prof_from_config;
+static ph_hook_point_t *pressure_hook;
 
 static uint32_t memtypes_size = 0;
 static ph_memtype_t next_memtype = PH_MEMTYPE_FIRST;
@@ -45,6 +217,14 @@ static const char *sized_counter_names[] = {
   "frees",   // total number of free calls
 };
 
+static const char *cached_counter_names[] = {
+  "bytes",   // current number of allocated bytes
+  "oom",     // total number of times allocation failed
+  "allocs",  // total number of successful allocation calls
+  "frees",   // total number of free calls
+  "cached",  // bytes held in magazines, ready for reuse
+};
+
 static const char *vsize_counter_names[] = {
   "bytes",   // current number of allocated bytes
   "oom",     // total number of times allocation failed
@@ -58,80 +238,1211 @@ static const char *vsize_counter_names[] = {
 #define SLOT_ALLOCS 2
 #define SLOT_FREES 3
 #define SLOT_REALLOC 4
+#define SLOT_CACHED 4
 
 #define MEM_COUNTER_SLOTS 5
 
+#ifdef PH_PLACATE_VALGRIND
+static void drain_depots(void);
+#endif
+
 /** tear things down and make valgrind believe that we didn't leak */
 static void memory_destroy(void)
 {
 #ifdef PH_PLACATE_VALGRIND
   int i;
 
+  ph_mem_cache_flush();
+  drain_depots();
+
   // One last try to collect anything lingering in SMR.
   // Any defers that take place after this point will most likely never
   // be actioned.
   ph_thread_epoch_barrier();
 
-  ph_counter_scope_delref(memory_scope);
+  ph_counter_scope_delref(memory_scope);
+
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    ph_counter_scope_delref(memtypes[i].scope);
+    if (i == PH_MEMTYPE_FIRST ||
+        memtypes[i].def.facility != memtypes[i-1].def.facility) {
+      free((char*)memtypes[i].def.facility);
+    }
+    free((char*)memtypes[i].def.name);
+  }
+
+  free(memtypes);
+#endif
+}
+
+// Can't use ph_panic() from here, as that may allocate
+static void
+#ifdef __GNUC__
+  __attribute__((format(printf, 1, 2)))
+  __attribute__((noreturn))
+#endif
+  memory_panic(const char *fmt, ...)
+{
+  va_list ap;
+  char buf[512];
+
+  va_start(ap, fmt);
+  snprintf(buf, sizeof(buf), fmt, ap); // NOLINT(runtime/printf)
+  va_end(ap);
+
+  ph_ignore_result(write(STDERR_FILENO, buf, strlen(buf)));
+  abort();
+}
+
+static uint64_t cache_clock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * PH_NSEC_PER_SEC) + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ph_timeval_to_ns(tv);
+#endif
+}
+
+static struct mem_mag *mag_new(struct mem_depot *depot)
+{
+  struct mem_mag *mag;
+
+  mag = malloc(sizeof(*mag) + depot->mag_size * sizeof(void*));
+  if (mag) {
+    mag->count = 0;
+  }
+  return mag;
+}
+
+// Frees the objects in a magazine.  Returns the number of bytes freed
+static uint64_t mag_empty(struct mem_mag *mag, uint64_t item_size)
+{
+  uint64_t freed = mag->count * item_size;
+
+  while (mag->count) {
+    free(mag->objs[--mag->count]);
+  }
+  return freed;
+}
+
+// Parks an empty magazine in the depot, or frees it.  Called with the
+// depot locked
+static void depot_put_empty(struct mem_depot *depot, struct mem_mag *mag)
+{
+  if (depot->nempty >= DEPOT_MAX_EMPTY) {
+    free(mag);
+    return;
+  }
+  mag->next = depot->empty;
+  depot->empty = mag;
+  depot->nempty++;
+}
+
+static void depot_put_full(struct mem_depot *depot, struct mem_mag *mag)
+{
+  mag->next = depot->full;
+  depot->full = mag;
+  depot->nfull++;
+}
+
+// Frees the full magazines that weren't needed over the last interval.
+// Called with the depot locked; returns the number of bytes freed
+static uint64_t depot_trim(struct mem_depot *depot, uint64_t item_size,
+    uint64_t now)
+{
+  struct mem_mag *mag;
+  uint64_t freed = 0;
+  uint32_t n;
+
+  if (now < depot->trim_at) {
+    return 0;
+  }
+  for (n = MIN(depot->min_full, depot->nfull); n > 0; n--) {
+    mag = depot->full;
+    depot->full = mag->next;
+    depot->nfull--;
+    freed += mag_empty(mag, item_size);
+    depot_put_empty(depot, mag);
+  }
+  depot->min_full = depot->nfull;
+  depot->trim_at = now + CACHE_TRIM_NS;
+  return freed;
+}
+
+// Hands this thread's magazines of a type to its depot
+static void flush_thread_type(struct mem_thread_type *c,
+    struct mem_depot *depot)
+{
+  struct mem_mag *mags[2] = { c->loaded, c->prev };
+  int i;
+
+  pthread_mutex_lock(&depot->lock);
+  for (i = 0; i < 2; i++) {
+    if (!mags[i]) {
+      continue;
+    }
+    if (mags[i]->count) {
+      depot_put_full(depot, mags[i]);
+    } else {
+      depot_put_empty(depot, mags[i]);
+    }
+  }
+  pthread_mutex_unlock(&depot->lock);
+  c->loaded = NULL;
+  c->prev = NULL;
+}
+
+static void release_class_caches(struct mem_thread_cache *tc);
+
+static void destroy_thread_cache(void *ptr)
+{
+  struct mem_thread_cache *tc = ptr;
+  struct mem_thread_type *c;
+  uint32_t i;
+
+  // The depots trim what they get as it goes unused
+  for (i = 0; i < MAX_CACHED_TYPES; i++) {
+    c = &tc->types[i];
+    if (c->loaded || c->prev) {
+      flush_thread_type(c, &depots[i]);
+    }
+  }
+  release_class_caches(tc);
+  for (i = 0; i < tc->num_blocks; i++) {
+    if (tc->blocks[i]) {
+      ph_counter_block_delref(tc->blocks[i]);
+    }
+  }
+#ifdef HAVE___THREAD
+  thread_cache = NULL;
+#endif
+  free(tc->blocks);
+  free(tc);
+}
+
+static struct mem_thread_cache *get_thread_cache(void)
+{
+  struct mem_thread_cache *tc;
+
+#ifdef HAVE___THREAD
+  tc = thread_cache;
+#else
+  tc = pthread_getspecific(cache_key);
+#endif
+  if (ph_likely(tc != NULL)) {
+    return tc;
+  }
+
+  tc = calloc(1, sizeof(*tc) +
+      MAX_CACHED_TYPES * sizeof(struct mem_thread_type));
+  if (!tc) {
+    return NULL;
+  }
+  tc->swept_at = cache_clock();
+  pthread_setspecific(cache_key, tc);
+#ifdef HAVE___THREAD
+  thread_cache = tc;
+#endif
+  return tc;
+}
+
+static ph_counter_block_t *open_thread_block(struct mem_thread_cache *tc,
+    ph_memtype_t mt, struct mem_type *mem_type)
+{
+  ph_counter_block_t *block, **blocks;
+  uint32_t size;
+
+  // Opening the block may allocate, and so land back in here
+  block = ph_counter_block_open(mem_type->scope);
+  if (!block) {
+    return NULL;
+  }
+
+  if ((uint32_t)mt >= tc->num_blocks) {
+    size = ph_power_2(MAX((uint32_t)next_memtype, (uint32_t)mt + 1));
+    blocks = realloc(tc->blocks, size * sizeof(*blocks));
+    if (!blocks) {
+      ph_counter_block_delref(block);
+      return NULL;
+    }
+    memset(blocks + tc->num_blocks, 0,
+        (size - tc->num_blocks) * sizeof(*blocks));
+    tc->blocks = blocks;
+    tc->num_blocks = size;
+  }
+
+  if (tc->blocks[mt]) {
+    ph_counter_block_delref(block);
+    return tc->blocks[mt];
+  }
+  tc->blocks[mt] = block;
+  return block;
+}
+
+// Returns this thread's counter block for a memtype, or NULL if it
+// doesn't have one and can't make one
+static inline ph_counter_block_t *thread_block(ph_memtype_t mt,
+    struct mem_type *mem_type)
+{
+  struct mem_thread_cache *tc = get_thread_cache();
+
+  if (ph_unlikely(!tc)) {
+    return NULL;
+  }
+  if (ph_likely((uint32_t)mt < tc->num_blocks && tc->blocks[mt])) {
+    return tc->blocks[mt];
+  }
+  return open_thread_block(tc, mt, mem_type);
+}
+
+// Adds to the counters of a memtype
+static inline void mem_account(ph_memtype_t mt, struct mem_type *mem_type,
+    uint8_t num_slots, const uint8_t *slots, const int64_t *values)
+{
+  ph_counter_block_t *block = thread_block(mt, mem_type);
+
+  if (ph_likely(block != NULL)) {
+    ph_counter_block_bulk_add(block, num_slots, slots, values);
+    return;
+  }
+
+  block = ph_counter_block_open(mem_type->scope);
+  ph_counter_block_bulk_add(block, num_slots, slots, values);
+  ph_counter_block_delref(block);
+}
+
+static void init_size_classes(void)
+{
+  uint32_t i, c = 0;
+
+  for (i = 0; i < sizeof(size_classes); i++) {
+    while (class_sizes[c] < i * 16) {
+      c++;
+    }
+    size_classes[i] = c;
+  }
+  for (i = 0; i < NUM_CLASSES; i++) {
+    pthread_mutex_init(&classes[i].lock, NULL);
+  }
+  slab_map = calloc(1 << SLAB_ROOT_BITS, sizeof(*slab_map));
+  if (!slab_map) {
+    memory_panic("failed to allocate slab map");
+  }
+}
+
+static inline uint32_t size_class(uint64_t size)
+{
+  return size_classes[(size + 15) / 16];
+}
+
+// Returns 1 + the class of the slab that ptr is in, or 0 if it isn't
+// in a slab
+static inline uint32_t slab_class(const void *ptr)
+{
+  uintptr_t idx = (uintptr_t)ptr >> SLAB_SHIFT;
+  uint8_t *leaf;
+
+  if (idx >> (SLAB_ADDR_BITS - SLAB_SHIFT)) {
+    return 0;
+  }
+  leaf = ck_pr_load_ptr(&slab_map[idx >> SLAB_LEAF_BITS]);
+  if (!leaf) {
+    return 0;
+  }
+  return ck_pr_load_8(&leaf[idx & ((1 << SLAB_LEAF_BITS) - 1)]);
+}
+
+// Call with the class lock held
+static bool new_slab(uint32_t c)
+{
+  void *slab;
+  uintptr_t idx;
+  uint8_t **root, *leaf;
+
+  if (posix_memalign(&slab, SLAB_SIZE, SLAB_SIZE)) {
+    return false;
+  }
+  idx = (uintptr_t)slab >> SLAB_SHIFT;
+  if (idx >> (SLAB_ADDR_BITS - SLAB_SHIFT)) {
+    free(slab);
+    return false;
+  }
+
+  // Leaves are shared by the classes, and never freed
+  root = &slab_map[idx >> SLAB_LEAF_BITS];
+  leaf = ck_pr_load_ptr(root);
+  if (!leaf) {
+    leaf = calloc(1 << SLAB_LEAF_BITS, 1);
+    if (!leaf) {
+      free(slab);
+      return false;
+    }
+    if (!ck_pr_cas_ptr(root, NULL, leaf)) {
+      free(leaf);
+      leaf = ck_pr_load_ptr(root);
+    }
+  }
+  ck_pr_store_8(&leaf[idx & ((1 << SLAB_LEAF_BITS) - 1)], c + 1);
+
+  classes[c].next = slab;
+  classes[c].end = (char*)slab + SLAB_SIZE;
+  return true;
+}
+
+static inline uint32_t class_cache_max(uint32_t c)
+{
+  return MAX(CLASS_CACHE_BYTES / class_sizes[c], 4);
+}
+
+// Moves objects from the thread's list to the shared one, until it is
+// down to keep
+static void release_class(struct class_cache *cc, uint32_t c, uint32_t keep)
+{
+  struct size_class *cls = &classes[c];
+  void *obj;
+
+  pthread_mutex_lock(&cls->lock);
+  while (cc->count > keep) {
+    obj = cc->head;
+    cc->head = *(void**)obj;
+    cc->count--;
+    *(void**)obj = cls->free;
+    cls->free = obj;
+  }
+  pthread_mutex_unlock(&cls->lock);
+}
+
+static void release_class_caches(struct mem_thread_cache *tc)
+{
+  uint32_t c;
+
+  for (c = 0; c < NUM_CLASSES; c++) {
+    if (tc->classes[c].count) {
+      release_class(&tc->classes[c], c, 0);
+    }
+  }
+}
+
+// Fills half of the thread's list from the shared one, carving more
+// objects out of slabs as needed.  Returns false if there was nothing
+// to be had
+static bool refill_class(struct class_cache *cc, uint32_t c)
+{
+  struct size_class *cls = &classes[c];
+  uint32_t size = class_sizes[c];
+  uint32_t want = class_cache_max(c) / 2;
+  uint32_t slabs = 0;
+  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_ALLOCS };
+  int64_t values[2];
+  void *obj;
+
+  pthread_mutex_lock(&cls->lock);
+  while (cc->count < want) {
+    if (cls->free) {
+      obj = cls->free;
+      cls->free = *(void**)obj;
+    } else {
+      if (cls->next + size > cls->end) {
+        if (!new_slab(c)) {
+          break;
+        }
+        slabs++;
+      }
+      obj = cls->next;
+      cls->next += size;
+    }
+    *(void**)obj = cc->head;
+    cc->head = obj;
+    cc->count++;
+  }
+  pthread_mutex_unlock(&cls->lock);
+
+  if (slabs) {
+    values[0] = (int64_t)slabs * SLAB_SIZE;
+    values[1] = slabs;
+    mem_account(mt_slab, &memtypes[mt_slab], 2, slots, values);
+  }
+  return cc->count > 0;
+}
+
+static inline void *class_alloc(struct mem_thread_cache *tc, uint32_t c)
+{
+  struct class_cache *cc = &tc->classes[c];
+  void *obj;
+
+  if (ph_unlikely(!cc->head) && !refill_class(cc, c)) {
+    return NULL;
+  }
+  obj = cc->head;
+  cc->head = *(void**)obj;
+  cc->count--;
+  return obj;
+}
+
+static inline void class_free(uint32_t c, void *ptr)
+{
+  struct mem_thread_cache *tc = get_thread_cache();
+  struct class_cache *cc, single;
+
+  if (ph_unlikely(!tc)) {
+    single.head = ptr;
+    single.count = 1;
+    *(void**)ptr = NULL;
+    release_class(&single, c, 0);
+    return;
+  }
+  cc = &tc->classes[c];
+  *(void**)ptr = cc->head;
+  cc->head = ptr;
+  if (ph_unlikely(++cc->count > class_cache_max(c))) {
+    release_class(cc, c, class_cache_max(c) / 2);
+  }
+}
+
+// Returns the magazines of the types this thread hasn't used since the
+// last sweep to their depots
+static void sweep_thread_cache(struct mem_thread_cache *tc, uint64_t now)
+{
+  struct mem_thread_type *c;
+  uint32_t i;
+
+  if (now - tc->swept_at < CACHE_TRIM_NS) {
+    return;
+  }
+  tc->swept_at = now;
+
+  for (i = 0; i < MAX_CACHED_TYPES; i++) {
+    c = &tc->types[i];
+    if (!c->active && (c->loaded || c->prev)) {
+      flush_thread_type(c, &depots[i]);
+    }
+    c->active = false;
+  }
+}
+
+static inline struct mem_thread_type *thread_type(struct mem_type *mem_type,
+    struct mem_thread_cache **tcp)
+{
+  struct mem_thread_cache *tc = get_thread_cache();
+  struct mem_thread_type *c;
+
+  if (ph_unlikely(!tc)) {
+    return NULL;
+  }
+  c = &tc->types[mem_type->cache_idx];
+  if (ph_unlikely(!c->block)) {
+    c->block = thread_block(mem_type - memtypes, mem_type);
+    if (!c->block) {
+      return NULL;
+    }
+  }
+  c->active = true;
+  *tcp = tc;
+  return c;
+}
+
+// Takes an object from this thread's magazines, swapping an empty one
+// for a full one from the depot if need be.  Returns NULL if there is
+// nothing to reuse
+static void *cache_alloc(struct mem_type *mem_type,
+    struct mem_thread_cache *tc, struct mem_thread_type *c)
+{
+  struct mem_depot *depot = mem_type->depot;
+  struct mem_mag *mag;
+  uint64_t now, freed;
+
+  if (ph_likely(c->loaded && c->loaded->count)) {
+    return c->loaded->objs[--c->loaded->count];
+  }
+  if (c->prev && c->prev->count) {
+    mag = c->loaded;
+    c->loaded = c->prev;
+    c->prev = mag;
+    return c->loaded->objs[--c->loaded->count];
+  }
+
+  now = cache_clock();
+  pthread_mutex_lock(&depot->lock);
+  freed = depot_trim(depot, mem_type->def.item_size, now);
+  mag = depot->full;
+  if (mag) {
+    depot->full = mag->next;
+    depot->nfull--;
+    depot->min_full = MIN(depot->min_full, depot->nfull);
+    if (c->prev) {
+      depot_put_empty(depot, c->prev);
+    }
+    c->prev = c->loaded;
+    c->loaded = mag;
+  }
+  pthread_mutex_unlock(&depot->lock);
+
+  if (freed) {
+    ph_counter_block_add(c->block, SLOT_CACHED, -(int64_t)freed);
+  }
+  sweep_thread_cache(tc, now);
+
+  if (!mag) {
+    return NULL;
+  }
+  return c->loaded->objs[--c->loaded->count];
+}
+
+// Puts an object in this thread's magazines, swapping a full one for an
+// empty one from the depot if need be.  Returns false if the object
+// has to be freed instead
+static bool cache_free(struct mem_type *mem_type,
+    struct mem_thread_cache *tc, struct mem_thread_type *c, void *ptr)
+{
+  struct mem_depot *depot = mem_type->depot;
+  struct mem_mag *mag;
+  uint64_t now, freed;
+
+  if (ph_likely(c->loaded && c->loaded->count < depot->mag_size)) {
+    c->loaded->objs[c->loaded->count++] = ptr;
+    return true;
+  }
+  if (c->prev && c->prev->count == 0) {
+    mag = c->loaded;
+    c->loaded = c->prev;
+    c->prev = mag;
+    c->loaded->objs[c->loaded->count++] = ptr;
+    return true;
+  }
+
+  now = cache_clock();
+  pthread_mutex_lock(&depot->lock);
+  freed = depot_trim(depot, mem_type->def.item_size, now);
+  mag = depot->empty;
+  if (mag) {
+    depot->empty = mag->next;
+    depot->nempty--;
+  } else {
+    mag = mag_new(depot);
+  }
+  if (mag) {
+    // prev, if we have one, is full
+    if (c->prev) {
+      depot_put_full(depot, c->prev);
+    }
+    c->prev = c->loaded;
+    c->loaded = mag;
+  }
+  pthread_mutex_unlock(&depot->lock);
+
+  if (freed) {
+    ph_counter_block_add(c->block, SLOT_CACHED, -(int64_t)freed);
+  }
+  sweep_thread_cache(tc, now);
+
+  if (!mag) {
+    return false;
+  }
+  c->loaded->objs[c->loaded->count++] = ptr;
+  return true;
+}
+
+// Run by emitter and pool threads when they are idle; see the comment
+// on struct mem_mag
+static void cache_collector(ph_thread_t *me)
+{
+  struct mem_thread_cache *tc;
+  struct mem_depot *depot;
+  ph_counter_block_t *block;
+  uint64_t now = cache_clock(), freed;
+  ph_memtype_t i;
+
+  ph_unused_parameter(me);
+
+#ifdef HAVE___THREAD
+  tc = thread_cache;
+#else
+  tc = pthread_getspecific(cache_key);
+#endif
+  if (tc) {
+    sweep_thread_cache(tc, now);
+  }
+
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    depot = memtypes[i].depot;
+    if (!depot) {
+      continue;
+    }
+    pthread_mutex_lock(&depot->lock);
+    freed = depot_trim(depot, memtypes[i].def.item_size, now);
+    pthread_mutex_unlock(&depot->lock);
+    if (freed && (block = thread_block(i, &memtypes[i])) != NULL) {
+      ph_counter_block_add(block, SLOT_CACHED, -(int64_t)freed);
+    }
+  }
+}
+
+void ph_mem_cache_flush(void)
+{
+  struct mem_thread_cache *tc;
+  uint32_t i;
+
+#ifdef HAVE___THREAD
+  tc = thread_cache;
+#else
+  tc = pthread_getspecific(cache_key);
+#endif
+  if (!tc) {
+    return;
+  }
+  for (i = 0; i < MAX_CACHED_TYPES; i++) {
+    if (tc->types[i].loaded || tc->types[i].prev) {
+      flush_thread_type(&tc->types[i], &depots[i]);
+    }
+  }
+  release_class_caches(tc);
+}
+
+#ifdef PH_PLACATE_VALGRIND
+static void drain_depots(void)
+{
+  struct mem_depot *depot;
+  struct mem_mag *mag;
+  ph_memtype_t i;
+
+  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
+    depot = memtypes[i].depot;
+    if (!depot) {
+      continue;
+    }
+    while ((mag = depot->full) != NULL) {
+      depot->full = mag->next;
+      mag_empty(mag, memtypes[i].def.item_size);
+      free(mag);
+    }
+    while ((mag = depot->empty) != NULL) {
+      depot->empty = mag->next;
+      free(mag);
+    }
+    depot->nfull = 0;
+    depot->nempty = 0;
+  }
+}
+#endif
+
+static struct ph_memtype_def slab_def = {
+  "pool", "slab", SLAB_SIZE, 0
+};
+
+static void memory_init(void)
+{
+  pthread_mutexattr_t attr;
+
+  memtypes_size = 1024;
+  memtypes = malloc(memtypes_size * sizeof(*memtypes));
+  if (!memtypes) {
+    memory_panic("failed to allocate memtypes array");
+  }
+
+  memory_scope = ph_counter_scope_define(NULL, "memory", 16);
+  if (!memory_scope) {
+    memory_panic("failed to define memory scope");
+  }
+
+  pthread_key_create(&cache_key, destroy_thread_cache);
+
+  // Pressure hooks may set limits while we're loading them
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&limits_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  init_size_classes();
+  mt_slab = ph_memtype_register(&slab_def);
+  ph_job_collector_register(cache_collector);
+}
+
+PH_LIBRARY_INIT_PRI(memory_init, memory_destroy, 3)
+
+static ph_counter_scope_t *resolve_facility(const char *fac)
+{
+  ph_counter_scope_t *scope;
+
+  scope = ph_counter_scope_resolve(memory_scope, fac);
+  if (scope) {
+    return scope;
+  }
+
+  return ph_counter_scope_define(memory_scope, fac, 0);
+}
+
+// Gives a PH_MEM_FLAGS_CACHED type a depot, unless we're out of them
+static void setup_cache(struct mem_type *mem_type)
+{
+  struct mem_depot *depot;
+  uint32_t idx;
+
+  if (!(mem_type->def.flags & PH_MEM_FLAGS_CACHED) ||
+      (mem_type->def.flags & PH_MEM_FLAGS_ARENA) ||
+      mem_type->def.item_size == 0) {
+    mem_type->def.flags &= ~PH_MEM_FLAGS_CACHED;
+    return;
+  }
+
+  idx = ck_pr_faa_32(&next_cache_idx, 1);
+  if (idx >= MAX_CACHED_TYPES) {
+    mem_type->def.flags &= ~PH_MEM_FLAGS_CACHED;
+    return;
+  }
+
+  depot = &depots[idx];
+  pthread_mutex_init(&depot->lock, NULL);
+  depot->mag_size = MAG_BYTES / mem_type->def.item_size;
+  depot->mag_size = MAX(MIN(depot->mag_size, MAG_MAX), MAG_MIN);
+  mem_type->cache_idx = idx;
+  mem_type->depot = depot;
+}
+
+static const char **pick_counters(struct mem_type *mem_type,
+    uint32_t *num_slots)
+{
+  setup_cache(mem_type);
+
+  if (mem_type->def.item_size == 0) {
+    *num_slots = MEM_COUNTER_SLOTS;
+    return vsize_counter_names;
+  }
+  if (mem_type->depot) {
+    *num_slots = MEM_COUNTER_SLOTS;
+    return cached_counter_names;
+  }
+  *num_slots = MEM_COUNTER_SLOTS - 1;
+  return sized_counter_names;
+}
+
+static uint32_t pressure_level(struct mem_limit *l, int64_t bytes,
+    uint64_t limit)
+{
+  uint32_t level = 0;
+
+  while (level < l->num_soft &&
+      (uint64_t)MAX(bytes, 0) * 100 >= l->soft[level] * limit) {
+    level++;
+  }
+  return level;
+}
+
+static void set_pressure(struct mem_limit *l, uint32_t level, int64_t bytes)
+{
+  uint32_t prev = ck_pr_load_32(&l->level);
+  uint64_t now = MAX(bytes, 0), limit = l->limit;
+  uint32_t percent = 0;
+  void *args[5];
+
+  if (ph_likely(prev == level) || !ck_pr_cas_32(&l->level, prev, level)) {
+    return;
+  }
+
+  if (level == LEVEL_REFUSED) {
+    percent = 100;
+  } else if (level) {
+    percent = l->soft[level - 1];
+  }
+
+  if (ph_unlikely(!pressure_hook)) {
+    pressure_hook = ph_hook_point_get_cstr(PH_MEM_PRESSURE_HOOK_NAME, true);
+  }
+  args[0] = (void*)l->facility;
+  args[1] = (void*)l->name;
+  args[2] = &now;
+  args[3] = &limit;
+  args[4] = &percent;
+  ph_hook_invoke_inner(pressure_hook, 5, args);
+}
+
+static bool charge_limit(struct mem_limit *l, int64_t delta, bool may_refuse)
+{
+  int64_t bytes = (int64_t)ck_pr_faa_64((uint64_t*)&l->bytes, delta) + delta;
+  uint64_t limit = ck_pr_load_64(&l->limit);
+
+  if (!limit) {
+    return true;
+  }
+  if (delta > 0 && may_refuse && bytes > (int64_t)limit) {
+    ck_pr_sub_64((uint64_t*)&l->bytes, delta);
+    set_pressure(l, LEVEL_REFUSED, bytes - delta);
+    return false;
+  }
+  set_pressure(l, pressure_level(l, bytes, limit), bytes);
+  return true;
+}
+
+// The slow path of limit_charge, kept out of line so that the check
+// for an unlimited memtype stays small enough to inline everywhere
+static __attribute__((noinline))
+bool charge_limits(struct mem_type *mem_type, int64_t delta)
+{
+  struct mem_limit *limit = ck_pr_load_ptr(&mem_type->limit);
+  struct mem_limit *fac_limit = ck_pr_load_ptr(&mem_type->fac_limit);
+  bool may_refuse = !(mem_type->def.flags & PH_MEM_FLAGS_PANIC);
+
+  if (limit && !charge_limit(limit, delta, may_refuse)) {
+    return false;
+  }
+  if (fac_limit && !charge_limit(fac_limit, delta, may_refuse)) {
+    if (limit) {
+      charge_limit(limit, -delta, false);
+    }
+    return false;
+  }
+  return true;
+}
+
+// Charges bytes to the limits of a memtype, if it has any.  Returns
+// false if the allocation would take it over one of them
+static inline bool limit_charge(struct mem_type *mem_type, int64_t delta)
+{
+  if (ph_likely(!ck_pr_load_8((uint8_t*)&mem_type->limited))) {
+    return true;
+  }
+  return charge_limits(mem_type, delta);
+}
+
+// Gives back what limit_charge took for an allocation that then failed
+static void limit_refund(struct mem_type *mem_type, int64_t bytes)
+{
+  if (ck_pr_load_8((uint8_t*)&mem_type->limited)) {
+    charge_limits(mem_type, -bytes);
+  }
+}
+
+static void update_limited(struct mem_type *mem_type)
+{
+  ck_pr_store_8((uint8_t*)&mem_type->limited,
+      (mem_type->limit && mem_type->limit->limit) ||
+      (mem_type->fac_limit && mem_type->fac_limit->limit));
+}
+
+static int compare_soft(const void *a, const void *b)
+{
+  return *(const uint8_t*)a - *(const uint8_t*)b;
+}
+
+// Call with limits_lock held
+static bool set_limit(struct mem_limit *l, int64_t bytes, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft)
+{
+  uint8_t i;
+
+  if (num_soft > PH_MEM_MAX_SOFT_LIMITS) {
+    return false;
+  }
+  for (i = 0; i < num_soft; i++) {
+    if (soft[i] == 0 || soft[i] >= 100) {
+      return false;
+    }
+  }
+
+  // Stop enforcing while we change things
+  ck_pr_store_64(&l->limit, 0);
+  ck_pr_fence_store();
+  if (num_soft) {
+    memcpy(l->soft, soft, num_soft);
+  }
+  qsort(l->soft, num_soft, sizeof(l->soft[0]), compare_soft);
+  l->num_soft = num_soft;
+  ck_pr_store_64((uint64_t*)&l->bytes, bytes);
+  ck_pr_store_32(&l->level, limit ? pressure_level(l, bytes, limit) : 0);
+  ck_pr_fence_store();
+  ck_pr_store_64(&l->limit, limit);
+  return true;
+}
+
+static int64_t facility_bytes(const char *facility)
+{
+  ph_mem_stats_t stats;
+  ph_memtype_t mt;
+  int64_t bytes = 0;
+
+  for (mt = PH_MEMTYPE_FIRST; mt < next_memtype; mt++) {
+    if (!strcmp(memtypes[mt].def.facility, facility) &&
+        ph_mem_stat(mt, &stats)) {
+      bytes += stats.bytes;
+    }
+  }
+  return bytes;
+}
+
+static struct mem_limit *find_facility_limit(const char *facility)
+{
+  struct mem_limit *l;
+
+  for (l = facility_limits; l; l = l->next) {
+    if (!strcmp(l->facility, facility)) {
+      return l;
+    }
+  }
+  return NULL;
+}
+
+// Call with limits_lock held
+static ph_result_t do_set_limit(ph_memtype_t mt, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft, bool from_config)
+{
+  struct mem_type *mem_type;
+  struct mem_limit *l;
+  ph_mem_stats_t stats;
+
+  if (mt < PH_MEMTYPE_FIRST || mt >= next_memtype) {
+    return PH_ERR;
+  }
+  mem_type = &memtypes[mt];
+
+  l = mem_type->limit;
+  if (!l) {
+    if (!limit) {
+      return PH_OK;
+    }
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+      return PH_NOMEM;
+    }
+    l->facility = mem_type->def.facility;
+    l->name = mem_type->def.name;
+  }
+
+  ph_mem_stat(mt, &stats);
+  if (!set_limit(l, stats.bytes, limit, num_soft, soft)) {
+    if (!mem_type->limit) {
+      free(l);
+    }
+    return PH_ERR;
+  }
+  l->from_config = from_config;
+  ck_pr_store_ptr(&mem_type->limit, l);
+  update_limited(mem_type);
+  return PH_OK;
+}
+
+// Call with limits_lock held
+static ph_result_t do_set_facility_limit(const char *facility,
+    uint64_t limit, uint8_t num_soft, const uint8_t *soft, bool from_config)
+{
+  struct mem_limit *l = find_facility_limit(facility);
+  bool is_new = false;
+  ph_memtype_t mt;
+
+  if (!l) {
+    if (!limit) {
+      return PH_OK;
+    }
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+      return PH_NOMEM;
+    }
+    l->facility = strdup(facility);
+    if (!l->facility) {
+      free(l);
+      return PH_NOMEM;
+    }
+    is_new = true;
+  }
 
-  for (i = PH_MEMTYPE_FIRST; i < next_memtype; i++) {
-    ph_counter_scope_delref(memtypes[i].scope);
-    if (i == PH_MEMTYPE_FIRST ||
-        memtypes[i].def.facility != memtypes[i-1].def.facility) {
-      free((char*)memtypes[i].def.facility);
+  if (!set_limit(l, facility_bytes(facility), limit, num_soft, soft)) {
+    if (is_new) {
+      free((char*)l->facility);
+      free(l);
     }
-    free((char*)memtypes[i].def.name);
+    return PH_ERR;
+  }
+  l->from_config = from_config;
+  if (is_new) {
+    l->next = facility_limits;
+    facility_limits = l;
   }
 
-  free(memtypes);
-#endif
+  for (mt = PH_MEMTYPE_FIRST; mt < next_memtype; mt++) {
+    if (!strcmp(memtypes[mt].def.facility, facility)) {
+      ck_pr_store_ptr(&memtypes[mt].fac_limit, l);
+      update_limited(&memtypes[mt]);
+    }
+  }
+  return PH_OK;
 }
 
-// Can't use ph_panic() from here, as that may allocate
-static void
-#ifdef __GNUC__
-  __attribute__((format(printf, 1, 2)))
-  __attribute__((noreturn))
-#endif
-  memory_panic(const char *fmt, ...)
+ph_result_t ph_mem_set_limit(ph_memtype_t mt, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft)
 {
-  va_list ap;
-  char buf[512];
+  ph_result_t res;
 
-  va_start(ap, fmt);
-  snprintf(buf, sizeof(buf), fmt, ap); // NOLINT(runtime/printf)
-  va_end(ap);
+  pthread_mutex_lock(&limits_lock);
+  res = do_set_limit(mt, limit, num_soft, soft, false);
+  pthread_mutex_unlock(&limits_lock);
+  return res;
+}
 
-  ph_ignore_result(write(STDERR_FILENO, buf, strlen(buf)));
-  abort();
+ph_result_t ph_mem_set_facility_limit(const char *facility, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft)
+{
+  ph_result_t res;
+
+  pthread_mutex_lock(&limits_lock);
+  res = do_set_facility_limit(facility, limit, num_soft, soft, false);
+  pthread_mutex_unlock(&limits_lock);
+  return res;
 }
 
-static void memory_init(void)
+int ph_mem_stat_facility_limits(int num_stats,
+    ph_mem_facility_stats_t *stats)
 {
-  memtypes_size = 1024;
-  memtypes = malloc(memtypes_size * sizeof(*memtypes));
-  if (!memtypes) {
-    memory_panic("failed to allocate memtypes array");
+  struct mem_limit *l;
+  int n = 0;
+
+  pthread_mutex_lock(&limits_lock);
+  for (l = facility_limits; l && n < num_stats; l = l->next) {
+    if (!l->limit) {
+      continue;
+    }
+    stats[n].facility = l->facility;
+    stats[n].bytes = MAX(facility_bytes(l->facility), 0);
+    stats[n].limit = l->limit;
+    n++;
   }
+  pthread_mutex_unlock(&limits_lock);
+  return n;
+}
 
-  memory_scope = ph_counter_scope_define(NULL, "memory", 16);
-  if (!memory_scope) {
-    memory_panic("failed to define memory scope");
+// Applies one entry of $.memory.limits
+static void apply_limit_config(ph_string_t *key, ph_variant_t *val)
+{
+  char name[128];
+  char *slash;
+  ph_variant_t *limit_var, *soft_var;
+  uint8_t soft[PH_MEM_MAX_SOFT_LIMITS];
+  uint8_t num_soft = sizeof(default_soft_limits);
+  int64_t limit = -1;
+  uint32_t i;
+  ph_result_t res;
+
+  memcpy(soft, default_soft_limits, sizeof(default_soft_limits));
+  if (ph_var_is_int(val)) {
+    limit = ph_var_int_val(val);
+  } else if (ph_var_is_object(val)) {
+    limit_var = ph_var_object_get_cstr(val, "limit");
+    if (limit_var && ph_var_is_int(limit_var)) {
+      limit = ph_var_int_val(limit_var);
+    }
+    soft_var = ph_var_object_get_cstr(val, "soft");
+    if (soft_var && ph_var_is_array(soft_var)) {
+      num_soft = MIN(ph_var_array_size(soft_var), PH_MEM_MAX_SOFT_LIMITS);
+      for (i = 0; i < num_soft; i++) {
+        int64_t pct = ph_var_int_val(ph_var_array_get(soft_var, i));
+
+        if (pct <= 0 || pct >= 100) {
+          limit = -1;
+          break;
+        }
+        soft[i] = pct;
+      }
+    }
+  }
+
+  if (limit <= 0 || key->len >= sizeof(name)) {
+    ph_log(PH_LOG_ERR, "ignoring invalid memory limit for `Ps%p",
+        (void*)key);
+    return;
+  }
+  memcpy(name, key->buf, key->len);
+  name[key->len] = '\0';
+
+  slash = strchr(name, '/');
+  if (slash) {
+    *slash = '\0';
+    res = do_set_limit(ph_mem_type_by_name(name, slash + 1), limit,
+        num_soft, soft, true);
+  } else {
+    res = do_set_facility_limit(name, limit, num_soft, soft, true);
+  }
+  if (res != PH_OK) {
+    ph_log(PH_LOG_ERR, "failed to apply memory limit for `Ps%p",
+        (void*)key);
   }
 }
 
-PH_LIBRARY_INIT_PRI(memory_init, memory_destroy, 3)
+// Applies $.memory.sample_bytes, or turns off the profiling that an
+// earlier configuration turned on
+static void load_prof_config(void)
+{
+  ph_variant_t *val = ph_config_query("$.memory.sample_bytes");
+
+  if (val && ph_var_is_int(val) && ph_var_int_val(val) >= 0) {
+    ph_mem_prof_set_sample_bytes(ph_var_int_val(val));
+    prof_from_config = true;
+  } else if (prof_from_config) {
+    ph_mem_prof_set_sample_bytes(0);
+    prof_from_config = false;
+  }
+  if (val) {
+    ph_var_delref(val);
+  }
+}
 
-static ph_counter_scope_t *resolve_facility(const char *fac)
+// Replaces the limits that came from the previous configuration with
+// those of the current one, and picks up the profiling rate.  Called
+// by ph_config_set_global, so the allocation path never has to look
+// at the configuration
+void ph_mem_load_config(void)
 {
-  ph_counter_scope_t *scope;
+  uint32_t seen = ck_pr_load_32(&config_generation);
+  uint32_t gen = ph_config_get_generation();
+  ph_variant_t *cfg, *val;
+  ph_string_t *key;
+  ph_ht_iter_t iter;
+  struct mem_limit *l;
+  ph_memtype_t mt;
 
-  scope = ph_counter_scope_resolve(memory_scope, fac);
-  if (scope) {
-    return scope;
+  // Of the threads racing to set the configuration, whoever wins
+  // loads the latest one
+  if (seen == gen || !ck_pr_cas_32(&config_generation, seen, gen)) {
+    return;
   }
 
-  return ph_counter_scope_define(memory_scope, fac, 0);
+  pthread_mutex_lock(&limits_lock);
+  for (mt = PH_MEMTYPE_FIRST; mt < next_memtype; mt++) {
+    l = memtypes[mt].limit;
+    if (l && l->from_config) {
+      do_set_limit(mt, 0, 0, NULL, false);
+    }
+  }
+  for (l = facility_limits; l; l = l->next) {
+    if (l->from_config) {
+      do_set_facility_limit(l->facility, 0, 0, NULL, false);
+    }
+  }
+
+  cfg = ph_config_query("$.memory.limits");
+  if (cfg && ph_var_is_object(cfg) &&
+      ph_var_object_iter_first(cfg, &iter, &key, &val)) {
+    do {
+      apply_limit_config(key, val);
+    } while (ph_var_object_iter_next(cfg, &iter, &key, &val));
+  }
+  pthread_mutex_unlock(&limits_lock);
+
+  if (cfg) {
+    ph_var_delref(cfg);
+  }
+  load_prof_config();
+}
+
+// Puts a newly registered memtype under its facility's limit
+static void attach_facility_limit(struct mem_type *mem_type)
+{
+  pthread_mutex_lock(&limits_lock);
+  mem_type->fac_limit = find_facility_limit(mem_type->def.facility);
+  update_limited(mem_type);
+  pthread_mutex_unlock(&limits_lock);
 }
 
 ph_memtype_t ph_memtype_register(const ph_memtype_def_t *def)
@@ -140,7 +1451,7 @@ ph_memtype_t ph_memtype_register(const ph_memtype_def_t *def)
   ph_counter_scope_t *scope, *fac_scope;
   struct mem_type *mem_type;
   const char **names;
-  int num_slots;
+  uint32_t num_slots;
 
   fac_scope = resolve_facility(def->facility);
   if (!fac_scope) {
@@ -167,18 +1478,13 @@ ph_memtype_t ph_memtype_register(const ph_memtype_def_t *def)
   mem_type->def.name = strdup(def->name);
   mem_type->scope = scope;
 
-  if (mem_type->def.item_size == 0) {
-    names = vsize_counter_names;
-    num_slots = MEM_COUNTER_SLOTS;
-  } else {
-    names = sized_counter_names;
-    num_slots = MEM_COUNTER_SLOTS - 1;
-  }
+  names = pick_counters(mem_type, &num_slots);
   if (!ph_counter_scope_register_counter_block(
       scope, num_slots, 0, names)) {
     memory_panic("failed to register counter block for memory scope %s",
       def->name);
   }
+  attach_facility_limit(mem_type);
 
   return mt;
 }
@@ -233,19 +1539,13 @@ ph_memtype_t ph_memtype_register_block(
     }
     mem_type->scope = scope;
 
-    if (mem_type->def.item_size == 0) {
-      names = vsize_counter_names;
-      num_slots = MEM_COUNTER_SLOTS;
-    } else {
-      names = sized_counter_names;
-      num_slots = MEM_COUNTER_SLOTS - 1;
-    }
-    mem_type->first_slot = ph_counter_scope_get_num_slots(scope);
+    names = pick_counters(mem_type, &num_slots);
     if (!ph_counter_scope_register_counter_block(
           scope, num_slots, 0, names)) {
       memory_panic("failed to register counter block for memory scope %s",
         mem_type->def.name);
     }
+    attach_facility_limit(mem_type);
   }
 
   if (types) {
@@ -269,15 +1569,145 @@ static struct mem_type *resolve_mt(ph_memtype_t mt)
   return &memtypes[mt];
 }
 
+// Allocates from a size class; the whole of the class is accounted for
+static void *alloc_class(struct mem_type *mem_type, ph_memtype_t mt,
+    uint64_t size)
+{
+  uint32_t c = size_class(size);
+  uint64_t csize = class_sizes[c];
+  struct mem_thread_cache *tc;
+  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_ALLOCS };
+  int64_t values[2];
+  void *ptr = NULL;
+
+  if (!limit_charge(mem_type, csize)) {
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+    return NULL;
+  }
+  tc = get_thread_cache();
+  if (tc) {
+    ptr = class_alloc(tc, c);
+  }
+  if (!ptr) {
+    limit_refund(mem_type, csize);
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+
+    if (mem_type->def.flags & PH_MEM_FLAGS_PANIC) {
+      ph_panic("OOM while allocating %" PRIu64 " bytes of %s/%s memory",
+          csize, mem_type->def.facility, mem_type->def.name);
+    }
+    return NULL;
+  }
+
+  values[0] = csize;
+  values[1] = 1;
+  mem_account(mt, mem_type, 2, slots, values);
+  ph_mem_prof_alloc(mt, ptr, csize);
+
+  if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
+    memset(ptr, 0, csize);
+  }
+  return ptr;
+}
+
+// Allocations of vsize and PH_MEM_FLAGS_ARENA types carry a header,
+// unless they come from a size class.  Those that come from the arena,
+// if one is given, are charged to its chunks, not to us
+static void *alloc_sized_in(struct mem_type *mem_type, ph_memtype_t mt,
+    uint64_t size, ph_arena_t *arena)
+{
+  struct sized_header *ptr;
+  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_ALLOCS };
+  int64_t values[2];
+
+  if (size > INT64_MAX) {
+    // we can't account for numbers this big
+    return NULL;
+  }
+
+  if (!arena && size <= MAX_CLASS_SIZE && mem_type->def.item_size == 0 &&
+      (mem_type->def.flags & PH_MEM_FLAGS_SIZE_CLASSES)) {
+    return alloc_class(mem_type, mt, size);
+  }
+  if (arena) {
+    struct arena_header *ahdr = ph_arena_alloc(arena,
+        size + HEADER_RESERVATION + sizeof(*ahdr));
+
+    ptr = NULL;
+    if (ahdr) {
+      ahdr->arena = arena;
+      ptr = (struct sized_header*)(ahdr + 1);
+    }
+  } else if (limit_charge(mem_type, size)) {
+    ptr = malloc(size + HEADER_RESERVATION);
+    if (!ptr) {
+      limit_refund(mem_type, size);
+    }
+  } else {
+    // Refused by a limit
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+    return NULL;
+  }
+  if (!ptr) {
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+
+    if (mem_type->def.flags & PH_MEM_FLAGS_PANIC) {
+      ph_panic("OOM while allocating %" PRIu64 " bytes of %s/%s memory",
+          size + HEADER_RESERVATION, mem_type->def.facility,
+          mem_type->def.name);
+    }
+
+    return NULL;
+  }
+
+  ptr->size = size;
+  ptr->mt = mt;
+  ptr->arena = arena != NULL;
+  ptr++;
+
+  if (!arena) {
+    values[0] = size;
+    values[1] = 1;
+    mem_account(mt, mem_type, 2, slots, values);
+    ph_mem_prof_alloc(mt, ptr, size);
+  }
+
+  if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
+    memset(ptr, 0, size);
+  }
+
+  return ptr;
+}
+
+// PH_MEM_FLAGS_ARENA types come from the current arena, if there is one
+static void *alloc_sized(struct mem_type *mem_type, ph_memtype_t mt,
+    uint64_t size)
+{
+  ph_arena_t *arena = NULL;
+
+  if (mem_type->def.flags & PH_MEM_FLAGS_ARENA) {
+    arena = ph_arena_current();
+  }
+  return alloc_sized_in(mem_type, mt, size, arena);
+}
+
 void *ph_mem_alloc(ph_memtype_t mt)
 {
   struct mem_type *mem_type = resolve_mt(mt);
   void *ptr;
-  ph_counter_block_t *block;
+  struct mem_thread_cache *tc;
+  struct mem_thread_type *c;
   int64_t values[3];
   static const uint8_t slots[2] = {
     SLOT_BYTES, SLOT_ALLOCS
   };
+  static const uint8_t cached_slots[3] = {
+    SLOT_BYTES, SLOT_ALLOCS, SLOT_CACHED
+  };
 
   if (mem_type->def.item_size == 0) {
     memory_panic("mem_type %s is vsize, cannot be used with ph_mem_alloc",
@@ -285,8 +1715,39 @@ void *ph_mem_alloc(ph_memtype_t mt)
     return NULL;
   }
 
+  if (mem_type->def.flags & PH_MEM_FLAGS_ARENA) {
+    // Arena objects carry a header to say so.  The others come from a
+    // size class, whose slab tells ph_mem_free() that they don't
+    if (ph_likely(!ph_arena_current()) &&
+        mem_type->def.item_size <= MAX_CLASS_SIZE) {
+      return alloc_class(mem_type, mt, mem_type->def.item_size);
+    }
+    return alloc_sized(mem_type, mt, mem_type->def.item_size);
+  }
+
+  if (!limit_charge(mem_type, mem_type->def.item_size)) {
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+    return NULL;
+  }
+
+  if (mem_type->depot && (c = thread_type(mem_type, &tc)) != NULL &&
+      (ptr = cache_alloc(mem_type, tc, c)) != NULL) {
+    values[0] = mem_type->def.item_size;
+    values[1] = 1;
+    values[2] = -(int64_t)mem_type->def.item_size;
+    ph_counter_block_bulk_add(c->block, 3, cached_slots, values);
+    ph_mem_prof_alloc(mt, ptr, mem_type->def.item_size);
+
+    if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
+      memset(ptr, 0, mem_type->def.item_size);
+    }
+    return ptr;
+  }
+
   ptr = malloc(mem_type->def.item_size);
   if (!ptr) {
+    limit_refund(mem_type, mem_type->def.item_size);
     ph_counter_scope_add(mem_type->scope,
         mem_type->first_slot + SLOT_OOM, 1);
 
@@ -298,11 +1759,10 @@ void *ph_mem_alloc(ph_memtype_t mt)
     return NULL;
   }
 
-  block = ph_counter_block_open(mem_type->scope);
   values[0] = mem_type->def.item_size;
   values[1] = 1;
-  ph_counter_block_bulk_add(block, 2, slots, values);
-  ph_counter_block_delref(block);
+  mem_account(mt, mem_type, 2, slots, values);
+  ph_mem_prof_alloc(mt, ptr, mem_type->def.item_size);
 
   if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
     memset(ptr, 0, mem_type->def.item_size);
@@ -328,10 +1788,6 @@ char *ph_mem_strdup(ph_memtype_t memtype, const char *str)
 void *ph_mem_alloc_size(ph_memtype_t mt, uint64_t size)
 {
   struct mem_type *mem_type = resolve_mt(mt);
-  struct sized_header *ptr;
-  ph_counter_block_t *block;
-  static const uint8_t slots[2] = { SLOT_BYTES, SLOT_ALLOCS };
-  int64_t values[2];
 
   if (mem_type->def.item_size) {
     memory_panic(
@@ -340,57 +1796,52 @@ void *ph_mem_alloc_size(ph_memtype_t mt, uint64_t size)
     return NULL;
   }
 
-  if (size > INT64_MAX) {
-    // we can't account for numbers this big
-    return NULL;
-  }
-
-  ptr = malloc(size + HEADER_RESERVATION);
-  if (!ptr) {
-    ph_counter_scope_add(mem_type->scope,
-        mem_type->first_slot + SLOT_OOM, 1);
-
-    if (mem_type->def.flags & PH_MEM_FLAGS_PANIC) {
-      ph_panic("OOM while allocating %" PRIu64 " bytes of %s/%s memory",
-          size + HEADER_RESERVATION, mem_type->def.facility,
-          mem_type->def.name);
-    }
-
-    return NULL;
-  }
-
-  ptr->size = size;
-  ptr->mt = mt;
-  ptr++;
-
-  block = ph_counter_block_open(mem_type->scope);
-  values[0] = size;
-  values[1] = 1;
-  ph_counter_block_bulk_add(block, 2, slots, values);
-  ph_counter_block_delref(block);
-
-  if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
-    memset(ptr, 0, size);
-  }
-
-  return ptr;
+  return alloc_sized(mem_type, mt, size);
 }
 
 void ph_mem_free(ph_memtype_t mt, void *ptr)
 {
   struct mem_type *mem_type;
-  ph_counter_block_t *block;
+  struct mem_thread_cache *tc;
+  struct mem_thread_type *c;
   static const uint8_t slots[2] = { SLOT_BYTES, SLOT_FREES };
-  int64_t values[2];
+  static const uint8_t cached_slots[3] = {
+    SLOT_BYTES, SLOT_FREES, SLOT_CACHED
+  };
+  int64_t values[3];
   uint64_t size;
+  uint32_t cls;
 
   if (!ptr) {
     return;
   }
+  ph_mem_prof_free(ptr);
 
   mem_type = resolve_mt(mt);
-  if (mem_type->def.item_size) {
+  if (mem_type->def.item_size &&
+      !(mem_type->def.flags & PH_MEM_FLAGS_ARENA)) {
     size = mem_type->def.item_size;
+    limit_charge(mem_type, -(int64_t)size);
+
+    if (mem_type->depot && (c = thread_type(mem_type, &tc)) != NULL &&
+        cache_free(mem_type, tc, c, ptr)) {
+      values[0] = -size;
+      values[1] = 1;
+      values[2] = size;
+      ph_counter_block_bulk_add(c->block, 3, cached_slots, values);
+      return;
+    }
+  } else if ((mem_type->def.flags &
+        (PH_MEM_FLAGS_SIZE_CLASSES|PH_MEM_FLAGS_ARENA)) &&
+      (cls = slab_class(ptr)) != 0) {
+    size = class_sizes[cls - 1];
+    limit_charge(mem_type, -(int64_t)size);
+    class_free(cls - 1, ptr);
+
+    values[0] = -size;
+    values[1] = 1;
+    mem_account(mt, mem_type, 2, slots, values);
+    return;
   } else {
     struct sized_header *hdr = ptr;
 
@@ -402,26 +1853,59 @@ void ph_mem_free(ph_memtype_t mt, void *ptr)
       memory_panic("ph_mem_free: hdr->mt %d != caller provided mt %d %s",
         hdr->mt, mt, mem_type->def.name);
     }
+    if (hdr->arena) {
+      return;
+    }
+    limit_charge(mem_type, -(int64_t)size);
   }
 
   free(ptr);
 
-  block = ph_counter_block_open(mem_type->scope);
   values[0] = -size;
   values[1] = 1;
-  ph_counter_block_bulk_add(block, 2, slots, values);
-  ph_counter_block_delref(block);
+  mem_account(mt, mem_type, 2, slots, values);
+}
+
+// Size class objects stay put for as long as the new size is of the same
+// class.  Otherwise they move, which is accounted for as an allocation
+// and a free
+static void *realloc_class(struct mem_type *mem_type, ph_memtype_t mt,
+    void *ptr, uint32_t c, uint64_t size)
+{
+  uint64_t csize = class_sizes[c];
+  static const uint8_t slots[1] = { SLOT_REALLOC };
+  static const int64_t values[1] = { 1 };
+  void *new_ptr;
+
+  if (size <= MAX_CLASS_SIZE && size_class(size) == c) {
+    // What lies beyond the caller's size stays zeroed, for when it grows
+    if (mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
+      memset((char*)ptr + size, 0, csize - size);
+    }
+    mem_account(mt, mem_type, 1, slots, values);
+    return ptr;
+  }
+
+  // It didn't come from an arena, and mustn't move into one that may
+  // be released from under it
+  new_ptr = alloc_sized_in(mem_type, mt, size, NULL);
+  if (!new_ptr) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, MIN(size, csize));
+  ph_mem_free(mt, ptr);
+  return new_ptr;
 }
 
 void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
 {
   struct mem_type *mem_type;
-  ph_counter_block_t *block;
   static const uint8_t slots[2] = { SLOT_BYTES, SLOT_REALLOC };
   int64_t values[3];
   struct sized_header *hdr;
   uint64_t orig_size;
   void *new_ptr;
+  uint32_t cls;
 
   if (size == 0) {
     ph_mem_free(mt, ptr);
@@ -438,6 +1922,11 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
     return NULL;
   }
 
+  if ((mem_type->def.flags & PH_MEM_FLAGS_SIZE_CLASSES) &&
+      (cls = slab_class(ptr)) != 0) {
+    return realloc_class(mem_type, mt, ptr, cls - 1, size);
+  }
+
   hdr = ptr;
   hdr--;
   ptr = hdr;
@@ -449,11 +1938,39 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
 
   orig_size = hdr->size;
   if (orig_size == size) {
-    return ptr;
+    return hdr + 1;
+  }
+
+  if (hdr->arena) {
+    // Arena memory stays put; shrink it in place, or move it within the
+    // arena that it came from, whichever is current, as its owner lives
+    // there and goes when that arena is reset
+    if (size < orig_size) {
+      hdr->size = size;
+      return hdr + 1;
+    }
+    new_ptr = alloc_sized_in(mem_type, mt, size,
+        ((struct arena_header*)hdr - 1)->arena);
+    if (new_ptr) {
+      memcpy(new_ptr, hdr + 1, orig_size);
+    }
+    return new_ptr;
+  }
+
+  if (size > orig_size && !limit_charge(mem_type, size - orig_size)) {
+    ph_counter_scope_add(mem_type->scope,
+        mem_type->first_slot + SLOT_OOM, 1);
+    return NULL;
   }
 
+  // The sample goes with the old pointer; the new one may be sampled
+  // in its place
+  ph_mem_prof_free(hdr + 1);
   hdr = realloc(ptr, size + HEADER_RESERVATION);
   if (!hdr) {
+    if (size > orig_size) {
+      limit_refund(mem_type, size - orig_size);
+    }
     ph_counter_scope_add(mem_type->scope,
         mem_type->first_slot + SLOT_OOM, 1);
 
@@ -467,12 +1984,14 @@ void *ph_mem_realloc(ph_memtype_t mt, void *ptr, uint64_t size)
   }
   new_ptr = hdr + 1;
   hdr->size = size;
+  if (size < orig_size) {
+    limit_charge(mem_type, -(int64_t)(orig_size - size));
+  }
 
-  block = ph_counter_block_open(mem_type->scope);
   values[0] = size - orig_size;
   values[1] = 1;
-  ph_counter_block_bulk_add(block, 2, slots, values);
-  ph_counter_block_delref(block);
+  mem_account(mt, mem_type, 2, slots, values);
+  ph_mem_prof_alloc(mt, new_ptr, size);
 
   if (size > orig_size && mem_type->def.flags & PH_MEM_FLAGS_ZERO) {
     memset((char*)new_ptr + orig_size, 0, size - orig_size);
@@ -496,13 +2015,18 @@ bool ph_mem_stat(ph_memtype_t mt, ph_mem_stats_t *stats)
   stats->def = &mem_type->def;
   n = ph_counter_scope_get_view(mem_type->scope,
       MEM_COUNTER_SLOTS, values, NULL);
-  if (n == MEM_COUNTER_SLOTS) {
+  if (n == MEM_COUNTER_SLOTS && mem_type->depot) {
+    stats->cached = values[SLOT_CACHED];
+  } else if (n == MEM_COUNTER_SLOTS) {
     stats->reallocs = values[SLOT_REALLOC];
   }
   stats->frees = values[SLOT_FREES];
   stats->allocs = values[SLOT_ALLOCS];
   stats->oom = values[SLOT_OOM];
   stats->bytes = values[SLOT_BYTES];
+  if (mem_type->limit) {
+    stats->limit = ck_pr_load_64(&mem_type->limit->limit);
+  }
 
   return true;
 }
@@ -536,6 +2060,14 @@ int ph_mem_stat_range(ph_memtype_t start,
   return n_stats;
 }
 
+ph_arena_t *ph_arena_for_memtype(ph_memtype_t mt)
+{
+  if (!(resolve_mt(mt)->def.flags & PH_MEM_FLAGS_ARENA)) {
+    return NULL;
+  }
+  return ph_arena_current();
+}
+
 ph_memtype_t ph_mem_type_by_name(const char *facility,
     const char *name)
 {
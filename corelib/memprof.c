@@ -0,0 +1,398 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/stream.h"
+#include "phenom/log.h"
+#include "corelib/memprof.h"
+#include <math.h>
+#ifdef HAVE_BACKTRACE
+# include <execinfo.h>
+#endif
+
+/* Sampling heap profiler, after the one in tcmalloc.  Each thread counts
+ * down the bytes it allocates and samples the allocation that takes the
+ * count below zero, then starts over from an exponentially distributed
+ * interval with a mean of the sample rate.  That makes the chance of an
+ * allocation being sampled depend only on its size, which is what pprof
+ * assumes when it scales the samples back up.
+ *
+ * Sampled allocations are grouped into buckets by memtype and stack.
+ * A table of the sampled pointers lets frees find their sample; frees
+ * only take the lock if the pointer's slot is occupied.  The table has
+ * twice as many slots as there can be samples, so that most slots stay
+ * empty and most frees don't hash to a sample even when it is full.
+ *
+ * Our own structures come from malloc, as allocating them from a
+ * memtype would bring us back in here. */
+
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_SAMPLES 65536
+#define PROF_MAX_BUCKETS 65536
+#define PROF_SAMPLE_BITS 17
+#define PROF_SAMPLE_SLOTS (1 << PROF_SAMPLE_BITS)
+// Power of 2
+#define PROF_BUCKET_SLOTS 4096
+
+ph_static_assert(PROF_SAMPLE_SLOTS >= 2 * PROF_MAX_SAMPLES,
+    sample_table_too_small);
+
+struct prof_bucket {
+  struct prof_bucket *next;
+  uint32_t hash;
+  ph_memtype_t mt;
+  uint32_t depth;
+  uint64_t live_objs, live_bytes;
+  uint64_t alloc_objs, alloc_bytes;
+  void *stack[PROF_MAX_DEPTH];
+};
+
+struct prof_sample {
+  struct prof_sample *next;
+  void *ptr;
+  uint64_t size;
+  struct prof_bucket *bucket;
+};
+
+struct prof_thread {
+  int64_t countdown;
+  uint64_t rng;
+};
+
+uint64_t _ph_mem_prof_rate = 0;
+uint32_t _ph_mem_prof_live = 0;
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+// Allocated when profiling is first enabled, and kept from then on
+static struct prof_sample **samples;
+static struct prof_bucket **buckets;
+static uint32_t num_buckets;
+
+#ifdef HAVE___THREAD
+static __thread struct prof_thread prof_thread;
+#else
+static pthread_key_t prof_key;
+#endif
+
+static void init_memprof(void)
+{
+#ifndef HAVE___THREAD
+  pthread_key_create(&prof_key, free);
+#endif
+}
+PH_LIBRARY_INIT(init_memprof, 0)
+
+static struct prof_thread *get_prof_thread(void)
+{
+#ifdef HAVE___THREAD
+  return &prof_thread;
+#else
+  struct prof_thread *pt = pthread_getspecific(prof_key);
+
+  if (pt) {
+    return pt;
+  }
+  pt = calloc(1, sizeof(*pt));
+  if (pt) {
+    pthread_setspecific(prof_key, pt);
+  }
+  return pt;
+#endif
+}
+
+// xorshift64*
+static uint64_t next_random(struct prof_thread *pt)
+{
+  pt->rng ^= pt->rng >> 12;
+  pt->rng ^= pt->rng << 25;
+  pt->rng ^= pt->rng >> 27;
+  return pt->rng * UINT64_C(2685821657736338717);
+}
+
+static int64_t next_interval(struct prof_thread *pt, uint64_t rate)
+{
+  // Uniform in (0, 1]
+  double u = ((next_random(pt) >> 11) + 1) / 9007199254740992.0;
+
+  return (int64_t)(-log(u) * rate) + 1;
+}
+
+static inline uint32_t sample_slot(void *ptr)
+{
+  return ((uintptr_t)ptr >> 4) * UINT64_C(0x9E3779B97F4A7C15) >>
+    (64 - PROF_SAMPLE_BITS);
+}
+
+static uint32_t hash_stack(ph_memtype_t mt, void **stack, uint32_t depth)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325) ^ (uint32_t)mt;
+  uint32_t i;
+
+  for (i = 0; i < depth; i++) {
+    h = (h ^ (uintptr_t)stack[i]) * UINT64_C(0x100000001b3);
+  }
+  return h ^ (h >> 32);
+}
+
+// Call with prof_lock held
+static struct prof_bucket *find_bucket(ph_memtype_t mt, void **stack,
+    uint32_t depth)
+{
+  uint32_t hash = hash_stack(mt, stack, depth);
+  struct prof_bucket *b;
+
+  for (b = buckets[hash & (PROF_BUCKET_SLOTS - 1)]; b; b = b->next) {
+    if (b->hash == hash && b->mt == mt && b->depth == depth &&
+        !memcmp(b->stack, stack, depth * sizeof(void*))) {
+      return b;
+    }
+  }
+
+  if (num_buckets >= PROF_MAX_BUCKETS) {
+    return NULL;
+  }
+  b = malloc(sizeof(*b));
+  if (!b) {
+    return NULL;
+  }
+  memset(b, 0, offsetof(struct prof_bucket, stack));
+  b->hash = hash;
+  b->mt = mt;
+  b->depth = depth;
+  memcpy(b->stack, stack, depth * sizeof(void*));
+  b->next = buckets[hash & (PROF_BUCKET_SLOTS - 1)];
+  buckets[hash & (PROF_BUCKET_SLOTS - 1)] = b;
+  num_buckets++;
+  return b;
+}
+
+void ph_mem_prof_count(ph_memtype_t mt, void *ptr, uint64_t size)
+{
+  struct prof_thread *pt = get_prof_thread();
+  uint64_t rate = ck_pr_load_64(&_ph_mem_prof_rate);
+  void *stack[PROF_MAX_DEPTH + 1];
+  struct prof_sample *s;
+  struct prof_bucket *b;
+  uint32_t depth = 0, slot;
+
+  if (!pt || !rate) {
+    return;
+  }
+  if (ph_unlikely(!pt->rng)) {
+    pt->rng = ((uintptr_t)pt ^ (uint64_t)time(NULL)) |
+      UINT64_C(0x8000000000000000);
+    pt->countdown = next_interval(pt, rate);
+  }
+
+  pt->countdown -= MIN(size, INT64_MAX);
+  if (ph_likely(pt->countdown > 0)) {
+    return;
+  }
+  pt->countdown = next_interval(pt, rate);
+
+#ifdef HAVE_BACKTRACE
+  // Leave ourselves out
+  depth = backtrace(stack, PROF_MAX_DEPTH + 1);
+  depth = depth ? depth - 1 : 0;
+#endif
+
+  s = malloc(sizeof(*s));
+  if (!s) {
+    return;
+  }
+  s->ptr = ptr;
+  s->size = size;
+
+  pthread_mutex_lock(&prof_lock);
+  // Profiling may have been reset since we looked
+  if (ck_pr_load_64(&_ph_mem_prof_rate) != rate ||
+      _ph_mem_prof_live >= PROF_MAX_SAMPLES ||
+      (b = find_bucket(mt, stack + 1, depth)) == NULL) {
+    pthread_mutex_unlock(&prof_lock);
+    free(s);
+    return;
+  }
+  s->bucket = b;
+  b->live_objs++;
+  b->live_bytes += size;
+  b->alloc_objs++;
+  b->alloc_bytes += size;
+
+  slot = sample_slot(ptr);
+  s->next = samples[slot];
+  ck_pr_store_ptr(&samples[slot], s);
+  ck_pr_store_32(&_ph_mem_prof_live, _ph_mem_prof_live + 1);
+  pthread_mutex_unlock(&prof_lock);
+}
+
+void ph_mem_prof_forget(void *ptr)
+{
+  uint32_t slot = sample_slot(ptr);
+  struct prof_sample *s, **prev;
+
+  // Most pointers weren't sampled and find their slot empty
+  if (!ck_pr_load_ptr(&samples[slot])) {
+    return;
+  }
+
+  pthread_mutex_lock(&prof_lock);
+  for (prev = &samples[slot]; (s = *prev) != NULL; prev = &s->next) {
+    if (s->ptr != ptr) {
+      continue;
+    }
+    ck_pr_store_ptr(prev, s->next);
+    s->bucket->live_objs--;
+    s->bucket->live_bytes -= s->size;
+    ck_pr_store_32(&_ph_mem_prof_live, _ph_mem_prof_live - 1);
+    free(s);
+    break;
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
+
+// Call with prof_lock held
+static void reset_samples(void)
+{
+  struct prof_sample *s;
+  struct prof_bucket *b;
+  uint32_t i;
+
+  for (i = 0; i < PROF_SAMPLE_SLOTS; i++) {
+    while ((s = samples[i]) != NULL) {
+      ck_pr_store_ptr(&samples[i], s->next);
+      free(s);
+    }
+  }
+  for (i = 0; i < PROF_BUCKET_SLOTS; i++) {
+    while ((b = buckets[i]) != NULL) {
+      buckets[i] = b->next;
+      free(b);
+    }
+  }
+  num_buckets = 0;
+  ck_pr_store_32(&_ph_mem_prof_live, 0);
+}
+
+void ph_mem_prof_set_sample_bytes(uint64_t sample_bytes)
+{
+  pthread_mutex_lock(&prof_lock);
+  if (sample_bytes == _ph_mem_prof_rate) {
+    pthread_mutex_unlock(&prof_lock);
+    return;
+  }
+  if (!samples) {
+    samples = calloc(PROF_SAMPLE_SLOTS, sizeof(*samples));
+    buckets = calloc(PROF_BUCKET_SLOTS, sizeof(*buckets));
+    if (!samples || !buckets) {
+      free(samples);
+      free(buckets);
+      samples = NULL;
+      buckets = NULL;
+      pthread_mutex_unlock(&prof_lock);
+      ph_log(PH_LOG_ERR, "unable to allocate heap profiler tables");
+      return;
+    }
+  }
+  reset_samples();
+  ck_pr_fence_store();
+  ck_pr_store_64(&_ph_mem_prof_rate, sample_bytes);
+  pthread_mutex_unlock(&prof_lock);
+}
+
+uint64_t ph_mem_prof_get_sample_bytes(void)
+{
+  return ck_pr_load_64(&_ph_mem_prof_rate);
+}
+
+// Lets pprof map the stack addresses to our binaries
+static void dump_maps(ph_stream_t *stm)
+{
+  ph_stream_t *maps;
+  char buf[8192];
+  uint64_t n;
+
+  ph_stm_printf(stm, "\nMAPPED_LIBRARIES:\n");
+  maps = ph_stm_file_open("/proc/self/maps", O_RDONLY, 0);
+  if (!maps) {
+    return;
+  }
+  while (ph_stm_read(maps, buf, sizeof(buf), &n) && n > 0) {
+    ph_stm_write(stm, buf, n, NULL);
+  }
+  ph_stm_close(maps);
+}
+
+bool ph_mem_prof_dump(ph_stream_t *stm)
+{
+  struct prof_bucket *snap, *b;
+  uint64_t rate, live_objs = 0, live_bytes = 0;
+  uint64_t alloc_objs = 0, alloc_bytes = 0;
+  uint32_t i, j, n = 0;
+  ph_mem_stats_t stats;
+
+  // Copy the buckets out, as writing to the stream may allocate
+  pthread_mutex_lock(&prof_lock);
+  rate = _ph_mem_prof_rate;
+  if (!rate) {
+    pthread_mutex_unlock(&prof_lock);
+    return false;
+  }
+  snap = malloc(MAX(num_buckets, 1) * sizeof(*snap));
+  if (!snap) {
+    pthread_mutex_unlock(&prof_lock);
+    return false;
+  }
+  for (i = 0; i < PROF_BUCKET_SLOTS; i++) {
+    for (b = buckets[i]; b; b = b->next) {
+      snap[n++] = *b;
+    }
+  }
+  pthread_mutex_unlock(&prof_lock);
+
+  for (i = 0; i < n; i++) {
+    live_objs += snap[i].live_objs;
+    live_bytes += snap[i].live_bytes;
+    alloc_objs += snap[i].alloc_objs;
+    alloc_bytes += snap[i].alloc_bytes;
+  }
+
+  ph_stm_printf(stm, "heap profile: %" PRIu64 ": %" PRIu64
+      " [%" PRIu64 ": %" PRIu64 "] @ heap_v2/%" PRIu64 "\n",
+      live_objs, live_bytes, alloc_objs, alloc_bytes, rate);
+
+  for (i = 0; i < n; i++) {
+    b = &snap[i];
+    ph_stm_printf(stm, "%" PRIu64 ": %" PRIu64
+        " [%" PRIu64 ": %" PRIu64 "] @",
+        b->live_objs, b->live_bytes, b->alloc_objs, b->alloc_bytes);
+    for (j = 0; j < b->depth; j++) {
+      ph_stm_printf(stm, " 0x%" PRIxPTR, (uintptr_t)b->stack[j]);
+    }
+    if (ph_mem_stat(b->mt, &stats)) {
+      ph_stm_printf(stm, "\n# %s/%s\n",
+          stats.def->facility, stats.def->name);
+    } else {
+      ph_stm_printf(stm, "\n");
+    }
+  }
+  free(snap);
+
+  dump_maps(stm);
+  return ph_stm_flush(stm);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CORELIB_MEMPROF_H
+#define CORELIB_MEMPROF_H
+
+#include "phenom/memory.h"
+#include <ck_pr.h>
+
+/* The allocator calls these on every allocation and free; they cost a
+ * load unless profiling is enabled, or there are live samples */
+extern uint64_t _ph_mem_prof_rate;
+extern uint32_t _ph_mem_prof_live;
+
+/* Reloads the memory limits and the profiling rate from the global
+ * configuration; ph_config_set_global calls it after each change */
+void ph_mem_load_config(void);
+
+void ph_mem_prof_count(ph_memtype_t mt, void *ptr, uint64_t size);
+void ph_mem_prof_forget(void *ptr);
+
+static inline void ph_mem_prof_alloc(ph_memtype_t mt, void *ptr,
+    uint64_t size)
+{
+  if (ph_unlikely(ck_pr_load_64(&_ph_mem_prof_rate))) {
+    ph_mem_prof_count(mt, ptr, size);
+  }
+}
+
+static inline void ph_mem_prof_free(void *ptr)
+{
+  if (ph_unlikely(ck_pr_load_32(&_ph_mem_prof_live))) {
+    ph_mem_prof_forget(ptr);
+  }
+}
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
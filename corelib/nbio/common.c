@@ -29,7 +29,8 @@ GIMLI_DECLARE_TRACER_MODULE("gimli_libphenom");
 #endif
 
 static ph_memtype_def_t ajob_def = {
-  "nbio", "affine_job", sizeof(struct ph_nbio_affine_job), PH_MEM_FLAGS_ZERO
+  "nbio", "affine_job", sizeof(struct ph_nbio_affine_job),
+  PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED
 };
 static ph_memtype_t mt_ajob;
 static ph_counter_scope_t *counter_scope = NULL;
@@ -47,7 +48,7 @@ static int gc_interval;
 #ifdef USE_GIMLI
 static volatile struct gimli_heartbeat *hb = NULL;
 #endif
-static struct timeval max_sleep_tv = { 5, 0 };
+static uint64_t max_sleep_ns = 5 * PH_NSEC_PER_SEC;
 
 static inline struct ph_nbio_emitter *emitter_for_affinity(uint32_t n)
 {
@@ -67,6 +68,11 @@ struct ph_nbio_emitter *ph_nbio_emitter_for_job(ph_job_t *job) {
   return emitter_for_job(job);
 }
 
+uint32_t ph_nbio_num_emitters(void)
+{
+  return num_schedulers;
+}
+
 uint32_t ph_thread_emitter_affinity(void) {
   ph_thread_t *me = ph_thread_self();
   if (!me->is_emitter) {
@@ -95,19 +101,16 @@ void ph_nbio_emitter_dispatch_immediate(
   ph_counter_block_add(emitter->cblock, SLOT_DISP, 1);
 
   if (job != &emitter->timer_job && job != &gc_job) {
-    emitter->last_dispatch = ph_time_now();
+    emitter->last_dispatch = ph_time_now_ns();
   }
   job->callback(job, why, job->data);
 }
 
 void ph_job_collector_emitter_call(struct ph_nbio_emitter *emitter)
 {
-  struct timeval now = ph_time_now();
-  struct timeval target;
+  uint64_t now = ph_time_now_ns();
 
-  timeradd(&emitter->last_dispatch, &max_sleep_tv, &target);
-
-  if (!timercmp(&now, &target, <)) {
+  if (now >= emitter->last_dispatch + max_sleep_ns) {
     emitter->last_dispatch = now;
     ph_job_collector_call(emitter->thread);
   }
@@ -124,7 +127,7 @@ static inline ph_job_t *job_from_timer(struct ph_timerwheel_timer *timer)
 static bool before_dispatch_timer(
     ph_timerwheel_t *w,
     struct ph_timerwheel_timer *timer,
-    struct timeval now,
+    uint64_t now,
     void *arg)
 {
   ph_job_t *job;
@@ -148,7 +151,7 @@ static bool before_dispatch_timer(
 static void dispatch_timer(
     ph_timerwheel_t *w,
     struct ph_timerwheel_timer *timer,
-    struct timeval now,
+    uint64_t now,
     void *arg)
 {
   ph_job_t *job;
@@ -166,8 +169,8 @@ static void dispatch_timer(
 
 void ph_nbio_emitter_timer_tick(struct ph_nbio_emitter *emitter)
 {
-  struct timeval now = ph_time_now();
-  while (timercmp(&emitter->wheel.next_run, &now, <)) {
+  uint64_t now = ph_time_now_ns();
+  while (emitter->wheel.next_run < now) {
     ph_counter_block_add(emitter->cblock, SLOT_TIMER_TICK, 1);
     ph_timerwheel_tick(&emitter->wheel, now,
         before_dispatch_timer, dispatch_timer, emitter);
@@ -266,14 +269,14 @@ ph_result_t ph_nbio_init(uint32_t sched_cores)
   ph_thread_t *me;
   uint32_t i;
   int max_sleep;
+  uint64_t now;
 
   if (counter_scope) {
     return PH_OK;
   }
 
   max_sleep = ph_config_query_int("$.nbio.max_sleep", 5000);
-  max_sleep_tv.tv_sec = max_sleep / 1000;
-  max_sleep_tv.tv_usec = (max_sleep - (max_sleep_tv.tv_sec * 1000)) * 1000;
+  max_sleep_ns = max_sleep * PH_NSEC_PER_MSEC;
 
   sched_cores = ph_config_query_int("$.nbio.sched_cores", sched_cores);
   mt_ajob = ph_memtype_register(&ajob_def);
@@ -294,14 +297,14 @@ ph_result_t ph_nbio_init(uint32_t sched_cores)
   me = ph_thread_self_slow();
   me->is_worker = 1;
 
-  gettimeofday(&me->now, NULL);
-  me->refresh_time = false;
+  ph_thread_refresh_time(me);
+  now = ph_time_now_ns();
   ph_thread_set_name("phenom:sched");
 
   for (i = 0; i < num_schedulers; i++) {
-    ph_timerwheel_init(&emitters[i].wheel, me->now, WHEEL_INTERVAL_MS);
+    ph_timerwheel_init(&emitters[i].wheel, now, WHEEL_INTERVAL_MS);
     emitters[i].emitter_id = i;
-    emitters[i].last_dispatch = me->now;
+    emitters[i].last_dispatch = now;
 
     // prep for affine dispatch
     PH_STAILQ_INIT(&emitters[i].affine_jobs);
@@ -453,7 +456,7 @@ static void process_deferred(ph_thread_t *me, void *impl)
     job->mask = 0;
 
     // Enable
-    if (timerisset(&job->timer.due)) {
+    if (job->timer.due) {
       ph_timerwheel_enable(&target_emitter->wheel, &job->timer);
     }
     ph_nbio_emitter_apply_io_mask(target_emitter, job, mask);
@@ -465,18 +468,49 @@ void ph_job_pool_apply_deferred_items(ph_thread_t *me)
   process_deferred(me, NULL);
 }
 
-ph_result_t ph_job_set_nbio_timeout_in(
-    ph_job_t *job,
-    ph_iomask_t mask,
-    struct timeval interval)
+bool ph_nbio_defer_to_batch_end(struct ph_nbio_batch_ent *bent)
 {
-  struct timeval abst = ph_time_now();
-  timeradd(&abst, &interval, &abst);
-  return ph_job_set_nbio(job, mask, &abst);
+  ph_thread_t *me = ph_thread_self();
+
+  if (!me->is_emitter) {
+    return false;
+  }
+  if (!bent->queued) {
+    bent->queued = true;
+    PH_STAILQ_INSERT_TAIL(&me->pending_batch, bent, ent);
+  }
+  return true;
 }
 
-ph_result_t ph_job_set_nbio(ph_job_t *job, ph_iomask_t mask,
-    struct timeval *timeout)
+void ph_nbio_run_batch_end(ph_thread_t *me)
+{
+  struct ph_nbio_batch_ent *bent;
+
+  // Entries may queue more entries; they'll run in this pass
+  while ((bent = PH_STAILQ_FIRST(&me->pending_batch)) != NULL) {
+    PH_STAILQ_REMOVE_HEAD(&me->pending_batch, ent);
+    bent->queued = false;
+    bent->func(bent->code, bent->arg);
+  }
+  if (ph_job_have_deferred_items(me)) {
+    ph_job_pool_apply_deferred_items(me);
+  }
+}
+
+// Map a wall clock deadline to the monotonic clock used by the wheel
+static uint64_t abstime_to_due(struct timeval abstime)
+{
+  struct timeval now = ph_time_now();
+
+  if (!timercmp(&abstime, &now, >)) {
+    return ph_time_now_ns();
+  }
+  timersub(&abstime, &now, &abstime);
+  return ph_time_now_ns() + ph_timeval_to_ns(abstime);
+}
+
+static ph_result_t set_nbio_due(ph_job_t *job, ph_iomask_t mask,
+    uint64_t due)
 {
   ph_thread_t *me;
   struct ph_nbio_emitter *target_emitter = emitter_for_job(job);
@@ -489,14 +523,10 @@ ph_result_t ph_job_set_nbio(ph_job_t *job, ph_iomask_t mask,
 
   job->mask = mask;
   ph_timerwheel_remove(&target_emitter->wheel, &job->timer);
-  if (timeout) {
-    job->timer.due = *timeout;
-  } else {
-    timerclear(&job->timer.due);
-  }
+  job->timer.due = due;
 
   if (!me->is_worker || target_emitter == me->is_emitter) {
-    if (timerisset(&job->timer.due)) {
+    if (job->timer.due) {
       ph_timerwheel_enable(&target_emitter->wheel, &job->timer);
     }
     ph_nbio_emitter_apply_io_mask(target_emitter, job, mask);
@@ -516,20 +546,34 @@ ph_result_t ph_job_set_nbio(ph_job_t *job, ph_iomask_t mask,
   return PH_OK;
 }
 
+ph_result_t ph_job_set_nbio(ph_job_t *job, ph_iomask_t mask,
+    struct timeval *timeout)
+{
+  return set_nbio_due(job, mask, timeout ? abstime_to_due(*timeout) : 0);
+}
+
+ph_result_t ph_job_set_nbio_timeout_in(
+    ph_job_t *job,
+    ph_iomask_t mask,
+    struct timeval interval)
+{
+  return set_nbio_due(job, mask,
+      ph_time_now_ns() + ph_timeval_to_ns(interval));
+}
+
 ph_result_t ph_job_set_timer_at(
     ph_job_t *job,
     struct timeval abstime)
 {
-  return ph_job_set_nbio(job, PH_IOMASK_TIME, &abstime);
+  return set_nbio_due(job, PH_IOMASK_TIME, abstime_to_due(abstime));
 }
 
 ph_result_t ph_job_set_timer_in(
     ph_job_t *job,
     struct timeval interval)
 {
-  struct timeval abst = ph_time_now();
-  timeradd(&abst, &interval, &abst);
-  return ph_job_set_nbio(job, PH_IOMASK_TIME, &abst);
+  return set_nbio_due(job, PH_IOMASK_TIME,
+      ph_time_now_ns() + ph_timeval_to_ns(interval));
 }
 
 ph_result_t ph_job_clear_timer(ph_job_t *job)
@@ -541,12 +585,8 @@ ph_result_t ph_job_set_timer_in_ms(
     ph_job_t *job,
     uint32_t interval)
 {
-  struct timeval d;
-
-  d.tv_sec = interval / 1000;
-  d.tv_usec = (interval - (d.tv_sec * 1000)) * 1000;
-
-  return ph_job_set_timer_in(job, d);
+  return set_nbio_due(job, PH_IOMASK_TIME,
+      ph_time_now_ns() + (interval * PH_NSEC_PER_MSEC));
 }
 
 ph_result_t ph_job_init(ph_job_t *job)
@@ -571,6 +611,46 @@ struct timeval ph_time_now(void)
   return me->now;
 }
 
+static inline uint64_t read_monotonic_ns(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (ts.tv_sec * PH_NSEC_PER_SEC) + ts.tv_nsec;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * PH_NSEC_PER_SEC) + ts.tv_nsec;
+#elif defined(__MACH__)
+  static mach_timebase_info_data_t timebase;
+
+  if (ph_unlikely(timebase.denom == 0)) {
+    mach_timebase_info(&timebase);
+  }
+  return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ph_timeval_to_ns(tv);
+#endif
+}
+
+uint64_t ph_time_now_ns(void)
+{
+  ph_thread_t *me = ph_thread_self();
+
+  if (!me->is_worker || me->refresh_time_ns ||
+      ph_unlikely(me->now_ns == 0)) {
+    me->now_ns = read_monotonic_ns();
+    me->refresh_time_ns = false;
+  }
+
+  return me->now_ns;
+}
+
 void ph_socket_set_nonblock(ph_socket_t fd, bool enable)
 {
   int flag = fcntl(fd, F_GETFL);
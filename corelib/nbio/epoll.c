@@ -120,7 +120,7 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
 
   while (ck_pr_load_int(&_ph_run_loop)) {
     n = epoll_wait(emitter->io_fd, event, max_chunk, max_sleep);
-    thread->refresh_time = true;
+    ph_thread_refresh_time(thread);
 
     if (n < 0) {
       if (errno != EINTR) {
@@ -167,6 +167,9 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
         ph_job_pool_apply_deferred_items(thread);
       }
     }
+    if (ph_nbio_have_batch_items(thread)) {
+      ph_nbio_run_batch_end(thread);
+    }
     ph_thread_epoch_end();
     ph_job_collector_emitter_call(emitter);
     ph_thread_epoch_poll();
@@ -90,8 +90,7 @@ static inline void dispatch_kevent(struct ph_nbio_emitter *emitter,
 
   switch (event->filter) {
     case EVFILT_TIMER:
-      gettimeofday(&thread->now, NULL);
-      thread->refresh_time = false;
+      ph_thread_refresh_time(thread);
       ph_nbio_emitter_timer_tick(emitter);
       break;
 
@@ -108,14 +107,14 @@ static inline void dispatch_kevent(struct ph_nbio_emitter *emitter,
       }
       */
 
-      thread->refresh_time = true;
+      ph_thread_refresh_time(thread);
       job = event->udata;
       job->kmask = 0;
       ph_nbio_emitter_dispatch_immediate(emitter, job, mask);
       break;
 
     case EVFILT_WRITE:
-      thread->refresh_time = true;
+      ph_thread_refresh_time(thread);
       job = event->udata;
       job->kmask = 0;
       ph_nbio_emitter_dispatch_immediate(emitter, job, PH_IOMASK_WRITE);
@@ -158,6 +157,9 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
     }
     emitter->kqset.used = 0;
 
+    if (ph_nbio_have_batch_items(thread)) {
+      ph_nbio_run_batch_end(thread);
+    }
     if (ph_job_have_deferred_items(thread)) {
       ph_job_pool_apply_deferred_items(thread);
     }
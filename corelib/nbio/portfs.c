@@ -86,8 +86,7 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
 
       switch (event[i].portev_source) {
         case PORT_SOURCE_TIMER:
-          gettimeofday(&thread->now, NULL);
-          thread->refresh_time = false;
+          ph_thread_refresh_time(thread);
           ph_nbio_emitter_timer_tick(emitter);
           break;
 
@@ -95,7 +94,7 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
           break;
 
         case PORT_SOURCE_FD:
-          thread->refresh_time = true;
+          ph_thread_refresh_time(thread);
           job = event[i].portev_user;
 
           switch (event[i].portev_events & (POLLIN|POLLOUT|POLLERR|POLLHUP)) {
@@ -116,6 +115,10 @@ void ph_nbio_emitter_run(struct ph_nbio_emitter *emitter, ph_thread_t *thread)
           break;
       }
 
+      // Still inside the epoch section of the last event of the batch
+      if (i + 1 == n && ph_nbio_have_batch_items(thread)) {
+        ph_nbio_run_batch_end(thread);
+      }
       if (ph_job_have_deferred_items(thread)) {
         ph_job_pool_apply_deferred_items(thread);
       }
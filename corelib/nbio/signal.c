@@ -0,0 +1,305 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "corelib/job.h"
+
+#ifndef NSIG
+# define NSIG 65
+#endif
+
+// How many siginfo records we pull from the kernel per read()
+#define SIG_BATCH 16
+
+struct sig_ent {
+  ph_job_t *job;
+  // true if a delivery is queued to the job's emitter
+  bool queued;
+  ph_job_siginfo_t info;
+};
+
+static pthread_mutex_t sig_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sig_ent sigs[NSIG];
+static ph_job_t sig_job;
+static sigset_t sig_mask;
+
+#ifdef HAVE_SIGNALFD
+typedef struct signalfd_siginfo sig_rec_t;
+# define SIG_REC_SIGNO(r) (int)(r)->ssi_signo
+# define SIG_REC_PID(r)   (pid_t)(r)->ssi_pid
+# define SIG_REC_UID(r)   (uid_t)(r)->ssi_uid
+# define SIG_REC_CODE(r)  (r)->ssi_code
+#else
+// Written by the handler into the self-pipe; small enough that
+// the write is atomic
+struct sig_rec {
+  int signo;
+  int code;
+  pid_t pid;
+  uid_t uid;
+};
+typedef struct sig_rec sig_rec_t;
+# define SIG_REC_SIGNO(r) (r)->signo
+# define SIG_REC_PID(r)   (r)->pid
+# define SIG_REC_UID(r)   (r)->uid
+# define SIG_REC_CODE(r)  (r)->code
+
+static ph_socket_t sig_pipe[2] = { -1, -1 };
+
+static void sig_handler(int signo, siginfo_t *si, void *ctx)
+{
+  struct sig_rec rec;
+  int saved_errno = errno;
+
+  ph_unused_parameter(ctx);
+
+  rec.signo = signo;
+  rec.code = si ? si->si_code : 0;
+  rec.pid = si ? si->si_pid : 0;
+  rec.uid = si ? si->si_uid : 0;
+  ph_ignore_result(write(sig_pipe[1], &rec, sizeof(rec)));
+
+  errno = saved_errno;
+}
+#endif
+
+static void deliver_signal(intptr_t code, void *arg)
+{
+  ph_job_t *job = arg;
+  struct sig_ent *ent = &sigs[code];
+  bool mine;
+
+  pthread_mutex_lock(&sig_lock);
+  ent->queued = false;
+  mine = ent->job == job;
+  pthread_mutex_unlock(&sig_lock);
+
+  ck_pr_dec_32(&job->n_wakeups_pending);
+  if (mine) {
+    ph_nbio_emitter_dispatch_immediate(ph_thread_self()->is_emitter,
+        job, PH_IOMASK_SIGNAL);
+  }
+}
+
+static void record_signal(sig_rec_t *rec)
+{
+  int signo = SIG_REC_SIGNO(rec);
+  struct sig_ent *ent;
+  ph_job_t *job = NULL;
+
+  if (signo <= 0 || signo >= NSIG) {
+    return;
+  }
+  ent = &sigs[signo];
+
+  pthread_mutex_lock(&sig_lock);
+  if (ent->job) {
+    ent->info.count++;
+    ent->info.pid = SIG_REC_PID(rec);
+    ent->info.uid = SIG_REC_UID(rec);
+    ent->info.code = SIG_REC_CODE(rec);
+
+    if (!ent->queued) {
+      ent->queued = true;
+      job = ent->job;
+      ck_pr_inc_32(&job->n_wakeups_pending);
+    }
+  }
+  pthread_mutex_unlock(&sig_lock);
+
+  if (job && ph_nbio_queue_affine_func(job->emitter_affinity,
+        deliver_signal, signo, job) != PH_OK) {
+    ph_log(PH_LOG_ERR, "failed to queue delivery of signal %d", signo);
+    pthread_mutex_lock(&sig_lock);
+    ent->queued = false;
+    pthread_mutex_unlock(&sig_lock);
+    ck_pr_dec_32(&job->n_wakeups_pending);
+  }
+}
+
+static void dispatch_signals(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  sig_rec_t recs[SIG_BATCH];
+  int i, n;
+  ssize_t r;
+
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  do {
+    r = read(job->fd, recs, sizeof(recs));
+    if (r <= 0) {
+      break;
+    }
+    n = r / sizeof(recs[0]);
+    for (i = 0; i < n; i++) {
+      record_signal(&recs[i]);
+    }
+  } while (n == SIG_BATCH);
+
+  ph_job_set_nbio(job, PH_IOMASK_READ, NULL);
+}
+
+// Called under sig_lock
+static ph_result_t update_sig_source(int signo, bool enable)
+{
+  bool first = sig_job.callback == NULL;
+
+  if (first) {
+    sigemptyset(&sig_mask);
+  }
+  if (enable) {
+    sigaddset(&sig_mask, signo);
+  } else {
+    sigdelset(&sig_mask, signo);
+  }
+
+#ifdef HAVE_SIGNALFD
+  {
+    int fd = signalfd(first ? -1 : sig_job.fd, &sig_mask,
+        SFD_NONBLOCK|SFD_CLOEXEC);
+
+    if (fd == -1) {
+      return PH_ERR;
+    }
+    sig_job.fd = fd;
+  }
+#else
+  {
+    struct sigaction sa;
+
+    if (first) {
+      if (ph_pipe(sig_pipe, PH_PIPE_NONBLOCK|PH_PIPE_CLOEXEC) != PH_OK) {
+        return PH_ERR;
+      }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    if (enable) {
+      sa.sa_sigaction = sig_handler;
+      sa.sa_flags = SA_SIGINFO|SA_RESTART;
+    } else {
+      sa.sa_handler = SIG_DFL;
+    }
+    if (sigaction(signo, &sa, NULL)) {
+      return PH_ERR;
+    }
+    sig_job.fd = sig_pipe[0];
+  }
+#endif
+
+  if (first) {
+    sig_job.callback = dispatch_signals;
+    sig_job.emitter_affinity = 0;
+    ph_job_set_nbio(&sig_job, PH_IOMASK_READ, NULL);
+  }
+
+  return PH_OK;
+}
+
+static bool valid_signo(int signo)
+{
+  if (signo <= 0 || signo >= NSIG || signo == SIGKILL || signo == SIGSTOP) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+ph_result_t ph_job_set_signal(ph_job_t *job, int signo)
+{
+  struct sig_ent *ent;
+  ph_result_t res;
+
+  if (!valid_signo(signo)) {
+    return PH_ERR;
+  }
+  ent = &sigs[signo];
+
+  pthread_mutex_lock(&sig_lock);
+  if (ent->job) {
+    res = ent->job == job ? PH_OK : PH_EXISTS;
+    pthread_mutex_unlock(&sig_lock);
+    return res;
+  }
+
+#ifdef HAVE_SIGNALFD
+  {
+    sigset_t block;
+
+    sigemptyset(&block);
+    sigaddset(&block, signo);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+  }
+#endif
+
+  if (!sig_job.callback) {
+    ph_job_init(&sig_job);
+  }
+  res = update_sig_source(signo, true);
+  if (res == PH_OK) {
+    memset(&ent->info, 0, sizeof(ent->info));
+    ent->info.signo = signo;
+    ent->job = job;
+  }
+  pthread_mutex_unlock(&sig_lock);
+
+  return res;
+}
+
+ph_result_t ph_job_clear_signal(int signo)
+{
+  ph_result_t res;
+
+  if (!valid_signo(signo)) {
+    return PH_ERR;
+  }
+
+  pthread_mutex_lock(&sig_lock);
+  if (!sigs[signo].job) {
+    pthread_mutex_unlock(&sig_lock);
+    return PH_NOENT;
+  }
+  res = update_sig_source(signo, false);
+  sigs[signo].job = NULL;
+  pthread_mutex_unlock(&sig_lock);
+
+  return res;
+}
+
+bool ph_job_get_siginfo(int signo, ph_job_siginfo_t *info)
+{
+  struct sig_ent *ent;
+
+  if (signo <= 0 || signo >= NSIG) {
+    return false;
+  }
+  ent = &sigs[signo];
+
+  pthread_mutex_lock(&sig_lock);
+  *info = ent->info;
+  ent->info.count = 0;
+  pthread_mutex_unlock(&sig_lock);
+
+  info->signo = signo;
+  return info->count > 0;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
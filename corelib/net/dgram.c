@@ -0,0 +1,708 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/dgram.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include <netinet/udp.h>
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+# define USE_MMSG 1
+typedef struct mmsghdr mmsg_t;
+#else
+// Same shape as struct mmsghdr, so that the batching logic is the
+// same either way; we just make one syscall per message
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} mmsg_t;
+#endif
+
+#if defined(SOL_UDP) && defined(UDP_SEGMENT)
+# define USE_UDP_SEGMENT 1
+#endif
+#if defined(SOL_UDP) && defined(UDP_GRO)
+# define USE_UDP_GRO 1
+#endif
+
+// Receive buffer size per slot when the kernel may coalesce datagrams
+#define GRO_SLOT_SIZE 65535
+// Limits for a single sendmmsg call
+#define SEND_MSGS 64
+#define SEND_PKTS 256
+// The most segments that the kernel accepts in a UDP_SEGMENT message,
+// and the most payload that fits in one
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_BYTES (65535 - 8 - 40)
+
+#define ALIGN_PTR(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+struct ph_dgram_pkt {
+  PH_STAILQ_ENTRY(ph_dgram_pkt) ent;
+  ph_sockaddr_t addr;
+  bool has_addr;
+  uint32_t len;
+  char data[];
+};
+
+struct ph_dgram_rslot {
+  ph_sockaddr_t peer;
+  struct iovec iov;
+  uint32_t len;
+  // Size of each datagram if the kernel coalesced several, else 0
+  uint32_t seg;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    size_t align;
+  } cmsg;
+};
+
+struct ph_dgram_rbatch {
+  uint32_t slot_size;
+  uint32_t count, next;
+  // How far through the current slot ph_dgram_recv() has got
+  uint32_t offset;
+  struct ph_dgram_rslot *slots;
+  mmsg_t *hdrs;
+  char *mem;
+};
+
+static ph_memtype_def_t defs[] = {
+  { "dgram", "dgram", sizeof(ph_dgram_t), PH_MEM_FLAGS_ZERO },
+  { "dgram", "pkt", 0, 0 },
+  { "dgram", "rbatch", 0, 0 },
+};
+static struct {
+  ph_memtype_t dgram, pkt, rbatch;
+} mt;
+
+static ph_counter_scope_t *dgram_counters;
+static const char *counter_names[] = {
+  "recv_calls",   // syscalls made to receive
+  "recv_pkts",    // datagrams received by those calls
+  "send_calls",   // syscalls made to send
+  "send_pkts",    // datagrams sent by those calls
+  "send_drops",   // datagrams the kernel refused to send
+};
+#define SLOT_RECV_CALLS 0
+#define SLOT_RECV_PKTS 1
+#define SLOT_SEND_CALLS 2
+#define SLOT_SEND_PKTS 3
+#define SLOT_SEND_DROPS 4
+
+static void count_batch(uint8_t calls_slot, uint64_t calls, uint64_t pkts)
+{
+  uint8_t slots[2] = { calls_slot, calls_slot + 1 };
+  int64_t values[2] = { (int64_t)calls, (int64_t)pkts };
+  ph_counter_block_t *block = ph_counter_block_open(dgram_counters);
+
+  ph_counter_block_bulk_add(block, 2, slots, values);
+  ph_counter_block_delref(block);
+}
+
+static void free_rbatch(ph_dgram_t *dgram)
+{
+  if (dgram->rbatch) {
+    ph_mem_free(mt.rbatch, dgram->rbatch);
+    dgram->rbatch = NULL;
+  }
+}
+
+// The slots, message headers and receive buffers live in one allocation
+static bool alloc_rbatch(ph_dgram_t *dgram)
+{
+  struct ph_dgram_rbatch *rb;
+  uint32_t slot_size = dgram->max_size;
+  uint64_t size, slots_off, hdrs_off, mem_off;
+
+  if (dgram->offload & PH_DGRAM_OFFLOAD_RECV) {
+    slot_size = MAX(slot_size, GRO_SLOT_SIZE);
+  }
+
+  slots_off = ALIGN_PTR(sizeof(*rb));
+  hdrs_off = ALIGN_PTR(slots_off +
+      dgram->batch * sizeof(struct ph_dgram_rslot));
+  mem_off = ALIGN_PTR(hdrs_off + dgram->batch * sizeof(mmsg_t));
+  size = mem_off + (uint64_t)dgram->batch * slot_size;
+
+  rb = ph_mem_alloc_size(mt.rbatch, size);
+  if (!rb) {
+    return false;
+  }
+  memset(rb, 0, mem_off);
+  rb->slot_size = slot_size;
+  rb->slots = (struct ph_dgram_rslot*)(void*)((char*)rb + slots_off);
+  rb->hdrs = (mmsg_t*)(void*)((char*)rb + hdrs_off);
+  rb->mem = (char*)rb + mem_off;
+
+  free_rbatch(dgram);
+  dgram->rbatch = rb;
+  return true;
+}
+
+static void release_pkt(ph_dgram_t *dgram, struct ph_dgram_pkt *pkt)
+{
+  if (dgram->pool_len < dgram->pool_max) {
+    PH_STAILQ_INSERT_HEAD(&dgram->pool, pkt, ent);
+    dgram->pool_len++;
+    return;
+  }
+  ph_mem_free(mt.pkt, pkt);
+}
+
+static void dgram_dtor(ph_job_t *job)
+{
+  ph_dgram_t *dgram = (ph_dgram_t*)job;
+  struct ph_dgram_pkt *pkt;
+
+  while ((pkt = PH_STAILQ_FIRST(&dgram->sendq)) != NULL) {
+    PH_STAILQ_REMOVE_HEAD(&dgram->sendq, ent);
+    ph_mem_free(mt.pkt, pkt);
+  }
+  while ((pkt = PH_STAILQ_FIRST(&dgram->pool)) != NULL) {
+    PH_STAILQ_REMOVE_HEAD(&dgram->pool, ent);
+    ph_mem_free(mt.pkt, pkt);
+  }
+  free_rbatch(dgram);
+
+  if (dgram->job.fd != -1) {
+    close(dgram->job.fd);
+    dgram->job.fd = -1;
+  }
+}
+
+#ifdef USE_UDP_GRO
+static uint32_t gro_segment_size(struct msghdr *msg)
+{
+  struct cmsghdr *cm;
+
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+      int seg;
+
+      memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+      return seg;
+    }
+  }
+  return 0;
+}
+#endif
+
+static int recv_msgs(ph_dgram_t *dgram, mmsg_t *hdrs, uint32_t n)
+{
+#ifdef USE_MMSG
+  return recvmmsg(dgram->job.fd, hdrs, n, 0, NULL);
+#else
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    ssize_t r = recvmsg(dgram->job.fd, &hdrs[i].msg_hdr, 0);
+
+    if (r == -1) {
+      return i ? (int)i : -1;
+    }
+    hdrs[i].msg_len = r;
+  }
+  return n;
+#endif
+}
+
+// Fills the receive batch.  Returns false if the socket failed
+static bool receive_batch(ph_dgram_t *dgram)
+{
+  struct ph_dgram_rbatch *rb = dgram->rbatch;
+  uint64_t pkts = 0;
+  uint32_t i;
+  int n;
+
+  rb->count = 0;
+  rb->next = 0;
+  rb->offset = 0;
+
+  for (i = 0; i < dgram->batch; i++) {
+    struct msghdr *msg = &rb->hdrs[i].msg_hdr;
+    struct ph_dgram_rslot *slot = &rb->slots[i];
+
+    memset(msg, 0, sizeof(*msg));
+    slot->iov.iov_base = rb->mem + ((uint64_t)i * rb->slot_size);
+    slot->iov.iov_len = rb->slot_size;
+    msg->msg_iov = &slot->iov;
+    msg->msg_iovlen = 1;
+    msg->msg_name = &slot->peer.sa.sa;
+    msg->msg_namelen = sizeof(slot->peer.sa);
+#ifdef USE_UDP_GRO
+    if (dgram->offload & PH_DGRAM_OFFLOAD_RECV) {
+      msg->msg_control = slot->cmsg.buf;
+      msg->msg_controllen = sizeof(slot->cmsg.buf);
+    }
+#endif
+  }
+
+  n = recv_msgs(dgram, rb->hdrs, dgram->batch);
+
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return true;
+    }
+    dgram->last_err = errno;
+    return false;
+  }
+
+  for (i = 0; i < (uint32_t)n; i++) {
+    struct msghdr *msg = &rb->hdrs[i].msg_hdr;
+    struct ph_dgram_rslot *slot = &rb->slots[i];
+
+    slot->len = rb->hdrs[i].msg_len;
+    slot->peer.family = AF_UNSPEC;
+    if (msg->msg_namelen) {
+      slot->peer.family = slot->peer.sa.sa.sa_family;
+    }
+    slot->seg = 0;
+#ifdef USE_UDP_GRO
+    if (dgram->offload & PH_DGRAM_OFFLOAD_RECV) {
+      slot->seg = gro_segment_size(msg);
+    }
+#endif
+    if (slot->seg && slot->seg < slot->len) {
+      pkts += (slot->len + slot->seg - 1) / slot->seg;
+    } else {
+      slot->seg = 0;
+      pkts++;
+    }
+  }
+  rb->count = n;
+  count_batch(SLOT_RECV_CALLS, 1, pkts);
+  return true;
+}
+
+bool ph_dgram_recv(ph_dgram_t *dgram, ph_dgram_msg_t *msg)
+{
+  struct ph_dgram_rbatch *rb = dgram->rbatch;
+  struct ph_dgram_rslot *slot;
+  uint32_t len;
+
+  if (!rb || rb->next >= rb->count) {
+    return false;
+  }
+
+  slot = &rb->slots[rb->next];
+  len = slot->len - rb->offset;
+  if (slot->seg) {
+    len = MIN(len, slot->seg);
+  }
+
+  msg->peer = &slot->peer;
+  msg->data = rb->mem + ((uint64_t)rb->next * rb->slot_size) + rb->offset;
+  msg->len = len;
+
+  rb->offset += len;
+  if (rb->offset >= slot->len) {
+    rb->next++;
+    rb->offset = 0;
+  }
+  return true;
+}
+
+static int send_msgs(ph_dgram_t *dgram, mmsg_t *hdrs, uint32_t n)
+{
+#ifdef USE_MMSG
+  return sendmmsg(dgram->job.fd, hdrs, n, 0);
+#else
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    ssize_t r = sendmsg(dgram->job.fd, &hdrs[i].msg_hdr, 0);
+
+    if (r == -1) {
+      return i ? (int)i : -1;
+    }
+    hdrs[i].msg_len = r;
+  }
+  return n;
+#endif
+}
+
+static bool same_dest(struct ph_dgram_pkt *a, struct ph_dgram_pkt *b)
+{
+  if (a->has_addr != b->has_addr) {
+    return false;
+  }
+  if (!a->has_addr) {
+    return true;
+  }
+  return a->addr.family == b->addr.family &&
+    memcmp(&a->addr.sa.sa, &b->addr.sa.sa,
+        ph_sockaddr_socklen(&a->addr)) == 0;
+}
+
+// Releases the first `npkts` packets of the send queue
+static void consume_sent(ph_dgram_t *dgram, uint32_t npkts)
+{
+  while (npkts--) {
+    struct ph_dgram_pkt *pkt = PH_STAILQ_FIRST(&dgram->sendq);
+
+    PH_STAILQ_REMOVE_HEAD(&dgram->sendq, ent);
+    dgram->sendq_len--;
+    release_pkt(dgram, pkt);
+  }
+}
+
+bool ph_dgram_flush(ph_dgram_t *dgram)
+{
+  mmsg_t hdrs[SEND_MSGS];
+  struct iovec iov[SEND_PKTS];
+  // Number of packets carried by each message
+  uint32_t msg_pkts[SEND_MSGS];
+#ifdef USE_UDP_SEGMENT
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    size_t align;
+  } cmsgs[SEND_MSGS];
+#endif
+  uint64_t calls = 0, sent = 0;
+  bool res = true;
+
+  while (!PH_STAILQ_EMPTY(&dgram->sendq)) {
+    struct ph_dgram_pkt *pkt = PH_STAILQ_FIRST(&dgram->sendq);
+    uint32_t nmsgs = 0, niov = 0, i, npkts;
+    int n;
+
+    while (pkt && nmsgs < SEND_MSGS && niov < SEND_PKTS) {
+      struct msghdr *msg = &hdrs[nmsgs].msg_hdr;
+      struct ph_dgram_pkt *first = pkt;
+      uint32_t seg = pkt->len, total = 0;
+
+      memset(msg, 0, sizeof(*msg));
+      if (pkt->has_addr) {
+        msg->msg_name = &pkt->addr.sa.sa;
+        msg->msg_namelen = ph_sockaddr_socklen(&pkt->addr);
+      }
+      msg->msg_iov = &iov[niov];
+      msg_pkts[nmsgs] = 0;
+
+      do {
+        iov[niov].iov_base = pkt->data;
+        iov[niov].iov_len = pkt->len;
+        niov++;
+        total += pkt->len;
+        msg_pkts[nmsgs]++;
+        pkt = PH_STAILQ_NEXT(pkt, ent);
+
+        // Only the last segment of a run may be short
+        if ((dgram->offload & PH_DGRAM_OFFLOAD_SEND) == 0 ||
+            seg == 0 || iov[niov - 1].iov_len < seg) {
+          break;
+        }
+      } while (pkt && niov < SEND_PKTS &&
+          msg_pkts[nmsgs] < GSO_MAX_SEGS &&
+          pkt->len <= seg && total + pkt->len <= GSO_MAX_BYTES &&
+          same_dest(first, pkt));
+
+      msg->msg_iovlen = msg_pkts[nmsgs];
+#ifdef USE_UDP_SEGMENT
+      if (msg_pkts[nmsgs] > 1) {
+        struct cmsghdr *cm;
+        uint16_t segsize = seg;
+
+        msg->msg_control = cmsgs[nmsgs].buf;
+        msg->msg_controllen = sizeof(cmsgs[nmsgs].buf);
+        cm = CMSG_FIRSTHDR(msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(segsize));
+        memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+      }
+#endif
+      nmsgs++;
+    }
+
+    n = send_msgs(dgram, hdrs, nmsgs);
+    calls++;
+
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ||
+          errno == EINTR) {
+        errno = EAGAIN;
+        res = false;
+        break;
+      }
+      // The first message can't be sent; drop it and carry on
+      dgram->last_err = errno;
+      ph_counter_scope_add(dgram_counters, SLOT_SEND_DROPS, msg_pkts[0]);
+      consume_sent(dgram, msg_pkts[0]);
+      continue;
+    }
+
+    for (i = 0, npkts = 0; i < (uint32_t)n; i++) {
+      npkts += msg_pkts[i];
+    }
+    sent += npkts;
+    consume_sent(dgram, npkts);
+  }
+
+  if (calls) {
+    count_batch(SLOT_SEND_CALLS, calls, sent);
+  }
+  return res;
+}
+
+ph_result_t ph_dgram_send(ph_dgram_t *dgram, const ph_sockaddr_t *addr,
+    const void *data, uint32_t len)
+{
+  struct ph_dgram_pkt *pkt;
+
+  if (len > dgram->max_size) {
+    errno = EMSGSIZE;
+    return PH_ERR;
+  }
+  if (dgram->sendq_len >= dgram->sendq_max) {
+    errno = EAGAIN;
+    return PH_ERR;
+  }
+
+  pkt = PH_STAILQ_FIRST(&dgram->pool);
+  if (pkt) {
+    PH_STAILQ_REMOVE_HEAD(&dgram->pool, ent);
+    dgram->pool_len--;
+  } else {
+    pkt = ph_mem_alloc_size(mt.pkt, sizeof(*pkt) + dgram->max_size);
+    if (!pkt) {
+      errno = ENOMEM;
+      return PH_ERR;
+    }
+  }
+
+  pkt->has_addr = addr != NULL;
+  if (addr) {
+    pkt->addr = *addr;
+  }
+  pkt->len = len;
+  memcpy(pkt->data, data, len);
+
+  PH_STAILQ_INSERT_TAIL(&dgram->sendq, pkt, ent);
+  dgram->sendq_len++;
+  return PH_OK;
+}
+
+static void dgram_set_mask(ph_dgram_t *dgram)
+{
+  ph_iomask_t mask = PH_IOMASK_READ;
+
+  if (!PH_STAILQ_EMPTY(&dgram->sendq)) {
+    mask |= PH_IOMASK_WRITE;
+  }
+  ph_job_set_nbio(&dgram->job, mask, NULL);
+}
+
+static void dgram_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
+{
+  ph_dgram_t *dgram = (ph_dgram_t*)j;
+
+  if (j->def && j->epoch_entry.function) {
+    // Woken up after being freed
+    return;
+  }
+
+  if (dgram->enabled) {
+    // Receiving also collects any error queued on the socket
+    if (why & (PH_IOMASK_READ|PH_IOMASK_ERR)) {
+      if (!receive_batch(dgram)) {
+        why |= PH_IOMASK_ERR;
+      }
+      if (dgram->rbatch->count == 0) {
+        why &= ~PH_IOMASK_READ;
+      }
+    }
+    if ((why & PH_IOMASK_WRITE) && !ph_dgram_flush(dgram)) {
+      // Still backed up; no need to tell the callback about it
+      why &= ~PH_IOMASK_WRITE;
+    }
+  }
+
+  if (why) {
+    dgram->callback(dgram, why, data);
+  }
+
+  if (dgram->rbatch) {
+    // The buffers are about to be reused
+    dgram->rbatch->count = 0;
+  }
+
+  if (!dgram->enabled) {
+    return;
+  }
+
+  ph_dgram_flush(dgram);
+  dgram_set_mask(dgram);
+}
+
+static struct ph_job_def dgram_job_template = {
+  dgram_dispatch,
+  PH_MEMTYPE_INVALID,
+  dgram_dtor,
+  NULL
+};
+
+static void do_dgram_init(void)
+{
+  ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.dgram);
+  dgram_job_template.memtype = mt.dgram;
+
+  dgram_counters = ph_counter_scope_define(NULL, "dgram", 8);
+  ph_counter_scope_register_counter_block(dgram_counters,
+      sizeof(counter_names)/sizeof(counter_names[0]), 0, counter_names);
+}
+PH_LIBRARY_INIT(do_dgram_init, 0)
+
+ph_dgram_t *ph_dgram_new_from_socket(ph_socket_t s)
+{
+  ph_dgram_t *dgram;
+
+  dgram = (ph_dgram_t*)ph_job_alloc(&dgram_job_template);
+  if (!dgram) {
+    return NULL;
+  }
+
+  dgram->job.fd = -1;
+  PH_STAILQ_INIT(&dgram->sendq);
+  PH_STAILQ_INIT(&dgram->pool);
+  dgram->batch = MAX(1, ph_config_query_int("$.dgram.batch", 32));
+  dgram->max_size = MAX(1, ph_config_query_int("$.dgram.max_size", 2048));
+  dgram->sendq_max = MAX(1, ph_config_query_int("$.dgram.max_queue", 1024));
+  dgram->pool_max = ph_config_query_int("$.dgram.pool_size", 256);
+
+  if (!alloc_rbatch(dgram)) {
+    ph_job_free(&dgram->job);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  {
+    socklen_t len = sizeof(dgram->sockname.sa);
+
+    if (getsockname(s, &dgram->sockname.sa.sa, &len) == 0) {
+      dgram->sockname.family = dgram->sockname.sa.sa.sa_family;
+      dgram->sockname.protocol = IPPROTO_UDP;
+    }
+  }
+
+  ph_socket_set_nonblock(s, true);
+  dgram->job.fd = s;
+  dgram->job.data = dgram;
+
+  return dgram;
+}
+
+ph_dgram_t *ph_dgram_new_for_addr(const ph_sockaddr_t *addr)
+{
+  ph_sockaddr_t udp = *addr;
+  ph_dgram_t *dgram;
+  ph_socket_t s;
+  int err;
+
+  udp.protocol = IPPROTO_UDP;
+  s = ph_socket_for_addr(&udp, SOCK_DGRAM, PH_SOCK_CLOEXEC|PH_SOCK_NONBLOCK);
+  if (s == -1) {
+    return NULL;
+  }
+
+  dgram = ph_dgram_new_from_socket(s);
+  if (!dgram) {
+    err = errno;
+    close(s);
+    errno = err;
+  }
+  return dgram;
+}
+
+ph_result_t ph_dgram_set_offload(ph_dgram_t *dgram, uint32_t flags)
+{
+  uint32_t prior = dgram->offload;
+
+  if (flags & ~prior & PH_DGRAM_OFFLOAD_SEND) {
+#ifdef USE_UDP_SEGMENT
+    int off = 0;
+
+    // Kernels that can't segment don't know the option at all
+    if (setsockopt(dgram->job.fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off))) {
+      errno = ENOSYS;
+      return PH_ERR;
+    }
+#else
+    errno = ENOSYS;
+    return PH_ERR;
+#endif
+  }
+
+  if ((flags ^ prior) & PH_DGRAM_OFFLOAD_RECV) {
+#ifdef USE_UDP_GRO
+    int on = (flags & PH_DGRAM_OFFLOAD_RECV) ? 1 : 0;
+
+    if (setsockopt(dgram->job.fd, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+      if (errno == ENOPROTOOPT) {
+        errno = ENOSYS;
+      }
+      return PH_ERR;
+    }
+    dgram->offload = flags;
+    if (!alloc_rbatch(dgram)) {
+      on = !on;
+      setsockopt(dgram->job.fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+      dgram->offload = prior;
+      errno = ENOMEM;
+      return PH_ERR;
+    }
+#else
+    errno = ENOSYS;
+    return PH_ERR;
+#endif
+  }
+
+  dgram->offload = flags;
+  return PH_OK;
+}
+
+void ph_dgram_enable(ph_dgram_t *dgram, bool enable)
+{
+  if (dgram->enabled == enable) {
+    return;
+  }
+
+  dgram->enabled = enable;
+  if (enable) {
+    dgram_set_mask(dgram);
+  } else {
+    ph_job_set_nbio(&dgram->job, 0, NULL);
+  }
+}
+
+ph_result_t ph_dgram_wakeup(ph_dgram_t *dgram)
+{
+  return ph_job_wakeup(&dgram->job);
+}
+
+void ph_dgram_free(ph_dgram_t *dgram)
+{
+  dgram->enabled = false;
+  ph_job_free(&dgram->job);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -37,7 +37,8 @@ static void listener_dtor(ph_job_t *job);
 static struct ph_job_def listener_template = {
   accept_dispatch,
   PH_MEMTYPE_INVALID,
-  listener_dtor
+  listener_dtor,
+  NULL
 };
 
 static void do_init(void)
@@ -22,41 +22,331 @@
 #include "phenom/dns.h"
 #include "phenom/printf.h"
 #include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include <netinet/tcp.h>
+
+#if defined(TCP_CORK)
+# define PH_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+# define PH_TCP_CORK TCP_NOPUSH
+#endif
 
 struct connect_job {
   ph_job_t job;
   ph_socket_t s;
   ph_sockaddr_t addr;
   int status;
-  struct timeval start;
+  uint64_t start;
   void *arg;
   ph_socket_connect_func func;
 };
 
+// Resolving a name and racing connections to its addresses.  Once
+// the addresses are known, everything happens on the emitter that this
+// job is bound to; the job timer paces the staggered attempts
 struct resolve_and_connect {
-  ph_sockaddr_t addr;
-  ph_socket_t s;
-  int resolve_status;
-  int connect_status;
+  ph_job_t job;
+  ph_sockaddr_t *addrs;
+  uint32_t naddrs, next;
+  // Attempts that are still waiting for connect to finish
+  PH_LIST_HEAD(connect_attempts, connect_attempt) attempts;
+  // Error from the most recently failed attempt
+  int last_err;
   uint16_t port;
-  struct timeval start, timeout, elapsed;
+  uint16_t protocol;
+  uint64_t start, deadline;
+  struct timeval timeout, elapsed;
   void *arg;
   ph_sock_connect_func func;
 };
 
+// One of the connections being raced by a resolve_and_connect
+struct connect_attempt {
+  ph_job_t job;
+  struct resolve_and_connect *rac;
+  ph_sockaddr_t addr;
+  PH_LIST_ENTRY(connect_attempt) ent;
+};
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+# define USE_SENDFILE 1
+#endif
+
+// The largest single sendfile() request; Linux caps it at a little
+// under 2GB in any case
+#define SENDFILE_CHUNK (1024 * 1024 * 1024)
+
+#if defined(HAVE_SPLICE) && defined(SPLICE_F_NONBLOCK)
+# define USE_SPLICE 1
+#endif
+
+// How much spliced data may be in flight between a pair of socks
+// before we stop reading from the source
+#define SPLICE_BUFFER_SIZE (256 * 1024)
+
+// State shared by the two halves of a ph_sock_splice().  Both socks
+// run on the same emitter, so this is never touched concurrently
+struct ph_sock_splice {
+  // Either side is set to NULL when it is done with the splice;
+  // we're freed when both are NULL
+  ph_sock_t *src, *dst;
+  // The kernel pipe that carries the data, or -1 if we're copying
+  // through dst's write buffer instead
+  ph_socket_t pipe[2];
+  uint64_t in_pipe;
+  uint64_t capacity;
+  // UINT64_MAX if there is no limit
+  uint64_t remaining;
+  // src isn't going to contribute any more data
+  bool src_done;
+  // src hit EOF; we shut down the write side of dst once we're drained
+  bool eof;
+  // We've stopped reading from src until dst catches up
+  bool paused;
+};
+
+// Carries a step of an SSL handshake to the handshake pool
+struct handshake_job {
+  ph_job_t job;
+  ph_sock_t *sock;
+};
+
+struct ph_sock_file_range {
+  PH_STAILQ_ENTRY(ph_sock_file_range) ent;
+  // How many bytes at the front of wbuf must be sent before this range
+  uint64_t wbuf_ahead;
+  int fd;
+  uint64_t offset, len;
+  // If set, the range is whatever arrives through this splice's pipe
+  struct ph_sock_splice *splice;
+};
+
+// Settings consulted for every new sock; looked up again only when the
+// global configuration is replaced.  A fresh copy is published each
+// time, since socks on other emitters may be reading the current one.
+// The copies it replaces are kept until shutdown; the configuration is
+// rarely replaced
+struct sock_config {
+  struct sock_config *prev;
+  uint32_t generation;
+  int64_t max_buffer_size;
+  int64_t read_budget;
+  int64_t shell_pool_size;
+  int64_t track_stats;
+  int64_t ktls;
+  int64_t ssl_handshake_offload;
+  int64_t ssl_small_record_size;
+  int64_t ssl_small_record_bytes;
+  int64_t ssl_record_idle_reset;
+  int64_t idle_release;
+  int64_t connect_attempt_delay;
+};
+
 static ph_memtype_def_t defs[] = {
-  { "socket", "connect_job", sizeof(struct connect_job), PH_MEM_FLAGS_ZERO },
+  { "socket", "connect_job", sizeof(struct connect_job),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED },
   { "socket", "sock", sizeof(ph_sock_t), PH_MEM_FLAGS_ZERO },
   { "socket", "resolve_and_connect",
     sizeof(struct resolve_and_connect), PH_MEM_FLAGS_ZERO },
+  { "socket", "connect_attempt",
+    sizeof(struct connect_attempt), PH_MEM_FLAGS_ZERO },
+  { "socket", "connect_addrs", 0, 0 },
+  { "socket", "file_range", sizeof(struct ph_sock_file_range),
+    PH_MEM_FLAGS_ZERO },
+  { "socket", "splice", sizeof(struct ph_sock_splice), PH_MEM_FLAGS_ZERO },
+  { "socket", "emitters", 0, PH_MEM_FLAGS_ZERO },
+  { "socket", "handshake", sizeof(struct handshake_job),
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED },
+  { "socket", "config", sizeof(struct sock_config), 0 },
 };
 static struct {
-  ph_memtype_t connect_job, sock, resolve_and_connect;
+  ph_memtype_t connect_job, sock, resolve_and_connect, connect_attempt,
+               connect_addrs, file_range, splice, emitters, handshake,
+               config;
 } mt;
 static int ssl_sock_idx;
 
+static ph_counter_scope_t *sock_counters;
+static const char *counter_names[] = {
+  "writev",           // writev syscalls made to send wbuf
+  "writev_bytes",     // bytes sent by those calls
+  "deferred_flush",   // flushes deferred to the end of a batch
+  "shell_reuse",      // socks made from a recycled shell
+  "ktls",             // SSL socks handed over to kernel TLS
+  "ktls_fallback",    // SSL socks that asked for kernel TLS but kept
+                      // encrypting in userspace
+  "ssl_handshakes",   // SSL handshakes completed
+  "ssl_resumed",      // of those, sessions that were resumed
+  "ssl_handshake_offloads", // handshake steps run on the handshake pool
+  "ssl_records",      // SSL records written with application data
+  "ssl_full_records", // of those, records of the maximum size
+  "ssl_staged_bytes", // plaintext copied into sslwbuf to be encrypted
+                      // later, rather than straight from the caller
+};
+#define SLOT_WRITEV 0
+#define SLOT_WRITEV_BYTES 1
+#define SLOT_DEFERRED_FLUSH 2
+#define SLOT_SHELL_REUSE 3
+#define SLOT_KTLS 4
+#define SLOT_KTLS_FALLBACK 5
+#define SLOT_SSL_HANDSHAKES 6
+#define SLOT_SSL_RESUMED 7
+#define SLOT_SSL_HANDSHAKE_OFFLOADS 8
+#define SLOT_SSL_RECORDS 9
+#define SLOT_SSL_FULL_RECORDS 10
+#define SLOT_SSL_STAGED_BYTES 11
+
 static uint32_t connect_affinity = 0;
 
+#define MAX_SOCK_BUFFER_SIZE 128*1024
+#define DEFAULT_READ_BUDGET 256*1024
+#define DEFAULT_SHELL_POOL_SIZE 256
+#define DEFAULT_HANDSHAKE_THREADS 2
+#define HANDSHAKE_QUEUE_LEN 1024
+// A small record fits in one segment with a typical MSS, along with
+// its header and MAC
+#define DEFAULT_SSL_SMALL_RECORD_SIZE 1360
+#define DEFAULT_SSL_SMALL_RECORD_BYTES 128*1024
+#define DEFAULT_SSL_RECORD_IDLE_RESET 1000
+#define DEFAULT_IDLE_RELEASE 1000
+#define DEFAULT_CONNECT_ATTEMPT_DELAY 250
+#define SSL_FULL_RECORD SSL3_RT_MAX_PLAIN_LENGTH
+// What SSL_write() may add to a record's plaintext in wbuf: the header,
+// IV, MAC and padding, twice over for an empty record or post-handshake
+// message that OpenSSL writes ahead of it
+#define SSL_RECORD_OVERHEAD \
+  (2 * (SSL3_RT_HEADER_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD))
+
+// Runs SSL handshakes for socks that have handshake_offload set;
+// defined and started by the first emitter to need it
+static ph_thread_pool_t *handshake_pool;
+static pthread_once_t handshake_pool_once = PTHREAD_ONCE_INIT;
+
+static struct sock_config *sock_config;
+// Serializes loading of a new copy
+static pthread_mutex_t sock_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct sock_config *load_sock_config(void)
+{
+  uint32_t gen = ph_config_get_generation();
+  struct sock_config *cfg = ck_pr_load_ptr(&sock_config);
+
+  if (ph_likely(cfg && cfg->generation == gen)) {
+    return cfg;
+  }
+
+  pthread_mutex_lock(&sock_config_lock);
+  cfg = sock_config;
+  if (cfg && cfg->generation == gen) {
+    // Another thread got there first
+    pthread_mutex_unlock(&sock_config_lock);
+    return cfg;
+  }
+  cfg = ph_mem_alloc(mt.config);
+  if (!cfg) {
+    pthread_mutex_unlock(&sock_config_lock);
+    ph_panic("failed to allocate socket configuration");
+  }
+  cfg->prev = sock_config;
+  cfg->generation = gen;
+  cfg->max_buffer_size = ph_config_query_int(
+      "$.socket.max_buffer_size", MAX_SOCK_BUFFER_SIZE);
+  cfg->read_budget = ph_config_query_int(
+      "$.socket.read_budget", DEFAULT_READ_BUDGET);
+  cfg->shell_pool_size = ph_config_query_int(
+      "$.socket.shell_pool_size", DEFAULT_SHELL_POOL_SIZE);
+  cfg->track_stats = ph_config_query_int(
+      "$.socket.track_stats", 1);
+  cfg->ktls = ph_config_query_int("$.socket.ktls", 0);
+  cfg->ssl_handshake_offload = ph_config_query_int(
+      "$.socket.ssl_handshake_offload", 0);
+  cfg->ssl_small_record_size = ph_config_query_int(
+      "$.socket.ssl_small_record_size", DEFAULT_SSL_SMALL_RECORD_SIZE);
+  cfg->ssl_small_record_bytes = ph_config_query_int(
+      "$.socket.ssl_small_record_bytes", DEFAULT_SSL_SMALL_RECORD_BYTES);
+  cfg->ssl_record_idle_reset = ph_config_query_int(
+      "$.socket.ssl_record_idle_reset", DEFAULT_SSL_RECORD_IDLE_RESET);
+  cfg->idle_release = ph_config_query_int(
+      "$.socket.idle_release", DEFAULT_IDLE_RELEASE);
+  cfg->connect_attempt_delay = ph_config_query_int(
+      "$.socket.connect_attempt_delay", DEFAULT_CONNECT_ATTEMPT_DELAY);
+  ck_pr_fence_store();
+  ck_pr_store_ptr(&sock_config, cfg);
+  pthread_mutex_unlock(&sock_config_lock);
+  return cfg;
+}
+
+// The settings as last loaded, for paths that run too often to look
+// for a new configuration
+static inline const struct sock_config *cur_sock_config(void)
+{
+  const struct sock_config *cfg = ck_pr_load_ptr(&sock_config);
+
+  return ph_likely(cfg != NULL) ? cfg : load_sock_config();
+}
+
+// Socks that keep stats, for ph_sock_stats_top()
+struct ph_sock_stats_list {
+  pthread_mutex_t lock;
+  PH_LIST_HEAD(stats_socks, ph_sock) socks;
+};
+
+// State kept for each emitter, touched only by that emitter's thread.
+// Freed socks are kept as shells, with their streams and buffer queues,
+// to be reset for the next connection instead of being rebuilt
+struct ph_sock_emitter {
+  PH_STAILQ_HEAD(sock_shells, ph_job) shells;
+  uint32_t count;
+  // Our blocks in sock_counters and the latency histograms, for the
+  // counts made on every send; see emitter_block()
+  ph_counter_block_t *counters, *ttfb_counters, *drain_counters;
+  // Socks whose buffers were empty when they last went back to
+  // waiting for IO; see release_idle_socks().  The lock is for socks
+  // that are freed on other threads
+  pthread_mutex_t idle_lock;
+  PH_LIST_HEAD(idle_socks, ph_sock) idle_socks;
+  uint64_t last_release_ns;
+  // The socks made on this emitter; the lock is only contended by
+  // ph_sock_stats_top() and by socks freed on other threads
+  struct ph_sock_stats_list stats;
+};
+static struct ph_sock_emitter *sock_emitters;
+static uint32_t num_sock_emitters;
+// Set once the library is shutting down
+static int sock_emitters_closed;
+
+// Socks that were made off the emitter threads
+static struct ph_sock_stats_list unbound_stats = {
+  PTHREAD_MUTEX_INITIALIZER, PH_LIST_HEAD_INITIALIZER(unbound_stats.socks)
+};
+
+// Latency histograms; bucket i counts times below 2^(16+i) ns
+#define LATENCY_BUCKETS 20
+static const char *latency_bucket_names[LATENCY_BUCKETS] = {
+  "65us", "131us", "262us", "524us", "1ms", "2ms", "4ms", "8ms", "16ms",
+  "33ms", "67ms", "134ms", "268ms", "536ms", "1s", "2s", "4s", "8s", "17s",
+  "inf",
+};
+static ph_counter_scope_t *ttfb_counters, *drain_counters;
+
+// The latencies are timed with the uncached monotonic clock, as
+// ph_time_now_ns() is too coarse for the smaller buckets.  They are
+// taken once per sock and once per drain, so the cost is small
+static uint64_t latency_clock_ns(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * PH_NSEC_PER_SEC) + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ph_timeval_to_ns(tv);
+#endif
+}
+
 ph_socket_t ph_socket_for_addr(const ph_sockaddr_t *addr, int type, int flags)
 {
   ph_socket_t s;
@@ -98,107 +388,1181 @@ static void connect_complete(ph_job_t *j, ph_iomask_t why, void *data)
     // Check status
     socklen_t slen = sizeof(status);
 
-    if (getsockopt(job->s, SOL_SOCKET, SO_ERROR, (void*)&status, &slen) < 0) {
-      status = errno;
+    if (getsockopt(job->s, SOL_SOCKET, SO_ERROR, (void*)&status, &slen) < 0) {
+      status = errno;
+    }
+  }
+
+  done = ph_ns_to_timeval(ph_time_now_ns() - job->start);
+
+  // This defers the free, so we are still safe to access job on
+  // the following line
+  ph_job_free(&job->job);
+  job->job.fd = -1;
+
+  job->func(job->s, &job->addr, status, &done, job->arg);
+}
+
+static void splice_release(struct ph_sock_splice *sp)
+{
+  if (sp->src || sp->dst) {
+    return;
+  }
+  if (sp->pipe[0] != -1) {
+    close(sp->pipe[0]);
+    close(sp->pipe[1]);
+  }
+  ph_mem_free(mt.splice, sp);
+}
+
+static void untrack_sock(ph_sock_t *sock);
+
+static void unlist_idle(ph_sock_t *sock)
+{
+  struct ph_sock_emitter *em = sock->idle_emitter;
+
+  if (!em) {
+    return;
+  }
+  pthread_mutex_lock(&em->idle_lock);
+  PH_LIST_REMOVE(sock, idle_ent);
+  sock->idle_emitter = NULL;
+  pthread_mutex_unlock(&em->idle_lock);
+}
+
+static void sock_dtor(ph_job_t *job)
+{
+  ph_sock_t *sock = (ph_sock_t*)job;
+
+  if (sock->sslwbuf) {
+    ph_bufq_free(sock->sslwbuf);
+    sock->sslwbuf = NULL;
+  }
+  if (sock->ssl) {
+#if OPENSSL_VERSION_NUMBER < 0x10100001L
+    SSL_CTX *ctx = sock->ssl->ctx;
+#else
+    SSL_CTX *ctx = SSL_get_SSL_CTX(sock->ssl);
+#endif
+
+    // We don't exchange close_notify alerts, and OpenSSL would otherwise
+    // treat the session as unfit for resumption.  Fatal alerts have
+    // already taken it out of the session cache
+    if (sock->ssl_handshake_done) {
+      SSL_set_shutdown(sock->ssl,
+          SSL_get_shutdown(sock->ssl) | SSL_SENT_SHUTDOWN);
+    }
+
+    if (sock->ssl_stream) {
+      ph_stm_close(sock->ssl_stream);
+      sock->ssl_stream = NULL;
+    } else {
+      SSL_free(sock->ssl);
+    }
+    sock->ssl = NULL;
+
+    if (sock->free_ssl_ctx) {
+      SSL_CTX_free(ctx);
+    }
+  }
+
+  while (!PH_STAILQ_EMPTY(&sock->file_ranges)) {
+    struct ph_sock_file_range *r = PH_STAILQ_FIRST(&sock->file_ranges);
+
+    PH_STAILQ_REMOVE_HEAD(&sock->file_ranges, ent);
+    if (r->fd != -1) {
+      close(r->fd);
+    }
+    ph_mem_free(mt.file_range, r);
+  }
+
+  if (sock->splice_out) {
+    struct ph_sock_splice *sp = sock->splice_out;
+
+    sock->splice_out = NULL;
+    sp->src = NULL;
+    sp->src_done = true;
+    if (sp->dst) {
+      // dst won't hear from us again; let it send what it has and
+      // finish up rather than wait for its next IO or timeout
+      ph_job_wakeup(&sp->dst->job);
+    }
+    splice_release(sp);
+  }
+  if (sock->splice_in) {
+    struct ph_sock_splice *sp = sock->splice_in;
+
+    sock->splice_in = NULL;
+    sp->dst = NULL;
+    splice_release(sp);
+  }
+
+  if (sock->pool_key) {
+    ph_string_delref(sock->pool_key);
+    sock->pool_key = NULL;
+  }
+
+  untrack_sock(sock);
+  unlist_idle(sock);
+
+  // The buffers and streams make up the shell; see recycle_sock()
+}
+
+// Returns the state of the calling emitter, or NULL if the caller
+// isn't an emitter
+static struct ph_sock_emitter *my_sock_emitter(void)
+{
+  ph_thread_t *me = ph_thread_self();
+  struct ph_sock_emitter *emitters;
+  uint32_t i, n;
+
+  if (!me || !me->is_emitter || ck_pr_load_int(&sock_emitters_closed)) {
+    return NULL;
+  }
+
+  emitters = ck_pr_load_ptr(&sock_emitters);
+  if (!emitters) {
+    n = ph_nbio_num_emitters();
+    emitters = ph_mem_alloc_size(mt.emitters, n * sizeof(*emitters));
+    if (!emitters) {
+      return NULL;
+    }
+    for (i = 0; i < n; i++) {
+      PH_STAILQ_INIT(&emitters[i].shells);
+      pthread_mutex_init(&emitters[i].idle_lock, NULL);
+      PH_LIST_INIT(&emitters[i].idle_socks);
+      pthread_mutex_init(&emitters[i].stats.lock, NULL);
+      PH_LIST_INIT(&emitters[i].stats.socks);
+    }
+    num_sock_emitters = n;
+    ck_pr_fence_store();
+    if (!ck_pr_cas_ptr(&sock_emitters, NULL, emitters)) {
+      // Another emitter got there first
+      for (i = 0; i < n; i++) {
+        pthread_mutex_destroy(&emitters[i].idle_lock);
+        pthread_mutex_destroy(&emitters[i].stats.lock);
+      }
+      ph_mem_free(mt.emitters, emitters);
+      emitters = ck_pr_load_ptr(&sock_emitters);
+    }
+  }
+
+  return &emitters[ph_thread_emitter_affinity()];
+}
+
+static void free_shell(ph_sock_t *sock, bool closed)
+{
+  if (sock->wbuf) {
+    ph_bufq_free(sock->wbuf);
+  }
+  if (sock->rbuf) {
+    ph_bufq_free(sock->rbuf);
+  }
+  if (sock->conn) {
+    if (closed) {
+      ph_stm_destroy(sock->conn);
+    } else {
+      ph_stm_close(sock->conn);
+    }
+  }
+  if (sock->stream) {
+    ph_stm_close(sock->stream);
+  }
+  ph_mem_free(mt.sock, sock);
+}
+
+// Called in place of freeing the memory of a sock once its dtor has run
+static void recycle_sock(ph_job_t *job)
+{
+  ph_sock_t *sock = (ph_sock_t*)job;
+  struct ph_sock_emitter *em = my_sock_emitter();
+
+  if (!em || !sock->wbuf || !sock->rbuf || !sock->conn || !sock->stream ||
+      em->count >= cur_sock_config()->shell_pool_size) {
+    free_shell(sock, false);
+    return;
+  }
+
+  close(sock->job.fd);
+  ph_bufq_reset(sock->wbuf);
+  ph_bufq_reset(sock->rbuf);
+  PH_STAILQ_INSERT_HEAD(&em->shells, &sock->job, q_ent);
+  em->count++;
+}
+
+static void track_sock(ph_sock_t *sock)
+{
+  struct ph_sock_emitter *em = my_sock_emitter();
+  struct ph_sock_stats_list *list = em ? &em->stats : &unbound_stats;
+
+  sock->track_stats = true;
+  sock->stats.created_ns = ph_time_now_ns();
+  sock->stats.last_activity_ns = sock->stats.created_ns;
+  sock->ttfb_start_ns = latency_clock_ns();
+
+  pthread_mutex_lock(&list->lock);
+  PH_LIST_INSERT_HEAD(&list->socks, sock, stats_ent);
+  pthread_mutex_unlock(&list->lock);
+  sock->stats_list = list;
+}
+
+static void untrack_sock(ph_sock_t *sock)
+{
+  struct ph_sock_stats_list *list = sock->stats_list;
+
+  if (!list) {
+    return;
+  }
+  pthread_mutex_lock(&list->lock);
+  PH_LIST_REMOVE(sock, stats_ent);
+  pthread_mutex_unlock(&list->lock);
+  sock->stats_list = NULL;
+  sock->track_stats = false;
+}
+
+// Opens an emitter's block in a scope the first time it is needed,
+// sparing the counts made on busy paths the lookup that
+// ph_counter_scope_add() makes each time
+static inline ph_counter_block_t *emitter_block(ph_counter_block_t **block,
+    ph_counter_scope_t *scope)
+{
+  if (ph_unlikely(!*block)) {
+    *block = ph_counter_block_open(scope);
+  }
+  return *block;
+}
+
+static void record_latency(bool ttfb, uint64_t ns)
+{
+  struct ph_sock_emitter *em = my_sock_emitter();
+  ph_counter_scope_t *scope = ttfb ? ttfb_counters : drain_counters;
+  ph_counter_block_t *block = NULL;
+  int bucket = 0;
+
+  if (ns >> 16) {
+    bucket = MIN(63 - __builtin_clzll(ns) - 15, LATENCY_BUCKETS - 1);
+  }
+  if (ph_likely(em != NULL)) {
+    block = emitter_block(ttfb ? &em->ttfb_counters : &em->drain_counters,
+        scope);
+  }
+  if (block) {
+    ph_counter_block_add(block, bucket, 1);
+  } else {
+    ph_counter_scope_add(scope, bucket, 1);
+  }
+}
+
+static inline void note_bytes_in(ph_sock_t *sock, uint64_t n)
+{
+  if (!sock->track_stats) {
+    return;
+  }
+  sock->stats.last_activity_ns = ph_time_now_ns();
+  if (sock->stats.bytes_in == 0) {
+    record_latency(true, latency_clock_ns() - sock->ttfb_start_ns);
+  }
+  sock->stats.bytes_in += n;
+}
+
+static inline void note_bytes_out(ph_sock_t *sock, uint64_t n)
+{
+  if (!sock->track_stats) {
+    return;
+  }
+  sock->stats.last_activity_ns = ph_time_now_ns();
+  sock->stats.bytes_out += n;
+}
+
+// Returns a stream to the state that ph_stm_make() leaves it in
+static void reset_stream(ph_stream_t *stm, void *cookie)
+{
+  stm->cookie = cookie;
+  stm->rpos = stm->rend = NULL;
+  stm->wpos = stm->wend = stm->wbase = NULL;
+  stm->last_err = 0;
+  stm->need_mask = 0;
+}
+
+// Takes a shell from the pool and makes it look freshly allocated
+static ph_sock_t *reuse_shell(void)
+{
+  struct ph_sock_emitter *em = my_sock_emitter();
+  ph_sock_t *sock, saved;
+
+  while (em && !PH_STAILQ_EMPTY(&em->shells)) {
+    sock = (ph_sock_t*)PH_STAILQ_FIRST(&em->shells);
+    PH_STAILQ_REMOVE_HEAD(&em->shells, q_ent);
+    em->count--;
+
+    if (ph_bufq_get_max_size(sock->rbuf) !=
+        (uint64_t)cur_sock_config()->max_buffer_size) {
+      // Made under an older configuration
+      free_shell(sock, true);
+      continue;
+    }
+
+    saved = *sock;
+    memset(sock, 0, sizeof(*sock));
+    ph_job_init(&sock->job);
+    sock->job.callback = saved.job.def->callback;
+    sock->job.def = saved.job.def;
+    sock->wbuf = saved.wbuf;
+    sock->rbuf = saved.rbuf;
+    sock->conn = saved.conn;
+    sock->stream = saved.stream;
+    reset_stream(sock->conn, sock);
+    reset_stream(sock->stream, sock);
+
+    ph_counter_scope_add(sock_counters, SLOT_SHELL_REUSE, 1);
+    return sock;
+  }
+
+  return NULL;
+}
+
+#ifdef USE_SENDFILE
+// Pushes as much of the range as the socket will take right now.
+// Returns true once the range has been completely sent
+static bool send_file_range(ph_sock_t *sock, struct ph_sock_file_range *r)
+{
+  while (r->len) {
+    off_t off = r->offset;
+    ssize_t n;
+
+    n = sendfile(sock->job.fd, r->fd, &off, MIN(r->len, SENDFILE_CHUNK));
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      sock->conn->last_err = errno;
+      if (errno == EAGAIN) {
+        sock->conn->need_mask |= PH_IOMASK_WRITE;
+      }
+      return false;
+    }
+    if (n == 0) {
+      // The file is shorter than the range we were asked to send
+      sock->conn->last_err = EIO;
+      return false;
+    }
+    r->offset += n;
+    r->len -= n;
+    if (sock->track_stats) {
+      sock->stats.writes++;
+      note_bytes_out(sock, n);
+    }
+  }
+  return true;
+}
+#endif
+
+// Whether try_send() has anything it could make progress on
+static bool want_write(ph_sock_t *sock)
+{
+  struct ph_sock_file_range *r = PH_STAILQ_FIRST(&sock->file_ranges);
+
+  if (sock->sslwbuf && ph_bufq_len(sock->sslwbuf)) {
+    return true;
+  }
+  if (!r) {
+    return ph_bufq_len(sock->wbuf) > 0;
+  }
+  if (r->wbuf_ahead || !r->splice) {
+    return true;
+  }
+  // Waiting on the source of a splice
+  return r->splice->in_pipe > 0 || r->splice->src_done;
+}
+
+// Stop reading while rbuf is above its high watermark; sock_set_mask()
+// starts again once the application has consumed enough of it
+static void rbuf_watermark(ph_bufq_t *q, bool above, void *arg)
+{
+  ph_sock_t *sock = arg;
+
+  ph_unused_parameter(q);
+  sock->read_paused = above;
+}
+
+// Let the application know when it can write again
+static void wbuf_watermark(ph_bufq_t *q, bool above, void *arg)
+{
+  ph_sock_t *sock = arg;
+
+  ph_unused_parameter(q);
+  if (!above) {
+    sock->write_drained = true;
+  }
+}
+
+static void set_default_watermarks(ph_sock_t *sock, ph_bufq_t *q,
+    ph_bufq_watermark_func func)
+{
+  uint64_t max = ph_bufq_get_max_size(q);
+
+  if (max) {
+    ph_bufq_set_watermarks(q, max / 2, max);
+    ph_bufq_set_watermark_func(q, func, sock);
+  }
+}
+
+// Give back the storage of buffers that have been emptied, so that a
+// sock waiting for its peer holds no buffer memory
+static void release_idle_buffers(ph_sock_t *sock)
+{
+  if (ph_bufq_len(sock->rbuf) == 0) {
+    ph_bufq_shrink(sock->rbuf);
+  }
+  if (ph_bufq_len(sock->wbuf) == 0) {
+    ph_bufq_shrink(sock->wbuf);
+  }
+  if (sock->sslwbuf && ph_bufq_len(sock->sslwbuf) == 0) {
+    ph_bufq_shrink(sock->sslwbuf);
+  }
+}
+
+// Gives back the buffer storage of the emitter's socks that have gone
+// `$.socket.idle_release` milliseconds without being dispatched.  Runs
+// on the emitter's thread, periodically while it is busy and from its
+// collector while it is quiescent
+static void release_idle_socks(struct ph_sock_emitter *em, uint64_t now)
+{
+  uint64_t idle_ns = cur_sock_config()->idle_release * PH_NSEC_PER_MSEC;
+  ph_sock_t *sock, *tmp;
+
+  em->last_release_ns = now;
+  pthread_mutex_lock(&em->idle_lock);
+  PH_LIST_FOREACH_SAFE(sock, &em->idle_socks, idle_ent, tmp) {
+    if (now - sock->last_dispatch_ns < idle_ns) {
+      continue;
+    }
+    release_idle_buffers(sock);
+    PH_LIST_REMOVE(sock, idle_ent);
+    sock->idle_emitter = NULL;
+  }
+  pthread_mutex_unlock(&em->idle_lock);
+}
+
+static void release_idle_collector(ph_thread_t *me)
+{
+  struct ph_sock_emitter *em;
+
+  if (!me->is_emitter || !(em = my_sock_emitter())) {
+    return;
+  }
+  release_idle_socks(em, ph_time_now_ns());
+}
+
+// Puts the sock on its emitter's idle list if its buffers hold storage
+// but no data
+static void note_dispatch(ph_sock_t *sock)
+{
+  struct ph_sock_emitter *em = my_sock_emitter();
+  uint64_t now = ph_time_now_ns();
+
+  sock->last_dispatch_ns = now;
+  if (!em) {
+    return;
+  }
+  if (now - em->last_release_ns >=
+      (uint64_t)cur_sock_config()->idle_release * PH_NSEC_PER_MSEC) {
+    release_idle_socks(em, now);
+  }
+
+  // Only the sock's own emitter may touch its buffers
+  if (sock->idle_emitter ||
+      sock->job.emitter_affinity % num_sock_emitters !=
+        ph_thread_emitter_affinity() ||
+      ph_bufq_len(sock->rbuf) || ph_bufq_len(sock->wbuf) ||
+      (sock->sslwbuf && ph_bufq_len(sock->sslwbuf)) ||
+      ph_sock_get_resident_size(sock) == 0) {
+    return;
+  }
+  pthread_mutex_lock(&em->idle_lock);
+  PH_LIST_INSERT_HEAD(&em->idle_socks, sock, idle_ent);
+  sock->idle_emitter = em;
+  pthread_mutex_unlock(&em->idle_lock);
+}
+
+static void sock_set_mask(ph_sock_t *sock)
+{
+  ph_iomask_t mask = sock->conn->need_mask;
+
+  note_dispatch(sock);
+
+  if ((!sock->splice_out || !sock->splice_out->paused) &&
+      !sock->read_paused) {
+    mask |= PH_IOMASK_READ;
+  }
+
+  if (sock->ssl_stream && !sock->ktls_rx) {
+    mask |= sock->ssl_stream->need_mask;
+  }
+
+  if (want_write(sock)) {
+    mask |= PH_IOMASK_WRITE;
+  } else if (sock->drain_start_ns) {
+    record_latency(false, latency_clock_ns() - sock->drain_start_ns);
+    sock->drain_start_ns = 0;
+  }
+
+  ph_log(PH_LOG_DEBUG, "fd=%d setting mask=%x timeout={%d,%d}",
+      sock->job.fd, mask, (int)sock->timeout_duration.tv_sec,
+      (int)sock->timeout_duration.tv_usec);
+  ph_job_set_nbio_timeout_in(&sock->job, mask, sock->timeout_duration);
+}
+
+// How much of the splice is waiting to be sent by dst
+static uint64_t splice_pending(struct ph_sock_splice *sp)
+{
+  if (sp->pipe[0] != -1) {
+    return sp->in_pipe;
+  }
+  if (!sp->dst) {
+    return 0;
+  }
+  return ph_bufq_len(sp->dst->wbuf) +
+    (sp->dst->sslwbuf ? ph_bufq_len(sp->dst->sslwbuf) : 0);
+}
+
+// Called by dst when it has sent some data
+static void splice_resume_src(struct ph_sock_splice *sp)
+{
+  if (!sp->paused || !sp->src || splice_pending(sp) >= sp->capacity) {
+    return;
+  }
+  sp->paused = false;
+  if (sp->src->enabled) {
+    sock_set_mask(sp->src);
+  }
+}
+
+// Called by dst when everything that src gave it has been sent
+static void splice_finish_dst(ph_sock_t *dst)
+{
+  struct ph_sock_splice *sp = dst->splice_in;
+
+  if (sp->eof && !dst->ssl) {
+    shutdown(dst->job.fd, SHUT_WR);
+  }
+  dst->splice_in = NULL;
+  sp->dst = NULL;
+  splice_release(sp);
+}
+
+// Called by src after it has tried to move data along
+static void splice_progress(ph_sock_t *src, struct ph_sock_splice *sp,
+    bool moved)
+{
+  ph_sock_t *dst = sp->dst;
+
+  if (!dst || sp->eof || sp->remaining == 0) {
+    src->splice_out = NULL;
+    sp->src = NULL;
+    sp->src_done = true;
+    sp->paused = false;
+    if (!dst) {
+      splice_release(sp);
+      return;
+    }
+  } else if (splice_pending(sp) >= sp->capacity) {
+    sp->paused = true;
+  }
+
+  if ((moved || sp->src_done) && dst->enabled) {
+    sock_set_mask(dst);
+  }
+}
+
+#ifdef USE_SPLICE
+static bool splice_from_src(ph_sock_t *src, struct ph_sock_splice *sp)
+{
+  uint64_t want, before = sp->in_pipe;
+  ssize_t n;
+  bool res = true;
+
+  while (sp->dst && sp->remaining && !sp->paused) {
+    want = MIN(sp->capacity - sp->in_pipe, sp->remaining);
+    if (want == 0) {
+      sp->paused = true;
+      break;
+    }
+
+    n = splice(src->job.fd, NULL, sp->pipe[1], NULL, want,
+        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n == 0) {
+      sp->eof = true;
+      break;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        src->conn->last_err = errno;
+        res = false;
+      } else if (sp->in_pipe) {
+        // We can't tell a drained socket from a pipe that has run
+        // out of slots; wait for dst to make room either way so that
+        // we don't spin on a readable socket
+        sp->paused = true;
+      }
+      break;
+    }
+
+    sp->in_pipe += n;
+    if (sp->remaining != UINT64_MAX) {
+      sp->remaining -= n;
+    }
+  }
+
+  splice_progress(src, sp, sp->in_pipe != before);
+  return res;
+}
+
+static bool send_spliced(ph_sock_t *sock, struct ph_sock_splice *sp)
+{
+  ssize_t n;
+
+  while (sp->in_pipe) {
+    n = splice(sp->pipe[0], NULL, sock->job.fd, NULL, sp->in_pipe,
+        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      sock->conn->last_err = errno;
+      if (errno == EAGAIN) {
+        sock->conn->need_mask |= PH_IOMASK_WRITE;
+      }
+      return false;
+    }
+    sp->in_pipe -= n;
+  }
+  return true;
+}
+#endif
+
+// Counts in sock_counters, through the emitter's block where we can
+static void count_sock(uint8_t num_slots, const uint8_t *slots,
+    const int64_t *values)
+{
+  struct ph_sock_emitter *em = my_sock_emitter();
+  ph_counter_block_t *block = NULL;
+  uint8_t i;
+
+  if (ph_likely(em != NULL)) {
+    block = emitter_block(&em->counters, sock_counters);
+  }
+  if (ph_unlikely(!block)) {
+    for (i = 0; i < num_slots; i++) {
+      ph_counter_scope_add(sock_counters, slots[i], values[i]);
+    }
+    return;
+  }
+  ph_counter_block_bulk_add(block, num_slots, slots, values);
+}
+
+static void count_event(uint8_t slot)
+{
+  static const int64_t one = 1;
+
+  count_sock(1, &slot, &one);
+}
+
+static void count_writev(uint64_t n)
+{
+  static const uint8_t slots[2] = { SLOT_WRITEV, SLOT_WRITEV_BYTES };
+  int64_t values[2] = { 1, (int64_t)n };
+
+  count_sock(2, slots, values);
+}
+
+static void count_staged(uint64_t n)
+{
+  static const uint8_t slots[1] = { SLOT_SSL_STAGED_BYTES };
+  int64_t values[1] = { (int64_t)n };
+
+  count_sock(1, slots, values);
+}
+
+static bool send_queued(ph_sock_t *sock)
+{
+  struct ph_sock_file_range *r;
+  uint64_t max, n;
+  bool ok;
+
+  while (true) {
+    r = PH_STAILQ_FIRST(&sock->file_ranges);
+    max = r ? r->wbuf_ahead : ph_bufq_len(sock->wbuf);
+
+    if (max) {
+      n = 0;
+      ok = ph_bufq_stm_write_bytes(sock->wbuf, sock->conn, max, &n);
+      count_writev(n);
+      if (!ok) {
+        if (ph_stm_errno(sock->conn) != EAGAIN) {
+          return false;
+        }
+        // No room right now
+        return true;
+      }
+      if (r) {
+        r->wbuf_ahead -= n;
+      }
+      continue;
+    }
+
+    if (!r) {
+      break;
+    }
+
+    if (r->splice) {
+#ifdef USE_SPLICE
+      if (!send_spliced(sock, r->splice)) {
+        return ph_stm_errno(sock->conn) == EAGAIN;
+      }
+#endif
+      if (!r->splice->src_done) {
+        // Wait for src to give us more
+        return true;
+      }
+      PH_STAILQ_REMOVE_HEAD(&sock->file_ranges, ent);
+      ph_mem_free(mt.file_range, r);
+      splice_finish_dst(sock);
+      continue;
+    }
+
+#ifdef USE_SENDFILE
+    if (!send_file_range(sock, r)) {
+      return ph_stm_errno(sock->conn) == EAGAIN;
+    }
+#endif
+
+    PH_STAILQ_REMOVE_HEAD(&sock->file_ranges, ent);
+    close(r->fd);
+    ph_mem_free(mt.file_range, r);
+  }
+
+  // A splice that copies through wbuf is complete once it has all
+  // been sent
+  if (sock->splice_in && sock->splice_in->pipe[0] == -1 &&
+      sock->splice_in->src_done &&
+      !(sock->sslwbuf && ph_bufq_len(sock->sslwbuf))) {
+    splice_finish_dst(sock);
+  }
+  return true;
+}
+
+static bool try_send(ph_sock_t *sock)
+{
+  if (!send_queued(sock)) {
+    return false;
+  }
+  if (sock->splice_in) {
+    splice_resume_src(sock->splice_in);
+  }
+  return true;
+}
+
+// How much plaintext to put in the next SSL record.  Small records
+// let the peer decrypt the start of a response as soon as its first
+// segment arrives, rather than after a whole 16k record; they are used
+// until `$.socket.ssl_small_record_bytes` have been sent, and again once
+// the connection has been idle for `$.socket.ssl_record_idle_reset`
+// milliseconds, as the congestion window has likely shrunk by then.
+// Bulk transfers get full records, which cost the least per byte
+static uint64_t ssl_record_size(ph_sock_t *sock)
+{
+  const struct sock_config *cfg = cur_sock_config();
+  uint64_t max = ph_bufq_get_max_size(sock->wbuf);
+  uint64_t now, size = SSL_FULL_RECORD;
+
+  if (cfg->ssl_small_record_size > 0) {
+    now = ph_time_now_ns();
+    if (now - sock->ssl_last_write_ns >
+          (uint64_t)cfg->ssl_record_idle_reset * PH_NSEC_PER_MSEC &&
+        ph_bufq_len(sock->wbuf) == 0) {
+      sock->ssl_record_bytes = 0;
+    }
+    if (sock->ssl_record_bytes < (uint64_t)cfg->ssl_small_record_bytes) {
+      size = MIN((uint64_t)cfg->ssl_small_record_size, SSL_FULL_RECORD);
+    }
+  }
+
+  // A record has to fit in wbuf along with what SSL_write() adds to it
+  if (max) {
+    size = MIN(size, max > SSL_RECORD_OVERHEAD ?
+        max - SSL_RECORD_OVERHEAD : 1);
+  }
+  return size;
+}
+
+// Encrypts len bytes into wbuf as a single record.  Returns PH_BUSY if
+// wbuf has no room for it yet, or if OpenSSL needs IO first; in that
+// case the same bytes must be offered again.  OpenSSL may already hold
+// them in an encrypted record, so they are offered as at least
+// ssl_write_retry bytes
+static ph_result_t ssl_write_record(ph_sock_t *sock, const void *buf,
+    uint64_t len)
+{
+  static const uint8_t record_slots[2] = {
+    SLOT_SSL_RECORDS, SLOT_SSL_FULL_RECORDS
+  };
+  static const int64_t record_values[2] = { 1, 1 };
+  uint64_t max = ph_bufq_get_max_size(sock->wbuf);
+  uint64_t queued = ph_bufq_len(sock->wbuf);
+
+  // An empty wbuf always takes the record, even if the buffer is too
+  // small to hold all of it; OpenSSL adds the rest as it drains
+  if (!sock->ssl_write_retry && max && queued &&
+      queued + len + SSL_RECORD_OVERHEAD > max) {
+    return PH_BUSY;
+  }
+
+  if (!ph_stm_write(sock->ssl_stream, buf, len, NULL)) {
+    if (ph_stm_errno(sock->ssl_stream) != EAGAIN) {
+      return PH_ERR;
+    }
+    sock->ssl_write_retry = len;
+    return PH_BUSY;
+  }
+
+  sock->ssl_write_retry = 0;
+  sock->ssl_record_bytes += len;
+  sock->ssl_last_write_ns = ph_time_now_ns();
+  count_sock(len == SSL_FULL_RECORD ? 2 : 1, record_slots, record_values);
+  return PH_OK;
+}
+
+static bool try_ssl_shunt(ph_sock_t *sock)
+{
+  uint64_t len;
+  ph_buf_t *buf;
+  ph_result_t res;
+
+  // Until we know whether the kernel takes over, the application's
+  // data stays where it is; see switch_to_ktls()
+  if (!sock->sslwbuf || sock->ktls_pending) {
+    return true;
+  }
+  while ((len = ph_bufq_len(sock->sslwbuf)) > 0) {
+    len = MAX(MIN(len, ssl_record_size(sock)), sock->ssl_write_retry);
+    // A slice of the queue unless the record spans several buffers
+    buf = ph_bufq_peek_bytes(sock->sslwbuf, len);
+    if (!buf) {
+      // Try again when we're next dispatched
+      return true;
+    }
+    res = ssl_write_record(sock, ph_buf_mem(buf), len);
+    ph_buf_delref(buf);
+    if (res == PH_ERR) {
+      return false;
+    }
+    if (res == PH_BUSY) {
+      // No room right now
+      return true;
+    }
+    ph_bufq_discard(sock->sslwbuf, len);
+  }
+  return true;
+}
+
+static bool try_read(ph_sock_t *sock)
+{
+  ph_stream_t *stm = sock->ssl_stream && !sock->ktls_rx ?
+    sock->ssl_stream : sock->conn;
+  struct ph_sock_splice *sp = sock->splice_out;
+  uint64_t n = 0;
+
+  if (sock->ktls_pending) {
+    // Records read past the handshake would be lost to the kernel
+    return true;
+  }
+
+  if (sp) {
+#ifdef USE_SPLICE
+    if (sp->pipe[0] != -1) {
+      return splice_from_src(sock, sp);
+    }
+#endif
+    if (sp->paused) {
+      return true;
     }
   }
 
-  done = ph_time_now();
-  timersub(&done, &job->start, &done);
+  if (sp) {
+    // Read one chunk at a time so that splice_progress() can apply
+    // back pressure
+    if (!ph_bufq_stm_read(sock->rbuf, stm, &n)) {
+      if (ph_stm_errno(stm) != EAGAIN) {
+        return false;
+      }
+    } else if (n == 0) {
+      sp->eof = true;
+    }
+  } else if (sock->read_paused) {
+    // Leave it in the kernel until the application catches up
+    return true;
+  } else if (!ph_bufq_stm_read_bytes(sock->rbuf, stm, sock->read_budget,
+        &n)) {
+    if (errno != ENOBUFS && ph_stm_errno(stm) != EAGAIN) {
+      return false;
+    }
+  }
 
-  // This defers the free, so we are still safe to access job on
-  // the following line
-  ph_job_free(&job->job);
-  job->job.fd = -1;
+  if (sp) {
+    // Copy what we read over to dst
+    n = 0;
+    if (sp->dst && ph_bufq_len(sock->rbuf)) {
+      ph_bufq_stm_write_bytes(sock->rbuf, sp->dst->stream,
+          MIN(ph_bufq_len(sock->rbuf), sp->remaining), &n);
+      if (sp->remaining != UINT64_MAX) {
+        sp->remaining -= n;
+      }
+    }
+    splice_progress(sock, sp, n > 0);
+  }
+  return true;
+}
 
-  job->func(job->s, &job->addr, status, &done, job->arg);
+static void set_cork(ph_sock_t *sock, int on)
+{
+#ifdef PH_TCP_CORK
+  setsockopt(sock->job.fd, IPPROTO_TCP, PH_TCP_CORK, &on, sizeof(on));
+#else
+  ph_unused_parameter(sock);
+  ph_unused_parameter(on);
+#endif
 }
 
-static void sock_dtor(ph_job_t *job)
+// Sends what we can after the callback has run.  Returns the mask that
+// the callback needs to be dispatched with again, or 0
+static ph_iomask_t flush_sock(ph_sock_t *sock)
 {
-  ph_sock_t *sock = (ph_sock_t*)job;
+  uint64_t rbufsize = ph_bufq_len(sock->rbuf);
+  bool cork = (sock->write_policy & PH_SOCK_WRITE_CORK) && want_write(sock);
+  bool sent;
 
-  if (sock->sslwbuf) {
-    ph_bufq_free(sock->sslwbuf);
-    sock->sslwbuf = NULL;
+  if (!try_ssl_shunt(sock)) {
+    return PH_IOMASK_ERR;
   }
-  if (sock->ssl) {
-#if OPENSSL_VERSION_NUMBER < 0x10100001L
-    SSL_CTX *ctx = sock->ssl->ctx;
-#else
-    SSL_CTX *ctx = SSL_get_SSL_CTX(sock->ssl);
-#endif
 
-    if (sock->ssl_stream) {
-      ph_stm_close(sock->ssl_stream);
-      sock->ssl_stream = NULL;
-    } else {
-      SSL_free(sock->ssl);
-    }
-    sock->ssl = NULL;
+  if (sock->track_stats) {
+    uint64_t queued = ph_bufq_len(sock->wbuf);
 
-    if (sock->free_ssl_ctx) {
-      SSL_CTX_free(ctx);
+    if (sock->sslwbuf) {
+      queued += ph_bufq_len(sock->sslwbuf);
+    }
+    sock->stats.max_wbuf = MAX(sock->stats.max_wbuf, queued);
+    if (queued && !sock->drain_start_ns) {
+      sock->drain_start_ns = latency_clock_ns();
     }
   }
 
-  if (sock->wbuf) {
-    ph_bufq_free(sock->wbuf);
-    sock->wbuf = NULL;
+  // Hold back partial segments until everything we have is queued
+  // in the kernel, then let them go
+  if (cork) {
+    set_cork(sock, 1);
   }
-  if (sock->rbuf) {
-    ph_bufq_free(sock->rbuf);
-    sock->rbuf = NULL;
+  sent = try_send(sock);
+  if (cork) {
+    set_cork(sock, 0);
   }
-  if (sock->conn) {
-    ph_stm_close(sock->conn);
-    sock->conn = NULL;
+  if (!sent) {
+    return PH_IOMASK_ERR;
   }
-  if (sock->stream) {
-    ph_stm_close(sock->stream);
-    sock->stream = NULL;
+
+  if (sock->ssl_stream && !sock->ktls_rx) {
+    // SSL writes can also read; while it remains buffered
+    // in the SSL structure, we don't see it in rbuf and won't
+    // get woken up by epoll.  If we hit that case, we perform
+    // this speculative read, and if the rbuf_len changes we
+    // know that we should make another attempt at dispatching
+    // to read the remainder
+    if (!try_read(sock)) {
+      return PH_IOMASK_ERR;
+    }
+
+    if (ph_bufq_len(sock->rbuf) > rbufsize) {
+      return PH_IOMASK_READ;
+    }
   }
+  if (sock->write_drained) {
+    return PH_IOMASK_DRAINED;
+  }
+  return 0;
 }
 
-static bool try_send(ph_sock_t *sock)
+// Hands the SSL record layer to the kernel once the handshake is done
+// and OpenSSL's last flight has left wbuf; the kernel would otherwise
+// encrypt it a second time.  Returns false on IO errors
+static bool switch_to_ktls(ph_sock_t *sock)
 {
-  while (ph_bufq_len(sock->wbuf)) {
-    if (!ph_bufq_stm_write(sock->wbuf, sock->conn, NULL)) {
-      if (ph_stm_errno(sock->conn) != EAGAIN) {
-        return false;
+  uint32_t offload;
+  ph_buf_t *buf;
+
+  if (ph_bufq_len(sock->wbuf) && !try_send(sock)) {
+    return false;
+  }
+  if (ph_bufq_len(sock->wbuf)) {
+    // We'll be dispatched again as it drains
+    return true;
+  }
+
+  sock->ktls_pending = false;
+  offload = ph_openssl_ktls_enable(sock->ssl, sock->job.fd);
+  if ((offload & PH_OPENSSL_KTLS_TX) == 0) {
+    ph_log(PH_LOG_DEBUG, "fd=%d staying with userspace TLS: `Pe%d",
+        sock->job.fd, errno);
+    ph_counter_scope_add(sock_counters, SLOT_KTLS_FALLBACK, 1);
+    return true;
+  }
+  sock->ktls_tx = true;
+  sock->ktls_rx = offload & PH_OPENSSL_KTLS_RX;
+  ph_counter_scope_add(sock_counters, SLOT_KTLS, 1);
+
+  // The application writes plaintext straight into wbuf from now on;
+  // move over what it wrote during the handshake
+  if (ph_bufq_len(sock->sslwbuf)) {
+    buf = ph_bufq_consume_bytes(sock->sslwbuf, ph_bufq_len(sock->sslwbuf));
+    if (!buf || ph_bufq_append(sock->wbuf, ph_buf_mem(buf), ph_buf_len(buf),
+          NULL) != PH_OK) {
+      if (buf) {
+        ph_buf_delref(buf);
       }
-      // No room right now
-      return true;
+      return false;
     }
+    ph_buf_delref(buf);
   }
+  ph_bufq_free(sock->sslwbuf);
+  sock->sslwbuf = NULL;
+  set_default_watermarks(sock, sock->wbuf, wbuf_watermark);
   return true;
 }
 
-static bool try_ssl_shunt(ph_sock_t *sock)
+static inline bool in_first_handshake(ph_sock_t *sock)
 {
-  if (!sock->sslwbuf) {
-    return true;
+  return sock->ssl && SSL_in_init(sock->ssl) &&
+    SSL_total_renegotiations(sock->ssl) == 0;
+}
+
+// Acts on the outcome of a handshake step.  Returns true if the sock is
+// now waiting for IO and the dispatch is over
+static bool handshake_step_done(ph_sock_t *sock, int err, ph_iomask_t *why)
+{
+  switch (err) {
+    case SSL_ERROR_NONE:
+      return false;
+    case SSL_ERROR_WANT_READ:
+      if (try_send(sock)) {
+        ph_job_set_nbio_timeout_in(&sock->job,
+            PH_IOMASK_READ,
+            sock->timeout_duration);
+        return true;
+      }
+      *why |= PH_IOMASK_ERR;
+      return false;
+    case SSL_ERROR_WANT_WRITE:
+      if (try_send(sock)) {
+        ph_job_set_nbio_timeout_in(&sock->job,
+            PH_IOMASK_WRITE,
+            sock->timeout_duration);
+        return true;
+      }
+      *why |= PH_IOMASK_ERR;
+      return false;
+    default:
+      *why |= PH_IOMASK_ERR;
+      return false;
   }
-  while (ph_bufq_len(sock->sslwbuf)) {
-    if (!ph_bufq_stm_write(sock->sslwbuf, sock->ssl_stream, NULL)) {
-      if (ph_stm_errno(sock->conn) != EAGAIN) {
-        return false;
+}
+
+static void sock_dispatch(ph_job_t *j, ph_iomask_t why, void *data);
+
+// Back on the emitter with the result of the step
+static void handshake_returned(intptr_t code, void *arg)
+{
+  ph_sock_t *sock = arg;
+  ph_iomask_t why = sock->handshake_why;
+
+  ph_unused_parameter(code);
+
+  sock->handshake_away = false;
+  sock->handshake_why = 0;
+
+  if (!sock->job.epoch_entry.function) {
+    if (sock->handshake_cb_pending) {
+      sock->handshake_cb_pending = false;
+      if (sock->handshake_cb) {
+        sock->handshake_cb(sock, sock->handshake_cb_res);
       }
-      // No room right now
-      return true;
     }
+    sock->handshake_stepped = true;
+    sock_dispatch(&sock->job, why, sock->job.data);
   }
-  return true;
+
+  // Lets a pending ph_sock_free() go ahead
+  ck_pr_dec_32(&sock->job.n_wakeups_pending);
 }
 
-static bool try_read(ph_sock_t *sock)
+static void handshake_on_pool(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  struct handshake_job *hs = data;
+  ph_sock_t *sock = hs->sock;
+
+  ph_unused_parameter(why);
+
+  sock->handshake_err = SSL_get_error(sock->ssl,
+      SSL_do_handshake(sock->ssl));
+  ph_job_free(job);
+
+  if (ph_nbio_queue_affine_func(sock->job.emitter_affinity,
+        handshake_returned, 0, sock) != PH_OK) {
+    ph_panic("sock: failed to return handshake to emitter: `Pe%d", errno);
+  }
+}
+
+static struct ph_job_def handshake_job_template = {
+  handshake_on_pool,
+  PH_MEMTYPE_INVALID,
+  NULL,
+  NULL
+};
+
+static void start_handshake_pool(void)
+{
+  ph_thread_pool_t *pool = ph_thread_pool_define("ssl_handshake",
+      HANDSHAKE_QUEUE_LEN, DEFAULT_HANDSHAKE_THREADS);
+
+  // We're past ph_sched_run(), which starts the pools it knows about
+  ph_thread_pool_start_workers(pool);
+  ck_pr_store_ptr(&handshake_pool, pool);
+}
+
+// Sends the next step of the handshake to the handshake pool, so that
+// the emitter can get on with other socks while the crypto is done.
+// Returns false if the step should be run here instead
+static bool hand_off_handshake(ph_sock_t *sock)
 {
-  ph_stream_t *stm = sock->ssl_stream ? sock->ssl_stream : sock->conn;
+  struct handshake_job *hs;
+
+  pthread_once(&handshake_pool_once, start_handshake_pool);
 
-  if (!ph_bufq_stm_read(sock->rbuf, stm, NULL) &&
-      ph_stm_errno(stm) != EAGAIN) {
+  hs = (struct handshake_job*)ph_job_alloc(&handshake_job_template);
+  if (!hs) {
     return false;
   }
+  hs->sock = sock;
+  hs->job.data = hs;
+
+  // Counted as a wakeup so that a ph_sock_free() in the meantime waits
+  // for handshake_returned()
+  ck_pr_inc_32(&sock->job.n_wakeups_pending);
+  sock->handshake_away = true;
+  ph_counter_scope_add(sock_counters, SLOT_SSL_HANDSHAKE_OFFLOADS, 1);
+  ph_job_set_pool(&hs->job, ck_pr_load_ptr(&handshake_pool));
   return true;
 }
 
@@ -206,6 +1570,7 @@ static void sock_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
 {
   ph_sock_t *sock = (ph_sock_t*)j;
   bool had_err = why & PH_IOMASK_ERR;
+  bool stepped = false;
 
   if (j->def && j->epoch_entry.function) {
     // We're being woken up after we've been freed.
@@ -213,9 +1578,31 @@ static void sock_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
     return;
   }
 
+  if (sock->handshake_away) {
+    // The handshake pool has the SSL object; we'll be dispatched again
+    // when it comes back
+    sock->handshake_why |= why;
+    return;
+  }
+
+  sock->stats.dispatches++;
+
   if (sock->enabled) {
     sock->conn->need_mask = 0;
 
+    if (sock->handshake_offload && in_first_handshake(sock)) {
+      if (sock->handshake_stepped) {
+        sock->handshake_stepped = false;
+        stepped = true;
+        if (handshake_step_done(sock, sock->handshake_err, &why)) {
+          return;
+        }
+      } else if (hand_off_handshake(sock)) {
+        return;
+      }
+    }
+    sock->handshake_stepped = false;
+
     // Push data into the SSL stream
     if (sock->sslwbuf) {
       if (try_ssl_shunt(sock)) {
@@ -226,8 +1613,10 @@ static void sock_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
     }
 
     // If we have data pending write, try to get that sent, and flag
-    // errors
-    if (!try_send(sock)) {
+    // errors.  When coalescing, leave it to join whatever the callback
+    // writes unless we were woken up because there's room to send
+    if (((sock->write_policy & PH_SOCK_WRITE_COALESCE) == 0 ||
+          (why & PH_IOMASK_WRITE)) && !try_send(sock)) {
       why |= PH_IOMASK_ERR;
     }
 
@@ -237,32 +1626,16 @@ static void sock_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
       }
     }
 
-    if (sock->ssl && SSL_in_init(sock->ssl)
-        && SSL_total_renegotiations(sock->ssl) == 0) {
-      switch (SSL_get_error(sock->ssl, SSL_do_handshake(sock->ssl))) {
-        case SSL_ERROR_NONE:
-          break;
-        case SSL_ERROR_WANT_READ:
-          if (try_send(sock)) {
-            ph_job_set_nbio_timeout_in(&sock->job,
-                PH_IOMASK_READ,
-                sock->timeout_duration);
-            return;
-          }
-          why |= PH_IOMASK_ERR;
-          break;
-        case SSL_ERROR_WANT_WRITE:
-          if (try_send(sock)) {
-            ph_job_set_nbio_timeout_in(&sock->job,
-                PH_IOMASK_WRITE,
-                sock->timeout_duration);
-            return;
-          }
-          why |= PH_IOMASK_ERR;
-          break;
-        default:
-          why |= PH_IOMASK_ERR;
-          break;
+    if (!stepped && in_first_handshake(sock) &&
+        handshake_step_done(sock,
+          SSL_get_error(sock->ssl, SSL_do_handshake(sock->ssl)), &why)) {
+      return;
+    }
+
+    if (sock->ktls_pending && (why & PH_IOMASK_ERR) == 0 &&
+        !SSL_in_init(sock->ssl)) {
+      if (!switch_to_ktls(sock) || !try_read(sock)) {
+        why |= PH_IOMASK_ERR;
       }
     }
   }
@@ -271,6 +1644,10 @@ dispatch_again:
   if (why & PH_IOMASK_ERR) {
     had_err = true;
   }
+  if (sock->write_drained) {
+    sock->write_drained = false;
+    why |= PH_IOMASK_DRAINED;
+  }
   if (sock->enabled || (why & PH_IOMASK_WAKEUP) || (why & PH_IOMASK_ERR)) {
     sock->callback(sock, why, data);
   }
@@ -280,62 +1657,73 @@ dispatch_again:
   }
 
   if (!had_err) {
-    uint64_t rbufsize = ph_bufq_len(sock->rbuf);
-
-    if (!try_ssl_shunt(sock)) {
-      why = PH_IOMASK_ERR;
-      goto dispatch_again;
+    if ((sock->write_policy & PH_SOCK_WRITE_COALESCE) &&
+        ph_nbio_defer_to_batch_end(&sock->flush_ent)) {
+      // flush_at_batch_end() sends and sets the mask for us
+      count_event(SLOT_DEFERRED_FLUSH);
+      return;
     }
 
-    if (!try_send(sock)) {
-      why = PH_IOMASK_ERR;
+    why = flush_sock(sock);
+    if (why) {
       goto dispatch_again;
-    } else if (sock->ssl_stream) {
-      // SSL writes can also read; while it remains buffered
-      // in the SSL structure, we don't see it in rbuf and won't
-      // get woken up by epoll.  If we hit that case, we perform
-      // this speculative read, and if the rbuf_len changes we
-      // know that we should make another attempt at dispatching
-      // to read the remainder
-      if (!try_read(sock)) {
-        why = PH_IOMASK_ERR;
-        goto dispatch_again;
-      }
-
-      if (ph_bufq_len(sock->rbuf) > rbufsize) {
-        why = PH_IOMASK_READ;
-        goto dispatch_again;
-      }
     }
   }
 
-  ph_iomask_t mask = sock->conn->need_mask | PH_IOMASK_READ;
+  sock_set_mask(sock);
+}
 
-  if (sock->ssl_stream) {
-    mask |= sock->ssl_stream->need_mask;
-  }
+static void flush_at_batch_end(intptr_t code, void *arg)
+{
+  ph_sock_t *sock = arg;
+  ph_iomask_t why;
 
-  if (ph_bufq_len(sock->wbuf) ||
-      (sock->sslwbuf && ph_bufq_len(sock->sslwbuf))) {
-    mask |= PH_IOMASK_WRITE;
+  ph_unused_parameter(code);
+
+  if (sock->job.epoch_entry.function || !sock->enabled) {
+    // Freed or disabled since the flush was queued
+    return;
   }
 
-  ph_log(PH_LOG_DEBUG, "fd=%d setting mask=%x timeout={%d,%d}",
-      sock->job.fd, mask, (int)sock->timeout_duration.tv_sec,
-      (int)sock->timeout_duration.tv_usec);
-  ph_job_set_nbio_timeout_in(&sock->job, mask, sock->timeout_duration);
+  why = flush_sock(sock);
+  if (why) {
+    sock_dispatch(&sock->job, why, sock->job.data);
+    return;
+  }
+  sock_set_mask(sock);
 }
 
 static struct ph_job_def connect_job_template = {
   connect_complete,
   PH_MEMTYPE_INVALID,
+  NULL,
   NULL
 };
 
 static struct ph_job_def sock_job_template = {
   sock_dispatch,
   PH_MEMTYPE_INVALID,
-  sock_dtor
+  sock_dtor,
+  recycle_sock
+};
+
+static void rac_dispatch(ph_job_t *j, ph_iomask_t why, void *data);
+static void rac_dtor(ph_job_t *job);
+static void connect_attempt_complete(ph_job_t *j, ph_iomask_t why,
+    void *data);
+
+static struct ph_job_def rac_job_template = {
+  rac_dispatch,
+  PH_MEMTYPE_INVALID,
+  rac_dtor,
+  NULL
+};
+
+static struct ph_job_def connect_attempt_template = {
+  connect_attempt_complete,
+  PH_MEMTYPE_INVALID,
+  NULL,
+  NULL
 };
 
 static void do_sock_init(void)
@@ -344,9 +1732,65 @@ static void do_sock_init(void)
       &mt.connect_job);
   sock_job_template.memtype = mt.sock;
   connect_job_template.memtype = mt.connect_job;
+  rac_job_template.memtype = mt.resolve_and_connect;
+  connect_attempt_template.memtype = mt.connect_attempt;
+  handshake_job_template.memtype = mt.handshake;
   ssl_sock_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+  sock_counters = ph_counter_scope_define(NULL, "sock", 16);
+  ph_counter_scope_register_counter_block(sock_counters,
+      sizeof(counter_names)/sizeof(counter_names[0]), 0, counter_names);
+
+  ttfb_counters = ph_counter_scope_define(sock_counters, "ttfb",
+      LATENCY_BUCKETS);
+  ph_counter_scope_register_counter_block(ttfb_counters,
+      LATENCY_BUCKETS, 0, latency_bucket_names);
+  drain_counters = ph_counter_scope_define(sock_counters, "write_drain",
+      LATENCY_BUCKETS);
+  ph_counter_scope_register_counter_block(drain_counters,
+      LATENCY_BUCKETS, 0, latency_bucket_names);
+
+  ph_job_collector_register(release_idle_collector);
+}
+
+static void do_sock_fini(void)
+{
+  struct ph_sock_emitter *emitters = ck_pr_load_ptr(&sock_emitters);
+  struct sock_config *cfg;
+  ph_sock_t *sock;
+  uint32_t i;
+
+  while ((cfg = sock_config) != NULL) {
+    sock_config = cfg->prev;
+    ph_mem_free(mt.config, cfg);
+  }
+
+  ck_pr_store_int(&sock_emitters_closed, 1);
+  if (!emitters) {
+    return;
+  }
+  for (i = 0; i < num_sock_emitters; i++) {
+    while (!PH_STAILQ_EMPTY(&emitters[i].shells)) {
+      sock = (ph_sock_t*)PH_STAILQ_FIRST(&emitters[i].shells);
+      PH_STAILQ_REMOVE_HEAD(&emitters[i].shells, q_ent);
+      free_shell(sock, true);
+    }
+    if (emitters[i].counters) {
+      ph_counter_block_delref(emitters[i].counters);
+    }
+    if (emitters[i].ttfb_counters) {
+      ph_counter_block_delref(emitters[i].ttfb_counters);
+    }
+    if (emitters[i].drain_counters) {
+      ph_counter_block_delref(emitters[i].drain_counters);
+    }
+    pthread_mutex_destroy(&emitters[i].idle_lock);
+    pthread_mutex_destroy(&emitters[i].stats.lock);
+  }
+  ph_mem_free(mt.emitters, emitters);
+  sock_emitters = NULL;
 }
-PH_LIBRARY_INIT(do_sock_init, 0)
+PH_LIBRARY_INIT(do_sock_init, do_sock_fini)
 
 void ph_socket_connect(ph_socket_t s, const ph_sockaddr_t *addr,
   struct timeval *timeout, ph_socket_connect_func func, void *arg)
@@ -368,7 +1812,7 @@ void ph_socket_connect(ph_socket_t s, const ph_sockaddr_t *addr,
   job->arg = arg;
   job->job.emitter_affinity = ck_pr_faa_32(&connect_affinity, 1);
 
-  job->start = ph_time_now();
+  job->start = ph_time_now_ns();
   res = connect(s, &job->addr.sa.sa, ph_sockaddr_socklen(&job->addr));
 
   if (res < 0 && errno == EINPROGRESS) {
@@ -381,15 +1825,107 @@ void ph_socket_connect(ph_socket_t s, const ph_sockaddr_t *addr,
     return;
   }
 
-  done = ph_time_now();
-  timersub(&done, &job->start, &done);
+  done = ph_ns_to_timeval(ph_time_now_ns() - job->start);
 
   // Immediate result
   func(s, addr, res == 0 ? 0 : errno, &done, arg);
   ph_job_free(&job->job);
 }
 
-#define MAX_SOCK_BUFFER_SIZE 128*1024
+// The stream for the connection itself; like an fd stream but keeping
+// the stats of the sock
+static bool conn_should_retry(ph_stream_t *stm)
+{
+  switch (stm->last_err) {
+    case EAGAIN:
+    case EINTR:
+    case EINPROGRESS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool conn_stm_close(ph_stream_t *stm)
+{
+  ph_sock_t *sock = stm->cookie;
+
+  if (close(sock->job.fd) == 0) {
+    return true;
+  }
+  stm->last_err = errno;
+  return false;
+}
+
+static bool conn_stm_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nread)
+{
+  ph_sock_t *sock = stm->cookie;
+  ssize_t r;
+
+  r = readv(sock->job.fd, iov, iovcnt);
+  sock->stats.reads++;
+  if (r == -1 && errno == EIO && sock->ktls_rx) {
+    r = ph_openssl_ktls_recv_control(sock->job.fd);
+  }
+
+  if (r == -1) {
+    stm->last_err = errno;
+    if (conn_should_retry(stm)) {
+      stm->need_mask |= PH_IOMASK_READ;
+    }
+    return false;
+  }
+
+  if (r > 0) {
+    note_bytes_in(sock, r);
+  }
+  if (nread) {
+    *nread = r;
+  }
+  return true;
+}
+
+static bool conn_stm_writev(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nwrote)
+{
+  ph_sock_t *sock = stm->cookie;
+  ssize_t w;
+
+  w = writev(sock->job.fd, iov, iovcnt);
+  sock->stats.writes++;
+
+  if (w == -1) {
+    stm->last_err = errno;
+    if (conn_should_retry(stm)) {
+      stm->need_mask |= PH_IOMASK_WRITE;
+    }
+    return false;
+  }
+
+  note_bytes_out(sock, w);
+  if (nwrote) {
+    *nwrote = w;
+  }
+  return true;
+}
+
+static bool conn_stm_seek(ph_stream_t *stm, int64_t delta, int whence,
+    uint64_t *newpos)
+{
+  ph_unused_parameter(delta);
+  ph_unused_parameter(whence);
+  ph_unused_parameter(newpos);
+  stm->last_err = ESPIPE;
+  return false;
+}
+
+static struct ph_stream_funcs conn_stm_funcs = {
+  conn_stm_close,
+  conn_stm_readv,
+  conn_stm_writev,
+  conn_stm_seek
+};
 
 static bool sock_stm_close(ph_stream_t *stm)
 {
@@ -401,41 +1937,80 @@ static bool sock_stm_readv(ph_stream_t *stm, const struct iovec *iov,
     int iovcnt, uint64_t *nread)
 {
   ph_sock_t *sock = stm->cookie;
+  uint64_t tot;
+
+  tot = ph_bufq_consume_iov(sock->rbuf, iov, iovcnt);
+
+  if (nread) {
+    *nread = tot;
+  }
+
+  return true;
+}
+
+// Writes the application's data to an SSL sock whose handshake is done.
+// Whole records are encrypted straight from the caller's memory into
+// wbuf.  Writes smaller than a record are gathered in sslwbuf, so that
+// they share one when we flush, and so is whatever wbuf has no room
+// for; once sslwbuf holds anything, later data queues up behind it
+static bool ssl_writev(ph_sock_t *sock, const struct iovec *iov,
+    int iovcnt, uint64_t *nwrotep)
+{
   int i;
-  uint64_t tot = 0;
-  uint64_t avail;
-  ph_buf_t *b;
-  bool res = true;
+  uint64_t n, want, size, staged, len, total = 0, copied = 0;
+  const char *base;
 
   for (i = 0; i < iovcnt; i++) {
-    avail = MIN(ph_bufq_len(sock->rbuf), iov[i].iov_len);
-    if (avail == 0) {
-      continue;
-    }
+    base = iov[i].iov_base;
+    len = iov[i].iov_len;
+
+    while (len) {
+      size = ssl_record_size(sock);
+      staged = ph_bufq_len(sock->sslwbuf);
+
+      if (!staged && len >= size &&
+          ssl_write_record(sock, base, size) == PH_OK) {
+        base += size;
+        len -= size;
+        total += size;
+        continue;
+      }
 
-    // This allocates a buf slice; in theory, we can eliminate this
-    // allocation, but in practice it's probably fine until profiling
-    // tells us otherwise
-    b = ph_bufq_consume_bytes(sock->rbuf, avail);
-    if (!b) {
-      stm->last_err = ENOMEM;
-      res = false;
-      break;
+      // Just enough to complete a record, so that the rest of a large
+      // write can still be encrypted in place
+      want = staged < size ? MIN(len, size - staged) : len;
+      if (ph_bufq_append(sock->sslwbuf, base, want, &n) != PH_OK) {
+        sock->stream->last_err = EAGAIN;
+        goto done;
+      }
+      base += n;
+      len -= n;
+      total += n;
+      copied += n;
+      if (n < want) {
+        // Full; don't let the next iov jump the queue
+        goto done;
+      }
+
+      if (ph_bufq_len(sock->sslwbuf) >= size && !try_ssl_shunt(sock)) {
+        // The error is reported when we next flush
+        sock->stream->last_err = EIO;
+        goto done;
+      }
     }
-    memcpy(iov[i].iov_base, ph_buf_mem(b), avail);
-    ph_buf_delref(b);
-    tot += avail;
   }
 
-  if (nread) {
-    *nread = tot;
+done:
+  if (copied) {
+    count_staged(copied);
   }
-
-  if (tot > 0) {
+  if (total) {
+    if (nwrotep) {
+      *nwrotep = total;
+    }
     return true;
   }
-
-  return res;
+  return false;
 }
 
 static bool sock_stm_writev(ph_stream_t *stm, const struct iovec *iov,
@@ -446,6 +2021,11 @@ static bool sock_stm_writev(ph_stream_t *stm, const struct iovec *iov,
   ph_sock_t *sock = stm->cookie;
   ph_bufq_t *bufq = sock->sslwbuf ? sock->sslwbuf : sock->wbuf;
 
+  if (sock->sslwbuf && !sock->ktls_pending && !sock->handshake_away &&
+      !SSL_in_init(sock->ssl)) {
+    return ssl_writev(sock, iov, iovcnt, nwrotep);
+  }
+
   for (i = 0; i < iovcnt; i++) {
     if (iov[i].iov_len == 0) {
       continue;
@@ -455,7 +2035,14 @@ static bool sock_stm_writev(ph_stream_t *stm, const struct iovec *iov,
       stm->last_err = EAGAIN;
       break;
     }
-    total += n;
+    if (bufq == sock->sslwbuf) {
+      count_staged(n);
+    }
+    total += n;
+    if (n < iov[i].iov_len) {
+      // Full; don't let the next iov jump the queue
+      break;
+    }
   }
 
   if (total) {
@@ -487,38 +2074,45 @@ static struct ph_stream_funcs sock_stm_funcs = {
 ph_sock_t *ph_sock_new_from_socket(ph_socket_t s, const ph_sockaddr_t *sockname,
   const ph_sockaddr_t *peername)
 {
+  const struct sock_config *cfg = load_sock_config();
   ph_sock_t *sock;
-  int64_t max_buf;
 
-  sock = (ph_sock_t*)ph_job_alloc(&sock_job_template);
+  sock = reuse_shell();
   if (!sock) {
-    return NULL;
-  }
-
-  sock->free_ssl_ctx = true;
+    sock = (ph_sock_t*)ph_job_alloc(&sock_job_template);
+    if (!sock) {
+      return NULL;
+    }
+    // So that closing conn on failure closes `s`
+    sock->job.fd = s;
 
-  max_buf = ph_config_query_int("$.socket.max_buffer_size",
-              MAX_SOCK_BUFFER_SIZE);
+    sock->wbuf = ph_bufq_new(cfg->max_buffer_size);
+    if (!sock->wbuf) {
+      goto fail;
+    }
 
-  sock->wbuf = ph_bufq_new(max_buf);
-  if (!sock->wbuf) {
-    goto fail;
-  }
+    sock->rbuf = ph_bufq_new(cfg->max_buffer_size);
+    if (!sock->rbuf) {
+      goto fail;
+    }
 
-  sock->rbuf = ph_bufq_new(max_buf);
-  if (!sock->rbuf) {
-    goto fail;
-  }
+    sock->conn = ph_stm_make(&conn_stm_funcs, sock, 0, 0);
+    if (!sock->conn) {
+      goto fail;
+    }
 
-  sock->conn = ph_stm_fd_open(s, 0, 0);
-  if (!sock->conn) {
-    goto fail;
+    sock->stream = ph_stm_make(&sock_stm_funcs, sock, 0, 0);
+    if (!sock->stream) {
+      goto fail;
+    }
   }
 
-  sock->stream = ph_stm_make(&sock_stm_funcs, sock, 0, 0);
-  if (!sock->stream) {
-    goto fail;
-  }
+  sock->free_ssl_ctx = true;
+  PH_STAILQ_INIT(&sock->file_ranges);
+  sock->flush_ent.func = flush_at_batch_end;
+  sock->flush_ent.arg = sock;
+  set_default_watermarks(sock, sock->rbuf, rbuf_watermark);
+  set_default_watermarks(sock, sock->wbuf, wbuf_watermark);
 
   if (sockname) {
     sock->sockname = *sockname;
@@ -531,6 +2125,10 @@ ph_sock_t *ph_sock_new_from_socket(ph_socket_t s, const ph_sockaddr_t *sockname,
 
   sock->job.fd = s;
   sock->timeout_duration.tv_sec = 60;
+  sock->read_budget = cfg->read_budget;
+  if (cfg->track_stats) {
+    track_sock(sock);
+  }
 
   return sock;
 
@@ -545,6 +2143,87 @@ void ph_sock_free(ph_sock_t *sock)
   ph_job_free(&sock->job);
 }
 
+static inline uint64_t traffic(const ph_sock_stats_t *stats)
+{
+  return stats->bytes_in + stats->bytes_out;
+}
+
+// Merges the socks on list into the busiest-first entries, of which
+// there are n; returns the new n
+static uint32_t collect_top(struct ph_sock_stats_list *list,
+    ph_sock_stats_entry_t *entries, uint32_t n, uint32_t max)
+{
+  ph_sock_stats_entry_t ent;
+  ph_sock_t *sock;
+  uint32_t i;
+
+  pthread_mutex_lock(&list->lock);
+  PH_LIST_FOREACH(sock, &list->socks, stats_ent) {
+    ent.stats = sock->stats;
+    if (n == max && traffic(&ent.stats) <= traffic(&entries[n-1].stats)) {
+      continue;
+    }
+    ent.peername = sock->peername;
+    ent.fd = sock->job.fd;
+
+    // Insertion sort into the busiest-first list, dropping the last
+    // entry if it is full
+    i = n < max ? n++ : n - 1;
+    while (i > 0 && traffic(&entries[i-1].stats) < traffic(&ent.stats)) {
+      entries[i] = entries[i-1];
+      i--;
+    }
+    entries[i] = ent;
+  }
+  pthread_mutex_unlock(&list->lock);
+
+  return n;
+}
+
+uint32_t ph_sock_stats_top(ph_sock_stats_entry_t *entries, uint32_t max)
+{
+  struct ph_sock_emitter *emitters;
+  uint32_t n, i;
+
+  if (max == 0) {
+    return 0;
+  }
+
+  n = collect_top(&unbound_stats, entries, 0, max);
+  emitters = ck_pr_load_ptr(&sock_emitters);
+  if (emitters) {
+    for (i = 0; i < num_sock_emitters; i++) {
+      n = collect_top(&emitters[i].stats, entries, n, max);
+    }
+  }
+
+  return n;
+}
+
+uint64_t ph_sock_get_resident_size(ph_sock_t *sock)
+{
+  uint64_t size = ph_bufq_get_resident_size(sock->rbuf) +
+    ph_bufq_get_resident_size(sock->wbuf);
+
+  if (sock->sslwbuf) {
+    size += ph_bufq_get_resident_size(sock->sslwbuf);
+  }
+  return size;
+}
+
+void ph_sock_set_write_policy(ph_sock_t *sock, uint32_t policy)
+{
+  uint32_t changed = sock->write_policy ^ policy;
+
+  if (changed & PH_SOCK_WRITE_NODELAY) {
+    int on = (policy & PH_SOCK_WRITE_NODELAY) ? 1 : 0;
+
+    // Not meaningful for every kind of socket; ignore failure
+    setsockopt(sock->job.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  sock->write_policy = policy;
+}
+
 ph_result_t ph_sock_wakeup(ph_sock_t *sock)
 {
   return ph_job_wakeup(&sock->job);
@@ -572,96 +2251,338 @@ void ph_sock_enable(ph_sock_t *sock, bool enable)
 
 static inline void calc_elapsed(struct resolve_and_connect *rac)
 {
-  struct timeval now;
+  rac->elapsed = ph_ns_to_timeval(ph_time_now_ns() - rac->start);
+}
+
+static void rac_dtor(ph_job_t *job)
+{
+  struct resolve_and_connect *rac = (struct resolve_and_connect*)job;
 
-  now = ph_time_now();
-  timersub(&now, &rac->start, &rac->elapsed);
+  if (rac->addrs) {
+    ph_mem_free(mt.connect_addrs, rac->addrs);
+  }
 }
 
-static void free_rac(struct resolve_and_connect *rac)
+// Stop waiting on an attempt, closing its socket unless it is being
+// handed over to the caller
+static void end_attempt(struct connect_attempt *a, bool close_socket)
 {
-  ph_mem_free(mt.resolve_and_connect, rac);
+  ph_socket_t s = a->job.fd;
+
+  PH_LIST_REMOVE(a, ent);
+  // This removes the fd from the emitter, so it must still be open.
+  // The free is deferred, so a remains valid for our caller
+  ph_job_free(&a->job);
+  a->job.fd = -1;
+  if (close_socket) {
+    close(s);
+  }
 }
 
-static void connected_sock(ph_socket_t s, const ph_sockaddr_t *addr,
-    int status, struct timeval *elapsed, void *arg)
+static void cancel_attempts(struct resolve_and_connect *rac)
 {
-  struct resolve_and_connect *rac = arg;
-  ph_sock_t *sock = NULL;
+  struct connect_attempt *a;
 
-  ph_unused_parameter(elapsed);
+  while ((a = PH_LIST_FIRST(&rac->attempts)) != NULL) {
+    end_attempt(a, true);
+  }
+}
 
-  if (status == 0) {
-    sock = ph_sock_new_from_socket(s, NULL, addr);
+static void rac_fail(struct resolve_and_connect *rac, int status)
+{
+  const ph_sockaddr_t *addr = NULL;
 
-    if (!sock) {
-      status = ENOMEM;
-    }
+  cancel_attempts(rac);
+  if (rac->next > 0) {
+    addr = &rac->addrs[rac->next - 1];
   }
+  calc_elapsed(rac);
+  rac->func(NULL, PH_SOCK_CONNECT_ERRNO, status, addr,
+      &rac->elapsed, rac->arg);
+  ph_job_free(&rac->job);
+}
+
+static void rac_win(struct resolve_and_connect *rac, ph_socket_t s,
+    const ph_sockaddr_t *addr)
+{
+  ph_sock_t *sock;
 
-  if (status != 0 && rac->s != -1) {
-    close(rac->s);
+  cancel_attempts(rac);
+
+  sock = ph_sock_new_from_socket(s, NULL, addr);
+  if (!sock) {
+    close(s);
+    rac_fail(rac, ENOMEM);
+    return;
   }
 
   calc_elapsed(rac);
+  rac->func(sock, PH_SOCK_CONNECT_SUCCESS, 0, addr,
+      &rac->elapsed, rac->arg);
+  ph_job_free(&rac->job);
+}
 
-  if (sock) {
-    rac->func(sock, PH_SOCK_CONNECT_SUCCESS, 0, addr,
-        &rac->elapsed, rac->arg);
-  } else {
-    rac->func(NULL, PH_SOCK_CONNECT_ERRNO, status, addr,
-        &rac->elapsed, rac->arg);
+// Start connecting to the next address.  If that doesn't finish right
+// away, the rac timer starts another after the attempt delay, so that
+// an unresponsive address only holds us up for that long (RFC 8305)
+static void launch_next(struct resolve_and_connect *rac)
+{
+  struct connect_attempt *a;
+  ph_sockaddr_t *addr;
+  ph_socket_t s;
+  uint64_t now, delay;
+
+  while (rac->next < rac->naddrs) {
+    now = ph_time_now_ns();
+    if (now >= rac->deadline) {
+      rac->last_err = ETIMEDOUT;
+      break;
+    }
+
+    addr = &rac->addrs[rac->next++];
+    s = ph_socket_for_addr(addr,
+        rac->protocol == IPPROTO_UDP ? SOCK_DGRAM : SOCK_STREAM,
+        PH_SOCK_CLOEXEC|PH_SOCK_NONBLOCK);
+    if (s == -1) {
+      rac->last_err = errno;
+      continue;
+    }
+
+    if (connect(s, &addr->sa.sa, ph_sockaddr_socklen(addr)) == 0) {
+      rac_win(rac, s, addr);
+      return;
+    }
+    if (errno != EINPROGRESS) {
+      rac->last_err = errno;
+      close(s);
+      continue;
+    }
+
+    a = (struct connect_attempt*)ph_job_alloc(&connect_attempt_template);
+    if (!a) {
+      rac->last_err = ENOMEM;
+      close(s);
+      continue;
+    }
+    a->rac = rac;
+    a->addr = *addr;
+    a->job.fd = s;
+    a->job.data = a;
+    a->job.emitter_affinity = rac->job.emitter_affinity;
+    PH_LIST_INSERT_HEAD(&rac->attempts, a, ent);
+    ph_job_set_nbio_timeout_in(&a->job, PH_IOMASK_WRITE,
+        ph_ns_to_timeval(rac->deadline - now));
+
+    if (rac->next < rac->naddrs) {
+      delay = load_sock_config()->connect_attempt_delay * PH_NSEC_PER_MSEC;
+      ph_job_set_timer_in(&rac->job,
+          ph_ns_to_timeval(MIN(delay, rac->deadline - now)));
+    }
+    return;
   }
 
-  free_rac(rac);
+  if (PH_LIST_EMPTY(&rac->attempts)) {
+    rac_fail(rac, rac->last_err);
+  }
 }
 
-static void attempt_connect(struct resolve_and_connect *rac)
+static void connect_attempt_complete(ph_job_t *j, ph_iomask_t why,
+    void *data)
 {
-  if (rac->addr.protocol == IPPROTO_UDP) {
-      rac->s = ph_socket_for_addr(&rac->addr, SOCK_DGRAM,
-          PH_SOCK_CLOEXEC|PH_SOCK_NONBLOCK);
+  struct connect_attempt *a = data;
+  struct resolve_and_connect *rac = a->rac;
+  ph_socket_t s = a->job.fd;
+  int status = 0;
+
+  ph_unused_parameter(j);
+
+  if (why == PH_IOMASK_TIME) {
+    status = ETIMEDOUT;
   } else {
-      rac->s = ph_socket_for_addr(&rac->addr, SOCK_STREAM,
-          PH_SOCK_CLOEXEC|PH_SOCK_NONBLOCK);
+    socklen_t slen = sizeof(status);
+
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, (void*)&status, &slen) < 0) {
+      status = errno;
+    }
   }
 
-  if (rac->s == -1) {
-    calc_elapsed(rac);
-    rac->func(NULL, PH_SOCK_CONNECT_ERRNO, errno, &rac->addr,
-        &rac->elapsed, rac->arg);
-    free_rac(rac);
+  if (status == 0) {
+    end_attempt(a, false);
+    rac_win(rac, s, &a->addr);
     return;
   }
 
-  ph_socket_connect(rac->s, &rac->addr, &rac->timeout,
-      connected_sock, rac);
+  rac->last_err = status;
+  end_attempt(a, true);
+  // No sense waiting for the timer to try the next address
+  launch_next(rac);
+}
+
+// Called on the emitter when the addresses are ready, and when the
+// attempt delay expires
+static void rac_dispatch(ph_job_t *j, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(j);
+  ph_unused_parameter(why);
+
+  launch_next(data);
+}
+
+static struct addrinfo *next_of_family(struct addrinfo *ai, int family)
+{
+  while (ai && ai->ai_family != family) {
+    ai = ai->ai_next;
+  }
+  return ai;
+}
+
+// Builds the list of addresses to try, alternating between IPv6 and
+// IPv4 and starting with the family that the resolver put first
+static bool set_rac_addrs(struct resolve_and_connect *rac,
+    struct addrinfo *res)
+{
+  struct addrinfo *ai, *cursor[2];
+  int family[2];
+  uint32_t n = 0, turn = 0;
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) {
+      n++;
+    }
+  }
+  if (n == 0) {
+    errno = EAFNOSUPPORT;
+    return false;
+  }
+
+  rac->addrs = ph_mem_alloc_size(mt.connect_addrs, n * sizeof(ph_sockaddr_t));
+  if (!rac->addrs) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  for (ai = res; ai->ai_family != AF_INET && ai->ai_family != AF_INET6;
+      ai = ai->ai_next) {
+    ;
+  }
+  family[0] = ai->ai_family;
+  family[1] = family[0] == AF_INET6 ? AF_INET : AF_INET6;
+  cursor[0] = cursor[1] = res;
+
+  while (rac->naddrs < n) {
+    ai = next_of_family(cursor[turn], family[turn]);
+    if (ai) {
+      ph_sockaddr_set_from_addrinfo(&rac->addrs[rac->naddrs], ai);
+      ph_sockaddr_set_port(&rac->addrs[rac->naddrs], rac->port);
+      rac->addrs[rac->naddrs].protocol = rac->protocol;
+      rac->naddrs++;
+      cursor[turn] = ai->ai_next;
+    }
+    turn ^= 1;
+  }
+
+  return true;
 }
 
 static void did_sys_resolve(ph_dns_addrinfo_t *info)
 {
   struct resolve_and_connect *rac = info->arg;
+  int status;
 
-  if (info->result == 0) {
-    ph_sockaddr_set_from_addrinfo(&rac->addr, info->ai);
-    ph_sockaddr_set_port(&rac->addr, rac->port);
-    attempt_connect(rac);
-  } else {
+  if (info->result != 0) {
     calc_elapsed(rac);
     rac->func(NULL, PH_SOCK_CONNECT_GAI_ERR, info->result,
         NULL, &rac->elapsed, rac->arg);
-    free_rac(rac);
+    ph_job_free(&rac->job);
+  } else if (!set_rac_addrs(rac, info->ai) ||
+      ph_job_wakeup(&rac->job) != PH_OK) {
+    status = errno;
+    calc_elapsed(rac);
+    rac->func(NULL, PH_SOCK_CONNECT_ERRNO, status, NULL,
+        &rac->elapsed, rac->arg);
+    ph_job_free(&rac->job);
   }
 
   ph_dns_addrinfo_free(info);
 }
 
+static struct resolve_and_connect *new_rac(struct timeval *timeout,
+    ph_sock_connect_func func, void *arg)
+{
+  struct resolve_and_connect *rac;
+  struct timeval default_timeout = { 60, 0 };
+
+  rac = (struct resolve_and_connect*)ph_job_alloc(&rac_job_template);
+  if (!rac) {
+    return NULL;
+  }
+
+  rac->func = func;
+  rac->arg = arg;
+  rac->start = ph_time_now_ns();
+  rac->timeout = timeout ? *timeout : default_timeout;
+  rac->deadline = rac->start + ph_timeval_to_ns(rac->timeout);
+  PH_LIST_INIT(&rac->attempts);
+  rac->last_err = ETIMEDOUT;
+  rac->job.data = rac;
+  rac->job.emitter_affinity = ck_pr_faa_32(&connect_affinity, 1);
+
+  return rac;
+}
+
+// Start the race on the emitter of the rac
+static void start_rac(struct resolve_and_connect *rac)
+{
+  int status;
+
+  if (ph_job_wakeup(&rac->job) != PH_OK) {
+    status = errno;
+    calc_elapsed(rac);
+    rac->func(NULL, PH_SOCK_CONNECT_ERRNO, status, NULL,
+        &rac->elapsed, rac->arg);
+    ph_job_free(&rac->job);
+  }
+}
+
+void ph_sock_connect_addrs(const ph_sockaddr_t *addrs, uint32_t naddrs,
+    struct timeval *timeout, ph_sock_connect_func func, void *arg)
+{
+  struct timeval tv = {0, 0};
+  struct resolve_and_connect *rac;
+
+  if (naddrs == 0) {
+    func(NULL, PH_SOCK_CONNECT_ERRNO, EINVAL, NULL, &tv, arg);
+    return;
+  }
+
+  rac = new_rac(timeout, func, arg);
+  if (rac) {
+    rac->addrs = ph_mem_alloc_size(mt.connect_addrs,
+        naddrs * sizeof(ph_sockaddr_t));
+  }
+  if (!rac || !rac->addrs) {
+    if (rac) {
+      ph_job_free(&rac->job);
+    }
+    func(NULL, PH_SOCK_CONNECT_ERRNO, ENOMEM, NULL, &tv, arg);
+    return;
+  }
+
+  memcpy(rac->addrs, addrs, naddrs * sizeof(ph_sockaddr_t));
+  rac->naddrs = naddrs;
+  rac->protocol = addrs[0].protocol;
+
+  start_rac(rac);
+}
+
 void ph_sock_resolve_and_connect(const char *name, uint16_t port,
     uint16_t protocol, struct timeval *timeout,
     int resolver, ph_sock_connect_func func, void *arg)
 {
   struct timeval tv = {0, 0};
   struct resolve_and_connect *rac;
+  ph_sockaddr_t addr;
+  struct addrinfo hints;
   char portstr[8];
 
   switch (resolver) {
@@ -672,44 +2593,215 @@ void ph_sock_resolve_and_connect(const char *name, uint16_t port,
       return;
   }
 
-  rac = ph_mem_alloc(mt.resolve_and_connect);
-  if (!rac) {
-    func(NULL, PH_SOCK_CONNECT_ERRNO, ENOMEM, NULL, &tv, arg);
+  if (ph_sockaddr_set_v4(&addr, name, protocol, port) == PH_OK ||
+      ph_sockaddr_set_v6(&addr, name, protocol, port) == PH_OK) {
+    // No need to resolve this address; it's a literal
+    ph_sock_connect_addrs(&addr, 1, timeout, func, arg);
     return;
   }
 
-  rac->func = func;
-  rac->arg = arg;
-  rac->start = ph_time_now();
-  rac->port = port;
-
-  if (timeout) {
-    rac->timeout = *timeout;
-  } else {
-    rac->timeout.tv_sec = 60;
-  }
-
-  if (ph_sockaddr_set_v4(&rac->addr, name, protocol, port) == PH_OK ||
-      ph_sockaddr_set_v6(&rac->addr, name, protocol, port) == PH_OK) {
-    // No need to resolve this address; it's a literal
-    attempt_connect(rac);
+  rac = new_rac(timeout, func, arg);
+  if (!rac) {
+    func(NULL, PH_SOCK_CONNECT_ERRNO, ENOMEM, NULL, &tv, arg);
     return;
   }
+  rac->port = port;
+  rac->protocol = protocol;
 
   switch (resolver) {
     case PH_SOCK_CONNECT_RESOLVE_SYSTEM:
+      // Ask for a single socket type, otherwise we'd see each address
+      // once per type
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = protocol == IPPROTO_UDP ? SOCK_DGRAM : SOCK_STREAM;
+      hints.ai_flags = AI_ADDRCONFIG;
+
       ph_snprintf(portstr, sizeof(portstr), "%d", port);
-      if (ph_dns_getaddrinfo(name, portstr, NULL,
+      if (ph_dns_getaddrinfo(name, portstr, &hints,
             did_sys_resolve, rac) == PH_OK) {
         return;
       }
       calc_elapsed(rac);
       func(NULL, PH_SOCK_CONNECT_ERRNO, errno, NULL, &rac->elapsed, arg);
-      free_rac(rac);
+      ph_job_free(&rac->job);
       break;
   }
 }
 
+// Reads the range and writes it through the sock stream, which lands it
+// in whichever write buffer is appropriate
+static ph_result_t copy_range_to_stream(ph_sock_t *sock, int fd,
+    uint64_t offset, uint64_t len)
+{
+  char buf[16384];
+  ssize_t n;
+  uint64_t wrote, max;
+  ph_bufq_t *q = sock->sslwbuf ? sock->sslwbuf : sock->wbuf;
+
+  // Don't queue part of the range and then give up
+  max = ph_bufq_get_max_size(q);
+  if (max && ph_bufq_len(q) + len > max) {
+    errno = ENOBUFS;
+    return PH_ERR;
+  }
+
+  while (len) {
+    n = pread(fd, buf, MIN(len, sizeof(buf)), offset);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return PH_ERR;
+    }
+    if (n == 0) {
+      errno = EIO;
+      return PH_ERR;
+    }
+    if (!ph_stm_write(sock->stream, buf, n, &wrote) || wrote != (uint64_t)n) {
+      errno = ph_stm_errno(sock->stream);
+      return PH_ERR;
+    }
+    offset += n;
+    len -= n;
+  }
+  return PH_OK;
+}
+
+// Appends a range to the send queue, behind everything in wbuf
+static void queue_range(ph_sock_t *sock, struct ph_sock_file_range *r)
+{
+  struct ph_sock_file_range *prior;
+  uint64_t ahead;
+
+  // Anything in wbuf that isn't already ahead of an earlier range
+  // goes out ahead of this one
+  ahead = ph_bufq_len(sock->wbuf);
+  PH_STAILQ_FOREACH(prior, &sock->file_ranges, ent) {
+    ahead -= prior->wbuf_ahead;
+  }
+  r->wbuf_ahead = ahead;
+
+  PH_STAILQ_INSERT_TAIL(&sock->file_ranges, r, ent);
+}
+
+ph_result_t ph_sock_sendfile(ph_sock_t *sock, int fd, uint64_t offset,
+    uint64_t len)
+{
+#ifdef USE_SENDFILE
+  struct ph_sock_file_range *r;
+#endif
+
+  if (len == 0) {
+    return PH_OK;
+  }
+
+#ifdef USE_SENDFILE
+  if (!sock->ssl || sock->ktls_tx) {
+    r = ph_mem_alloc(mt.file_range);
+    if (!r) {
+      errno = ENOMEM;
+      return PH_ERR;
+    }
+    r->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (r->fd == -1) {
+      ph_mem_free(mt.file_range, r);
+      return PH_ERR;
+    }
+    r->offset = offset;
+    r->len = len;
+    queue_range(sock, r);
+    return PH_OK;
+  }
+#endif
+
+  return copy_range_to_stream(sock, fd, offset, len);
+}
+
+#ifdef USE_SPLICE
+static ph_result_t make_splice_pipe(ph_sock_t *dst, struct ph_sock_splice *sp)
+{
+  struct ph_sock_file_range *r;
+
+  r = ph_mem_alloc(mt.file_range);
+  if (!r) {
+    errno = ENOMEM;
+    return PH_ERR;
+  }
+  if (ph_pipe(sp->pipe, PH_PIPE_NONBLOCK|PH_PIPE_CLOEXEC) != PH_OK) {
+    ph_mem_free(mt.file_range, r);
+    return PH_ERR;
+  }
+# ifdef F_SETPIPE_SZ
+  // Best effort; if this fails we'll simply pause sooner
+  fcntl(sp->pipe[1], F_SETPIPE_SZ, SPLICE_BUFFER_SIZE);
+# endif
+
+  r->fd = -1;
+  r->splice = sp;
+  queue_range(dst, r);
+  return PH_OK;
+}
+#endif
+
+ph_result_t ph_sock_splice(ph_sock_t *src, ph_sock_t *dst, uint64_t max_bytes)
+{
+  struct ph_sock_splice *sp;
+  uint64_t n;
+
+  if (src == dst) {
+    errno = EINVAL;
+    return PH_ERR;
+  }
+  if (src->splice_out || dst->splice_in ||
+      (dst->enabled &&
+       dst->job.emitter_affinity != src->job.emitter_affinity)) {
+    errno = EBUSY;
+    return PH_ERR;
+  }
+
+  sp = ph_mem_alloc(mt.splice);
+  if (!sp) {
+    errno = ENOMEM;
+    return PH_ERR;
+  }
+  sp->pipe[0] = -1;
+  sp->pipe[1] = -1;
+  sp->capacity = SPLICE_BUFFER_SIZE;
+  sp->remaining = max_bytes ? max_bytes : UINT64_MAX;
+
+  // Anything that we already read from src goes first
+  if (ph_bufq_len(src->rbuf)) {
+    n = 0;
+    ph_bufq_stm_write_bytes(src->rbuf, dst->stream,
+        MIN(ph_bufq_len(src->rbuf), sp->remaining), &n);
+    if (sp->remaining != UINT64_MAX) {
+      sp->remaining -= n;
+    }
+    if (sp->remaining == 0) {
+      ph_mem_free(mt.splice, sp);
+      return PH_OK;
+    }
+  }
+
+#ifdef USE_SPLICE
+  if ((!src->ssl || src->ktls_rx) && (!dst->ssl || dst->ktls_tx) &&
+      make_splice_pipe(dst, sp) != PH_OK) {
+    ph_mem_free(mt.splice, sp);
+    return PH_ERR;
+  }
+#endif
+
+  sp->src = src;
+  sp->dst = dst;
+  src->splice_out = sp;
+  dst->splice_in = sp;
+  // Both halves must be dispatched by the same emitter thread
+  dst->job.emitter_affinity = src->job.emitter_affinity;
+
+  return PH_OK;
+}
+
 ph_buf_t *ph_sock_read_bytes_exact(ph_sock_t *sock, uint64_t len)
 {
   return ph_bufq_consume_bytes(sock->rbuf, len);
@@ -726,11 +2818,49 @@ ph_buf_t *ph_sock_read_line(ph_sock_t *sock)
   return ph_bufq_consume_record(sock->rbuf, "\r\n", 2);
 }
 
+// Once the kernel encrypts for us, alerts that OpenSSL raises while it
+// reads, such as refusing renegotiation, don't reach the peer by
+// themselves.  If one can't be sent, we cut the connection rather than
+// leave the peer waiting for an answer
+static void send_ktls_alert(ph_sock_t *sock, int alert)
+{
+  unsigned char rec[2] = { (alert >> 8) & 0xff, alert & 0xff };
+
+  if (ph_openssl_ktls_send_control(sock->job.fd, SSL3_RT_ALERT,
+        rec, sizeof(rec)) == sizeof(rec)) {
+    return;
+  }
+  ph_log(PH_LOG_ERR, "fd=%d failed to send TLS alert %s: `Pe%d",
+      sock->job.fd, SSL_alert_desc_string_long(alert), errno);
+  shutdown(sock->job.fd, SHUT_RDWR);
+}
+
 static void ssl_info_callback(const SSL *ssl, int where, int ret)
 {
+  ph_sock_t *sock = SSL_get_ex_data(ssl, ssl_sock_idx);
+
+  if (sock->ssl_info_cb) {
+    sock->ssl_info_cb(ssl, where, ret);
+  }
+
+  if ((where & SSL_CB_WRITE_ALERT) == SSL_CB_WRITE_ALERT && sock->ktls_tx) {
+    send_ktls_alert(sock, ret);
+  }
+
   if (where & SSL_CB_HANDSHAKE_DONE) {
-    ph_sock_t *sock = SSL_get_ex_data(ssl, ssl_sock_idx);
-    if (sock->handshake_cb) {
+    // TLS 1.3 session tickets and renegotiation report here too
+    if (!sock->ssl_handshake_done) {
+      sock->ssl_handshake_done = true;
+      ph_counter_scope_add(sock_counters, SLOT_SSL_HANDSHAKES, 1);
+      if (SSL_session_reused((SSL*)ssl)) {
+        ph_counter_scope_add(sock_counters, SLOT_SSL_RESUMED, 1);
+      }
+    }
+    if (sock->handshake_away) {
+      // On the handshake pool; handshake_returned() calls it for us
+      sock->handshake_cb_pending = true;
+      sock->handshake_cb_res = ret;
+    } else if (sock->handshake_cb) {
       sock->handshake_cb(sock, ret);
     }
   }
@@ -739,6 +2869,7 @@ static void ssl_info_callback(const SSL *ssl, int where, int ret)
 void ph_sock_openssl_enable(ph_sock_t *sock, SSL *ssl,
     bool is_client, ph_sock_openssl_handshake_func handshake_cb)
 {
+  const struct sock_config *cfg;
   BIO *rbio, *wbio;
 
   if (sock->ssl) {
@@ -760,12 +2891,27 @@ void ph_sock_openssl_enable(ph_sock_t *sock, SSL *ssl,
   sock->ssl_stream = ph_stm_ssl_open(ssl);
   SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
-  sock->sslwbuf = ph_bufq_new(ph_config_query_int(
-        "$.socket.max_buffer_size", MAX_SOCK_BUFFER_SIZE));
+  cfg = load_sock_config();
+  sock->sslwbuf = ph_bufq_new(cfg->max_buffer_size);
+  // The application writes to sslwbuf now; wbuf is ours
+  ph_bufq_set_watermark_func(sock->wbuf, NULL, NULL);
+  set_default_watermarks(sock, sock->sslwbuf, wbuf_watermark);
   sock->handshake_cb = handshake_cb;
-  if (handshake_cb) {
-    SSL_set_info_callback(ssl, ssl_info_callback);
+  sock->ktls_pending = cfg->ktls;
+  sock->ssl_handshake_done = false;
+  sock->handshake_offload = cfg->ssl_handshake_offload;
+  sock->ssl_record_bytes = 0;
+  sock->ssl_last_write_ns = 0;
+  sock->ssl_write_retry = 0;
+  // Setting ours hides the one on the SSL_CTX, so chain to it
+  sock->ssl_info_cb = SSL_get_info_callback(ssl);
+  if (!sock->ssl_info_cb) {
+    sock->ssl_info_cb = SSL_CTX_get_info_callback(SSL_get_SSL_CTX(ssl));
   }
+  if (sock->ssl_info_cb == ssl_info_callback) {
+    sock->ssl_info_cb = NULL;
+  }
+  SSL_set_info_callback(ssl, ssl_info_callback);
 
   if (is_client) {
     SSL_set_connect_state(ssl);
@@ -774,6 +2920,12 @@ void ph_sock_openssl_enable(ph_sock_t *sock, SSL *ssl,
   }
 }
 
+void ph_sock_openssl_set_ktls(ph_sock_t *sock, bool enable)
+{
+  if (sock->ssl && SSL_in_init(sock->ssl)) {
+    sock->ktls_pending = enable;
+  }
+}
+
 /* vim:ts=2:sw=2:et:
  */
-
@@ -0,0 +1,572 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sockpool.h"
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/hashtable.h"
+#include "phenom/printf.h"
+
+#define MAX_HOST_LEN 255
+
+// Room for "host:port/ctx"
+#define MAX_KEY_LEN (MAX_HOST_LEN + 32)
+
+// Idle connections for one destination on one emitter.  Only exists
+// while there is at least one of them
+struct ph_sock_pool_dest {
+  PH_TAILQ_HEAD(ph_sock_pool_idle, ph_sock) idle;
+  uint32_t nidle;
+};
+
+// Only ever touched by the emitter that it belongs to
+struct ph_sock_pool_shard {
+  // "host:port/ctx" -> struct ph_sock_pool_dest*
+  ph_ht_t dests;
+};
+
+// A checkout that has to leave the calling thread
+struct pool_req {
+  ph_sock_pool_t *pool;
+  uint32_t affinity;
+  uint16_t port;
+  SSL_CTX *ctx;
+  ph_sock_connect_func func;
+  void *arg;
+  // The outcome of the connect, on its way to the emitter
+  ph_sock_t *sock;
+  int status, errcode;
+  bool have_addr;
+  ph_sockaddr_t addr;
+  struct timeval elapsed;
+  char host[MAX_HOST_LEN + 1];
+};
+
+static ph_memtype_def_t defs[] = {
+  { "sockpool", "pool", sizeof(ph_sock_pool_t), PH_MEM_FLAGS_ZERO },
+  { "sockpool", "shards", 0, PH_MEM_FLAGS_ZERO },
+  { "sockpool", "dest", sizeof(struct ph_sock_pool_dest), PH_MEM_FLAGS_ZERO },
+  { "sockpool", "req", sizeof(struct pool_req), PH_MEM_FLAGS_ZERO },
+  { "sockpool", "key", 0, 0 },
+};
+static struct {
+  ph_memtype_t pool, shards, dest, req, key;
+} mt;
+
+static ph_counter_scope_t *pool_counters;
+static const char *counter_names[] = {
+  "hits",             // checkouts satisfied from the idle list
+  "misses",           // checkouts that needed a new connection
+  "stale",            // idle connections that failed validation
+  "connects",         // new connections made
+  "connect_errors",   // new connections that failed
+  "checkins",         // connections returned to the pool
+  "evicted",          // connections discarded at checkin
+  "expired",          // idle connections that timed out or were closed
+};
+#define SLOT_HITS 0
+#define SLOT_MISSES 1
+#define SLOT_STALE 2
+#define SLOT_CONNECTS 3
+#define SLOT_CONNECT_ERRORS 4
+#define SLOT_CHECKINS 5
+#define SLOT_EVICTED 6
+#define SLOT_EXPIRED 7
+
+static void do_pool_init(void)
+{
+  ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.pool);
+  pool_counters = ph_counter_scope_define(NULL, "sockpool", 1);
+}
+PH_LIBRARY_INIT(do_pool_init, 0)
+
+static inline void count(ph_sock_pool_t *pool, uint8_t slot)
+{
+  ph_counter_scope_add(pool->counters, slot, 1);
+}
+
+// Whether we're running on the emitter that owns `affinity`
+static bool on_emitter(uint32_t affinity)
+{
+  return ph_thread_self()->is_emitter &&
+    ph_thread_emitter_affinity() == affinity % ph_nbio_num_emitters();
+}
+
+ph_sock_pool_t *ph_sock_pool_new(const char *name, uint32_t max_idle,
+    struct timeval *idle_timeout)
+{
+  ph_sock_pool_t *pool;
+  uint32_t i;
+
+  pool = ph_mem_alloc(mt.pool);
+  if (!pool) {
+    return NULL;
+  }
+
+  ph_snprintf(pool->name, sizeof(pool->name), "%s", name);
+  pool->max_idle = max_idle;
+  if (idle_timeout) {
+    pool->idle_timeout = *idle_timeout;
+  } else {
+    pool->idle_timeout.tv_sec = 60;
+  }
+  pool->connect_timeout.tv_sec = 60;
+  pool->io_timeout.tv_sec = 60;
+
+  pool->nshards = ph_nbio_num_emitters();
+  pool->shards = ph_mem_alloc_size(mt.shards,
+      pool->nshards * sizeof(struct ph_sock_pool_shard));
+  if (!pool->shards) {
+    goto fail;
+  }
+  for (i = 0; i < pool->nshards; i++) {
+    if (ph_ht_init(&pool->shards[i].dests, 8, &ph_ht_string_key_def,
+          &ph_ht_ptr_val_def) != PH_OK) {
+      goto fail;
+    }
+  }
+
+  pool->counters = ph_counter_scope_define(pool_counters, pool->name, 16);
+  if (!pool->counters) {
+    goto fail;
+  }
+  ph_counter_scope_register_counter_block(pool->counters,
+      sizeof(counter_names)/sizeof(counter_names[0]), 0, counter_names);
+
+  return pool;
+
+fail:
+  if (pool->shards) {
+    for (i = 0; i < pool->nshards; i++) {
+      ph_ht_destroy(&pool->shards[i].dests);
+    }
+    ph_mem_free(mt.shards, pool->shards);
+  }
+  ph_mem_free(mt.pool, pool);
+  return NULL;
+}
+
+// Runs on the emitter that owns the shard; the last one frees the pool
+static void free_shard(intptr_t code, void *arg)
+{
+  ph_sock_pool_t *pool = arg;
+  ph_ht_t *dests = &pool->shards[code].dests;
+  struct ph_sock_pool_dest **dest;
+  ph_string_t **key;
+  ph_ht_iter_t iter;
+  ph_sock_t *sock;
+  bool last;
+
+  if (ph_ht_iter_first(dests, &iter, (void*)&key, (void*)&dest)) do {
+    while ((sock = PH_TAILQ_FIRST(&(*dest)->idle)) != NULL) {
+      PH_TAILQ_REMOVE(&(*dest)->idle, sock, pool_ent);
+      sock->pool_dest = NULL;
+      ph_sock_free(sock);
+    }
+    ph_mem_free(mt.dest, *dest);
+  } while (ph_ht_iter_next(dests, &iter, (void*)&key, (void*)&dest));
+  ph_ht_destroy(dests);
+
+  ck_pr_dec_32_zero(&pool->shards_left, &last);
+  if (!last) {
+    return;
+  }
+  ph_mem_free(mt.shards, pool->shards);
+  ph_counter_scope_delref(pool->counters);
+  ph_mem_free(mt.pool, pool);
+}
+
+void ph_sock_pool_free(ph_sock_pool_t *pool)
+{
+  uint32_t i, nshards = pool->nshards;
+  bool mine = false;
+
+  pool->shards_left = nshards;
+  for (i = 0; i < nshards; i++) {
+    if (on_emitter(i)) {
+      mine = true;
+      continue;
+    }
+    if (ph_nbio_queue_affine_func(i, free_shard, i, pool) != PH_OK) {
+      ph_panic("sockpool: failed to queue shard teardown: `Pe%d", errno);
+    }
+  }
+  // Last, as it may be the one that frees the pool
+  if (mine) {
+    free_shard(ph_thread_emitter_affinity(), pool);
+  }
+}
+
+static struct ph_sock_pool_shard *shard_of(ph_sock_pool_t *pool,
+    uint32_t affinity)
+{
+  return &pool->shards[affinity % pool->nshards];
+}
+
+static void format_key(ph_string_t *key, const char *host, uint16_t port,
+    SSL_CTX *ctx)
+{
+  ph_string_printf(key, "%s:%u/%p", host, port, (void*)ctx);
+}
+
+static struct ph_sock_pool_dest *find_dest(ph_sock_pool_t *pool,
+    uint32_t affinity, const char *host, uint16_t port, SSL_CTX *ctx)
+{
+  struct ph_sock_pool_dest *dest;
+  ph_string_t *keyp;
+  PH_STRING_DECLARE_STACK(key, MAX_KEY_LEN);
+
+  format_key(&key, host, port, ctx);
+  keyp = &key;
+  if (ph_ht_lookup(&shard_of(pool, affinity)->dests, &keyp, &dest,
+        false) != PH_OK) {
+    dest = NULL;
+  }
+  ph_string_delref(&key);
+  return dest;
+}
+
+static struct ph_sock_pool_dest *make_dest(struct ph_sock_pool_shard *shard,
+    ph_string_t *key)
+{
+  struct ph_sock_pool_dest *dest;
+
+  dest = ph_mem_alloc(mt.dest);
+  if (!dest) {
+    return NULL;
+  }
+  PH_TAILQ_INIT(&dest->idle);
+  // The table takes its own reference to the key
+  if (ph_ht_set(&shard->dests, &key, &dest) != PH_OK) {
+    ph_mem_free(mt.dest, dest);
+    return NULL;
+  }
+  return dest;
+}
+
+// Returns true if this was the last idle connection to its destination,
+// which is then forgotten
+static bool unlink_idle(ph_sock_t *sock)
+{
+  struct ph_sock_pool_dest *dest = sock->pool_dest;
+
+  PH_TAILQ_REMOVE(&dest->idle, sock, pool_ent);
+  sock->pool_dest = NULL;
+  if (--dest->nidle) {
+    return false;
+  }
+  ph_ht_del(&shard_of(sock->pool, sock->job.emitter_affinity)->dests,
+      &sock->pool_key);
+  ph_mem_free(mt.dest, dest);
+  return true;
+}
+
+// An idle connection only hears from the NBIO layer if something
+// happened to it
+static void idle_dispatch(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(data);
+
+  if ((why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) || ph_bufq_len(sock->rbuf)) {
+    count(sock->pool, SLOT_EXPIRED);
+    unlink_idle(sock);
+    ph_sock_free(sock);
+  }
+}
+
+// A checked out sock whose owner hasn't set a callback yet
+static void unclaimed_dispatch(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(sock);
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+}
+
+static bool sock_is_alive(ph_sock_t *sock)
+{
+  char c;
+
+  if (ph_bufq_len(sock->rbuf)) {
+    return false;
+  }
+  // Data or EOF waiting for us means that this connection can't be
+  // reused, but we haven't yet been dispatched to notice
+  if (recv(sock->job.fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) == -1 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  return false;
+}
+
+static void prepare_for_caller(ph_sock_pool_t *pool, ph_sock_t *sock)
+{
+  ph_sock_enable(sock, false);
+  sock->callback = unclaimed_dispatch;
+  sock->job.data = NULL;
+  sock->timeout_duration = pool->io_timeout;
+}
+
+static ph_sock_t *take_idle(ph_sock_pool_t *pool,
+    struct ph_sock_pool_dest *dest)
+{
+  ph_sock_t *sock;
+  bool gone;
+
+  do {
+    sock = PH_TAILQ_FIRST(&dest->idle);
+    gone = unlink_idle(sock);
+    if (sock_is_alive(sock)) {
+      count(pool, SLOT_HITS);
+      prepare_for_caller(pool, sock);
+      return sock;
+    }
+    count(pool, SLOT_STALE);
+    ph_sock_free(sock);
+  } while (!gone);
+  return NULL;
+}
+
+static void deliver(intptr_t code, void *arg)
+{
+  struct pool_req *req = arg;
+
+  ph_unused_parameter(code);
+
+  if (req->sock) {
+    req->func(req->sock, PH_SOCK_CONNECT_SUCCESS, 0, &req->addr,
+        &req->elapsed, req->arg);
+  } else {
+    req->func(NULL, req->status, req->errcode,
+        req->have_addr ? &req->addr : NULL, &req->elapsed, req->arg);
+  }
+  ph_mem_free(mt.req, req);
+}
+
+static bool is_literal_addr(const char *host)
+{
+  struct in6_addr buf;
+
+  return inet_pton(AF_INET, host, &buf) == 1 ||
+    inet_pton(AF_INET6, host, &buf) == 1;
+}
+
+static bool enable_ssl(struct pool_req *req, ph_sock_t *sock)
+{
+  SSL *ssl = SSL_new(req->ctx);
+
+  if (!ssl) {
+    return false;
+  }
+  if (!is_literal_addr(req->host)) {
+    SSL_set_tlsext_host_name(ssl, req->host);
+  }
+  // Offer a session from an earlier connection if we have one
+  ph_openssl_client_session_resume(ssl, req->host, req->port);
+  ph_sock_openssl_enable(sock, ssl, true, NULL);
+  // The ctx belongs to whoever made the pool
+  sock->free_ssl_ctx = false;
+  return true;
+}
+
+// Remembers where a new connection goes, so that it can be checked in
+static bool set_pool_key(struct pool_req *req, ph_sock_t *sock)
+{
+  sock->pool_key = ph_string_make_empty(mt.key, MAX_KEY_LEN);
+  if (!sock->pool_key) {
+    return false;
+  }
+  format_key(sock->pool_key, req->host, req->port, req->ctx);
+  sock->pool = req->pool;
+  return true;
+}
+
+static void connected(ph_sock_t *sock, int overall_status, int errcode,
+    const ph_sockaddr_t *addr, struct timeval *elapsed, void *arg)
+{
+  struct pool_req *req = arg;
+
+  req->status = overall_status;
+  req->errcode = errcode;
+  req->elapsed = *elapsed;
+  if (addr) {
+    req->addr = *addr;
+    req->have_addr = true;
+  }
+
+  if (sock && ((req->ctx && !enable_ssl(req, sock)) ||
+        !set_pool_key(req, sock))) {
+    ph_sock_free(sock);
+    sock = NULL;
+    req->status = PH_SOCK_CONNECT_ERRNO;
+    req->errcode = ENOMEM;
+  }
+
+  if (sock) {
+    count(req->pool, SLOT_CONNECTS);
+    sock->job.emitter_affinity = req->affinity;
+    sock->timeout_duration = req->pool->io_timeout;
+    sock->callback = unclaimed_dispatch;
+    req->sock = sock;
+  } else {
+    count(req->pool, SLOT_CONNECT_ERRORS);
+  }
+
+  if (on_emitter(req->affinity)) {
+    deliver(0, req);
+    return;
+  }
+  if (ph_nbio_queue_affine_func(req->affinity, deliver, 0, req) != PH_OK) {
+    ph_panic("sockpool: failed to queue delivery: `Pe%d", errno);
+  }
+}
+
+// Runs on the emitter that the caller wants the sock on
+static void checkout_on_emitter(intptr_t code, void *arg)
+{
+  struct pool_req *req = arg;
+  struct timeval zero = { 0, 0 };
+  struct ph_sock_pool_dest *dest;
+  ph_sock_t *sock = NULL;
+
+  ph_unused_parameter(code);
+
+  dest = find_dest(req->pool, req->affinity, req->host, req->port,
+      req->ctx);
+  if (dest) {
+    sock = take_idle(req->pool, dest);
+  }
+  if (sock) {
+    req->func(sock, PH_SOCK_CONNECT_SUCCESS, 0, &sock->peername, &zero,
+        req->arg);
+    ph_mem_free(mt.req, req);
+    return;
+  }
+
+  count(req->pool, SLOT_MISSES);
+  ph_sock_resolve_and_connect(req->host, req->port, 0,
+      &req->pool->connect_timeout, PH_SOCK_CONNECT_RESOLVE_SYSTEM,
+      connected, req);
+}
+
+void ph_sock_pool_checkout(ph_sock_pool_t *pool, const char *host,
+    uint16_t port, SSL_CTX *ctx, ph_sock_connect_func func, void *arg)
+{
+  struct timeval zero = { 0, 0 };
+  struct pool_req *req;
+  uint32_t affinity;
+
+  if (strlen(host) > MAX_HOST_LEN) {
+    func(NULL, PH_SOCK_CONNECT_ERRNO, EINVAL, NULL, &zero, arg);
+    return;
+  }
+
+  if (ph_thread_self()->is_emitter) {
+    struct ph_sock_pool_dest *dest;
+    ph_sock_t *sock;
+
+    affinity = ph_thread_emitter_affinity();
+    // The common case: a pooled connection, with no allocation
+    dest = find_dest(pool, affinity, host, port, ctx);
+    if (dest && (sock = take_idle(pool, dest)) != NULL) {
+      func(sock, PH_SOCK_CONNECT_SUCCESS, 0, &sock->peername, &zero, arg);
+      return;
+    }
+  } else {
+    affinity = ck_pr_faa_32(&pool->next_affinity, 1) % pool->nshards;
+  }
+
+  req = ph_mem_alloc(mt.req);
+  if (!req) {
+    func(NULL, PH_SOCK_CONNECT_ERRNO, ENOMEM, NULL, &zero, arg);
+    return;
+  }
+  req->pool = pool;
+  req->affinity = affinity;
+  req->port = port;
+  req->ctx = ctx;
+  req->func = func;
+  req->arg = arg;
+  ph_snprintf(req->host, sizeof(req->host), "%s", host);
+
+  if (on_emitter(affinity)) {
+    checkout_on_emitter(0, req);
+    return;
+  }
+  if (ph_nbio_queue_affine_func(affinity, checkout_on_emitter,
+        0, req) != PH_OK) {
+    ph_mem_free(mt.req, req);
+    func(NULL, PH_SOCK_CONNECT_ERRNO, errno, NULL, &zero, arg);
+  }
+}
+
+static void checkin_on_emitter(intptr_t code, void *arg)
+{
+  ph_sock_t *sock = arg;
+  ph_sock_pool_t *pool = sock->pool;
+  struct ph_sock_pool_shard *shard =
+    shard_of(pool, sock->job.emitter_affinity);
+  struct ph_sock_pool_dest *dest;
+
+  ph_unused_parameter(code);
+
+  count(pool, SLOT_CHECKINS);
+  if (ph_ht_lookup(&shard->dests, &sock->pool_key, &dest,
+        false) != PH_OK) {
+    dest = NULL;
+  }
+  if ((dest ? dest->nidle : 0) >= pool->max_idle ||
+      ph_bufq_len(sock->rbuf) || sock->splice_in || sock->splice_out ||
+      !PH_STAILQ_EMPTY(&sock->file_ranges) ||
+      (!dest && (dest = make_dest(shard, sock->pool_key)) == NULL)) {
+    count(pool, SLOT_EVICTED);
+    ph_sock_free(sock);
+    return;
+  }
+
+  sock->callback = idle_dispatch;
+  sock->job.data = NULL;
+  sock->timeout_duration = pool->idle_timeout;
+  // Most recently used first, so that the least used ones expire
+  PH_TAILQ_INSERT_HEAD(&dest->idle, sock, pool_ent);
+  sock->pool_dest = dest;
+  dest->nidle++;
+
+  // Re-arm with the idle timeout
+  ph_sock_enable(sock, false);
+  ph_sock_enable(sock, true);
+}
+
+void ph_sock_pool_checkin(ph_sock_t *sock)
+{
+  if (!sock->pool) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  if (on_emitter(sock->job.emitter_affinity)) {
+    checkin_on_emitter(0, sock);
+    return;
+  }
+  if (ph_nbio_queue_affine_func(sock->job.emitter_affinity,
+        checkin_on_emitter, 0, sock) != PH_OK) {
+    ph_sock_free(sock);
+  }
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -42,21 +42,39 @@ static int bio_bufq_puts(BIO *h, const char *str)
 
 static int bio_bufq_read(BIO *h, char *buf, int size)
 {
-  ph_unused_parameter(h);
-  ph_unused_parameter(buf);
-  ph_unused_parameter(size);
-  errno = ENOSYS;
-  return -1;
+  uint64_t n;
+  ph_bufq_t *q = BIO_get_data(h);
+
+  BIO_clear_retry_flags(h);
+  if (size <= 0) {
+    return 0;
+  }
+
+  n = ph_bufq_consume_mem(q, buf, size);
+  if (n == 0) {
+    BIO_set_retry_read(h);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return (int)n;
 }
 
 static long bio_bufq_ctrl(BIO *h, int cmd, // NOLINT(runtime/int)
     long arg1, void *arg2)                 // NOLINT(runtime/int)
 {
   ph_unused_parameter(h);
-  ph_unused_parameter(cmd);
   ph_unused_parameter(arg1);
   ph_unused_parameter(arg2);
-  return 1;
+
+  switch (cmd) {
+    case BIO_CTRL_FLUSH:
+      return 1;
+    default:
+      // Claiming support for anything else misleads OpenSSL; it
+      // would take us for a kTLS socket, for example
+      return 0;
+  }
 }
 
 static int bio_bufq_new(BIO *h)
@@ -97,11 +115,11 @@ static BIO_METHOD method_bufq = {
 #else
 static BIO_METHOD *method_bufq;
 static int bio_method_init(void) {
-  if (!method_bufq) {
-    return 0;
+  if (method_bufq) {
+    return 1;
   }
-  method_bufq = BIO_meth_new(80 /* 'P' */
-			     | BIO_TYPE_SOURCE_SINK, "phenom-stream");
+  method_bufq = BIO_meth_new(81 /* 'Q' */
+			     | BIO_TYPE_SOURCE_SINK, "phenom-bufq");
   if (method_bufq == 0
       || !BIO_meth_set_write(method_bufq, bio_bufq_write)
       || !BIO_meth_set_read(method_bufq, bio_bufq_read)
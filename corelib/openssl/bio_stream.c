@@ -90,9 +90,10 @@ static long bio_stm_ctrl(BIO *h, int cmd, // NOLINT(runtime/int)
       ph_stm_flush(stm);
       return 1;
     default:
+      // See bio_bufq_ctrl()
       ph_unused_parameter(arg1);
       ph_unused_parameter(arg2);
-      return 1;
+      return 0;
   }
 }
 
@@ -137,8 +138,8 @@ static BIO_METHOD method_stm = {
 #else
 static BIO_METHOD *method_stm;
 static int bio_method_init(void) {
-  if (!method_stm) {
-    return 0;
+  if (method_stm) {
+    return 1;
   }
   method_stm = BIO_meth_new(80 /* 'P' */
 			    | BIO_TYPE_SOURCE_SINK, "phenom-stream");
@@ -0,0 +1,304 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/log.h"
+#include "phenom/openssl.h"
+#include <netinet/tcp.h>
+
+/* Hands the record layer of an established TLS session to the kernel */
+
+#if defined(HAVE_LINUX_TLS_H) && defined(TCP_ULP) && \
+  OPENSSL_VERSION_NUMBER >= 0x10101000L
+# define USE_KTLS 1
+# include <openssl/kdf.h>
+# ifndef SOL_TLS
+#  define SOL_TLS 282
+# endif
+#endif
+
+#ifdef USE_KTLS
+union ktls_crypto_info {
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 gcm128;
+  struct tls12_crypto_info_aes_gcm_256 gcm256;
+# ifdef TLS_CIPHER_CHACHA20_POLY1305
+  struct tls12_crypto_info_chacha20_poly1305 chacha;
+# endif
+};
+
+// TLS 1.2 key_block for the AEAD ciphers: there are no MAC keys, so
+// it is client key, server key, client IV, server IV
+#define MAX_KEY_BLOCK (2 * 32 + 2 * 12)
+
+// Computes the key_block of RFC 5246 section 6.3
+static bool derive_key_block(SSL *ssl, unsigned char *block, size_t len)
+{
+  unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+  unsigned char client_random[SSL3_RANDOM_SIZE];
+  unsigned char server_random[SSL3_RANDOM_SIZE];
+  static const unsigned char label[] = "key expansion";
+  const EVP_MD *md;
+  EVP_PKEY_CTX *pctx;
+  size_t mlen;
+  bool res = false;
+
+  md = SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl));
+  mlen = SSL_SESSION_get_master_key(SSL_get_session(ssl),
+      master, sizeof(master));
+  if (!md || !mlen ||
+      SSL_get_client_random(ssl, client_random, sizeof(client_random)) !=
+        sizeof(client_random) ||
+      SSL_get_server_random(ssl, server_random, sizeof(server_random)) !=
+        sizeof(server_random)) {
+    goto out;
+  }
+
+  pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, NULL);
+  if (!pctx) {
+    goto out;
+  }
+  if (EVP_PKEY_derive_init(pctx) > 0 &&
+      EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+      EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, (int)mlen) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, label,
+        sizeof(label) - 1) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random,
+        sizeof(server_random)) > 0 &&
+      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random,
+        sizeof(client_random)) > 0 &&
+      EVP_PKEY_derive(pctx, block, &len) > 0) {
+    res = true;
+  }
+  EVP_PKEY_CTX_free(pctx);
+
+out:
+  OPENSSL_cleanse(master, sizeof(master));
+  return res;
+}
+
+// The first record under the new keys, the Finished message, was
+// sequence number 0 in each direction.  We use the sequence number as
+// the explicit part of the GCM nonce, as the kernel does from here on
+# define FILL_GCM(ci, k, v, s) do { \
+    memcpy((ci).key, k, sizeof((ci).key)); \
+    memcpy((ci).salt, v, sizeof((ci).salt)); \
+    memcpy((ci).iv, s, sizeof((ci).iv)); \
+    memcpy((ci).rec_seq, s, sizeof((ci).rec_seq)); \
+  } while (0)
+
+// Fills in the kernel's view of one direction of the session
+static bool make_crypto_info(SSL *ssl, const unsigned char *block,
+    bool client, union ktls_crypto_info *ci, socklen_t *len)
+{
+  static const unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  int nid = SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl));
+  const unsigned char *key, *iv;
+  uint32_t klen, ivlen;
+
+  memset(ci, 0, sizeof(*ci));
+  ci->info.version = TLS_1_2_VERSION;
+
+  switch (nid) {
+    case NID_aes_128_gcm:
+      klen = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+      ivlen = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+      break;
+    case NID_aes_256_gcm:
+      klen = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+      ivlen = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+      break;
+# ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case NID_chacha20_poly1305:
+      klen = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+      ivlen = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+      break;
+# endif
+    default:
+      return false;
+  }
+
+  key = block + (client ? 0 : klen);
+  iv = block + 2 * klen + (client ? 0 : ivlen);
+
+  switch (nid) {
+    case NID_aes_128_gcm:
+      ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      FILL_GCM(ci->gcm128, key, iv, seq);
+      *len = sizeof(ci->gcm128);
+      return true;
+    case NID_aes_256_gcm:
+      ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+      FILL_GCM(ci->gcm256, key, iv, seq);
+      *len = sizeof(ci->gcm256);
+      return true;
+# ifdef TLS_CIPHER_CHACHA20_POLY1305
+    default:
+      // The whole nonce is derived from the IV and sequence number
+      ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      memcpy(ci->chacha.key, key, sizeof(ci->chacha.key));
+      memcpy(ci->chacha.iv, iv, sizeof(ci->chacha.iv));
+      memcpy(ci->chacha.rec_seq, seq, sizeof(ci->chacha.rec_seq));
+      *len = sizeof(ci->chacha);
+      return true;
+# else
+    default:
+      return false;
+# endif
+  }
+}
+#endif
+
+uint32_t ph_openssl_ktls_enable(SSL *ssl, ph_socket_t fd)
+{
+#ifdef USE_KTLS
+  unsigned char block[MAX_KEY_BLOCK];
+  union ktls_crypto_info tx, rx;
+  socklen_t len = 0;
+  uint32_t res = 0;
+  bool server = SSL_is_server(ssl);
+  int err = ENOTSUP;
+
+  // The sequence numbers we hand over are only known for TLS 1.2,
+  // and nothing may be left buffered inside OpenSSL
+  if (SSL_version(ssl) != TLS1_2_VERSION || SSL_in_init(ssl) ||
+      SSL_has_pending(ssl)) {
+    errno = ENOTSUP;
+    return 0;
+  }
+
+  memset(block, 0, sizeof(block));
+  if (!derive_key_block(ssl, block, sizeof(block)) ||
+      !make_crypto_info(ssl, block, !server, &tx, &len) ||
+      !make_crypto_info(ssl, block, server, &rx, &len)) {
+    goto out;
+  }
+
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == -1 ||
+      setsockopt(fd, SOL_TLS, TLS_TX, &tx, len) == -1) {
+    err = errno;
+    goto out;
+  }
+  res = PH_OPENSSL_KTLS_TX;
+
+  // Records that OpenSSL writes from now on would be encrypted a second
+  // time by the kernel.  The only ones it can still produce are alerts
+  // raised while reading, which the caller forwards with
+  // ph_openssl_ktls_send_control()
+  SSL_set0_wbio(ssl, BIO_new(BIO_s_null()));
+
+  // Kernels before 4.17 can only transmit; OpenSSL keeps reading
+  if (setsockopt(fd, SOL_TLS, TLS_RX, &rx, len) == 0) {
+    res |= PH_OPENSSL_KTLS_RX;
+  }
+
+# ifdef SSL_OP_NO_RENEGOTIATION
+  // The kernel can't switch keys under us
+  SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+# endif
+
+out:
+  OPENSSL_cleanse(block, sizeof(block));
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  if (!res) {
+    errno = err;
+  }
+  return res;
+#else
+  ph_unused_parameter(ssl);
+  ph_unused_parameter(fd);
+  errno = ENOSYS;
+  return 0;
+#endif
+}
+
+ssize_t ph_openssl_ktls_send_control(ph_socket_t fd, uint8_t type,
+    const void *buf, size_t len)
+{
+#ifdef USE_KTLS
+  char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+  struct iovec iov = { (void*)buf, len };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *CMSG_DATA(cmsg) = type;
+
+  return sendmsg(fd, &msg, 0);
+#else
+  ph_unused_parameter(fd);
+  ph_unused_parameter(type);
+  ph_unused_parameter(buf);
+  ph_unused_parameter(len);
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+ssize_t ph_openssl_ktls_recv_control(ph_socket_t fd)
+{
+#ifdef USE_KTLS
+  char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+  unsigned char alert[2];
+  struct iovec iov = { alert, sizeof(alert) };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  n = recvmsg(fd, &msg, 0);
+  if (n <= 0) {
+    return n;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+      cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+      *CMSG_DATA(cmsg) == SSL3_RT_ALERT && n == sizeof(alert) &&
+      alert[1] == SSL3_AD_CLOSE_NOTIFY) {
+    // The peer is done sending; treat it as EOF
+    return 0;
+  }
+
+  // Fatal alerts, or handshake messages that we can't act on now that
+  // OpenSSL is out of the loop
+  errno = EPROTO;
+  return -1;
+#else
+  ph_unused_parameter(fd);
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,642 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/memory.h"
+#include "phenom/log.h"
+#include "phenom/hashtable.h"
+#include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include "phenom/printf.h"
+#include "phenom/openssl.h"
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+#endif
+
+/* Session resumption: a server side session cache and ticket keys that
+ * are shared by every thread, and a client side cache of sessions for
+ * each destination */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+# define USE_SESSIONS 1
+#endif
+
+#define DEFAULT_SERVER_CACHE_SIZE 20480
+#define DEFAULT_CLIENT_CACHE_SIZE 1024
+#define DEFAULT_TICKET_KEY_LIFETIME 3600
+
+// Spread over a few locks so that emitters rarely contend
+#define SESSION_SHARDS 16
+
+// The current ticket key and the ones it replaced; a ticket can be
+// used for up to this many key lifetimes
+#define NUM_TICKET_KEYS 3
+
+#ifdef USE_SESSIONS
+struct cached_session {
+  PH_TAILQ_ENTRY(cached_session) lru;
+  ph_string_t *key;
+  SSL_SESSION *sess;
+};
+
+struct session_shard {
+  pthread_mutex_t lock;
+  // key -> struct cached_session*
+  ph_ht_t map;
+  // Most recently used at the head
+  PH_TAILQ_HEAD(session_lru, cached_session) lru;
+  uint32_t count;
+};
+
+struct session_cache {
+  struct session_shard shards[SESSION_SHARDS];
+  uint32_t max_per_shard;
+};
+
+// Server sessions are keyed by SSL_CTX and session id, client sessions
+// by SSL_CTX and destination
+static struct session_cache server_cache, client_cache;
+
+struct ticket_key {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+};
+
+static struct {
+  pthread_rwlock_t lock;
+  // keys[0] is used to issue tickets
+  struct ticket_key keys[NUM_TICKET_KEYS];
+  uint32_t nkeys;
+  uint64_t created;
+  uint64_t lifetime;
+} tickets;
+
+// Holds the client cache key of an SSL
+static int client_key_idx = -1;
+
+static ph_memtype_def_t defs[] = {
+  { "openssl", "session", sizeof(struct cached_session), PH_MEM_FLAGS_ZERO },
+  { "openssl", "session_key", 0, 0 },
+};
+static struct {
+  ph_memtype_t session, session_key;
+} mt;
+
+static ph_counter_scope_t *session_counters;
+static const char *counter_names[] = {
+  "server_hits",        // resumptions from the session cache
+  "server_misses",      // session ids we didn't have
+  "server_stores",      // sessions added to the cache
+  "evictions",          // sessions pushed out of either cache
+  "tickets_issued",     // session tickets encrypted
+  "tickets_resumed",    // tickets decrypted with a known key
+  "tickets_renewed",    // of those, tickets under an older key
+  "tickets_unknown",    // tickets whose key has been retired
+  "key_rotations",      // new ticket keys
+  "client_hits",        // sessions offered to a server
+  "client_misses",      // connections with no session to offer
+  "client_stores",      // sessions saved for a destination
+};
+#define SLOT_SERVER_HITS 0
+#define SLOT_SERVER_MISSES 1
+#define SLOT_SERVER_STORES 2
+#define SLOT_EVICTIONS 3
+#define SLOT_TICKETS_ISSUED 4
+#define SLOT_TICKETS_RESUMED 5
+#define SLOT_TICKETS_RENEWED 6
+#define SLOT_TICKETS_UNKNOWN 7
+#define SLOT_KEY_ROTATIONS 8
+#define SLOT_CLIENT_HITS 9
+#define SLOT_CLIENT_MISSES 10
+#define SLOT_CLIENT_STORES 11
+
+static inline void count(uint8_t slot)
+{
+  ph_counter_scope_add(session_counters, slot, 1);
+}
+
+static void free_client_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+    int idx, long argl, void *argp) // NOLINT(runtime/int)
+{
+  ph_unused_parameter(parent);
+  ph_unused_parameter(ad);
+  ph_unused_parameter(idx);
+  ph_unused_parameter(argl);
+  ph_unused_parameter(argp);
+
+  if (ptr) {
+    ph_string_delref(ptr);
+  }
+}
+
+static void init_cache(struct session_cache *cache)
+{
+  int i;
+
+  for (i = 0; i < SESSION_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+    ph_ht_init(&cache->shards[i].map, 8, &ph_ht_string_key_def,
+        &ph_ht_ptr_val_def);
+    PH_TAILQ_INIT(&cache->shards[i].lru);
+  }
+}
+
+static void destroy_cache(struct session_cache *cache)
+{
+  struct cached_session *ent;
+  int i;
+
+  for (i = 0; i < SESSION_SHARDS; i++) {
+    struct session_shard *shard = &cache->shards[i];
+
+    while ((ent = PH_TAILQ_FIRST(&shard->lru)) != NULL) {
+      PH_TAILQ_REMOVE(&shard->lru, ent, lru);
+      SSL_SESSION_free(ent->sess);
+      ph_string_delref(ent->key);
+      ph_mem_free(mt.session, ent);
+    }
+    ph_ht_destroy(&shard->map);
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
+
+static void do_session_init(void)
+{
+  ph_memtype_register_block(sizeof(defs)/sizeof(defs[0]), defs, &mt.session);
+
+  session_counters = ph_counter_scope_define(NULL, "ssl_session", 16);
+  ph_counter_scope_register_counter_block(session_counters,
+      sizeof(counter_names)/sizeof(counter_names[0]), 0, counter_names);
+
+  init_cache(&server_cache);
+  init_cache(&client_cache);
+  pthread_rwlock_init(&tickets.lock, NULL);
+}
+
+static void do_session_fini(void)
+{
+  destroy_cache(&server_cache);
+  destroy_cache(&client_cache);
+  OPENSSL_cleanse(tickets.keys, sizeof(tickets.keys));
+  pthread_rwlock_destroy(&tickets.lock);
+}
+PH_LIBRARY_INIT(do_session_init, do_session_fini)
+
+static void set_cache_size(struct session_cache *cache, const char *query,
+    int64_t def)
+{
+  int64_t size = ph_config_query_int(query, def);
+
+  cache->max_per_shard = (uint32_t)MAX(1, size / SESSION_SHARDS);
+}
+
+static struct session_shard *shard_for(struct session_cache *cache,
+    ph_string_t *key)
+{
+  uint64_t hash[2];
+
+  ph_hash_bytes_murmur(key->buf, key->len, 0, hash);
+  return &cache->shards[hash[0] % SESSION_SHARDS];
+}
+
+static void unlink_session(struct session_shard *shard,
+    struct cached_session *ent)
+{
+  ph_ht_del(&shard->map, &ent->key);
+  PH_TAILQ_REMOVE(&shard->lru, ent, lru);
+  shard->count--;
+  SSL_SESSION_free(ent->sess);
+  ph_string_delref(ent->key);
+  ph_mem_free(mt.session, ent);
+}
+
+// Takes over the caller's reference to sess
+static bool store_session(struct session_cache *cache, ph_string_t *key,
+    SSL_SESSION *sess)
+{
+  struct session_shard *shard = shard_for(cache, key);
+  struct cached_session *ent;
+  ph_string_t *keyp;
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (ph_ht_lookup(&shard->map, &key, &ent, false) == PH_OK) {
+    // Newer session for the same key
+    SSL_SESSION_free(ent->sess);
+    ent->sess = sess;
+    PH_TAILQ_REMOVE(&shard->lru, ent, lru);
+    PH_TAILQ_INSERT_HEAD(&shard->lru, ent, lru);
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+  }
+
+  ent = ph_mem_alloc(mt.session);
+  keyp = ph_string_make_copy(mt.session_key, key->buf, key->len, key->len);
+  if (!ent || !keyp || ph_ht_set(&shard->map, &keyp, &ent) != PH_OK) {
+    pthread_mutex_unlock(&shard->lock);
+    if (keyp) {
+      ph_string_delref(keyp);
+    }
+    if (ent) {
+      ph_mem_free(mt.session, ent);
+    }
+    return false;
+  }
+  ent->key = keyp;
+  ent->sess = sess;
+  PH_TAILQ_INSERT_HEAD(&shard->lru, ent, lru);
+
+  if (++shard->count > cache->max_per_shard) {
+    unlink_session(shard, PH_TAILQ_LAST(&shard->lru, session_lru));
+    count(SLOT_EVICTIONS);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+// Returns a new reference to the session for key, if we have one that
+// can still be resumed.  If `take` is set, it is removed from the cache
+static SSL_SESSION *find_session(struct session_cache *cache,
+    ph_string_t *key, bool take)
+{
+  struct session_shard *shard = shard_for(cache, key);
+  struct cached_session *ent;
+  SSL_SESSION *sess = NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  if (ph_ht_lookup(&shard->map, &key, &ent, false) == PH_OK) {
+    if (SSL_SESSION_is_resumable(ent->sess) &&
+        (uint64_t)SSL_SESSION_get_time(ent->sess) +
+          SSL_SESSION_get_timeout(ent->sess) > (uint64_t)time(NULL)) {
+      sess = ent->sess;
+      SSL_SESSION_up_ref(sess);
+    } else {
+      take = true;
+    }
+    if (take) {
+      unlink_session(shard, ent);
+    } else {
+      PH_TAILQ_REMOVE(&shard->lru, ent, lru);
+      PH_TAILQ_INSERT_HEAD(&shard->lru, ent, lru);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return sess;
+}
+
+static void remove_session(struct session_cache *cache, ph_string_t *key)
+{
+  struct session_shard *shard = shard_for(cache, key);
+  struct cached_session *ent;
+
+  pthread_mutex_lock(&shard->lock);
+  if (ph_ht_lookup(&shard->map, &key, &ent, false) == PH_OK) {
+    unlink_session(shard, ent);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+#define SERVER_KEY_SIZE (sizeof(SSL_CTX*) + SSL_MAX_SSL_SESSION_ID_LENGTH)
+
+static void make_server_key(ph_string_t *key, SSL_CTX *ctx,
+    const unsigned char *id, unsigned int len)
+{
+  ph_string_append_buf(key, (const char*)&ctx, sizeof(ctx));
+  ph_string_append_buf(key, (const char*)id,
+      MIN(len, SSL_MAX_SSL_SESSION_ID_LENGTH));
+}
+
+static int server_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+  PH_STRING_DECLARE_STACK(key, SERVER_KEY_SIZE);
+  const unsigned char *id;
+  unsigned int len;
+
+  // TLS 1.3 tickets carry the whole session; there's nothing to look
+  // up when they come back
+  if (SSL_version(ssl) == TLS1_3_VERSION &&
+      !(SSL_get_options(ssl) & SSL_OP_NO_TICKET)) {
+    return 0;
+  }
+
+  id = SSL_SESSION_get_id(sess, &len);
+  make_server_key(&key, SSL_get_SSL_CTX(ssl), id, len);
+  if (!store_session(&server_cache, &key, sess)) {
+    // OpenSSL keeps its reference
+    return 0;
+  }
+  count(SLOT_SERVER_STORES);
+  return 1;
+}
+
+static SSL_SESSION *server_get_session(SSL *ssl, const unsigned char *id,
+    int len, int *copy)
+{
+  PH_STRING_DECLARE_STACK(key, SERVER_KEY_SIZE);
+  SSL_SESSION *sess;
+
+  make_server_key(&key, SSL_get_SSL_CTX(ssl), id, (unsigned int)len);
+  sess = find_session(&server_cache, &key, false);
+  count(sess ? SLOT_SERVER_HITS : SLOT_SERVER_MISSES);
+
+  // We already took a reference for the caller
+  *copy = 0;
+  return sess;
+}
+
+static void server_remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+  PH_STRING_DECLARE_STACK(key, SERVER_KEY_SIZE);
+  const unsigned char *id;
+  unsigned int len;
+
+  id = SSL_SESSION_get_id(sess, &len);
+  make_server_key(&key, ctx, id, len);
+  remove_session(&server_cache, &key);
+}
+
+static bool new_ticket_key(struct ticket_key *key)
+{
+  return RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+    RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1 &&
+    RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1;
+}
+
+// Call with the write lock held
+static void rotate_ticket_keys(void)
+{
+  struct ticket_key key;
+
+  if (!new_ticket_key(&key)) {
+    ph_log(PH_LOG_ERR, "failed to make a session ticket key");
+    return;
+  }
+  memmove(&tickets.keys[1], &tickets.keys[0],
+      sizeof(tickets.keys[0]) * (NUM_TICKET_KEYS - 1));
+  tickets.keys[0] = key;
+  OPENSSL_cleanse(&key, sizeof(key));
+  tickets.nkeys = MIN(tickets.nkeys + 1, NUM_TICKET_KEYS);
+  tickets.created = ph_time_now_ns();
+  count(SLOT_KEY_ROTATIONS);
+}
+
+// Returns with the read lock held and, unless nkeys is 0, keys[0] fit
+// to issue tickets
+static void lock_ticket_keys(void)
+{
+  pthread_rwlock_rdlock(&tickets.lock);
+  if (tickets.nkeys &&
+      ph_time_now_ns() - tickets.created < tickets.lifetime) {
+    return;
+  }
+  pthread_rwlock_unlock(&tickets.lock);
+
+  pthread_rwlock_wrlock(&tickets.lock);
+  // Someone else may have beaten us to it
+  if (!tickets.nkeys ||
+      ph_time_now_ns() - tickets.created >= tickets.lifetime) {
+    rotate_ticket_keys();
+  }
+  pthread_rwlock_unlock(&tickets.lock);
+  pthread_rwlock_rdlock(&tickets.lock);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_hmac_t;
+
+static bool set_hmac_key(ticket_hmac_t *hctx, struct ticket_key *key)
+{
+  OSSL_PARAM params[3];
+
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+      key->hmac_key, sizeof(key->hmac_key));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+      (char*)"SHA256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+  return EVP_MAC_CTX_set_params(hctx, params) == 1;
+}
+#else
+typedef HMAC_CTX ticket_hmac_t;
+
+static bool set_hmac_key(ticket_hmac_t *hctx, struct ticket_key *key)
+{
+  return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+      EVP_sha256(), NULL) == 1;
+}
+#endif
+
+// Returns 1 if the ticket was handled with the current key, 2 if
+// it should be replaced by a new one, 0 if the key is unknown (or,
+// when issuing, if we have yet to make one) and -1 on error
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, ticket_hmac_t *hctx, int enc)
+{
+  struct ticket_key *key = NULL;
+  int res = -1;
+  uint32_t i;
+
+  lock_ticket_keys();
+
+  if (enc) {
+    if (!tickets.nkeys) {
+      // The first rotation failed; issue no ticket rather than one
+      // protected by an all-zero key
+      res = 0;
+      goto out;
+    }
+    key = &tickets.keys[0];
+    memcpy(name, key->name, sizeof(key->name));
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1 &&
+        EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+          key->aes_key, iv) == 1 &&
+        set_hmac_key(hctx, key)) {
+      count(SLOT_TICKETS_ISSUED);
+      res = 1;
+    }
+    goto out;
+  }
+
+  for (i = 0; i < tickets.nkeys; i++) {
+    if (!memcmp(name, tickets.keys[i].name, sizeof(tickets.keys[i].name))) {
+      key = &tickets.keys[i];
+      break;
+    }
+  }
+  if (!key) {
+    count(SLOT_TICKETS_UNKNOWN);
+    res = 0;
+    goto out;
+  }
+  if (set_hmac_key(hctx, key) &&
+      EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+        key->aes_key, iv) == 1) {
+    count(SLOT_TICKETS_RESUMED);
+    if (i > 0) {
+      count(SLOT_TICKETS_RENEWED);
+      res = 2;
+    } else if (SSL_version(ssl) == TLS1_3_VERSION) {
+      // Clients only use a TLS 1.3 ticket once; without a renewal the
+      // next connection would need a full handshake
+      res = 2;
+    } else {
+      res = 1;
+    }
+  }
+
+out:
+  pthread_rwlock_unlock(&tickets.lock);
+  return res;
+}
+
+static void make_client_key(ph_string_t *key, SSL_CTX *ctx,
+    const char *host, uint16_t port)
+{
+  ph_string_printf(key, "%s:%u/%p", host, port, (void*)ctx);
+}
+
+static int client_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+  ph_string_t *key = SSL_get_ex_data(ssl, client_key_idx);
+
+  if (!key || !store_session(&client_cache, key, sess)) {
+    return 0;
+  }
+  count(SLOT_CLIENT_STORES);
+  return 1;
+}
+#endif
+
+ph_result_t ph_openssl_server_session_cache_enable(SSL_CTX *ctx)
+{
+#ifdef USE_SESSIONS
+  set_cache_size(&server_cache, "$.openssl.session_cache_size",
+      DEFAULT_SERVER_CACHE_SIZE);
+
+  pthread_rwlock_wrlock(&tickets.lock);
+  tickets.lifetime = ph_config_query_int("$.openssl.ticket_key_lifetime",
+      DEFAULT_TICKET_KEY_LIFETIME) * 1000000000ULL;
+  pthread_rwlock_unlock(&tickets.lock);
+
+  SSL_CTX_set_session_cache_mode(ctx,
+      SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, server_new_session);
+  SSL_CTX_sess_set_get_cb(ctx, server_get_session);
+  SSL_CTX_sess_set_remove_cb(ctx, server_remove_session);
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb) != 1) {
+# else
+  if (SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb) != 1) {
+# endif
+    errno = EINVAL;
+    return PH_ERR;
+  }
+  return PH_OK;
+#else
+  ph_unused_parameter(ctx);
+  errno = ENOSYS;
+  return PH_ERR;
+#endif
+}
+
+void ph_openssl_rotate_ticket_keys(void)
+{
+#ifdef USE_SESSIONS
+  pthread_rwlock_wrlock(&tickets.lock);
+  rotate_ticket_keys();
+  pthread_rwlock_unlock(&tickets.lock);
+#endif
+}
+
+ph_result_t ph_openssl_client_session_cache_enable(SSL_CTX *ctx)
+{
+#ifdef USE_SESSIONS
+  set_cache_size(&client_cache, "$.openssl.client_session_cache_size",
+      DEFAULT_CLIENT_CACHE_SIZE);
+
+  // Racing callers compute the same index
+  if (ck_pr_load_int(&client_key_idx) == -1) {
+    int idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_client_key);
+
+    if (idx == -1) {
+      errno = ENOMEM;
+      return PH_ERR;
+    }
+    if (!ck_pr_cas_int(&client_key_idx, -1, idx)) {
+      // Lost the race; the index we made goes unused
+    }
+  }
+
+  SSL_CTX_set_session_cache_mode(ctx,
+      SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, client_new_session);
+  return PH_OK;
+#else
+  ph_unused_parameter(ctx);
+  errno = ENOSYS;
+  return PH_ERR;
+#endif
+}
+
+bool ph_openssl_client_session_resume(SSL *ssl, const char *host,
+    uint16_t port)
+{
+#ifdef USE_SESSIONS
+  SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+  PH_STRING_DECLARE_STACK(key, 300);
+  ph_string_t *keyp;
+  SSL_SESSION *sess;
+
+  if (SSL_CTX_sess_get_new_cb(ctx) != client_new_session) {
+    // Not a context that we're caching for
+    return false;
+  }
+
+  make_client_key(&key, ctx, host, port);
+  keyp = ph_string_make_copy(mt.session_key, key.buf, key.len, key.len);
+  if (keyp && !SSL_set_ex_data(ssl, client_key_idx, keyp)) {
+    ph_string_delref(keyp);
+  }
+
+  // TLS 1.3 tickets are meant to be used once; the server will send
+  // us fresh ones
+  sess = find_session(&client_cache, &key, false);
+  if (sess && SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION) {
+    remove_session(&client_cache, &key);
+  }
+  ph_string_delref(&key);
+
+  if (!sess) {
+    count(SLOT_CLIENT_MISSES);
+    return false;
+  }
+  SSL_set_session(ssl, sess);
+  SSL_SESSION_free(sess);
+  count(SLOT_CLIENT_HITS);
+  return true;
+#else
+  ph_unused_parameter(ssl);
+  ph_unused_parameter(host);
+  ph_unused_parameter(port);
+  return false;
+#endif
+}
+
+/* vim:ts=2:sw=2:et:
+ */
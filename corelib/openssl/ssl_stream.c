@@ -64,6 +64,11 @@ static bool do_ssl_read_or_write(ph_stream_t *stm, bool is_reading,
 
     if (res > 0) {
       total_read += res;
+      if ((size_t)res < iov[i].iov_len) {
+        // A read returns at most one record; moving on to the next
+        // iov would leave a hole in this one
+        break;
+      }
       continue;
     }
     err = SSL_get_error(s, res);
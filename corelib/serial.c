@@ -145,7 +145,8 @@ dispatch_again:
 static struct ph_job_def serial_job_template = {
   serial_dispatch,
   PH_MEMTYPE_INVALID,
-  serial_job_cleanup
+  serial_job_cleanup,
+  NULL
 };
 
 static void do_serial_init(void)
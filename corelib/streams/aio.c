@@ -0,0 +1,459 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "phenom/sysutil.h"
+#include "phenom/stream.h"
+#include "phenom/buffer.h"
+#include "phenom/job.h"
+#include "phenom/memory.h"
+#include "phenom/log.h"
+#include <sys/stat.h>
+
+/* Async file streams.
+ *
+ * At most one operation is in flight per stream.  While it is in flight
+ * the worker thread owns the read and write queues; the stream functions
+ * only touch them when the state is AIO_IDLE.  The worker flips the state
+ * back to AIO_IDLE and wakes the notify job when it is done.
+ */
+
+#define AIO_IDLE    0
+#define AIO_BUSY    1
+// closed while busy; the worker releases the state when it finishes
+#define AIO_ORPHAN  2
+
+#define AIO_OP_READ  1
+#define AIO_OP_WRITE 2
+
+struct ph_stm_aio {
+  // dispatched in the fileio pool to perform the IO
+  ph_job_t job;
+  int state;
+  int op;
+  int fd;
+  // file offset of the next pread/pwrite.  The logical stream position
+  // is this less any bytes held in the read-ahead queue
+  uint64_t off;
+  // how much we want in rbuf at the end of a read op
+  uint64_t want;
+  uint32_t readahead;
+  bool eof;
+  // errno from the last async op, reported on the next call
+  int err;
+  ph_bufq_t *rbuf, *wbuf;
+  ph_job_t *notify;
+  // positional stream over fd, used by the worker to fill and
+  // drain the queues
+  ph_stream_t *pstm;
+};
+
+static ph_memtype_t mt_aio;
+static ph_memtype_def_t aio_def = {
+  "stream", "aio", sizeof(struct ph_stm_aio), PH_MEM_FLAGS_ZERO
+};
+static ph_thread_pool_t *fileio_pool = NULL;
+
+static bool pos_close(ph_stream_t *stm)
+{
+  ph_unused_parameter(stm);
+  return true;
+}
+
+static bool pos_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nread)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+  ssize_t r;
+
+#ifdef HAVE_PREADV
+  r = preadv(aio->fd, iov, iovcnt, aio->off);
+#else
+  ph_unused_parameter(iovcnt);
+  r = pread(aio->fd, iov[0].iov_base, iov[0].iov_len, aio->off);
+#endif
+  if (r == -1) {
+    stm->last_err = errno;
+    return false;
+  }
+
+  aio->off += r;
+  if (nread) {
+    *nread = r;
+  }
+  return true;
+}
+
+static bool pos_writev(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nwrote)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+  ssize_t w;
+
+#ifdef HAVE_PWRITEV
+  w = pwritev(aio->fd, iov, iovcnt, aio->off);
+#else
+  ph_unused_parameter(iovcnt);
+  w = pwrite(aio->fd, iov[0].iov_base, iov[0].iov_len, aio->off);
+#endif
+  if (w == -1) {
+    stm->last_err = errno;
+    return false;
+  }
+
+  aio->off += w;
+  if (nwrote) {
+    *nwrote = w;
+  }
+  return true;
+}
+
+static bool pos_seek(ph_stream_t *stm, int64_t delta,
+    int whence, uint64_t *newpos)
+{
+  ph_unused_parameter(delta);
+  ph_unused_parameter(whence);
+  ph_unused_parameter(newpos);
+  stm->last_err = ESPIPE;
+  return false;
+}
+
+static struct ph_stream_funcs pos_funcs = {
+  pos_close,
+  pos_readv,
+  pos_writev,
+  pos_seek
+};
+
+static void free_aio(struct ph_stm_aio *aio)
+{
+  close(aio->fd);
+  ph_bufq_free(aio->rbuf);
+  ph_bufq_free(aio->wbuf);
+  ph_stm_destroy(aio->pstm);
+  ph_mem_free(mt_aio, aio);
+}
+
+static void do_read(struct ph_stm_aio *aio)
+{
+  uint64_t nread;
+
+  while (ph_bufq_len(aio->rbuf) < aio->want) {
+    if (!ph_bufq_stm_read(aio->rbuf, aio->pstm, &nread)) {
+      aio->err = ph_stm_errno(aio->pstm);
+      return;
+    }
+    if (nread == 0) {
+      aio->eof = true;
+      return;
+    }
+  }
+}
+
+static void do_write(struct ph_stm_aio *aio)
+{
+  uint64_t nwrote;
+
+  while (ph_bufq_len(aio->wbuf) > 0) {
+    if (!ph_bufq_stm_write(aio->wbuf, aio->pstm, &nwrote)) {
+      aio->err = ph_stm_errno(aio->pstm);
+      return;
+    }
+  }
+}
+
+// Runs in the fileio pool
+static void aio_run(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  struct ph_stm_aio *aio = data;
+  ph_job_t *notify;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(why);
+
+  if (aio->op == AIO_OP_READ) {
+    do_read(aio);
+  } else {
+    do_write(aio);
+  }
+
+  notify = aio->notify;
+  ck_pr_fence_store();
+  if (!ck_pr_cas_int(&aio->state, AIO_BUSY, AIO_IDLE)) {
+    // The stream was closed while we were working
+    free_aio(aio);
+    return;
+  }
+
+  if (notify) {
+    ph_job_wakeup(notify);
+  }
+}
+
+static void start_op(struct ph_stm_aio *aio, int op)
+{
+  aio->op = op;
+  ck_pr_fence_store();
+  ck_pr_store_int(&aio->state, AIO_BUSY);
+  ph_job_set_pool(&aio->job, fileio_pool);
+}
+
+// Returns false and sets up the error state if we can't
+// service a call right now
+static bool check_idle(ph_stream_t *stm, struct ph_stm_aio *aio,
+    ph_iomask_t mask)
+{
+  if (ck_pr_load_int(&aio->state) != AIO_IDLE) {
+    stm->last_err = EAGAIN;
+    stm->need_mask |= mask;
+    return false;
+  }
+  ck_pr_fence_load();
+
+  if (aio->err) {
+    stm->last_err = aio->err;
+    aio->err = 0;
+    return false;
+  }
+  return true;
+}
+
+// Move the kernel offset back to the logical position, discarding
+// any read-ahead
+static void discard_readahead(struct ph_stm_aio *aio)
+{
+  aio->off -= ph_bufq_discard(aio->rbuf, ph_bufq_len(aio->rbuf));
+  aio->eof = false;
+}
+
+static bool aio_close(ph_stream_t *stm)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+
+  for (;;) {
+    if (ck_pr_cas_int(&aio->state, AIO_IDLE, AIO_ORPHAN)) {
+      free_aio(aio);
+      return true;
+    }
+    if (ck_pr_cas_int(&aio->state, AIO_BUSY, AIO_ORPHAN)) {
+      // The worker will release it
+      return true;
+    }
+  }
+}
+
+static bool aio_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nread)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+  uint64_t want = 0, done;
+  int i;
+
+  if (!check_idle(stm, aio, PH_IOMASK_READ)) {
+    return false;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    want += iov[i].iov_len;
+  }
+
+  if (ph_bufq_len(aio->rbuf) == 0) {
+    if (aio->eof || want == 0) {
+      if (nread) {
+        *nread = 0;
+      }
+      return true;
+    }
+    aio->want = MAX(want, aio->readahead);
+    start_op(aio, AIO_OP_READ);
+
+    // Come back when the read completes
+    stm->last_err = EAGAIN;
+    stm->need_mask |= PH_IOMASK_READ;
+    return false;
+  }
+
+  done = ph_bufq_consume_iov(aio->rbuf, iov, iovcnt);
+  if (nread) {
+    *nread = done;
+  }
+  return true;
+}
+
+static bool aio_writev(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nwrote)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+  uint64_t total = 0;
+  int i;
+
+  if (!check_idle(stm, aio, PH_IOMASK_WRITE)) {
+    return false;
+  }
+
+  discard_readahead(aio);
+
+  for (i = 0; i < iovcnt; i++) {
+    if (ph_bufq_append(aio->wbuf, iov[i].iov_base,
+          iov[i].iov_len, NULL) != PH_OK) {
+      break;
+    }
+    total += iov[i].iov_len;
+  }
+
+  if (total == 0 && iovcnt > 0) {
+    stm->last_err = ENOMEM;
+    return false;
+  }
+
+  // The data is ours now; the write completes behind the caller
+  start_op(aio, AIO_OP_WRITE);
+
+  if (nwrote) {
+    *nwrote = total;
+  }
+  return true;
+}
+
+static bool aio_seek(ph_stream_t *stm, int64_t delta,
+    int whence, uint64_t *newpos)
+{
+  struct ph_stm_aio *aio = stm->cookie;
+  struct stat st;
+  int64_t pos;
+
+  if (!check_idle(stm, aio, PH_IOMASK_READ)) {
+    return false;
+  }
+
+  discard_readahead(aio);
+
+  switch (whence) {
+    case SEEK_SET:
+      pos = delta;
+      break;
+    case SEEK_CUR:
+      pos = aio->off + delta;
+      break;
+    case SEEK_END:
+      if (fstat(aio->fd, &st)) {
+        stm->last_err = errno;
+        return false;
+      }
+      pos = st.st_size + delta;
+      break;
+    default:
+      stm->last_err = EINVAL;
+      return false;
+  }
+
+  if (pos < 0) {
+    stm->last_err = EINVAL;
+    return false;
+  }
+
+  aio->off = pos;
+  if (newpos) {
+    *newpos = pos;
+  }
+  return true;
+}
+
+struct ph_stream_funcs ph_stm_funcs_aio = {
+  aio_close,
+  aio_readv,
+  aio_writev,
+  aio_seek
+};
+
+ph_stream_t *ph_stm_fd_open_async(int fd, ph_job_t *notify,
+    uint32_t readahead)
+{
+  struct ph_stm_aio *aio;
+  ph_stream_t *stm;
+
+  aio = ph_mem_alloc(mt_aio);
+  if (!aio) {
+    return NULL;
+  }
+
+  ph_job_init(&aio->job);
+  aio->job.callback = aio_run;
+  aio->job.data = aio;
+  aio->fd = fd;
+  aio->notify = notify;
+  aio->readahead = readahead;
+
+  aio->rbuf = ph_bufq_new(0);
+  aio->wbuf = ph_bufq_new(0);
+  aio->pstm = ph_stm_make(&pos_funcs, aio, 0, 0);
+  stm = ph_stm_make(&ph_stm_funcs_aio, aio, 0, 0);
+
+  if (!aio->rbuf || !aio->wbuf || !aio->pstm || !stm) {
+    if (aio->rbuf) {
+      ph_bufq_free(aio->rbuf);
+    }
+    if (aio->wbuf) {
+      ph_bufq_free(aio->wbuf);
+    }
+    if (aio->pstm) {
+      ph_stm_destroy(aio->pstm);
+    }
+    if (stm) {
+      ph_stm_destroy(stm);
+    }
+    ph_mem_free(mt_aio, aio);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return stm;
+}
+
+ph_stream_t *ph_stm_file_open_async(const char *filename, int oflags,
+    int mode, ph_job_t *notify, uint32_t readahead)
+{
+  int fd;
+  ph_stream_t *stm;
+
+#ifdef O_LARGEFILE
+  oflags |= O_LARGEFILE;
+#endif
+
+  fd = open(filename, oflags, mode);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  stm = ph_stm_fd_open_async(fd, notify, readahead);
+  if (!stm) {
+    close(fd);
+    errno = ENOMEM;
+  }
+
+  return stm;
+}
+
+static void aio_init(void)
+{
+  mt_aio = ph_memtype_register(&aio_def);
+  if (mt_aio == PH_MEMTYPE_INVALID) {
+    ph_panic("aio_init: unable to register memory types");
+  }
+  fileio_pool = ph_thread_pool_define("fileio", 256, 2);
+}
+PH_LIBRARY_INIT(aio_init, 0)
+
+/* vim:ts=2:sw=2:et:
+ */
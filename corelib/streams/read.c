@@ -170,6 +170,54 @@ bool ph_stm_read(ph_stream_t *stm, void *buf, uint64_t count, uint64_t *nread)
   return true;
 }
 
+bool ph_stm_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nread)
+{
+  bool res = true;
+  uint64_t total = 0, n;
+  int i;
+
+  if (stm->bufsize) {
+    // Go through ph_stm_read() so that anything already sitting in
+    // the stream buffer is returned first
+    for (i = 0; i < iovcnt; i++) {
+      n = 0;
+      res = ph_stm_read(stm, iov[i].iov_base, iov[i].iov_len, &n);
+      if (!res) {
+        break;
+      }
+      total += n;
+      if (n < iov[i].iov_len) {
+        break;
+      }
+    }
+
+    if (total) {
+      res = true;
+    }
+    if (res && nread) {
+      *nread = total;
+    }
+    return res;
+  }
+
+  // Flush any pending writes
+  if (!ph_stm_flush(stm)) {
+    return false;
+  }
+
+  // If unbuffered, pass it through
+  ph_stm_lock(stm);
+  stm->last_err = 0;
+  res = stm->funcs->readv(stm, iov, iovcnt, nread);
+  if (!res) {
+    errno = ph_stm_errno(stm);
+  }
+  ph_stm_unlock(stm);
+
+  return res;
+}
+
 /* vim:ts=2:sw=2:et:
  */
 
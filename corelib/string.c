@@ -15,13 +15,14 @@
  */
 #include "phenom/defs.h"
 #include "phenom/string.h"
+#include "phenom/arena.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
 #include <ctype.h>
 
 static ph_memtype_t mt_string = PH_MEMTYPE_INVALID;
 static ph_memtype_def_t string_def = {
-  "string", "string", sizeof(ph_string_t), 0
+  "string", "string", sizeof(ph_string_t), PH_MEM_FLAGS_ARENA
 };
 
 static void do_string_init(void)
@@ -38,6 +39,7 @@ void ph_string_init_slice(ph_string_t *str,
   str->slice = slice;
   str->mt = PH_MEMTYPE_INVALID;
   str->onstack = true;
+  str->arena = NULL;
   str->buf = slice->buf + start;
   str->len = len;
   str->alloc = len;
@@ -74,6 +76,7 @@ void ph_string_init_claim(ph_string_t *str,
   str->slice = 0;
   str->mt = mt;
   str->onstack = true;
+  str->arena = NULL;
 }
 
 ph_string_t *ph_string_make_claim(ph_memtype_t mt,
@@ -93,6 +96,7 @@ ph_string_t *ph_string_make_claim(ph_memtype_t mt,
   str->slice = 0;
   str->mt = mt;
   str->onstack = false;
+  str->arena = NULL;
 
   return str;
 }
@@ -100,9 +104,24 @@ ph_string_t *ph_string_make_claim(ph_memtype_t mt,
 ph_string_t *ph_string_make_empty(ph_memtype_t mt,
     uint32_t size)
 {
-  char *buf = ph_mem_alloc_size(mt, size);
+  ph_arena_t *arena = ph_arena_for_memtype(mt);
+  char *buf;
   ph_string_t *str;
 
+  if (arena) {
+    // The buffer goes in the arena, and stays there as it grows
+    buf = ph_arena_alloc(arena, size);
+    if (!buf) {
+      return NULL;
+    }
+    str = ph_string_make_claim(PH_STRING_GROW_MT(mt), buf, 0, size);
+    if (str) {
+      str->arena = arena;
+    }
+    return str;
+  }
+
+  buf = ph_mem_alloc_size(mt, size);
   if (!buf) {
     return NULL;
   }
@@ -162,8 +181,11 @@ ph_result_t ph_string_append_buf(ph_string_t *str,
       char *nbuf;
 
       // Negative memtypes encode the desired memtype as the negative
-      // value.  Allocate a buffer from scratch using the desired memtype
-      if (str->mt < 0) {
+      // value.  Allocate a buffer from scratch using the desired memtype,
+      // or from the arena that the string was made in
+      if (str->arena) {
+        nbuf = ph_arena_alloc(str->arena, nsize);
+      } else if (str->mt < 0) {
         nbuf = ph_mem_alloc_size(-str->mt, nsize);
       } else {
         nbuf = ph_mem_realloc(str->mt, str->buf, nsize);
@@ -174,8 +196,10 @@ ph_result_t ph_string_append_buf(ph_string_t *str,
       }
 
       if (str->mt < 0) {
-        // Promote from static growable to heap allocated growable
         memcpy(nbuf, str->buf, str->len);
+      }
+      if (str->mt < 0 && !str->arena) {
+        // Promote from static growable to heap allocated growable
         str->mt = -str->mt;
       }
 
@@ -139,6 +139,7 @@ static ph_thread_t *ph_thread_init_myself(bool booting)
 
   PH_STAILQ_INIT(&me->pending_nbio);
   PH_STAILQ_INIT(&me->pending_pool);
+  PH_STAILQ_INIT(&me->pending_batch);
 
   me->tid = ck_pr_faa_32(&next_tid, 1);
   me->thr = pthread_self();
@@ -15,21 +15,16 @@
  */
 
 #include "phenom/timerwheel.h"
+#include "phenom/sysutil.h"
 
-static inline void tval_add_res(ph_timerwheel_t *wheel,
-    struct timeval *op1, struct timeval *res)
+static inline uint64_t tick_ns(ph_timerwheel_t *wheel)
 {
-  struct timeval diff;
-
-  diff.tv_sec = wheel->tick_resolution / 1000;
-  diff.tv_usec = (wheel->tick_resolution - (diff.tv_sec * 1000)) * 1000;
-
-  timeradd(&diff, op1, res);
+  return wheel->tick_resolution * PH_NSEC_PER_MSEC;
 }
 
 ph_result_t ph_timerwheel_init(
     ph_timerwheel_t *wheel,
-    struct timeval now,
+    uint64_t now,
     uint32_t tick_resolution)
 {
   int i;
@@ -37,7 +32,7 @@ ph_result_t ph_timerwheel_init(
   ck_rwlock_init(&wheel->lock);
   wheel->tick_resolution = tick_resolution;
 
-  tval_add_res(wheel, &now, &wheel->next_run);
+  wheel->next_run = now + tick_ns(wheel);
 
   for (i = 0; i < PHENOM_WHEEL_SIZE; i++) {
     PH_LIST_INIT(&wheel->buckets[0].lists[i]);
@@ -49,10 +44,9 @@ ph_result_t ph_timerwheel_init(
   return PH_OK;
 }
 
-static inline uint64_t tval_to_tick(ph_timerwheel_t *wheel, struct timeval tv)
+static inline uint64_t ns_to_tick(ph_timerwheel_t *wheel, uint64_t ns)
 {
-  return (tv.tv_sec * 1000 / wheel->tick_resolution) +
-         (tv.tv_usec / (wheel->tick_resolution * 1000));
+  return ns / tick_ns(wheel);
 }
 
 static inline struct ph_timerwheel_list *compute_list(
@@ -63,12 +57,12 @@ static inline struct ph_timerwheel_list *compute_list(
   uint64_t due, now, diff;
 
   // Ensure that we never schedule in the past
-  if (timercmp(&timer->due, &wheel->next_run, <)) {
-    memcpy(&timer->due, &wheel->next_run, sizeof(timer->due));
+  if (timer->due < wheel->next_run) {
+    timer->due = wheel->next_run;
   }
 
-  now = tval_to_tick(wheel, wheel->next_run);
-  due = tval_to_tick(wheel, timer->due);
+  now = ns_to_tick(wheel, wheel->next_run);
+  due = ns_to_tick(wheel, timer->due);
   diff = due - now;
 
   if (diff < PHENOM_WHEEL_SIZE) {
@@ -194,7 +188,7 @@ static bool cascade_timer(ph_timerwheel_t *wheel,
 
 uint32_t ph_timerwheel_tick(
     ph_timerwheel_t *wheel,
-    struct timeval now,
+    uint64_t now,
     ph_timerwheel_should_dispatch_func_t should_dispatch,
     ph_timerwheel_dispatch_func_t dispatch,
     void *arg)
@@ -205,8 +199,8 @@ uint32_t ph_timerwheel_tick(
   uint64_t tick, nowtick;
   uint32_t ticked = 0;
 
-  tick = tval_to_tick(wheel, now);
-  nowtick = tval_to_tick(wheel, wheel->next_run);
+  tick = ns_to_tick(wheel, now);
+  nowtick = ns_to_tick(wheel, wheel->next_run);
 
   PH_LIST_INIT(&list);
 
@@ -230,7 +224,7 @@ uint32_t ph_timerwheel_tick(
         }
       }
 
-      tval_add_res(wheel, &wheel->next_run, &wheel->next_run);
+      wheel->next_run += tick_ns(wheel);
 
       /* claim the timers */
       PH_LIST_SWAP(&list, &wheel->buckets[0].lists[idx],
@@ -74,7 +74,7 @@ typedef struct {
 
 static ph_memtype_t mt_json;
 static struct ph_memtype_def def = {
-  "variant", "json", 0, 0
+  "variant", "json", 0, PH_MEM_FLAGS_ARENA|PH_MEM_FLAGS_SIZE_CLASSES
 };
 
 
@@ -15,6 +15,7 @@
  */
 
 #include "phenom/variant.h"
+#include "phenom/arena.h"
 #include "phenom/log.h"
 #include "phenom/sysutil.h"
 
@@ -23,8 +24,8 @@ static struct {
 } mt;
 
 static struct ph_memtype_def defs[] = {
-  { "variant", "variant", sizeof(ph_variant_t), 0 },
-  { "variant", "array",   0, 0 },
+  { "variant", "variant", sizeof(ph_variant_t), PH_MEM_FLAGS_ARENA },
+  { "variant", "array",   0, PH_MEM_FLAGS_ARENA|PH_MEM_FLAGS_SIZE_CLASSES },
 };
 
 static ph_variant_t bool_true_variant  = { 1, PH_VAR_TRUE, { 0 } };
@@ -284,10 +285,20 @@ static struct ph_ht_val_def var_val_def = {
   var_del
 };
 
+// The table of an object made in an arena is on the heap; make sure
+// it goes when the arena is reset
+static void destroy_arena_object(void *arg)
+{
+  ph_variant_t *var = arg;
+
+  ph_ht_destroy(&var->u.oval);
+}
+
 ph_variant_t *ph_var_object(uint32_t nelems)
 {
   ph_variant_t *var;
   ph_result_t res;
+  ph_arena_t *arena = ph_arena_for_memtype(mt.var);
 
   var = ph_mem_alloc(mt.var);
   if (!var) {
@@ -303,6 +314,12 @@ ph_variant_t *ph_var_object(uint32_t nelems)
     return 0;
   }
 
+  if (arena &&
+      ph_arena_defer(arena, destroy_arena_object, var) != PH_OK) {
+    ph_ht_destroy(&var->u.oval);
+    return 0;
+  }
+
   return var;
 }
 
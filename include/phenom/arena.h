@@ -0,0 +1,145 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_ARENA_H
+#define PHENOM_ARENA_H
+
+#include "phenom/defs.h"
+#include "phenom/memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * # Arenas
+ *
+ * An arena hands out memory by bumping a pointer through chunks that it
+ * allocates as it goes, and gives it all back in one go when it is
+ * reset.  This suits the many small objects made while handling a
+ * request, which would otherwise each cost a malloc and a free.
+ *
+ * The chunks are allocated against the `arena/chunk` memtype, so the
+ * memory held by arenas shows up in the memory counters.
+ *
+ * ```
+ * ph_arena_t *arena = ph_arena_new(0);
+ * char *scratch = ph_arena_alloc(arena, 128);
+ * ...
+ * ph_arena_reset(arena); // scratch is gone, the arena can be reused
+ * ph_arena_free(arena);
+ * ```
+ *
+ * ## Current arena
+ *
+ * A thread may make an arena current with `ph_arena_set_current`.
+ * While it is, allocations of memtypes defined with
+ * `PH_MEM_FLAGS_ARENA` come from the arena, and freeing them does
+ * nothing.  Strings and variants are such memtypes, so code that parses
+ * a request can build its variants in an arena, keep using the usual
+ * refcounting functions, and drop the lot with `ph_arena_reset`:
+ *
+ * ```
+ * ph_arena_t *prev = ph_arena_set_current(arena);
+ * req = ph_json_load_string(body, 0, &err);
+ * ph_arena_set_current(prev);
+ * ...
+ * ph_arena_reset(arena);
+ * ```
+ *
+ * Only make request scoped things while an arena is current: anything
+ * that outlives the reset must be made outside of it.  Strings made in
+ * an arena keep growing there.  Arrays that grow after the arena stops
+ * being current move to the heap, and need their references released
+ * as usual.
+ */
+
+typedef struct ph_arena ph_arena_t;
+
+/** Makes a new arena
+ *
+ * Memory is carved out of chunks of `chunk_size` bytes; pass 0 for
+ * the default of 16k.  Allocations larger than a quarter of the chunk
+ * size get a chunk of their own.
+ *
+ * Returns NULL if the arena could not be allocated.
+ */
+ph_arena_t *ph_arena_new(uint64_t chunk_size);
+
+/** Allocates memory from an arena
+ *
+ * The memory is aligned for any type, and is not initialized.  It stays
+ * valid until the arena is reset or freed.
+ *
+ * Returns NULL if a chunk could not be allocated.
+ */
+void *ph_arena_alloc(ph_arena_t *arena, uint64_t size)
+#ifdef __GNUC__
+  __attribute__((malloc))
+#endif
+  ;
+
+/** Arranges for a function to run when the arena is reset or freed
+ *
+ * For things made in the arena that hold on to memory from elsewhere.
+ * Functions run in the reverse order of their registration, before
+ * the arena memory is released, so they may still look at it.
+ */
+ph_result_t ph_arena_defer(ph_arena_t *arena,
+    void (*func)(void *arg), void *arg);
+
+/** Releases everything allocated from an arena
+ *
+ * Runs the deferred functions and frees all of the chunks but one,
+ * which is kept for the allocations that follow.
+ */
+void ph_arena_reset(ph_arena_t *arena);
+
+/** Resets an arena and frees it
+ *
+ * If it is the calling thread's current arena, the thread is left
+ * without one.
+ */
+void ph_arena_free(ph_arena_t *arena);
+
+/** Returns the number of bytes handed out since the last reset */
+uint64_t ph_arena_used(ph_arena_t *arena);
+
+/** Makes an arena the calling thread's current arena
+ *
+ * Pass NULL to leave the thread without one.  Returns the previously
+ * current arena, so that it can be restored.
+ */
+ph_arena_t *ph_arena_set_current(ph_arena_t *arena);
+
+/** Returns the calling thread's current arena, or NULL */
+ph_arena_t *ph_arena_current(void);
+
+/** Returns the arena that allocations of a memtype would come from
+ *
+ * That is the calling thread's current arena if `memtype` was defined
+ * with `PH_MEM_FLAGS_ARENA`, and NULL otherwise.
+ */
+ph_arena_t *ph_arena_for_memtype(ph_memtype_t memtype);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
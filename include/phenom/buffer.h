@@ -152,11 +152,50 @@ ph_buf_t *ph_buf_concat(uint64_t length, uint32_t num_bufs,
  * This is useful to implement a segmented read or write buffer with an
  * upper bound on buffer size.
  *
- * A freshly created buffer queued is populated with an initial ph_buf_t
- * with the default size.
+ * A freshly created buffer queue holds no storage; buffers are allocated
+ * as data is appended or read into it.
+ *
+ * The queue will not hold more than `max_size` bytes of unconsumed data;
+ * appends and reads are truncated to fit.  A `max_size` of 0 means that
+ * there is no limit.
  */
 ph_bufq_t *ph_bufq_new(uint64_t max_size);
 
+/** Returns the maximum size of a buffer queue, or 0 if unlimited */
+uint64_t ph_bufq_get_max_size(ph_bufq_t *q);
+
+/** Called when a buffer queue crosses one of its watermarks
+ *
+ * `above` is true when the queue has grown to its high watermark, and
+ * false when it has since shrunk to its low watermark.
+ *
+ * The function is called from inside the append, consume or stream
+ * operation that caused the change, so it must not modify the queue.
+ */
+typedef void (*ph_bufq_watermark_func)(ph_bufq_t *q, bool above, void *arg);
+
+/** Set the high and low watermarks of a buffer queue
+ *
+ * Once the amount of unconsumed data reaches `high`, the watermark
+ * function is called with `above` set to true.  It is called again with
+ * `above` set to false when the amount drops to `low` or below.  The gap
+ * between the two keeps a queue that hovers around one level from
+ * generating a stream of notifications.
+ *
+ * A `high` of 0, the default, disables the watermarks; if the queue was
+ * above its high watermark, the function is called with `above` set to
+ * false.
+ */
+void ph_bufq_set_watermarks(ph_bufq_t *q, uint64_t low, uint64_t high);
+
+/** Set the function to call when a buffer queue crosses a watermark */
+void ph_bufq_set_watermark_func(ph_bufq_t *q, ph_bufq_watermark_func func,
+    void *arg);
+
+/** Returns true if the buffer queue has reached its high watermark
+ * and not yet drained to its low watermark */
+bool ph_bufq_above_watermark(ph_bufq_t *q);
+
 /** Set a buffer queue's max record size
  *
  * Set the buffer queue's record size to a specified maximum,
@@ -173,6 +212,33 @@ void ph_bufq_set_max_record_size(ph_bufq_t *buf, uint64_t size);
  */
 uint64_t ph_bufq_get_max_record_size(ph_bufq_t *buf);
 
+/** Returns the bytes of buffer storage held by a buffer queue
+ *
+ * This includes space that has already been consumed or that is yet to
+ * be filled, so it is at least ph_bufq_len().  The `buffer` counter
+ * scope tracks the total for all queues in `resident_bytes`, alongside
+ * the number of `queues` and the `released_bytes` given back by
+ * ph_bufq_shrink().
+ */
+uint64_t ph_bufq_get_resident_size(ph_bufq_t *q);
+
+/** Releases storage that holds no unconsumed data
+ *
+ * Consumed buffers are normally kept at the tail of the queue to take
+ * the next append.  Call this when the queue is likely to stay idle for
+ * a while to give that storage back; it is allocated again on demand.
+ * Returns the number of bytes released.
+ */
+uint64_t ph_bufq_shrink(ph_bufq_t *q);
+
+/** Discards everything held by a buffer queue
+ *
+ * Frees its storage, unconsumed data included, and returns it to the
+ * state that ph_bufq_new() left it in: the maximum size is kept but the
+ * watermarks, watermark function and max record size are cleared.
+ */
+void ph_bufq_reset(ph_bufq_t *q);
+
 /** Destroy a buffer queue
  *
  * Releases all of its resources
@@ -189,8 +255,9 @@ void ph_bufq_free(ph_bufq_t *q);
  * If the data to be appended would exceed the maximum size of the buffer
  * queue, only the data up to the size limit will be added.
  *
- * Returns PH_OK on success (which may mean partial success), or an error
- * code on failure (such as failure to allocate buffers).
+ * Returns PH_OK on success (which may mean partial success), PH_BUSY if
+ * the queue is full, or an error code on failure (such as failure to
+ * allocate buffers).
  *
  * Populates the number of bytes that were consumed in the added_bytes
  * parameter.
@@ -222,6 +289,44 @@ ph_buf_t *ph_bufq_consume_bytes(ph_bufq_t *q, uint64_t len);
  */
 ph_buf_t *ph_bufq_peek_bytes(ph_bufq_t *q, uint64_t len);
 
+/** De-queue data from a buffer queue into caller supplied memory
+ *
+ * Copies as many bytes as are available, up to the total size of
+ * the iovecs, directly from the queued buffers into `iov`, filling
+ * each iovec in turn.  Unlike ph_bufq_consume_bytes(), no intermediate
+ * buffer object is created, which makes this the cheapest way to
+ * perform many small reads from a queue.
+ *
+ * Those bytes are considered read.  Returns the number of bytes
+ * that were copied, which is 0 if the queue is empty.
+ */
+uint64_t ph_bufq_consume_iov(ph_bufq_t *q, const struct iovec *iov,
+    int iovcnt);
+
+/** De-queue data from a buffer queue into a memory buffer
+ *
+ * A convenience wrapper around ph_bufq_consume_iov() for a single
+ * contiguous region.
+ */
+static inline uint64_t ph_bufq_consume_mem(ph_bufq_t *q, void *buf,
+    uint64_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return ph_bufq_consume_iov(q, &iov, 1);
+}
+
+/** Discard data from the front of a buffer queue
+ *
+ * Drops up to `len` bytes as though they had been consumed, without
+ * copying them anywhere; useful after ph_bufq_peek_bytes() once the
+ * peeked data has been dealt with.  Returns the number of bytes that
+ * were discarded.
+ */
+uint64_t ph_bufq_discard(ph_bufq_t *q, uint64_t len);
+
 /** Attempts to discard all bytes prior to a start sequence
  *
  * Searches the buffer queue until it finds the delimiter text.
@@ -307,18 +412,43 @@ ph_buf_t *ph_bufq_peek_record(ph_bufq_t *q, const char *delim,
  */
 bool ph_bufq_stm_write(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nwrote);
 
+/** Attempts to write at most `max` bytes from a queue to a stream
+ *
+ * Behaves like ph_bufq_stm_write() but stops building the iovec once
+ * `max` bytes have been gathered.  This allows a caller to flush exactly
+ * the data that was queued ahead of some other out-of-band write.
+ */
+bool ph_bufq_stm_write_bytes(ph_bufq_t *q, ph_stream_t *stm, uint64_t max,
+    uint64_t *nwrote);
+
 /** Attempts to read data from a stream and accumulate it in bufq
  *
- * If the bufq has a partially filled buffer at the tail, ph_stm_read() will
- * be invoked to attempt to fill that space.
+ * Makes a single ph_stm_readv() call into the space remaining in the
+ * buffer at the tail of the bufq plus as many new buffers as are needed
+ * to make up the current read size.  New buffers that receive no data
+ * are released again.
  *
- * If not bufs with space are present in the bufq, a default buffer will be
- * added and ph_stm_read() will be invoked to fill that space.
+ * The read size adapts to the stream: it starts at 8k, doubles (up to
+ * 256k) each time a read fills all of the space offered, and halves
+ * again when reads use less than a quarter of it.
  *
- * This function will invoke ph_stm_read() at most once per call.
+ * Reads are limited to the room left under the maximum size of the
+ * queue; if it is full, returns false and sets errno to `ENOBUFS`.
  */
 bool ph_bufq_stm_read(ph_bufq_t *q, ph_stream_t *stm, uint64_t *nread);
 
+/** Reads from a stream until it would block or `max` bytes arrive
+ *
+ * Calls ph_bufq_stm_read() repeatedly, stopping when it fails (for
+ * example with `EAGAIN`), reaches EOF or has read a total of `max`
+ * bytes.  Returns true if any data was read.  An error other than
+ * `EAGAIN` or `EINTR` that stopped the loop is then held, and returned
+ * by the next read into the bufq instead of reading from the stream.
+ * Otherwise behaves like ph_bufq_stm_read().
+ */
+bool ph_bufq_stm_read_bytes(ph_bufq_t *q, ph_stream_t *stm, uint64_t max,
+    uint64_t *nread);
+
 /** Returns the number of bytes to be consumed */
 uint64_t ph_bufq_len(ph_bufq_t *q);
 
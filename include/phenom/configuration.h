@@ -74,6 +74,14 @@ bool ph_config_load_config_file(const char *config_path);
  */
 void ph_config_set_global(ph_variant_t *cfg);
 
+/** Returns the generation of the global configuration
+ *
+ * The value changes each time ph_config_set_global() is called and is
+ * never 0, so code that caches values from the configuration can tell
+ * when to look them up again.
+ */
+uint32_t ph_config_get_generation(void);
+
 /** Get the global configuration
  *
  * Returns a reference to the global configuration.
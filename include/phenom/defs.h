@@ -89,9 +89,18 @@
 # ifdef HAVE_SYS_EVENTFD_H
 #  include <sys/eventfd.h>
 # endif
+# ifdef HAVE_SYS_SIGNALFD_H
+#  include <sys/signalfd.h>
+# endif
+# ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+# endif
 # ifdef HAVE_SYS_EPOLL_H
 #  include <sys/epoll.h>
 # endif
+# ifdef HAVE_LINUX_TLS_H
+#  include <linux/tls.h>
+# endif
 # ifdef HAVE_SYS_EVENT_H
 #  include <sys/event.h>
 # endif
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_DGRAM_H
+#define PHENOM_DGRAM_H
+
+#include "phenom/socket.h"
+#include "phenom/queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ph_dgram;
+typedef struct ph_dgram ph_dgram_t;
+
+/** The datagram object callback function */
+typedef void (*ph_dgram_func)(ph_dgram_t *dgram, ph_iomask_t why, void *data);
+
+struct ph_dgram_pkt;
+
+/** A received datagram
+ *
+ * Filled out by ph_dgram_recv().  `data` points into the receive buffers
+ * of the datagram object and remains valid until the callback returns.
+ */
+struct ph_dgram_msg {
+  // Where the datagram came from
+  const ph_sockaddr_t *peer;
+  char *data;
+  uint32_t len;
+};
+typedef struct ph_dgram_msg ph_dgram_msg_t;
+
+/** Datagram Object
+ *
+ * A datagram object manages a datagram (typically UDP) socket in the
+ * NBIO pool.  Rather than making a syscall per packet, it receives a
+ * batch of packets each time the socket is readable, using `recvmmsg(2)`
+ * where available, and sends everything queued by ph_dgram_send() at the
+ * end of the dispatch, using `sendmmsg(2)`.
+ *
+ * While enabled, the callback is invoked with `PH_IOMASK_READ` once a
+ * batch has been received; use ph_dgram_recv() to walk the batch.  It is
+ * also invoked with `PH_IOMASK_WRITE` when the socket has room again after
+ * the send queue backed up, with `PH_IOMASK_WAKEUP` in response to
+ * ph_dgram_wakeup(), and with `PH_IOMASK_ERR` if receiving fails, in
+ * which case `last_err` holds the errno value.  Errors such as
+ * `ECONNREFUSED` on a connected socket are transient; the object stays
+ * enabled unless you disable it.
+ *
+ * Like a sock, a datagram object may only be operated on from its own
+ * callback, or while it is disabled.
+ */
+struct ph_dgram {
+  // Embedded job so we can participate in NBIO
+  ph_job_t job;
+
+  // Dispatcher
+  ph_dgram_func callback;
+  bool enabled;
+
+  // The address that we are bound to, if known
+  ph_sockaddr_t sockname;
+
+  // Maximum number of datagrams received per wakeup, and the largest
+  // datagram that we can receive
+  uint32_t batch, max_size;
+  // `PH_DGRAM_OFFLOAD_XXX` flags that are in effect
+  uint32_t offload;
+
+  // Receive buffers and the current receive batch
+  struct ph_dgram_rbatch *rbatch;
+
+  // Datagrams waiting to be sent
+  PH_STAILQ_HEAD(ph_dgram_sendq, ph_dgram_pkt) sendq;
+  uint32_t sendq_len, sendq_max;
+  // Reusable send packet buffers
+  struct ph_dgram_sendq pool;
+  uint32_t pool_len, pool_max;
+
+  // errno value from the last failed send or receive, or 0
+  int last_err;
+};
+
+/** Create a new datagram object from a socket descriptor
+ *
+ * The socket is set to non-blocking mode.  The number of datagrams
+ * received per wakeup and the largest datagram size default to the
+ * `$.dgram.batch` and `$.dgram.max_size` configuration values (32 and
+ * 2048 respectively).  `$.dgram.max_queue` (1024) limits the number of
+ * datagrams that may be waiting in the send queue, and
+ * `$.dgram.pool_size` (256) the number of idle send buffers that are
+ * kept for reuse.
+ */
+ph_dgram_t *ph_dgram_new_from_socket(ph_socket_t s);
+
+/** Create a datagram socket bound to an address and wrap it
+ *
+ * Creates a `SOCK_DGRAM` socket with ph_socket_for_addr(), binds it to
+ * `addr` and returns a datagram object for it, or NULL with errno set
+ * on failure.
+ */
+ph_dgram_t *ph_dgram_new_for_addr(const ph_sockaddr_t *addr);
+
+/** Enable or disable IO dispatching for a datagram object */
+void ph_dgram_enable(ph_dgram_t *dgram, bool enable);
+
+/** Release all resources associated with a datagram object
+ *
+ * Implicitly disables the object and closes the socket.  Anything left
+ * in the send queue is discarded.
+ */
+void ph_dgram_free(ph_dgram_t *dgram);
+
+/** Wakeup the datagram object
+ *
+ * Queues a PH_IOMASK_WAKEUP to the object; see ph_job_wakeup().
+ */
+ph_result_t ph_dgram_wakeup(ph_dgram_t *dgram);
+
+/** Return the next datagram from the current receive batch
+ *
+ * Returns false once the batch is exhausted.  When receive offload is
+ * enabled, the kernel may coalesce a run of datagrams from the same
+ * peer into a single buffer; they are split back apart here, so each
+ * call yields exactly one datagram as it was sent.
+ *
+ * If a datagram was larger than the configured maximum size, `len` is
+ * set to the truncated length that was received.
+ */
+bool ph_dgram_recv(ph_dgram_t *dgram, ph_dgram_msg_t *msg);
+
+/** Queue a datagram to be sent to `addr`
+ *
+ * The data is copied into a pooled packet buffer and sent, along with
+ * everything else queued in the meantime, once the current dispatch of
+ * the object completes.  If called from outside the callback of an
+ * enabled object, it is sent the next time that the object is
+ * dispatched; use ph_dgram_wakeup() to make that happen promptly.
+ *
+ * Returns PH_ERR with errno set to `EMSGSIZE` if `len` exceeds the
+ * maximum datagram size, or `EAGAIN` if the send queue is full.
+ */
+ph_result_t ph_dgram_send(ph_dgram_t *dgram, const ph_sockaddr_t *addr,
+    const void *data, uint32_t len);
+
+/** Send the queued datagrams now
+ *
+ * Returns true if the send queue was drained, false if the socket pushed
+ * back (errno is `EAGAIN`) or failed.  Datagrams that the kernel rejects
+ * outright are dropped and counted; the errno value is recorded in
+ * `last_err`.
+ */
+bool ph_dgram_flush(ph_dgram_t *dgram);
+
+/** Let the kernel coalesce runs of datagrams for sending (`UDP_SEGMENT`)
+ *
+ * Consecutive queued datagrams of the same size that go to the same
+ * destination are handed to the kernel as a single message, which it
+ * segments as late as possible, ideally in the NIC.
+ */
+#define PH_DGRAM_OFFLOAD_SEND 1
+/** Let the kernel coalesce runs of received datagrams (`UDP_GRO`)
+ *
+ * Enabling this sizes each receive buffer to hold a coalesced run of
+ * datagrams, which is 64KB per slot in the receive batch.
+ */
+#define PH_DGRAM_OFFLOAD_RECV 2
+
+/** Enable or disable segmentation offload for a datagram object
+ *
+ * `flags` is a bitwise OR of the `PH_DGRAM_OFFLOAD_XXX` flags.  Returns
+ * PH_ERR with errno set to `ENOSYS` if the system doesn't support one of
+ * the requested kinds of offload, in which case none are changed.
+ * May only be called while the object is disabled.
+ */
+ph_result_t ph_dgram_set_offload(ph_dgram_t *dgram, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -303,7 +303,8 @@ bool ph_ht_grow(ph_ht_t *ht, uint32_t nelems);
 
 /** Tear down a hash table
  *
- * Frees all elements and the table portion.
+ * Frees all elements and the table portion.  Tearing down a table
+ * that was already torn down does nothing.
  */
 void ph_ht_destroy(ph_ht_t *ht);
 
@@ -136,6 +136,12 @@ typedef uint8_t ph_iomask_t;
 #define PH_IOMASK_TIME  8
 /* Dispatch triggered by ph_job_wakeup */
 #define PH_IOMASK_WAKEUP 16
+/* Dispatch triggered by a signal registered via ph_job_set_signal */
+#define PH_IOMASK_SIGNAL 32
+/* Data buffered for output has drained to its low watermark.  Not
+ * generated by NBIO itself; objects such as ph_sock_t pass it to their
+ * callbacks */
+#define PH_IOMASK_DRAINED 64
 
 struct ph_job;
 typedef struct ph_job ph_job_t;
@@ -160,6 +166,9 @@ struct ph_job_def {
   ph_memtype_t memtype;
   // Function to be called prior to freeing the job
   void (*dtor)(ph_job_t *job);
+  // If set, called after the dtor instead of freeing the memory of the
+  // job, which then belongs to this function; it may keep it for reuse
+  void (*recycle)(ph_job_t *job);
 };
 
 /** Job
@@ -446,6 +455,33 @@ typedef void (*ph_nbio_affine_func)(intptr_t code, void *arg);
 ph_result_t ph_nbio_queue_affine_func(uint32_t emitter_affinity,
     ph_nbio_affine_func func, intptr_t code, void *arg);
 
+/** Work deferred until the end of an emitter's batch of events
+ *
+ * Embed this in your own structure and initialize `func`, `code` and
+ * `arg`, then pass it to ph_nbio_defer_to_batch_end().
+ */
+struct ph_nbio_batch_ent {
+  PH_STAILQ_ENTRY(ph_nbio_batch_ent) ent;
+  ph_nbio_affine_func func;
+  intptr_t code;
+  void *arg;
+  // true while queued
+  bool queued;
+};
+
+/** Run a function after the emitter has dispatched its current batch
+ *
+ * Each iteration of an emitter's loop collects a batch of events from
+ * the kernel and dispatches them.  The entry is called once that batch
+ * has been dispatched, before the emitter waits for more events.
+ * Deferring an entry that is already queued has no further effect, so
+ * work can be coalesced across several dispatches in the same batch.
+ *
+ * Must be called from an emitter thread.  Returns false, without
+ * queuing anything, if called from any other thread.
+ */
+bool ph_nbio_defer_to_batch_end(struct ph_nbio_batch_ent *bent);
+
 /** Queue a request to dispatch the job with `PH_IOMASK_WAKEUP`
  *
  * The dispatch will happen as soon as the nbio emitter associated
@@ -465,6 +501,70 @@ static inline bool ph_job_has_pending_wakeup(ph_job_t *job) {
   return ck_pr_load_32(&job->n_wakeups_pending) > 0;
 }
 
+/** Arrange for a signal to be delivered as a job dispatch
+ *
+ * Once registered, each arrival of `signo` causes `job` to be
+ * dispatched with `PH_IOMASK_SIGNAL` on the emitter associated with
+ * the job, serialized with respect to its IO, timer and wakeup
+ * dispatches.  This makes it safe for the callback to touch any
+ * phenom state, unlike a traditional signal handler.
+ *
+ * Where available, signals are collected through a `signalfd` that is
+ * watched by the first scheduler thread; the pending signals are read
+ * in a single batch per wakeup.  Other systems fall back to a
+ * self-pipe fed from a signal handler.
+ *
+ * Multiple arrivals of the same signal before the job is dispatched
+ * are coalesced into a single dispatch; use ph_job_get_siginfo() in
+ * the callback to find out how many were received.  A job may be
+ * registered for more than one signal, but each signal can be owned
+ * by only one job at a time; registering a second job for the same
+ * signal fails with `PH_EXISTS`.
+ *
+ * The signal is added to the blocked signal mask of the calling
+ * thread.  For the signalfd implementation to see every arrival the
+ * signal must be blocked in all threads, so you should register your
+ * signals after ph_nbio_init() and before ph_sched_run() spawns the
+ * scheduler and thread pool threads; they inherit the mask.
+ *
+ * `SIGKILL` and `SIGSTOP` cannot be handled; attempting to register
+ * them, or any invalid signal number, sets errno to `EINVAL` and
+ * returns `PH_ERR`.
+ */
+ph_result_t ph_job_set_signal(ph_job_t *job, int signo);
+
+/** Stop delivering signo to its registered job
+ *
+ * The signal remains blocked in the calling thread.
+ * Returns `PH_NOENT` if no job was registered for the signal.
+ */
+ph_result_t ph_job_clear_signal(int signo);
+
+/** Information about signals delivered to a job */
+struct ph_job_siginfo {
+  // The signal number
+  int signo;
+  // Number of arrivals since the last call to ph_job_get_siginfo()
+  uint32_t count;
+  // The remaining fields describe the most recent arrival.
+  // The sending process and user, if known
+  pid_t pid;
+  uid_t uid;
+  // The si_code value for the signal
+  int code;
+};
+typedef struct ph_job_siginfo ph_job_siginfo_t;
+
+/** Collect the delivery information for a signal
+ *
+ * Intended to be called from the callback of a job dispatched with
+ * `PH_IOMASK_SIGNAL`.  Fills out `info` and resets the arrival count
+ * for `signo`.  Returns true if the signal arrived at least once
+ * since the previous call, which is how a job that is registered for
+ * several signals can tell which of them triggered the dispatch.
+ */
+bool ph_job_get_siginfo(int signo, ph_job_siginfo_t *info);
+
 typedef void (*ph_job_collector_func)(ph_thread_t *me);
 
 /** Register a worker collector callback
@@ -529,6 +629,13 @@ void ph_job_pool_apply_deferred_items(ph_thread_t *me);
  */
 ph_result_t ph_nbio_init(uint32_t sched_cores);
 
+/** Returns the number of NBIO emitter threads
+ *
+ * Only meaningful once ph_nbio_init() has been called.  Emitter affinity
+ * values are taken modulo this number.
+ */
+uint32_t ph_nbio_num_emitters(void);
+
 void _ph_job_set_pool_immediate(ph_job_t *job, ph_thread_t *me);
 void _ph_job_pool_start_threads(void);
 
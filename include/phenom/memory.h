@@ -41,6 +41,15 @@ typedef int ph_memtype_t;
 /* panic if memory could not be allocated */
 #define PH_MEM_FLAGS_PANIC 2
 
+/* keep freed objects in per-thread caches for reuse */
+#define PH_MEM_FLAGS_CACHED 4
+
+/* allocate from the calling thread's current arena, if it has one */
+#define PH_MEM_FLAGS_ARENA 8
+
+/* serve small variable size allocations from size classes */
+#define PH_MEM_FLAGS_SIZE_CLASSES 16
+
 /** defines a memory type.
  *
  * This data structure is used to define a named memory type.
@@ -68,6 +77,32 @@ struct ph_memtype_def {
    * PH_MEM_FLAGS_PANIC - if the allocation fails, call `ph_panic`.
    *   Use this only for extremely critical allocations with no reasonable
    *   recovery path.
+   * PH_MEM_FLAGS_CACHED - freed objects are kept in per-thread
+   *   magazines and handed out again by ph_mem_alloc(), sparing
+   *   malloc() and free() for types that churn.  Magazines that fill up
+   *   or run dry are exchanged with a depot shared by all threads, so
+   *   objects freed on one thread are reused by the others.  The depot
+   *   gives back to the system what went unused for a second or so,
+   *   checking whenever an NBIO emitter or pool thread is idle (see
+   *   ph_job_collector_register()) as well as when it is used.
+   *   Only honored for fixed size types, and for the first 64 types
+   *   that ask for it.
+   * PH_MEM_FLAGS_ARENA - while the calling thread has a current arena
+   *   (see phenom/arena.h), allocations come from the arena and freeing
+   *   them does nothing.  They are charged to the arena's chunks rather
+   *   than to this memtype.  Not combined with PH_MEM_FLAGS_CACHED.
+   *   Outside of an arena, fixed size objects of up to 2k come from the
+   *   size classes (see PH_MEM_FLAGS_SIZE_CLASSES), and are counted as
+   *   the size of their class, without the memtype check noted below.
+   * PH_MEM_FLAGS_SIZE_CLASSES - variable size allocations of up to 2k
+   *   are rounded up to one of a set of size classes and carved out of
+   *   slabs shared by all memtypes, without the header that other
+   *   variable size allocations carry.  ph_mem_realloc() leaves them in
+   *   place while the new size is of the same class.  The counters see
+   *   the size of the class rather than the size that was asked for.
+   *   Having no header, these allocations don't record their memtype,
+   *   so freeing or reallocating one with the wrong memtype is not
+   *   caught by a panic as it is for other variable size allocations.
    */
   unsigned flags;
 };
@@ -176,6 +211,15 @@ void *ph_mem_realloc(ph_memtype_t memtype, void *ptr, uint64_t size);
  */
 void ph_mem_free(ph_memtype_t memtype, void *ptr);
 
+/** Returns the calling thread's cached objects to the depots
+ *
+ * Threads that are about to sit idle for a while can call this so
+ * that other threads can reuse the PH_MEM_FLAGS_CACHED objects that they
+ * freed.  Threads do this by themselves when they exit, and for the
+ * memtypes they stop using.
+ */
+void ph_mem_cache_flush(void);
+
 /** Duplicates a C-String using a memtype
  *
  * Behaves like strdup(3), except that the storage is allocated
@@ -204,6 +248,11 @@ struct ph_mem_stats {
   /* total number of calls to realloc (that are not themselves
    * equivalent to an alloc or free) */
   uint64_t reallocs;
+  /* for PH_MEM_FLAGS_CACHED types, bytes of freed objects held
+   * for reuse; they are not included in `bytes` */
+  uint64_t cached;
+  /* the limit set on the memtype, or 0 if it has none */
+  uint64_t limit;
 };
 typedef struct ph_mem_stats ph_mem_stats_t;
 
@@ -238,6 +287,94 @@ int ph_mem_stat_facility(const char *facility,
 int ph_mem_stat_range(ph_memtype_t start,
     ph_memtype_t end, ph_mem_stats_t *stats);
 
+/**
+ * ## Limits
+ *
+ * A memtype, or a whole facility, may be limited to a number of bytes.
+ * An allocation that would take it over its limit fails as though the
+ * system were out of memory, except for PH_MEM_FLAGS_PANIC memtypes,
+ * which are never refused.  Limits are enforced against a running total
+ * kept from the moment they are set, so they may be overshot by the
+ * allocations that race with setting them.
+ *
+ * Limits may also be set from the configuration; each key of
+ * `$.memory.limits` names a facility, or a `facility/name` memtype, and
+ * maps to either a limit in bytes or an object holding the `limit` and
+ * the `soft` thresholds, which default to 75 and 90 percent:
+ *
+ * ```
+ * "memory": {
+ *   "limits": {
+ *     "buffer": 268435456,
+ *     "variant/json": { "limit": 67108864, "soft": [50, 80, 95] }
+ *   }
+ * }
+ * ```
+ *
+ * They are picked up when the configuration changes, replacing those
+ * that came from the previous configuration.
+ *
+ * ## Memory pressure
+ *
+ * Each limit may have up to PH_MEM_MAX_SOFT_LIMITS soft thresholds,
+ * given as percentages of the limit.  The hook point named by
+ * `PH_MEM_PRESSURE_HOOK_NAME` is invoked when usage crosses one of them,
+ * in either direction, and when an allocation is refused.  This gives
+ * the application a chance to shed load before the limit is reached.
+ * The hook receives 5 parameters:
+ *
+ * * `args[0]` -> `const char *facility` the facility of the limit
+ * * `args[1]` -> `const char *name` the memtype name, or NULL for a
+ *   facility limit
+ * * `args[2]` -> `uint64_t *bytes` the bytes now allocated
+ * * `args[3]` -> `uint64_t *limit` the limit
+ * * `args[4]` -> `uint32_t *percent` the highest threshold now exceeded,
+ *   0 once usage falls below all of them, or 100 if an allocation was
+ *   refused
+ *
+ * The hook runs on the thread that made the allocation, possibly with
+ * locks held, so it should only take note of the pressure and act on
+ * it later.
+ */
+#define PH_MEM_PRESSURE_HOOK_NAME "phenom::memory::pressure"
+#define PH_MEM_MAX_SOFT_LIMITS 4
+
+/** Limits the bytes allocated against a memtype
+ *
+ * * `limit` - the limit in bytes, or 0 to remove it
+ * * `num_soft` - the number of soft thresholds
+ * * `soft` - the thresholds, as percentages of the limit
+ *
+ * Returns PH_ERR if the memtype or the thresholds are invalid.
+ */
+ph_result_t ph_mem_set_limit(ph_memtype_t memtype, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft);
+
+/** Limits the bytes allocated against all memtypes of a facility
+ *
+ * Works like ph_mem_set_limit() and applies to the memtypes of the
+ * facility that are registered later, too.
+ */
+ph_result_t ph_mem_set_facility_limit(const char *facility, uint64_t limit,
+    uint8_t num_soft, const uint8_t *soft);
+
+/** Information about a facility limit */
+struct ph_mem_facility_stats {
+  const char *facility;
+  /* current amount of memory allocated against the facility */
+  uint64_t bytes;
+  uint64_t limit;
+};
+typedef struct ph_mem_facility_stats ph_mem_facility_stats_t;
+
+/** Queries the facilities that have limits
+ *
+ * Fills in up to `num_stats` elements of `stats` and returns the number
+ * that were populated.
+ */
+int ph_mem_stat_facility_limits(int num_stats,
+    ph_mem_facility_stats_t *stats);
+
 /** Resolves a memory type by name
  *
  * Intended as a diagnostic/testing aid.
@@ -245,6 +382,60 @@ int ph_mem_stat_range(ph_memtype_t start,
 ph_memtype_t ph_mem_type_by_name(const char *facility,
     const char *name);
 
+/**
+ * ## Heap profiling
+ *
+ * The counters say how much memory a memtype holds, but not who
+ * allocated it.  When heap profiling is enabled, allocations are sampled
+ * about once every `sample_bytes` bytes, at exponentially distributed
+ * intervals, and the call stack of each sampled allocation is recorded
+ * until it is freed.  The samples are grouped by memtype and stack.
+ *
+ * With profiling disabled, which is the default, allocations pay for a
+ * single load.  With it enabled, allocations count down a per-thread
+ * byte budget, frees of memory allocated while there are live samples
+ * look in a table of sampled pointers, and only the sampled allocations
+ * capture a stack and take a lock.  At most 65536 samples are kept live.
+ *
+ * Profiling can also be enabled through the configuration:
+ *
+ * ```
+ * "memory": {
+ *   "sample_bytes": 524288
+ * }
+ * ```
+ *
+ * The debug console `heapprof` command dumps the profile.
+ */
+
+/** Enables or disables heap profiling
+ *
+ * Samples an allocation about every `sample_bytes` bytes, or disables
+ * profiling if it is 0.  Changing the interval discards the samples
+ * taken so far.
+ */
+void ph_mem_prof_set_sample_bytes(uint64_t sample_bytes);
+
+/** Returns the heap profiling sample interval, or 0 if disabled */
+uint64_t ph_mem_prof_get_sample_bytes(void);
+
+struct ph_stream;
+
+/** Writes the live heap samples in the pprof legacy heap format
+ *
+ * Each sample line is followed by a comment naming its memtype, and
+ * the process maps follow the samples so that pprof can symbolize the
+ * stacks:
+ *
+ * ```
+ * $ echo heapprof | nc -UC /tmp/phenom-debug-console > heap.prof
+ * $ pprof --text ./myprog heap.prof
+ * ```
+ *
+ * Returns false if profiling is disabled or the stream failed.
+ */
+bool ph_mem_prof_dump(struct ph_stream *stm);
+
 #ifdef __cplusplus
 }
 #endif
@@ -82,6 +82,105 @@ ph_stream_t *ph_stm_ssl_open(SSL *ssl);
  */
 BIO *ph_openssl_bio_wrap_bufq(ph_bufq_t *bufq);
 
+#define PH_OPENSSL_KTLS_TX 1
+#define PH_OPENSSL_KTLS_RX 2
+
+/** Hand the record layer of an SSL session to the kernel
+ *
+ * Derives the keys of the session on `ssl` and installs them on `fd`
+ * with the Linux kernel TLS (kTLS) socket options, so that data written
+ * to the socket is encrypted by the kernel, and data read from it is
+ * decrypted.  The handshake must be complete, everything OpenSSL has
+ * written must already have been sent and no application data may have
+ * been written or read through `ssl`.
+ *
+ * Only TLS 1.2 sessions using AES-GCM or ChaCha20-Poly1305 can be
+ * offloaded.
+ *
+ * Returns `PH_OPENSSL_KTLS_TX`, possibly with `PH_OPENSSL_KTLS_RX`,
+ * according to which directions were offloaded; kernels that only
+ * support transmit leave reading to OpenSSL.  Returns 0 with errno set
+ * if nothing was offloaded, in which case `fd` is left as it was and
+ * `ssl` may be used as normal.
+ *
+ * Once transmit is offloaded, anything that OpenSSL writes on `ssl` is
+ * discarded.  If it still reads, it may raise alerts, which are
+ * reported through the `SSL_CB_WRITE_ALERT` info callback; send them
+ * with ph_openssl_ktls_send_control().
+ */
+uint32_t ph_openssl_ktls_enable(SSL *ssl, ph_socket_t fd);
+
+/** Send a record that isn't application data on a kTLS socket
+ *
+ * Sends `len` bytes from `buf` as a single record of content `type`,
+ * such as `SSL3_RT_ALERT`, encrypted by the kernel.  Returns the number
+ * of bytes sent, or -1 with errno set.
+ */
+ssize_t ph_openssl_ktls_send_control(ph_socket_t fd, uint8_t type,
+    const void *buf, size_t len);
+
+/** Read the record that a kTLS socket refused to return as data
+ *
+ * Reading a socket with receive offload fails with `EIO` when the next
+ * record is not application data.  This consumes that record, returning
+ * 0 if it was the peer's `close_notify` alert, which ends the stream,
+ * and failing with `EPROTO` for anything else.
+ */
+ssize_t ph_openssl_ktls_recv_control(ph_socket_t fd);
+
+/** Resume server sessions from a cache shared by all threads
+ *
+ * Replaces OpenSSL's per `SSL_CTX` session cache on `ctx` with one that
+ * is split over a number of locks, so that emitters accepting
+ * connections at the same time rarely wait on each other.  The cache
+ * holds up to `$.openssl.session_cache_size` sessions (default 20480),
+ * dropping the least recently used first.
+ *
+ * Session tickets are also encrypted with keys shared by every `ctx`
+ * set up this way.  A new key takes over issuing tickets every
+ * `$.openssl.ticket_key_lifetime` seconds (default 3600); tickets made
+ * under the two keys before it are still accepted, and are renewed
+ * when used.
+ *
+ * Resumption is counted in the `ssl_session` counter scope.
+ */
+ph_result_t ph_openssl_server_session_cache_enable(SSL_CTX *ctx);
+
+/** Start issuing session tickets with a new key
+ *
+ * Tickets made under the oldest of the retained keys can no longer be
+ * used to resume a session.  This is done on a timer by the ticket key
+ * callback; call it yourself if you suspect the keys have leaked.
+ */
+void ph_openssl_rotate_ticket_keys(void);
+
+/** Remember client sessions for each destination
+ *
+ * Keeps the sessions made by SSL objects from `ctx` in a cache shared
+ * by all threads, keyed by the destination passed to
+ * ph_openssl_client_session_resume(), so that later connections to
+ * the same place can skip the full handshake.  The cache holds up to
+ * `$.openssl.client_session_cache_size` sessions (default 1024).
+ */
+ph_result_t ph_openssl_client_session_cache_enable(SSL_CTX *ctx);
+
+/** Offer a cached session when connecting to a destination
+ *
+ * Call this before the handshake on a client `ssl` whose `SSL_CTX` has
+ * the client session cache enabled.  Sets the session last saved for
+ * `host` and `port`, if there is one that can still be resumed, and
+ * arranges for the session that `ssl` ends up with to be saved for
+ * them.  TLS 1.3 sessions are only offered once.
+ *
+ * ph_sock_pool_checkout() does this for you; if you are using
+ * ph_sock_resolve_and_connect() directly, call it when enabling SSL
+ * on the connected sock.
+ *
+ * Returns true if a session was offered.
+ */
+bool ph_openssl_client_session_resume(SSL *ssl, const char *host,
+    uint16_t port);
+
 #ifdef __cplusplus
 }
 #endif
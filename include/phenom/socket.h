@@ -189,6 +189,26 @@ typedef void (*ph_sock_func)(ph_sock_t *sock, ph_iomask_t why, void *data);
 typedef void (*ph_sock_openssl_handshake_func)(
     ph_sock_t *sock, int res);
 
+/** IO statistics for a sock
+ *
+ * Kept for every sock unless `$.socket.track_stats` is set to 0.
+ * Times are from ph_time_now_ns(), so they have the resolution of the
+ * emitter's cached clock.
+ */
+struct ph_sock_stats {
+  // Bytes read from and written to the connection
+  uint64_t bytes_in, bytes_out;
+  // readv and writev (or sendfile) calls made on the connection
+  uint64_t reads, writes;
+  // Times the sock has been dispatched
+  uint64_t dispatches;
+  // The most data that has been queued for write at once
+  uint64_t max_wbuf;
+  // When the sock was made, and when it last moved any data
+  uint64_t created_ns, last_activity_ns;
+};
+typedef struct ph_sock_stats ph_sock_stats_t;
+
 /** Socket Object
  *
  * A socket object is a higher level representation of an underlying
@@ -217,6 +237,10 @@ struct ph_sock {
   // The per IO operation timeout duration
   struct timeval timeout_duration;
 
+  // The most that a single dispatch reads from the connection before
+  // yielding to other jobs; from `$.socket.read_budget`, default 256k
+  uint64_t read_budget;
+
   // A stream for writing to the underlying connection
   ph_stream_t *conn;
   // A stream representation of myself.  Writing bytes into the
@@ -241,23 +265,140 @@ struct ph_sock {
   SSL *ssl;
   ph_stream_t *ssl_stream;
   ph_sock_openssl_handshake_func handshake_cb;
+  // The info callback that was in effect before ours; we call it too
+  void (*ssl_info_cb)(const SSL *ssl, int where, int ret);
+  // Plaintext waiting to be encrypted into wbuf; see
+  // ph_sock_openssl_enable()
   ph_bufq_t *sslwbuf;
+  // For sizing records: plaintext encrypted since the connection
+  // started or last went idle, and when we last encrypted any
+  uint64_t ssl_record_bytes, ssl_last_write_ns;
+  // Length that an interrupted SSL_write() must be repeated with
+  uint32_t ssl_write_retry;
+  // Set once the first handshake has been counted
+  bool ssl_handshake_done;
   // Whether we should free the associated SSL_CTX on destruction.
   // This defaults to true for backwards compatibility.
   // If you're building SSL enabled listeners, you probably want to keep
   // a global SSL_CTX and set this to false.  For clients, it is often
   // easier to leave this set to true.
   bool free_ssl_ctx;
+  // See ph_sock_openssl_set_ktls().  Once the kernel has taken over
+  // a direction of the session, the sock does plain IO on the
+  // connection in that direction, and sslwbuf is gone
+  bool ktls_pending;
+  bool ktls_tx, ktls_rx;
+  // Set if handshake steps are run on the `ssl_handshake` thread pool
+  // rather than the emitter; from `$.socket.ssl_handshake_offload`.
+  // While the pool has the sock, dispatches are held in handshake_why
+  bool handshake_offload;
+  bool handshake_away, handshake_stepped, handshake_cb_pending;
+  int handshake_err, handshake_cb_res;
+  ph_iomask_t handshake_why;
+
+  // File ranges queued by ph_sock_sendfile(), sent in order with wbuf
+  PH_STAILQ_HEAD(ph_sock_file_ranges, ph_sock_file_range) file_ranges;
+
+  // Set while data is being spliced from, or to, this sock
+  struct ph_sock_splice *splice_out, *splice_in;
+
+  // See ph_sock_set_write_policy()
+  uint32_t write_policy;
+  struct ph_nbio_batch_ent flush_ent;
+
+  // Set if the sock was made by a ph_sock_pool_t.  pool_key names its
+  // destination, and while the sock is checked in, pool_dest is the
+  // idle list that it is linked into
+  struct ph_sock_pool *pool;
+  ph_string_t *pool_key;
+  struct ph_sock_pool_dest *pool_dest;
+  PH_TAILQ_ENTRY(ph_sock) pool_ent;
+
+  // Flow control; see ph_sock_new_from_socket()
+  bool read_paused;
+  bool write_drained;
+
+  // See ph_sock_stats_top()
+  ph_sock_stats_t stats;
+  bool track_stats;
+  // When we started waiting for the first byte, and when the data now
+  // waiting in the write buffers started to queue, for the latency
+  // histograms (see ph_sock_stats_top())
+  uint64_t ttfb_start_ns, drain_start_ns;
+  // The registry we're on; it belongs to the emitter that made us
+  struct ph_sock_stats_list *stats_list;
+  PH_LIST_ENTRY(ph_sock) stats_ent;
+
+  // Set while the sock is on its emitter's list of socks whose empty
+  // buffers are released once they have been idle for long enough
+  struct ph_sock_emitter *idle_emitter;
+  PH_LIST_ENTRY(ph_sock) idle_ent;
+  uint64_t last_dispatch_ns;
 };
 
 /** Create a new sock object from a socket descriptor
  *
  * Creates and initialize a socket object using the specified descriptor,
  * sockname and peername.
+ *
+ * The read and write buffers are limited to `$.socket.max_buffer_size`
+ * bytes (128k by default), with a high watermark at that size and a low
+ * watermark at half of it:
+ *
+ * * Once `rbuf` reaches its high watermark the sock stops reading from
+ *   the connection, leaving the peer to block, and resumes when the
+ *   callback has consumed enough to bring it down to the low watermark.
+ *   Records larger than the buffer can never be read.
+ * * Writes to the sock stream are truncated once the write buffer is
+ *   full, failing with `EAGAIN` if nothing fits.  When the buffer has
+ *   drained to its low watermark after reaching the high watermark, the
+ *   callback is dispatched with `PH_IOMASK_DRAINED` so that you can
+ *   resume writing.  ph_bufq_above_watermark() on the write buffer
+ *   (`sslwbuf` when SSL is enabled) tells you whether to expect it.
+ *
+ * The levels may be changed with ph_bufq_set_watermarks().
+ *
+ * The buffers take no memory until data passes through them, and give
+ * it back once they are empty and the sock has not been dispatched for
+ * `$.socket.idle_release` milliseconds (default 1000), so idle
+ * connections cost little more than the sock itself.  Busy socks keep
+ * their buffers from one dispatch to the next.
  */
 ph_sock_t *ph_sock_new_from_socket(ph_socket_t s, const ph_sockaddr_t *sockname,
   const ph_sockaddr_t *peername);
 
+/** Returns the bytes of buffer storage held by a sock
+ *
+ * Sums ph_bufq_get_resident_size() over its read and write buffers.
+ */
+uint64_t ph_sock_get_resident_size(ph_sock_t *sock);
+
+/** A snapshot of the statistics of a sock, see ph_sock_stats_top() */
+struct ph_sock_stats_entry {
+  ph_sock_stats_t stats;
+  ph_sockaddr_t peername;
+  ph_socket_t fd;
+};
+typedef struct ph_sock_stats_entry ph_sock_stats_entry_t;
+
+/** Find the socks that have moved the most data
+ *
+ * Fills `entries` with up to `max` of the live socks with the most
+ * bytes read and written, busiest first, and returns how many it found.
+ * This may be called from any thread; the figures of socks that are
+ * active at the time are approximate.  The debug console `socks`
+ * command lists these.
+ *
+ * In addition to the per-sock statistics, two latency histograms are
+ * kept in the `sock.ttfb` (time from making a sock to reading its first
+ * byte) and `sock.write_drain` (time from data being queued for write
+ * to the write buffers emptying) counter scopes.  Each counter is named
+ * for the upper bound of its bucket, from `65us` to `17s`, with `inf`
+ * counting anything longer.  Unlike the per-sock times, these are
+ * measured with the precise monotonic clock.
+ */
+uint32_t ph_sock_stats_top(ph_sock_stats_entry_t *entries, uint32_t max);
+
 /** Enable or disable IO dispatching for a socket object
  *
  * While enabled, the sock will trigger callbacks when it is readable/writable
@@ -265,6 +406,35 @@ ph_sock_t *ph_sock_new_from_socket(ph_socket_t s, const ph_sockaddr_t *sockname,
  */
 void ph_sock_enable(ph_sock_t *sock, bool enable);
 
+/** Coalesce writes until the emitter finishes its batch of events
+ *
+ * Rather than sending at the end of each dispatch, data buffered for
+ * write is sent once the emitter has dispatched everything that it
+ * collected in the current iteration of its loop.  Several dispatches
+ * of the same sock, such as a burst of wakeups, result in a single
+ * flush.
+ */
+#define PH_SOCK_WRITE_COALESCE 1
+/** Cork the socket while a flush is in progress
+ *
+ * Sets `TCP_CORK` (or `TCP_NOPUSH`) before sending buffered data and
+ * clears it afterwards, so that the kernel transmits full segments
+ * rather than one per write or sendfile operation.
+ */
+#define PH_SOCK_WRITE_CORK     2
+/** Disable Nagle's algorithm on the socket (`TCP_NODELAY`) */
+#define PH_SOCK_WRITE_NODELAY  4
+
+/** Set the write policy for a socket object
+ *
+ * `policy` is a bitwise OR of the `PH_SOCK_WRITE_XXX` flags; 0 restores
+ * the default of sending at the end of each dispatch.
+ *
+ * The `sock` counter scope reports `writev` and `writev_bytes`; their
+ * ratio is the average number of bytes sent per writev syscall.
+ */
+void ph_sock_set_write_policy(ph_sock_t *sock, uint32_t policy);
+
 /** Wakeup the socket object
  *
  * Queues an PH_IOMASK_WAKEUP to the sock.  This is primarily useful in cases
@@ -279,9 +449,72 @@ ph_result_t ph_sock_wakeup(ph_sock_t *sock);
 /** Release all resources associated with a socket object
  *
  * Implicitly disables the socket.
+ *
+ * When the release happens on an emitter thread, the sock object and
+ * its buffers and streams are reset and kept in a pool belonging to
+ * that emitter, so that ph_sock_new_from_socket() can reuse them for a
+ * later connection rather than allocating them again.  Each emitter
+ * keeps up to `$.socket.shell_pool_size` (default 256) of these; the
+ * `shell_reuse` counter in the `sock` scope counts their reuse.
  */
 void ph_sock_free(ph_sock_t *sock);
 
+/** Queue a range of a file to be sent on the socket object
+ *
+ * Arranges for `len` bytes of the file `fd`, starting at `offset`, to be
+ * written to the sock after any data that is already buffered for write.
+ * Data written to the sock stream after this call is sent after the
+ * file range.
+ *
+ * Where the system supports it, the range is transmitted with
+ * `sendfile(2)` as the socket becomes writable, so that the file contents
+ * never pass through userspace.  The descriptor is duplicated, so you may
+ * close `fd` as soon as this function returns; the file contents are read
+ * at the time they are sent.
+ *
+ * When SSL is enabled on the sock, unless the kernel is encrypting for
+ * it (see ph_sock_openssl_set_ktls()), or the system lacks a usable
+ * `sendfile(2)`, the range is read into the write buffer immediately,
+ * failing with `ENOBUFS` if it won't fit.
+ *
+ * Returns PH_OK on success, or PH_ERR with errno set on failure.  If the
+ * file turns out to be shorter than the requested range, the sock will
+ * be dispatched with PH_IOMASK_ERR.
+ */
+ph_result_t ph_sock_sendfile(ph_sock_t *sock, int fd, uint64_t offset,
+    uint64_t len);
+
+/** Move data from one socket object to another
+ *
+ * Arranges for data arriving on `src` to be written to `dst` without
+ * passing through the sock callback.  Up to `max_bytes` are moved, or
+ * everything until `src` reaches EOF if `max_bytes` is 0.  Anything
+ * already buffered in the `src` read buffer is moved first, and data
+ * written to `dst` after this call is sent after the spliced data.
+ *
+ * When neither sock has SSL enabled, or the kernel handles the records
+ * on the SSL side (see ph_sock_openssl_set_ktls()), the data is moved
+ * through a kernel pipe with `splice(2)` and is never copied into
+ * userspace.  Otherwise,
+ * or on systems without `splice(2)`, it is copied from the `src` read
+ * buffer into the `dst` write buffer.  Either way, reads from `src` are
+ * paused while too much data is waiting to be sent by `dst`.
+ *
+ * Each sock keeps its own enabled state and timeout; data only moves
+ * while the sock at that end is enabled.  If `src` reaches EOF, the
+ * write side of a non-SSL `dst` is shut down once the data has been sent.
+ * Once the splice completes, `src` goes back to buffering its reads.
+ *
+ * `dst` is moved to the emitter that services `src`, so `dst` must be
+ * disabled when you call this unless the two already share an emitter.
+ * Each sock can be the source and destination of at most one splice at
+ * a time; to proxy in both directions, splice each sock to the other.
+ *
+ * Returns PH_OK on success, or PH_ERR with errno set on failure.
+ */
+ph_result_t ph_sock_splice(ph_sock_t *src, ph_sock_t *dst,
+    uint64_t max_bytes);
+
 /** Read exactly the specified number of bytes
  *
  * Returns a buffer containing the requested number of bytes, or NULL if they
@@ -344,7 +577,9 @@ typedef void (*ph_sock_connect_func)(
  *
  * This convenience function resolves the name using the specified resolver
  * (`PH_SOCK_CONNECT_RESOLVE_SYSTEM` for getaddrinfo)
- * and attempts to connect to the first address resolved.
+ * and connects to the resolved addresses as described for
+ * ph_sock_connect_addrs().  The addresses are ordered so that IPv6 and
+ * IPv4 alternate, starting with the family of the first address resolved.
  *
  * Success or failure is communicated to your ph_sock_connect_func.
  *
@@ -355,6 +590,24 @@ void ph_sock_resolve_and_connect(const char *name, uint16_t port,
     uint16_t protocol, struct timeval *timeout, int resolver,
     ph_sock_connect_func func, void *arg);
 
+/** Connect a socket object to the first of a set of addresses to answer
+ *
+ * Connections are started in the order given, in the style of RFC 8305
+ * "Happy Eyeballs": if an attempt hasn't completed within the attempt
+ * delay (the `$.socket.connect_attempt_delay` configuration value in
+ * milliseconds, default 250), the next address is tried alongside it.
+ * An attempt that fails moves on to the next address immediately.  The
+ * first connection to succeed is passed to `func` and the others are
+ * abandoned; if they all fail, `func` is given the error from the last
+ * one to fail.
+ *
+ * `timeout` bounds the whole process; if NULL, 60 seconds is used.
+ * The addresses are copied, and the socket type is chosen from the
+ * `protocol` of the first one.  `func` is called on an NBIO thread.
+ */
+void ph_sock_connect_addrs(const ph_sockaddr_t *addrs, uint32_t naddrs,
+    struct timeval *timeout, ph_sock_connect_func func, void *arg);
+
 #define PH_SOCK_SHUT_RD   0
 #define PH_SOCK_SHUT_WR   1
 #define PH_SOCK_SHUT_RDWR 2
@@ -383,13 +636,68 @@ static inline int ph_sock_shutdown(ph_sock_t *sock, int how) {
  * You may use this opportunity to perform additional validation
  * of the session.
  *
+ * The sock installs its own info callback on `ssl`.  One that was
+ * already set on `ssl`, or failing that on its `SSL_CTX`, is still
+ * called, ahead of the sock's own handling.
+ *
  * You must supply the SSL object for use by this function and ensure
  * that it is correctly configured (certificates and keys loaded, ciphers
  * selected and so on).
+ *
+ * The `sock` counter scope counts completed handshakes as
+ * `ssl_handshakes`, and those that resumed a session as `ssl_resumed`.
+ *
+ * If `$.socket.ssl_handshake_offload` is set to a non-zero value, the
+ * handshake crypto is done on the `ssl_handshake` thread pool (sized
+ * by `$.threadpool.ssl_handshake.num_threads`, 2 threads by default),
+ * so that a burst of new connections doesn't hold up the other socks
+ * on the emitter.  The sock is handed back to its emitter between
+ * steps, and handshake_cb is still called there.
+ *
+ * Once the handshake is done, data written to the sock stream is
+ * encrypted straight from the caller's memory into wbuf a record at a
+ * time.  Writes smaller than a record are gathered into `sslwbuf` so
+ * that they can share one, as is data that wbuf has no room for yet.
+ * Records are sized dynamically: the first
+ * `$.socket.ssl_small_record_bytes` (default 128k) of the connection go
+ * out in records of `$.socket.ssl_small_record_size` bytes (default
+ * 1360, small enough for a TCP segment), so that the peer can start
+ * decrypting a response as soon as it arrives, and the rest in 16k
+ * records.  Small records are used again after the connection has been
+ * idle for `$.socket.ssl_record_idle_reset` milliseconds (default 1000).
+ * Setting the small record size to 0 always uses 16k records.  Records
+ * are made smaller still if `$.socket.max_buffer_size` can't hold one
+ * along with its header and padding.  The
+ * `sock` counter scope counts `ssl_records`, `ssl_full_records` and
+ * `ssl_staged_bytes`, the plaintext that was copied to `sslwbuf`.
  */
 void ph_sock_openssl_enable(ph_sock_t *sock, SSL *ssl,
     bool is_client, ph_sock_openssl_handshake_func handshake_cb);
 
+/** Have the kernel encrypt and decrypt once the SSL handshake is done
+ *
+ * With kernel TLS (kTLS), the sock hands the keys negotiated by OpenSSL
+ * to the kernel once the handshake completes, and from then on reads
+ * and writes plain data on the connection, leaving the kernel to take
+ * care of the records.  That saves copying everything through the SSL
+ * write buffer and OpenSSL, and lets ph_sock_sendfile() and
+ * ph_sock_splice() use their zero copy paths.
+ *
+ * Call this after ph_sock_openssl_enable() and before enabling the
+ * sock.  `$.socket.ktls` sets the default for new SSL socks; it is off
+ * unless set to a non-zero value.
+ *
+ * If the kernel lacks kTLS, or the session can't be offloaded (see
+ * ph_openssl_ktls_enable()), the sock carries on with OpenSSL, and you
+ * won't notice any difference.  `ktls_tx` and `ktls_rx` on the sock
+ * tell you which directions were offloaded, and the `sock` counter
+ * scope counts the `ktls` and `ktls_fallback` outcomes.
+ *
+ * Anything written to the sock during the handshake is held back until
+ * the switch has been made or abandoned.
+ */
+void ph_sock_openssl_set_ktls(ph_sock_t *sock, bool enable);
+
 
 #ifdef __cplusplus
 }
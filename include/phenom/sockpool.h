@@ -0,0 +1,144 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHENOM_SOCKPOOL_H
+#define PHENOM_SOCKPOOL_H
+
+#include "phenom/socket.h"
+#include "phenom/counter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ph_sock_pool;
+typedef struct ph_sock_pool ph_sock_pool_t;
+
+/** Outbound connection pool
+ *
+ * Keeps connected socket objects around after use, so that later
+ * requests to the same destination can skip name resolution and the
+ * TCP (and SSL) handshakes.
+ *
+ * Connections are keyed by host name, port and `SSL_CTX`.  Idle
+ * connections are kept separately for each NBIO emitter and are only
+ * handed to callers that want a sock on that emitter, so there is no
+ * locking on the checkout and checkin paths.
+ *
+ * Idle connections remain enabled, watching for the peer closing them
+ * or sending unsolicited data, either of which causes them to be
+ * discarded, as does sitting idle for longer than `idle_timeout`.
+ *
+ * The pool maintains a counter scope named `sockpool.NAME`:
+ *
+ * * `hits` - checkouts satisfied by an idle connection
+ * * `misses` - checkouts that had to make a new connection
+ * * `stale` - idle connections found to be dead at checkout
+ * * `connects`, `connect_errors` - outcomes of new connections
+ * * `checkins` - connections returned to the pool
+ * * `evicted` - connections discarded at checkin because the pool was
+ *   full or the connection had unread data
+ * * `expired` - idle connections closed by timeout or by the peer
+ */
+struct ph_sock_pool {
+  // Name: used for accounting
+  char name[64];
+
+  // Maximum idle connections per destination, per emitter
+  uint32_t max_idle;
+  // How long a connection may sit idle before it is closed
+  struct timeval idle_timeout;
+  // Passed to ph_sock_resolve_and_connect()
+  struct timeval connect_timeout;
+  // The timeout_duration of a sock as it is checked out
+  struct timeval io_timeout;
+
+  // Round robin emitter affinity for callers that aren't emitters
+  uint32_t next_affinity;
+  ph_counter_scope_t *counters;
+
+  // One per emitter
+  uint32_t nshards;
+  struct ph_sock_pool_shard *shards;
+  // Shards yet to be torn down by ph_sock_pool_free()
+  uint32_t shards_left;
+};
+
+/** Create a new connection pool
+ *
+ * Must be called after ph_nbio_init().  `max_idle` is the number of
+ * idle connections that are kept for each destination on each emitter.
+ * `idle_timeout` defaults to 60 seconds if NULL.
+ */
+ph_sock_pool_t *ph_sock_pool_new(const char *name, uint32_t max_idle,
+    struct timeval *idle_timeout);
+
+/** Destroy a connection pool
+ *
+ * Closes the idle connections and releases the pool.  Each emitter
+ * tears down its own share of the pool, so the scheduler must be
+ * running; if called from an emitter thread, that emitter's share is
+ * done before this function returns.  There must be no checkouts in
+ * progress, and socks that are still checked out must be freed with
+ * ph_sock_free() rather than checked in.
+ */
+void ph_sock_pool_free(ph_sock_pool_t *pool);
+
+/** Obtain a connected sock for a destination
+ *
+ * If an idle connection to `host` and `port` using `ctx` is available,
+ * it is checked for liveness and handed to `func`.  Otherwise a new
+ * connection is made with ph_sock_resolve_and_connect().  If `ctx` is
+ * not NULL, SSL is enabled on new connections using a new `SSL` from
+ * `ctx` (with `host` as the SNI name) in client mode; `ctx` must
+ * outlive the pool.  If the client session cache is enabled on `ctx`
+ * (see ph_openssl_client_session_cache_enable()), new connections try
+ * to resume the last session made to the same destination.
+ *
+ * The sock is bound to the emitter of the calling thread, or to one
+ * chosen round robin if the caller is not an emitter thread, and `func`
+ * is always invoked on that emitter.  When called from an emitter
+ * thread, a pooled connection is handed over before this function
+ * returns.
+ *
+ * The sock is disabled and has its `timeout_duration` set to the pool's
+ * `io_timeout`; set its callback and enable it as you would for a new
+ * connection.  For a pooled connection, `elapsed` is zero and `addr` is
+ * the peer name of the sock.
+ */
+void ph_sock_pool_checkout(ph_sock_pool_t *pool, const char *host,
+    uint16_t port, SSL_CTX *ctx, ph_sock_connect_func func, void *arg);
+
+/** Return a sock to the pool that it came from
+ *
+ * Call this instead of ph_sock_free() once you've finished with a
+ * connection that is fit for reuse; that is, a complete request and
+ * response have been exchanged.  Call it from the callback of the sock,
+ * or while it is disabled.
+ *
+ * Socks with unread data, that the pool has no room for or that
+ * didn't come from a pool are freed.
+ */
+void ph_sock_pool_checkin(ph_sock_t *sock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
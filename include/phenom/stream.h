@@ -80,6 +80,20 @@ struct ph_stream {
 bool ph_stm_read(ph_stream_t *stm, void *buf,
     uint64_t count, uint64_t *nread);
 
+/** Reads data via scatter-gather interface
+ *
+ * Returns true and sets nread to 0 on EOF.
+ *
+ * Returns false on error. errno is set accordingly, and ph_stm_errno() can
+ * also be used to access that value.
+ *
+ * On an unbuffered stream, this makes a single call to the underlying
+ * readv function, so a read that doesn't fill the iovec indicates that
+ * no more data was available at the time.
+ */
+bool ph_stm_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nread);
+
 /** Requests pre-fetching of data into the read buffer
  *
  * Signals an intent to read `count` bytes of data. If the read buffer
@@ -213,6 +227,43 @@ void ph_stm_unlock(ph_stream_t *stm);
  */
 ph_stream_t *ph_stm_file_open(const char *filename, int oflags, int mode);
 
+/** Construct an asynchronous stream around a regular file descriptor
+ *
+ * Regular files are always "ready" as far as the kernel is concerned,
+ * so reads and writes on an fd stream block the calling thread when
+ * the disk is slow.  An async stream instead performs the IO in the
+ * `fileio` thread pool (configured via `$.threadpool.fileio`) and
+ * behaves like a non-blocking socket stream from the caller's point
+ * of view:
+ *
+ * * A read that cannot be satisfied from data already read fails with
+ *   errno `EAGAIN` and queues a read in the pool.  A write copies the
+ *   data, succeeds immediately and completes in the background.
+ *   While an operation is in flight, other calls fail with `EAGAIN`.
+ * * When an operation completes, `notify` (if not NULL) is woken via
+ *   ph_job_wakeup() and is dispatched with `PH_IOMASK_WAKEUP` on its
+ *   emitter; retry the operation from there.  Errors from a background
+ *   write are reported by the next call on the stream.
+ * * `readahead` sets the minimum number of bytes fetched by each read;
+ *   the excess is held in a ph_bufq_t and satisfies later reads without
+ *   another trip through the pool.  Use `0` to read only as much as
+ *   was asked for.
+ *
+ * The stream is unbuffered and takes ownership of `fd`; it is closed
+ * when the stream is closed.  Closing the stream while an operation
+ * is in flight is safe; the descriptor is released when it finishes.
+ */
+ph_stream_t *ph_stm_fd_open_async(int fd, ph_job_t *notify,
+    uint32_t readahead);
+
+/** Open an asynchronous file stream
+ *
+ * oflags are passed to the open(2) syscall.  See ph_stm_fd_open_async()
+ * for the meaning of `notify` and `readahead`.
+ */
+ph_stream_t *ph_stm_file_open_async(const char *filename, int oflags,
+    int mode, ph_job_t *notify, uint32_t readahead);
+
 /** Open a stream over a string object
  *
  * The returned string will start at position 0; reads will read the
@@ -266,6 +317,8 @@ ph_result_t ph_stm_init(void);
 
 /* functions that operate on a file descriptor */
 extern struct ph_stream_funcs ph_stm_funcs_fd;
+/* functions that operate on an async file stream */
+extern struct ph_stream_funcs ph_stm_funcs_aio;
 
 
 #ifdef __cplusplus
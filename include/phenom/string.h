@@ -162,6 +162,8 @@ struct ph_string {
   char *buf;
   ph_string_t *slice;
   bool onstack;
+  // The arena that the buffer was made in, if any; it grows there too
+  struct ph_arena *arena;
 };
 
 #define PH_STRING_STATIC       PH_MEMTYPE_INVALID
@@ -170,21 +172,21 @@ struct ph_string {
 #define PH_STRING_DECLARE_GROW(name, size, mt) \
   char _str_buf_grow_##name[size]; \
   ph_string_t name = { 1, PH_STRING_GROW_MT(mt), 0, size, \
-    _str_buf_grow_##name, 0, true }
+    _str_buf_grow_##name, 0, true, 0 }
 
 #define PH_STRING_DECLARE_STACK(name, size) \
   char _str_buf_static_##name[size]; \
   ph_string_t name = { 1, PH_STRING_STATIC, 0, size, \
-    _str_buf_static_##name, 0, true }
+    _str_buf_static_##name, 0, true, 0 }
 
 #define PH_STRING_DECLARE_STATIC(name, cstr) \
   ph_string_t name = { 1, PH_STRING_STATIC, sizeof(cstr)-1, \
-    sizeof(cstr), (char*)cstr, 0, true }
+    sizeof(cstr), (char*)cstr, 0, true, 0 }
 
 #define PH_STRING_DECLARE_STATIC_CSTR_INNER(name, cstr, len) \
   uint32_t len = strlen(cstr); \
   ph_string_t name = { 1, PH_STRING_STATIC, len, \
-    len + 1, (char*)cstr, 0, true }
+    len + 1, (char*)cstr, 0, true, 0 }
 #define PH_STRING_DECLARE_STATIC_CSTR(name, cstr) \
   PH_STRING_DECLARE_STATIC_CSTR_INNER(name, cstr, ph_defs_gen_symbol(len))
 
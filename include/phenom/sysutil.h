@@ -89,8 +89,51 @@ double ph_strtod(const char *s00, const char **se);
  */
 ph_result_t ph_library_init(void);
 
+/** Returns the current wall clock time
+ *
+ * When called from a scheduler or worker thread, this returns a
+ * value cached for the current dispatch rather than making a
+ * system call each time.
+ */
 struct timeval ph_time_now(void);
 
+#define PH_NSEC_PER_SEC  UINT64_C(1000000000)
+#define PH_NSEC_PER_MSEC UINT64_C(1000000)
+#define PH_NSEC_PER_USEC UINT64_C(1000)
+
+/** Returns the current monotonic time in nanoseconds
+ *
+ * The value has no relationship to the wall clock and is only
+ * meaningful when compared against other values returned from this
+ * function.  It does not jump when the system clock is changed, which
+ * makes it the right choice for timeouts and for measuring elapsed time.
+ *
+ * Like ph_time_now(), the result is cached per-thread for the
+ * duration of a dispatch on scheduler and worker threads.  Where the
+ * platform offers a coarse monotonic clock (`CLOCK_MONOTONIC_COARSE`)
+ * it is preferred as it can be read without a system call; its
+ * resolution is a few milliseconds, which is finer than the timer
+ * wheel tick.
+ */
+uint64_t ph_time_now_ns(void);
+
+/** Convert a timeval to nanoseconds */
+static inline uint64_t ph_timeval_to_ns(struct timeval tv)
+{
+  return (tv.tv_sec * PH_NSEC_PER_SEC) + (tv.tv_usec * PH_NSEC_PER_USEC);
+}
+
+/** Convert nanoseconds to a timeval */
+static inline struct timeval ph_ns_to_timeval(uint64_t ns)
+{
+  struct timeval tv;
+
+  tv.tv_sec = ns / PH_NSEC_PER_SEC;
+  tv.tv_usec = (ns % PH_NSEC_PER_SEC) / PH_NSEC_PER_USEC;
+
+  return tv;
+}
+
 /** round up to next power of 2 */
 static inline uint32_t ph_power_2(uint32_t n)
 {
@@ -37,15 +37,21 @@ struct ph_nbio_emitter;
 typedef struct ph_thread ph_thread_t;
 
 struct ph_thread {
+  // true if the cached wall clock time in `now` is stale
   bool refresh_time;
+  // true if the cached monotonic time in `now_ns` is stale
+  bool refresh_time_ns;
   // internal monotonic thread id
   uint32_t tid;
 
   PH_STAILQ_HEAD(pdisp, ph_job) pending_nbio, pending_pool;
+  // Work deferred to the end of the emitter's current batch of events
+  PH_STAILQ_HEAD(pbatch, ph_nbio_batch_ent) pending_batch;
   struct ph_nbio_emitter *is_emitter;
 
   int is_worker;
   struct timeval now;
+  uint64_t now_ns;
 
   ck_epoch_record_t epoch_record;
   ck_hs_t counter_hs;
@@ -112,6 +118,18 @@ static inline ph_thread_t *ph_thread_self(void)
   return me;
 }
 
+/** Mark the cached clocks of a thread as stale.
+ *
+ * The next call to ph_time_now() or ph_time_now_ns() on that
+ * thread will consult the system clock.  The schedulers call this
+ * each time they wake up to dispatch work.
+ */
+static inline void ph_thread_refresh_time(ph_thread_t *me)
+{
+  me->refresh_time = true;
+  me->refresh_time_ns = true;
+}
+
 /** Set the name of the currently executing thread.
  * Used for debugging.  libPhenom will set this up
  * when initializing thread pools, you probably don't
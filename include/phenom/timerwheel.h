@@ -57,7 +57,9 @@ PH_LIST_HEAD(
 struct ph_timerwheel_timer {
   PH_LIST_ENTRY(ph_timerwheel_timer) t;
   struct ph_timerwheel_list *list;
-  struct timeval due;
+  // monotonic due time in nanoseconds, as per ph_time_now_ns().
+  // 0 means that no due time is set
+  uint64_t due;
   int enable;
 #define PH_TIMER_DISABLED    0
 #define PH_TIMER_ENABLED     1
@@ -69,7 +71,7 @@ struct ph_timerwheel_timer {
 #define PHENOM_WHEEL_MASK (PHENOM_WHEEL_SIZE - 1)
 
 struct ph_timerwheel {
-  struct timeval next_run;
+  uint64_t next_run;
   uint32_t tick_resolution;
   ck_rwlock_t lock;
   struct {
@@ -81,10 +83,12 @@ typedef struct ph_timerwheel ph_timerwheel_t;
 
 /** Initialize a timerwheel
  * tick_resolution specifies how many milliseconds comprise a tick.
+ * `now` is the current monotonic time in nanoseconds, as returned
+ * by ph_time_now_ns().
  */
 ph_result_t ph_timerwheel_init(
     ph_timerwheel_t *wheel,
-    struct timeval now,
+    uint64_t now,
     uint32_t tick_resolution);
 
 /** Disable a timer that is already in the timerwheel.
@@ -131,14 +135,14 @@ ph_result_t ph_timerwheel_remove(
 typedef bool (*ph_timerwheel_should_dispatch_func_t)(
     ph_timerwheel_t *wheel,
     struct ph_timerwheel_timer *timer,
-    struct timeval now,
+    uint64_t now,
     void *arg);
 
 /* Called by the wheel to actually dispatch a timer */
 typedef void (*ph_timerwheel_dispatch_func_t)(
     ph_timerwheel_t *wheel,
     struct ph_timerwheel_timer *timer,
-    struct timeval now,
+    uint64_t now,
     void *arg);
 
 /** Tick and dispatch any due timer(s).
@@ -147,7 +151,8 @@ typedef void (*ph_timerwheel_dispatch_func_t)(
  * once every tick_resolution milliseconds to avoid
  * falling behind.
  *
- * You supply the current time when you call this function.
+ * You supply the current monotonic time in nanoseconds when you
+ * call this function.
  * The wheel will tick through and dispatch any due (or overdue!)
  * timers by invoking your dispatch function.
  *
@@ -155,7 +160,7 @@ typedef void (*ph_timerwheel_dispatch_func_t)(
  */
 uint32_t ph_timerwheel_tick(
     ph_timerwheel_t *wheel,
-    struct timeval now,
+    uint64_t now,
     ph_timerwheel_should_dispatch_func_t should_dispatch,
     ph_timerwheel_dispatch_func_t dispatch,
     void *arg);
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/stream.h"
+#include "tap.h"
+
+#define LINE "the quick brown fox\n"
+#define NUM_LINES 1000
+
+static ph_stream_t *stm;
+static char namebuf[128];
+static int state = 0;
+static int written = 0;
+static int wakeups = 0;
+static int eagains = 0;
+static uint64_t total = 0;
+static bool content_ok = true;
+
+static void driver(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  char buf[sizeof(LINE)-1];
+  uint64_t n;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(data);
+
+  if (why == PH_IOMASK_WAKEUP) {
+    wakeups++;
+  }
+
+  if (state == 0) {
+    // Only one operation may be in flight at a time
+    ok(ph_stm_write(stm, LINE, sizeof(LINE)-1, &n), "write accepted");
+    is(sizeof(LINE)-1, n);
+    ok(!ph_stm_write(stm, LINE, sizeof(LINE)-1, &n), "busy");
+    is(EAGAIN, ph_stm_errno(stm));
+    written = 1;
+    state = 1;
+    return;
+  }
+
+  if (state == 1) {
+    // Each wakeup means that the previous write completed
+    if (written < NUM_LINES) {
+      if (ph_stm_write(stm, LINE, sizeof(LINE)-1, &n)) {
+        written++;
+      }
+      return;
+    }
+    ok(ph_stm_rewind(stm), "rewound");
+    state = 2;
+  }
+
+  // Reading back
+  while (true) {
+    if (!ph_stm_read(stm, buf, sizeof(buf), &n)) {
+      if (ph_stm_errno(stm) == EAGAIN) {
+        eagains++;
+        return;
+      }
+      fail("read error %d", ph_stm_errno(stm));
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (n != sizeof(buf) || memcmp(buf, LINE, n)) {
+      content_ok = false;
+    }
+    total += n;
+  }
+
+  is(NUM_LINES * (sizeof(LINE)-1), total);
+  ok(content_ok, "content matches");
+  // 64k of read-ahead should cover the whole 20k file in one trip
+  is(1, eagains);
+  is(NUM_LINES + 1, wakeups);
+  ok(ph_stm_close(stm), "closed");
+  unlink(namebuf);
+  ph_sched_stop();
+}
+
+int main(int argc, char **argv)
+{
+  ph_job_t job;
+  int fd;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(15);
+
+  is(PH_OK, ph_nbio_init(0));
+  is(PH_OK, ph_job_init(&job));
+  job.callback = driver;
+
+  strcpy(namebuf, "/tmp/phenomXXXXXX");
+  fd = ph_mkostemp(namebuf, 0);
+  ok(fd != -1, "made temp file %s", namebuf);
+
+  stm = ph_stm_fd_open_async(fd, &job, 64 * 1024);
+  ok(stm != NULL, "made stream");
+
+  ph_job_set_timer_in_ms(&job, 1);
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/arena.h"
+#include "phenom/string.h"
+#include "phenom/variant.h"
+#include "phenom/json.h"
+#include "phenom/sysutil.h"
+#include "tap.h"
+
+#define CHUNK_SIZE 4096
+
+static int64_t mem_bytes(const char *facility, const char *name)
+{
+  ph_mem_stats_t stats;
+
+  ph_mem_stat(ph_mem_type_by_name(facility, name), &stats);
+  return stats.bytes;
+}
+
+static char names[] = "abc";
+static char order[8];
+
+static void record(void *arg)
+{
+  size_t len = strlen(order);
+
+  order[len] = *(char*)arg;
+  order[len + 1] = '\0';
+}
+
+static void test_bump(void)
+{
+  ph_arena_t *arena = ph_arena_new(CHUNK_SIZE);
+  int64_t before = mem_bytes("arena", "chunk");
+  char *a, *b, *big;
+  uint32_t i;
+  bool aligned = true;
+
+  a = ph_arena_alloc(arena, 3);
+  b = ph_arena_alloc(arena, 5);
+  ok(a && b, "allocated");
+  ok(b - a == 16, "rounded up to the alignment");
+  is_int(32, ph_arena_used(arena));
+
+  for (i = 0; i < 1000; i++) {
+    if ((uintptr_t)ph_arena_alloc(arena, i % 37) % 16) {
+      aligned = false;
+    }
+  }
+  ok(aligned, "allocations are aligned");
+  ok(mem_bytes("arena", "chunk") - before > 4 * CHUNK_SIZE,
+      "chained chunks are accounted");
+
+  big = ph_arena_alloc(arena, 4 * CHUNK_SIZE);
+  memset(big, 'x', 4 * CHUNK_SIZE);
+  // The chunk being carved up is still in use
+  a = ph_arena_alloc(arena, 16);
+  b = ph_arena_alloc(arena, 16);
+  ok(b - a == 16, "carried on with the same chunk");
+
+  for (i = 0; i < 3; i++) {
+    ph_arena_defer(arena, record, names + i);
+  }
+
+  ph_arena_reset(arena);
+  is_string("cba", order);
+  is_int(0, ph_arena_used(arena));
+  // One chunk stays for next time
+  ok(mem_bytes("arena", "chunk") - before > CHUNK_SIZE &&
+      mem_bytes("arena", "chunk") - before < 2 * CHUNK_SIZE,
+      "one chunk is kept");
+
+  order[0] = '\0';
+  ph_arena_reset(arena);
+  is_string("", order);
+
+  ph_arena_free(arena);
+  is_int(before, mem_bytes("arena", "chunk"));
+}
+
+static void test_memtypes(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "arenatest", "fixed", 24, PH_MEM_FLAGS_ARENA|PH_MEM_FLAGS_ZERO },
+    { "arenatest", "vsize", 0, PH_MEM_FLAGS_ARENA },
+    { "arenatest", "classes", 0,
+      PH_MEM_FLAGS_ARENA|PH_MEM_FLAGS_SIZE_CLASSES },
+  };
+  ph_memtype_t mt[3];
+  ph_arena_t *arena = ph_arena_new(CHUNK_SIZE);
+  char *fixed, *vsize, *heap, *cls;
+
+  ph_memtype_register_block(3, defs, mt);
+
+  // No current arena: from the heap as usual
+  heap = ph_mem_alloc_size(mt[1], 10);
+  is_int(10, mem_bytes("arenatest", "vsize"));
+
+  is(NULL, ph_arena_set_current(arena));
+  ok(ph_arena_current() == arena, "arena is current");
+
+  fixed = ph_mem_alloc(mt[0]);
+  ok(fixed[0] == 0 && fixed[23] == 0, "zeroed");
+  vsize = ph_mem_alloc_size(mt[1], 100);
+  strcpy(vsize, "hello");
+  ok(ph_arena_used(arena) > 124, "came from the arena");
+  is_int(10, mem_bytes("arenatest", "vsize"));
+  is_int(0, mem_bytes("arenatest", "fixed"));
+
+  // Growing moves to a new arena allocation
+  vsize = ph_mem_realloc(mt[1], vsize, 1000);
+  is_string("hello", vsize);
+  is_int(10, mem_bytes("arenatest", "vsize"));
+
+  // Frees do nothing, whether the arena is current or not
+  ph_mem_free(mt[0], fixed);
+  ph_arena_set_current(NULL);
+  ph_mem_free(mt[1], vsize);
+
+  // Heap memory stays on the heap
+  heap = ph_mem_realloc(mt[1], heap, 20);
+  is_int(20, mem_bytes("arenatest", "vsize"));
+  ph_mem_free(mt[1], heap);
+  is_int(0, mem_bytes("arenatest", "vsize"));
+
+  // From a size class, counted as such
+  fixed = ph_mem_alloc(mt[0]);
+  is_int(32, mem_bytes("arenatest", "fixed"));
+  ph_mem_free(mt[0], fixed);
+  is_int(0, mem_bytes("arenatest", "fixed"));
+
+  // Outgrowing its class while an arena is current keeps it on the heap
+  cls = ph_mem_alloc_size(mt[2], 100);
+  strcpy(cls, "class");
+  ph_arena_set_current(arena);
+  cls = ph_mem_realloc(mt[2], cls, 4000);
+  ph_arena_set_current(NULL);
+  is_string("class", cls);
+  is_int(4000, mem_bytes("arenatest", "classes"));
+  ph_mem_free(mt[2], cls);
+  is_int(0, mem_bytes("arenatest", "classes"));
+
+  ph_arena_free(arena);
+}
+
+static void test_strings(void)
+{
+  ph_arena_t *arena = ph_arena_new(CHUNK_SIZE);
+  ph_memtype_def_t defs[] = {
+    { "arenatest", "string", 0, PH_MEM_FLAGS_ARENA },
+    { "arenatest", "heapstring", 0, 0 },
+  };
+  ph_memtype_t mts[2];
+  ph_memtype_t mt = ph_memtype_register_block(2, defs, mts);
+  int64_t strings = mem_bytes("string", "string");
+  ph_string_t *str, *kept, *plain;
+  PH_STRING_DECLARE_GROW(stack, 4, mts[1]);
+
+  ph_arena_set_current(arena);
+  str = ph_string_make_cstr(mt, "hello");
+  is_int(0, mem_bytes("arenatest", "string"));
+  is_int(strings, mem_bytes("string", "string"));
+
+  // Grows within the arena
+  ph_string_printf(str, " there, %s", "a string that outgrows its buffer");
+  is_int(0, mem_bytes("arenatest", "string"));
+
+  // Strings of memtypes that don't ask for it stay out of the arena,
+  // whether they're made or grown in it
+  ph_string_printf(&stack, "too long for the stack");
+  is_int(32, mem_bytes("arenatest", "heapstring"));
+  ph_string_delref(&stack);
+  plain = ph_string_make_cstr(mts[1], "on the heap");
+  ok(mem_bytes("arenatest", "heapstring") > 0, "memtype not in the arena");
+  ph_string_delref(plain);
+  is_int(0, mem_bytes("arenatest", "heapstring"));
+
+  ph_arena_set_current(NULL);
+  kept = ph_string_make_cstr(mt, "outside");
+  ok(mem_bytes("arenatest", "string") > 0, "heap string");
+  ph_string_delref(kept);
+  is_int(0, mem_bytes("arenatest", "string"));
+
+  // Still grows in the arena it was made in
+  ph_string_printf(str, ", and then %s", "some more, once it isn't current");
+  is_int(0, mem_bytes("arenatest", "string"));
+  ok(ph_string_equal_cstr(str,
+        "hello there, a string that outgrows its buffer, "
+        "and then some more, once it isn't current"),
+      "arena string intact");
+  ph_string_delref(str);
+  ph_arena_free(arena);
+}
+
+static void test_variants(void)
+{
+  ph_arena_t *arena = ph_arena_new(0);
+  int64_t vars = mem_bytes("variant", "variant");
+  int64_t tables = mem_bytes("hashtable", "table");
+  ph_var_err_t err;
+  ph_variant_t *req, *arr, *nested;
+  uint32_t i;
+
+  for (i = 0; i < 3; i++) {
+    ph_arena_set_current(arena);
+    req = ph_json_load_cstr(
+        "{\"name\": \"widget\", \"tags\": [1, 2, 3], "
+        "\"nested\": {\"a\": {\"b\": true}}}", 0, &err);
+    arr = ph_var_array(0);
+    ph_var_array_append_claim(arr, ph_var_int(42));
+    ph_var_object_set_claim_cstr(req, "extra", arr);
+    ph_arena_set_current(NULL);
+
+    ok(req != NULL, "parsed");
+    ok(ph_string_equal_cstr(
+          ph_var_string_val(ph_var_object_get_cstr(req, "name")), "widget"),
+        "name");
+    is_int(3, ph_var_int_val(
+          ph_var_array_get(ph_var_object_get_cstr(req, "tags"), 2)));
+    is_int(vars, mem_bytes("variant", "variant"));
+    ok(mem_bytes("hashtable", "table") > tables, "objects have tables");
+
+    if (i == 1) {
+      // Releasing some references before the reset is fine too
+      nested = ph_var_object_get_cstr(req, "nested");
+      ph_var_addref(nested);
+      ph_var_delref(req);
+      ph_var_delref(nested);
+    }
+
+    ph_arena_reset(arena);
+    is_int(tables, mem_bytes("hashtable", "table"));
+  }
+
+  ph_arena_free(arena);
+}
+
+static void test_grow_elsewhere(void)
+{
+  ph_arena_t *a = ph_arena_new(CHUNK_SIZE), *b = ph_arena_new(CHUNK_SIZE);
+  ph_variant_t *arr;
+  bool intact = true;
+  char *junk;
+  uint32_t i;
+
+  ph_arena_set_current(a);
+  arr = ph_var_array(0);
+
+  // Grown while another arena is current, it stays in its own
+  ph_arena_set_current(b);
+  for (i = 0; i < 100; i++) {
+    ph_var_array_append_claim(arr, ph_var_bool(i % 2));
+  }
+  is_int(0, ph_arena_used(b));
+
+  // Reuses the chunk that the array would have moved into
+  ph_arena_reset(b);
+  junk = ph_arena_alloc(b, 2048);
+  memset(junk, 0xff, 2048);
+  ph_arena_set_current(NULL);
+
+  for (i = 0; i < 100; i++) {
+    if (ph_var_bool_val(ph_var_array_get(arr, i)) != (i % 2)) {
+      intact = false;
+    }
+  }
+  ok(intact, "array intact after the other arena is reset");
+
+  ph_arena_free(b);
+  ph_arena_free(a);
+}
+
+int main(int argc, char **argv)
+{
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(57);
+
+  test_bump();
+  test_memtypes();
+  test_strings();
+  test_variants();
+  test_grow_elsewhere();
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Accepts a stream of short-lived loopback connections, each of which
+ * sends one line and is then closed by the server, and compares the
+ * rate with and without the per-emitter pool of recycled sock shells.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define NUM_CONNS 4000
+#define NUM_CLIENTS 32
+#define REQ "ping\r\n"
+
+enum { MODE_UNPOOLED, MODE_POOLED, MODE_DONE };
+static const char *mode_names[] = { "unpooled", "pooled" };
+
+static int mode = MODE_UNPOOLED;
+static ph_listener_t *lstn;
+static struct sockaddr_in server_addr;
+static uint32_t started, completed;
+static int64_t last_reuse;
+static struct timeval start_wall;
+
+struct client {
+  ph_job_t job;
+  bool sent;
+};
+static struct client clients[NUM_CLIENTS];
+
+static int64_t reuse_delta(void)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, "sock");
+  int64_t val = ph_counter_scope_get(scope, 3);
+  int64_t delta = val - last_reuse;
+
+  ph_counter_scope_delref(scope);
+  last_reuse = val;
+  return delta;
+}
+
+static void set_pool_size(int64_t size)
+{
+  ph_variant_t *cfg = ph_var_object(1);
+  ph_variant_t *sock_cfg = ph_var_object(1);
+
+  ph_var_object_set_claim_cstr(sock_cfg, "shell_pool_size",
+      ph_var_int(size));
+  ph_var_object_set_claim_cstr(cfg, "socket", sock_cfg);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+}
+
+static void start_conn(struct client *c)
+{
+  ph_socket_t s;
+
+  started++;
+  c->sent = false;
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1) {
+    fail("socket: %s", strerror(errno));
+    ph_sched_stop();
+    return;
+  }
+  ph_socket_set_nonblock(s, true);
+  if (connect(s, (struct sockaddr*)&server_addr, sizeof(server_addr)) &&
+      errno != EINPROGRESS) {
+    fail("connect: %s", strerror(errno));
+    close(s);
+    ph_sched_stop();
+    return;
+  }
+  c->job.fd = s;
+  ph_job_set_nbio(&c->job, PH_IOMASK_WRITE, NULL);
+}
+
+static void start_mode(void)
+{
+  int i;
+
+  started = 0;
+  completed = 0;
+  set_pool_size(mode == MODE_POOLED ? 256 : 0);
+  reuse_delta();
+
+  gettimeofday(&start_wall, NULL);
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    start_conn(&clients[i]);
+  }
+}
+
+static void finish_mode(void)
+{
+  struct timeval now, diff;
+  int64_t reused = reuse_delta();
+
+  gettimeofday(&now, NULL);
+  timersub(&now, &start_wall, &diff);
+  diag("%-8s %8.0f conns/s", mode_names[mode],
+      NUM_CONNS / tv_secs(diff));
+
+  if (mode == MODE_POOLED) {
+    ok(reused > NUM_CONNS / 2, "%s: %" PRIi64 " socks reused shells",
+        mode_names[mode], reused);
+  } else {
+    is(0, reused);
+  }
+
+  if (++mode == MODE_DONE) {
+    ph_sched_stop();
+    return;
+  }
+  start_mode();
+}
+
+static void client_cb(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  struct client *c = data;
+  char buf[64];
+  ssize_t n;
+
+  ph_unused_parameter(why);
+
+  if (!c->sent) {
+    if (write(job->fd, REQ, sizeof(REQ) - 1) == -1) {
+      if (errno != EAGAIN && errno != ENOTCONN) {
+        fail("write: %s", strerror(errno));
+        ph_sched_stop();
+        return;
+      }
+      ph_job_set_nbio(job, PH_IOMASK_WRITE, NULL);
+      return;
+    }
+    c->sent = true;
+    ph_job_set_nbio(job, PH_IOMASK_READ, NULL);
+    return;
+  }
+
+  // Wait for the server to hang up
+  while ((n = read(job->fd, buf, sizeof(buf))) > 0) {
+    ;
+  }
+  if (n == -1 && errno == EAGAIN) {
+    ph_job_set_nbio(job, PH_IOMASK_READ, NULL);
+    return;
+  }
+
+  ph_job_set_nbio(job, 0, NULL);
+  close(job->fd);
+  job->fd = -1;
+
+  if (++completed == NUM_CONNS) {
+    finish_mode();
+    return;
+  }
+  if (started < NUM_CONNS) {
+    start_conn(c);
+  }
+}
+
+static void server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (line) {
+    ph_buf_delref(line);
+    ph_sock_free(sock);
+  }
+}
+
+static void acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->callback = server_cb;
+  ph_sock_enable(sock, true);
+}
+
+int main(int argc, char **argv)
+{
+  ph_sockaddr_t addr;
+  socklen_t len = sizeof(server_addr);
+  int i;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(4);
+
+  // One emitter, so that every sock is freed where it is made
+  is(PH_OK, ph_nbio_init(1));
+
+  lstn = ph_listener_new("churn", acceptor);
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+  ph_listener_bind(lstn, &addr);
+  ph_listener_set_backlog(lstn, 1024);
+  getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)&server_addr,
+      &len);
+  ph_listener_enable(lstn, true);
+
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    ph_job_init(&clients[i].job);
+    clients[i].job.callback = client_cb;
+    clients[i].job.data = &clients[i];
+  }
+
+  start_mode();
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Measures the round trip time of an established connection while the
+ * same emitter accepts a storm of SSL connections, with the handshakes
+ * run on the emitter and then on the handshake pool.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include "phenom/thread.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define NUM_CLIENTS 4
+#define HANDSHAKES_PER_CLIENT 100
+#define MAX_PINGS 100000
+#define REQ "hello\r\n"
+
+enum { MODE_INLINE, MODE_OFFLOAD, MODE_DONE };
+static const char *mode_names[] = { "inline", "offload" };
+
+static SSL_CTX *server_ctx, *client_ctx;
+static struct sockaddr_in tls_addr, echo_addr;
+static uint32_t handshakes_done;
+static int storm_over;
+
+static uint64_t pings[MAX_PINGS];
+static uint32_t num_pings;
+
+static void tls_server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (line) {
+    ph_buf_delref(line);
+    ph_stm_write(sock->stream, REQ, sizeof(REQ) - 1, NULL);
+  }
+}
+
+static void tls_acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->free_ssl_ctx = false;
+  ph_sock_openssl_enable(sock, SSL_new(server_ctx), false, NULL);
+  sock->callback = tls_server_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void echo_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  char buf[64];
+  uint64_t n;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  while ((n = ph_bufq_consume_mem(sock->rbuf, buf, sizeof(buf))) > 0) {
+    ph_stm_write(sock->stream, buf, n, NULL);
+  }
+}
+
+static void echo_acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->callback = echo_cb;
+  ph_sock_enable(sock, true);
+}
+
+static ph_listener_t *listen_on(const char *name, ph_listener_accept_func f,
+    struct sockaddr_in *sin)
+{
+  ph_listener_t *lstn = ph_listener_new(name, f);
+  ph_sockaddr_t addr;
+  socklen_t len = sizeof(*sin);
+
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+  ph_listener_bind(lstn, &addr);
+  ph_listener_set_backlog(lstn, 1024);
+  getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)sin, &len);
+  ph_listener_enable(lstn, true);
+  return lstn;
+}
+
+static int connect_to(struct sockaddr_in *sin)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (connect(s, (struct sockaddr*)sin, sizeof(*sin))) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+// Makes full handshakes, one after the other, with blocking IO
+static void *storm_client(void *arg)
+{
+  char buf[64];
+  uint32_t i;
+  SSL *ssl;
+  int s;
+
+  ph_unused_parameter(arg);
+
+  for (i = 0; i < HANDSHAKES_PER_CLIENT; i++) {
+    s = connect_to(&tls_addr);
+    if (s == -1) {
+      continue;
+    }
+    ssl = SSL_new(client_ctx);
+    SSL_set_fd(ssl, s);
+    if (SSL_connect(ssl) == 1 &&
+        SSL_write(ssl, REQ, sizeof(REQ) - 1) > 0 &&
+        SSL_read(ssl, buf, sizeof(buf)) > 0) {
+      ck_pr_inc_32(&handshakes_done);
+    }
+    SSL_free(ssl);
+    close(s);
+  }
+  return NULL;
+}
+
+// Times one byte round trips on an established connection until the
+// storm is over
+static void *pinger(void *arg)
+{
+  struct timeval start, end, diff;
+  char c = 'x';
+  int s = connect_to(&echo_addr);
+
+  ph_unused_parameter(arg);
+
+  while (!ck_pr_load_int(&storm_over) && num_pings < MAX_PINGS) {
+    gettimeofday(&start, NULL);
+    if (write(s, &c, 1) != 1 || read(s, &c, 1) != 1) {
+      break;
+    }
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    pings[num_pings++] = ph_timeval_to_ns(diff);
+    usleep(100);
+  }
+  close(s);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void set_offload(bool enable)
+{
+  ph_variant_t *cfg = ph_var_object(1);
+  ph_variant_t *sock_cfg = ph_var_object(1);
+
+  ph_var_object_set_claim_cstr(sock_cfg, "ssl_handshake_offload",
+      ph_var_int(enable));
+  ph_var_object_set_claim_cstr(cfg, "socket", sock_cfg);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+}
+
+static int64_t offloads(void)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, "sock");
+  int64_t val = ph_counter_scope_get(scope, 8);
+
+  ph_counter_scope_delref(scope);
+  return val;
+}
+
+static void run_mode(int mode)
+{
+  pthread_t clients[NUM_CLIENTS], ping_thr;
+  struct timeval start, end, diff;
+  int64_t before = offloads();
+  int i;
+
+  set_offload(mode == MODE_OFFLOAD);
+  handshakes_done = 0;
+  num_pings = 0;
+  storm_over = 0;
+
+  pthread_create(&ping_thr, NULL, pinger, NULL);
+  gettimeofday(&start, NULL);
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    pthread_create(&clients[i], NULL, storm_client, NULL);
+  }
+  for (i = 0; i < NUM_CLIENTS; i++) {
+    pthread_join(clients[i], NULL);
+  }
+  gettimeofday(&end, NULL);
+  ck_pr_store_int(&storm_over, 1);
+  pthread_join(ping_thr, NULL);
+
+  timersub(&end, &start, &diff);
+  qsort(pings, num_pings, sizeof(pings[0]), compare_u64);
+  diag("%-8s %6.0f handshakes/s, rtt p50 %" PRIu64 "us p99 %" PRIu64
+      "us max %" PRIu64 "us over %" PRIu32 " pings",
+      mode_names[mode],
+      handshakes_done / (diff.tv_sec + diff.tv_usec / 1000000.0),
+      num_pings ? pings[num_pings / 2] / 1000 : 0,
+      num_pings ? pings[num_pings * 99 / 100] / 1000 : 0,
+      num_pings ? pings[num_pings - 1] / 1000 : 0,
+      num_pings);
+
+  is_int(NUM_CLIENTS * HANDSHAKES_PER_CLIENT, handshakes_done);
+  if (mode == MODE_OFFLOAD) {
+    ok(offloads() > before, "%s: handshakes went to the pool",
+        mode_names[mode]);
+  } else {
+    is(before, offloads());
+  }
+}
+
+static void *controller(void *arg)
+{
+  int mode;
+
+  ph_unused_parameter(arg);
+
+  for (mode = MODE_INLINE; mode < MODE_DONE; mode++) {
+    run_mode(mode);
+  }
+  ph_sched_stop();
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  ph_thread_t *thr;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  ph_library_init_openssl();
+  plan_tests(7);
+
+  // One emitter, shared by the storm and the established connection
+  is(PH_OK, ph_nbio_init(1));
+
+  server_ctx = SSL_CTX_new(SSLv23_server_method());
+  ok(use_example_cert(server_ctx), "loaded key and certificate");
+  // Every connection makes a full handshake
+  SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+  client_ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+  listen_on("tls", tls_acceptor, &tls_addr);
+  listen_on("echo", echo_acceptor, &echo_addr);
+
+  thr = ph_thread_spawn(controller, NULL);
+
+  is(PH_OK, ph_sched_run());
+  ph_thread_join(thr, NULL);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Serves a large file over loopback, first with ph_sock_sendfile() and
+ * then by reading it and writing it through the sock stream, and
+ * compares the CPU time spent per GB transferred */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include "phenom/buffer.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define HDR "HEADER\r\n"
+#define HDR_LEN (sizeof(HDR) - 1)
+#define FILE_SIZE (32 * 1024 * 1024)
+#define SEG_SIZE (HDR_LEN + FILE_SIZE)
+#define REPEAT 8
+#define TOTAL_SIZE ((uint64_t)SEG_SIZE * REPEAT)
+// A multiple of 26 so that the file pattern is continuous
+#define FILL_SIZE (26 * 4096 * 10)
+#define COPY_CHUNK (64 * 1024)
+
+enum { MODE_SENDFILE, MODE_COPY, MODE_DONE };
+static const char *mode_names[] = { "sendfile", "read+write" };
+
+static int mode = MODE_SENDFILE;
+static int file_fd;
+static ph_sock_t *sender;
+static ph_job_t receiver;
+static uint64_t queued, received;
+static bool data_ok = true;
+static struct bench_usage usage;
+
+static char expected_byte(uint64_t pos)
+{
+  uint64_t p = pos % SEG_SIZE;
+
+  if (p < HDR_LEN) {
+    return HDR[p];
+  }
+  return 'a' + ((p - HDR_LEN) % 26);
+}
+
+// Checks the ends of the chunk and every header that falls inside it;
+// the headers are where ordering mistakes would show up
+static bool check_chunk(uint64_t pos, const char *buf, uint64_t n)
+{
+  uint64_t b, i;
+
+  if (buf[0] != expected_byte(pos) ||
+      buf[n - 1] != expected_byte(pos + n - 1)) {
+    return false;
+  }
+  for (b = ((pos + SEG_SIZE - 1) / SEG_SIZE) * SEG_SIZE;
+      b < pos + n; b += SEG_SIZE) {
+    for (i = b; i <= b + HDR_LEN && i < pos + n; i++) {
+      if (buf[i - pos] != expected_byte(i)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void start_mode(void)
+{
+  queued = 0;
+  received = 0;
+  data_ok = true;
+  bench_usage_start(&usage);
+  ph_sock_wakeup(sender);
+}
+
+static void finish_mode(void)
+{
+  bench_usage_report(&usage, mode_names[mode], TOTAL_SIZE);
+  ok(data_ok && received == TOTAL_SIZE,
+      "%s: received %" PRIu64 " bytes in order", mode_names[mode], received);
+}
+
+// Keeps the socket full until it pushes back; leaving data in wbuf is
+// what gets us dispatched again once it is writable
+static void top_up_copy(ph_sock_t *sock)
+{
+  char buf[COPY_CHUNK];
+  uint64_t p, nwrote;
+  ssize_t n;
+
+  while (queued < TOTAL_SIZE) {
+    // Flush once another chunk won't fit
+    if (ph_bufq_len(sock->wbuf) + COPY_CHUNK >
+        ph_bufq_get_max_size(sock->wbuf)) {
+      if (!ph_bufq_stm_write(sock->wbuf, sock->conn, NULL)) {
+        return;
+      }
+      continue;
+    }
+    p = queued % SEG_SIZE;
+    if (p < HDR_LEN) {
+      if (!ph_stm_write(sock->stream, HDR + p, HDR_LEN - p, &nwrote)) {
+        nwrote = 0;
+      }
+      queued += nwrote;
+      continue;
+    }
+    p -= HDR_LEN;
+    n = pread(file_fd, buf, MIN(sizeof(buf), FILE_SIZE - p), p);
+    if (n <= 0) {
+      fail("pread: %s", strerror(errno));
+      ph_sched_stop();
+      return;
+    }
+    // A partial write leaves the remainder for the next pass
+    if (!ph_stm_write(sock->stream, buf, n, &nwrote)) {
+      nwrote = 0;
+    }
+    queued += nwrote;
+  }
+}
+
+static void send_more(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  int i;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("sender got why=%x", why);
+    ph_sched_stop();
+    return;
+  }
+
+  switch (mode) {
+    case MODE_SENDFILE:
+      if (queued) {
+        return;
+      }
+      for (i = 0; i < REPEAT; i++) {
+        ph_stm_write(sock->stream, HDR, HDR_LEN, NULL);
+        if (ph_sock_sendfile(sock, file_fd, 0, FILE_SIZE) != PH_OK) {
+          fail("ph_sock_sendfile: %s", strerror(errno));
+          ph_sched_stop();
+          return;
+        }
+      }
+      queued = TOTAL_SIZE;
+      break;
+    case MODE_COPY:
+      top_up_copy(sock);
+      break;
+  }
+}
+
+static void receive(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  char buf[COPY_CHUNK];
+  ssize_t n;
+
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  while ((n = read(job->fd, buf, sizeof(buf))) > 0) {
+    if (data_ok && !check_chunk(received, buf, n)) {
+      data_ok = false;
+    }
+    received += n;
+  }
+
+  if (n == 0 || (n == -1 && errno != EAGAIN)) {
+    fail("receiver: n=%d %s", (int)n, strerror(errno));
+    ph_sched_stop();
+    return;
+  }
+
+  if (received >= TOTAL_SIZE) {
+    finish_mode();
+    if (++mode == MODE_DONE) {
+      ph_sched_stop();
+      return;
+    }
+    start_mode();
+  }
+
+  ph_job_set_nbio(job, PH_IOMASK_READ, 0);
+}
+
+static bool make_file(void)
+{
+  char name[] = "/tmp/phenomXXXXXX";
+  char *fill;
+  uint64_t off;
+  uint32_t i;
+  bool res = true;
+
+  file_fd = ph_mkostemp(name, 0);
+  if (file_fd == -1) {
+    return false;
+  }
+  unlink(name);
+
+  fill = malloc(FILL_SIZE);
+  for (i = 0; i < FILL_SIZE; i++) {
+    fill[i] = 'a' + (i % 26);
+  }
+  for (off = 0; off < FILE_SIZE; off += FILL_SIZE) {
+    uint64_t len = MIN(FILL_SIZE, FILE_SIZE - off);
+
+    if (pwrite(file_fd, fill, len, off) != (ssize_t)len) {
+      res = false;
+      break;
+    }
+  }
+  free(fill);
+  return res;
+}
+
+int main(int argc, char **argv)
+{
+  ph_socket_t server = -1, client = -1;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(7);
+
+  is(PH_OK, ph_nbio_init(1));
+  ok(make_file(), "made %d MB file", FILE_SIZE / (1024 * 1024));
+  ok(make_loopback_pair(&server, &client), "connected over loopback");
+
+  sender = ph_sock_new_from_socket(server, NULL, NULL);
+  ok(sender != NULL, "made sock");
+  sender->callback = send_more;
+  ph_sock_enable(sender, true);
+
+  ph_job_init(&receiver);
+  receiver.fd = client;
+  receiver.callback = receive;
+  ph_job_set_nbio(&receiver, PH_IOMASK_READ, 0);
+
+  start_mode();
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Microbenchmarks for the data paths of ph_sock_t */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include "phenom/buffer.h"
+#include "phenom/printf.h"
+#include "tap.h"
+#include <sys/socket.h>
+
+// As much as the rbuf will hold
+#define FILL_SIZE (128 * 1024)
+#define ROUNDS 200
+
+static char *commaprint(uint64_t n, char *retbuf, uint32_t size)
+{
+  char *p = retbuf + size - 1;
+  int i = 0;
+
+  *p = '\0';
+  do {
+    if (i % 3 == 0 && i != 0) {
+      *--p = ',';
+    }
+    *--p = '0' + n % 10;
+    n /= 10;
+    i++;
+  } while (n != 0);
+
+  return p;
+}
+
+static double elapsed_secs(struct timeval start)
+{
+  struct timeval end, diff;
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+  return diff.tv_sec + (diff.tv_usec / 1000000.0);
+}
+
+static void report(const char *label, uint64_t reads, uint64_t bytes,
+    double secs)
+{
+  char niceb[32];
+
+  diag("%-24s %s reads/s  %.1f MB/s", label,
+      commaprint(reads / secs, niceb, sizeof(niceb)),
+      bytes / secs / (1024 * 1024));
+}
+
+// Reads `size` bytes at a time from the stream until the rbuf is empty
+static void bench_stream_reads(ph_sock_t *sock, const char *fill,
+    uint32_t size)
+{
+  char buf[256], label[64];
+  uint64_t n, reads = 0, bytes = 0;
+  struct timeval start;
+  bool ok_data = true;
+  int r;
+
+  gettimeofday(&start, NULL);
+  for (r = 0; r < ROUNDS; r++) {
+    ph_bufq_append(sock->rbuf, fill, FILL_SIZE, NULL);
+    while (ph_stm_read(sock->stream, buf, size, &n) && n > 0) {
+      if (buf[0] != fill[bytes % FILL_SIZE]) {
+        ok_data = false;
+      }
+      reads++;
+      bytes += n;
+    }
+  }
+
+  ph_snprintf(label, sizeof(label), "stream read %" PRIu32 "b:", size);
+  report(label, reads, bytes, elapsed_secs(start));
+  ok(ok_data && bytes == (uint64_t)FILL_SIZE * ROUNDS,
+      "%" PRIu32 " byte reads saw all the data", size);
+}
+
+// The path that sock_stm_readv used to take: a buf slice per read
+static void bench_slice_reads(ph_bufq_t *q, const char *fill, uint32_t size)
+{
+  char buf[256], label[64];
+  uint64_t reads = 0, bytes = 0, avail;
+  struct timeval start;
+  ph_buf_t *b;
+  int r;
+
+  gettimeofday(&start, NULL);
+  for (r = 0; r < ROUNDS; r++) {
+    ph_bufq_append(q, fill, FILL_SIZE, NULL);
+    while ((avail = MIN(ph_bufq_len(q), size)) > 0) {
+      b = ph_bufq_consume_bytes(q, avail);
+      memcpy(buf, ph_buf_mem(b), avail);
+      ph_buf_delref(b);
+      reads++;
+      bytes += avail;
+    }
+  }
+
+  ph_snprintf(label, sizeof(label), "slice read %" PRIu32 "b:", size);
+  report(label, reads, bytes, elapsed_secs(start));
+}
+
+int main(int argc, char **argv)
+{
+  int pair[2];
+  ph_sock_t *sock;
+  ph_bufq_t *q;
+  char *fill;
+  uint32_t i;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(4);
+
+  is(PH_OK, ph_nbio_init(0));
+  ok(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0, "socketpair");
+
+  fill = malloc(FILL_SIZE);
+  for (i = 0; i < FILL_SIZE; i++) {
+    fill[i] = 'a' + (i % 26);
+  }
+
+  sock = ph_sock_new_from_socket(pair[0], NULL, NULL);
+  q = ph_bufq_new(0);
+
+  bench_slice_reads(q, fill, 16);
+  bench_stream_reads(sock, fill, 16);
+  bench_slice_reads(q, fill, 200);
+  bench_stream_reads(sock, fill, 200);
+
+  ph_bufq_free(q);
+  ph_sock_free(sock);
+  close(pair[1]);
+  free(fill);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
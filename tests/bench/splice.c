@@ -0,0 +1,230 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Proxies a stream between two loopback connections, first by copying
+ * it through the sock callback and then with ph_sock_splice(), and
+ * compares the CPU time spent per GB proxied.
+ *
+ *   writer --> [front sock] ==proxy==> [back sock] --> reader
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include "phenom/buffer.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define TOTAL_SIZE (256 * 1024 * 1024)
+#define EOF_SIZE (1024 * 1024 + 7)
+#define CHUNK (64 * 1024)
+
+enum { MODE_COPY, MODE_SPLICE, MODE_EOF, MODE_DONE };
+static const char *mode_names[] = { "copy", "splice", "splice to EOF" };
+
+static int mode = MODE_COPY;
+static ph_sock_t *front, *back;
+static ph_job_t writer, reader;
+static char pattern[CHUNK + 26];
+static uint64_t sent, received, mode_size;
+static bool data_ok = true;
+static struct bench_usage usage;
+
+static void start_mode(void)
+{
+  sent = 0;
+  received = 0;
+  data_ok = true;
+  mode_size = mode == MODE_EOF ? EOF_SIZE : TOTAL_SIZE;
+
+  if (mode == MODE_SPLICE) {
+    is(PH_OK, ph_sock_splice(front, back, TOTAL_SIZE));
+    is(PH_ERR, ph_sock_splice(front, back, 0));
+    is(EBUSY, errno);
+  } else if (mode == MODE_EOF) {
+    is(PH_OK, ph_sock_splice(front, back, 0));
+  }
+
+  bench_usage_start(&usage);
+  ph_job_set_nbio(&writer, PH_IOMASK_WRITE, 0);
+}
+
+static void next_mode(void)
+{
+  ok(data_ok && received == mode_size,
+      "%s: received %" PRIu64 " bytes in order", mode_names[mode], received);
+  if (++mode == MODE_DONE) {
+    ph_sched_stop();
+    return;
+  }
+  start_mode();
+}
+
+static void write_more(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  ssize_t n;
+
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  while (sent < mode_size) {
+    n = write(job->fd, pattern + (sent % 26), MIN(CHUNK, mode_size - sent));
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        ph_job_set_nbio(job, PH_IOMASK_WRITE, 0);
+      } else {
+        fail("writer: %s", strerror(errno));
+        ph_sched_stop();
+      }
+      return;
+    }
+    sent += n;
+  }
+
+  if (mode == MODE_EOF) {
+    shutdown(job->fd, SHUT_WR);
+  }
+}
+
+static void read_more(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  char buf[CHUNK];
+  ssize_t n;
+
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  while ((n = read(job->fd, buf, sizeof(buf))) > 0) {
+    if (buf[0] != pattern[received % 26] ||
+        buf[n - 1] != pattern[(received + n - 1) % 26]) {
+      data_ok = false;
+    }
+    received += n;
+
+    if (mode != MODE_EOF && received >= mode_size) {
+      bench_usage_report(&usage, mode_names[mode], TOTAL_SIZE);
+      next_mode();
+    }
+  }
+
+  if (n == 0 && mode == MODE_EOF) {
+    // The splice propagated the writer's shutdown
+    next_mode();
+    return;
+  }
+  if (n == 0 || errno != EAGAIN) {
+    fail("reader: n=%d %s", (int)n, strerror(errno));
+    ph_sched_stop();
+    return;
+  }
+
+  ph_job_set_nbio(job, PH_IOMASK_READ, 0);
+}
+
+// The traditional proxy: pull data out of one sock's read buffer and
+// push it into the other's write buffer
+static void front_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("front got why=%x", why);
+    ph_sched_stop();
+    return;
+  }
+
+  if (mode == MODE_COPY && ph_bufq_len(sock->rbuf)) {
+    // Stops when back's write buffer is full; back wakes us up once
+    // it has drained
+    while (ph_bufq_len(sock->rbuf)) {
+      if (!ph_bufq_stm_write(sock->rbuf, back->stream, NULL)) {
+        break;
+      }
+    }
+    ph_sock_wakeup(back);
+  } else if (mode == MODE_EOF && !sock->splice_out) {
+    // Nothing more to read
+    ph_sock_enable(sock, false);
+  }
+}
+
+static void back_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(sock);
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("back got why=%x", why);
+    ph_sched_stop();
+    return;
+  }
+
+  if (mode == MODE_COPY && (why & PH_IOMASK_DRAINED) &&
+      ph_bufq_len(front->rbuf)) {
+    ph_sock_wakeup(front);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  ph_socket_t front_fd = -1, writer_fd = -1, back_fd = -1, reader_fd = -1;
+  uint32_t i;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(13);
+
+  for (i = 0; i < sizeof(pattern); i++) {
+    pattern[i] = 'a' + (i % 26);
+  }
+
+  // One emitter, so that the copy proxy can touch both socks
+  is(PH_OK, ph_nbio_init(1));
+  ok(make_loopback_pair(&front_fd, &writer_fd), "front connection");
+  ok(make_loopback_pair(&reader_fd, &back_fd), "back connection");
+
+  front = ph_sock_new_from_socket(front_fd, NULL, NULL);
+  back = ph_sock_new_from_socket(back_fd, NULL, NULL);
+  ok(front && back, "made socks");
+
+  is(PH_ERR, ph_sock_splice(front, front, 0));
+
+  front->callback = front_cb;
+  back->callback = back_cb;
+  ph_sock_enable(front, true);
+  ph_sock_enable(back, true);
+
+  ph_job_init(&writer);
+  writer.fd = writer_fd;
+  writer.callback = write_more;
+
+  ph_job_init(&reader);
+  reader.fd = reader_fd;
+  reader.callback = read_more;
+  ph_job_set_nbio(&reader, PH_IOMASK_READ, 0);
+
+  start_mode();
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Runs the string and variant workloads in a loop, with their buffers
+ * in a memtype whose allocations carry a header and then in one that
+ * uses the size classes.  The variants' own arrays, tables and JSON
+ * strings always come from the size classes, so compare their rates
+ * across builds to see what the size classes do for them.
+ */
+
+#include "phenom/sysutil.h"
+#include "phenom/string.h"
+#include "phenom/variant.h"
+#include "phenom/json.h"
+#include "tap.h"
+
+#define STRING_ITERS 200000
+#define DOC_ITERS 50000
+
+static const char *doc =
+  "{\"name\": \"widget\", \"id\": 12345, \"price\": 9.99, "
+  "\"tags\": [\"red\", \"green\", \"blue\", \"a somewhat longer tag\"], "
+  "\"sizes\": [1, 2, 3, 4, 5, 6, 7, 8], "
+  "\"owner\": {\"name\": \"someone\", \"email\": \"someone@example.com\"}}";
+
+static double elapsed(struct timeval *start)
+{
+  struct timeval now, diff;
+
+  gettimeofday(&now, NULL);
+  timersub(&now, start, &diff);
+  return diff.tv_sec + (diff.tv_usec / 1000000.0);
+}
+
+// Builds up strings of a few hundred bytes a piece at a time, the way
+// log lines and protocol messages are put together
+static double build_strings(ph_memtype_t mt, uint32_t *len)
+{
+  struct timeval start;
+  ph_string_t *str;
+  uint32_t i, j;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < STRING_ITERS; i++) {
+    str = ph_string_make_empty(mt, 16);
+    for (j = 0; j < 24; j++) {
+      ph_string_printf(str, "field%u=%u; ", j, i);
+    }
+    *len = ph_string_len(str);
+    ph_string_delref(str);
+  }
+  return STRING_ITERS / elapsed(&start);
+}
+
+// Parses a document, adds to it and encodes it again
+static double round_trip(ph_memtype_t mt, bool *intact)
+{
+  struct timeval start;
+  ph_variant_t *var, *arr;
+  ph_var_err_t err;
+  ph_string_t *str;
+  uint32_t i;
+
+  *intact = true;
+  gettimeofday(&start, NULL);
+  for (i = 0; i < DOC_ITERS; i++) {
+    var = ph_json_load_cstr(doc, 0, &err);
+    if (!var) {
+      *intact = false;
+      return 0;
+    }
+    arr = ph_var_array(0);
+    ph_var_array_append_claim(arr, ph_var_int(i));
+    ph_var_array_append_claim(arr, ph_var_string_make_cstr("seen"));
+    ph_var_object_set_claim_cstr(var, "history", arr);
+
+    str = ph_string_make_empty(mt, 64);
+    if (ph_json_dump_string(var, str, 0) != PH_OK ||
+        ph_string_len(str) <= strlen(doc)) {
+      *intact = false;
+    }
+    ph_string_delref(str);
+    ph_var_delref(var);
+  }
+  return DOC_ITERS / elapsed(&start);
+}
+
+int main(int argc, char **argv)
+{
+  ph_memtype_def_t defs[] = {
+    { "vsizebench", "header", 0, 0 },
+    { "vsizebench", "classes", 0, PH_MEM_FLAGS_SIZE_CLASSES },
+  };
+  ph_memtype_t mt[2];
+  double header, classes;
+  uint32_t header_len, classes_len;
+  bool header_ok, classes_ok;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(3);
+
+  ph_memtype_register_block(2, defs, mt);
+
+  header = build_strings(mt[0], &header_len);
+  classes = build_strings(mt[1], &classes_len);
+  is(header_len, classes_len);
+  diag("strings, header: %.0f strings/sec", header);
+  diag("strings, size classes: %.0f strings/sec (%.2fx)",
+      classes, classes / header);
+
+  header = round_trip(mt[0], &header_ok);
+  classes = round_trip(mt[1], &classes_ok);
+  ok(header_ok, "round trips with header strings");
+  ok(classes_ok, "round trips with size class strings");
+  diag("json round trip, header: %.0f docs/sec", header);
+  diag("json round trip, size classes: %.0f docs/sec (%.2fx)",
+      classes, classes / header);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -237,7 +237,7 @@ static struct ph_stream_funcs drain_stm_funcs = {
 static void test_drain_with_size(const char *big_buf, uint32_t big_buf_size,
     uint32_t drain_size)
 {
-  ph_bufq_t *q = ph_bufq_new(128 * 1024);
+  ph_bufq_t *q = ph_bufq_new(big_buf_size);
   uint64_t n;
   ph_result_t res;
   struct drain_check check;
@@ -329,19 +329,303 @@ static void test_record_size_overflow(uint32_t max_size,
     }
   }
 
+  // Whatever was trimmed or consumed is no longer counted
+  is(0, ph_bufq_len(q));
+
   free(data);
   ph_bufq_free(q);
 }
 
+static void test_consume_iov(void)
+{
+  ph_bufq_t *q;
+  char data[20000], out[20000];
+  struct iovec iov[4];
+  uint32_t i;
+
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = 'a' + (i % 26);
+  }
+
+  q = ph_bufq_new(0);
+  // Appending in pieces spreads the data over several 8k buffers
+  for (i = 0; i < sizeof(data); i += 1000) {
+    ph_bufq_append(q, data + i, 1000, NULL);
+  }
+  is(sizeof(data), ph_bufq_len(q));
+
+  memset(out, 0, sizeof(out));
+  iov[0].iov_base = out;
+  iov[0].iov_len = 3;
+  iov[1].iov_base = out + 3;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = out + 3;
+  iov[2].iov_len = 10000;
+  iov[3].iov_base = out + 10003;
+  iov[3].iov_len = 7000;
+  is(17003, ph_bufq_consume_iov(q, iov, 4));
+  is(sizeof(data) - 17003, ph_bufq_len(q));
+
+  // Ask for more than is left
+  is(sizeof(data) - 17003, ph_bufq_consume_mem(q, out + 17003, 8192));
+  ok(!memcmp(data, out, sizeof(data)), "data was copied out in order");
+
+  is(0, ph_bufq_len(q));
+  is(0, ph_bufq_consume_mem(q, out, sizeof(out)));
+
+  // Discarding skips over buffer boundaries too
+  for (i = 0; i < sizeof(data); i += 1000) {
+    ph_bufq_append(q, data + i, 1000, NULL);
+  }
+  is(10500, ph_bufq_discard(q, 10500));
+  is(100, ph_bufq_consume_mem(q, out, 100));
+  ok(!memcmp(data + 10500, out, 100), "discarded data was skipped");
+  is(sizeof(data) - 10600, ph_bufq_discard(q, sizeof(data)));
+  is(0, ph_bufq_len(q));
+
+  ph_bufq_free(q);
+}
+
+// A stream with a fixed amount of data to read, which then reports
+// EAGAIN, as a drained non-blocking socket would, or else reports `err`
+// once and then EOF, as a reset connection would
+struct source {
+  uint32_t size, position;
+  uint32_t calls;
+  int err;
+};
+
+static bool source_stm_readv(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nreadp)
+{
+  struct source *src = stm->cookie;
+  uint64_t n, total = 0;
+  uint32_t j;
+  int i;
+
+  src->calls++;
+  if (src->position == src->size) {
+    if (src->err == -1) {
+      if (nreadp) {
+        *nreadp = 0;
+      }
+      return true;
+    }
+    stm->last_err = src->err ? src->err : EAGAIN;
+    if (src->err) {
+      src->err = -1;
+    }
+    return false;
+  }
+
+  for (i = 0; i < iovcnt && src->position < src->size; i++) {
+    n = MIN(iov[i].iov_len, src->size - src->position);
+    for (j = 0; j < n; j++) {
+      ((char*)iov[i].iov_base)[j] = 'a' + ((src->position + j) % 26);
+    }
+    src->position += n;
+    total += n;
+  }
+
+  if (nreadp) {
+    *nreadp = total;
+  }
+  return true;
+}
+
+static bool source_stm_writev(ph_stream_t *stm, const struct iovec *iov,
+    int iovcnt, uint64_t *nwrotep)
+{
+  ph_unused_parameter(iov);
+  ph_unused_parameter(iovcnt);
+  ph_unused_parameter(nwrotep);
+  stm->last_err = ENOTSUP;
+  return false;
+}
+
+static struct ph_stream_funcs source_stm_funcs = {
+  drain_stm_close,
+  source_stm_readv,
+  source_stm_writev,
+  drain_stm_seek
+};
+
+static bool check_pattern(ph_bufq_t *q, uint32_t len)
+{
+  char *out = malloc(len);
+  uint32_t i;
+  bool good;
+
+  good = ph_bufq_consume_mem(q, out, len) == len;
+  for (i = 0; good && i < len; i++) {
+    good = out[i] == (char)('a' + (i % 26));
+  }
+  free(out);
+  return good;
+}
+
+static void test_stm_read(void)
+{
+  struct source src = { 200 * 1024, 0, 0, 0 };
+  ph_stream_t *stm = ph_stm_make(&source_stm_funcs, &src, 0, 0);
+  ph_bufq_t *q = ph_bufq_new(0);
+  uint64_t n = 0, prev = 0;
+  uint32_t i;
+  bool grew = true;
+
+  // Single reads grow as they keep filling the space offered
+  for (i = 0; i < 4; i++) {
+    ok(ph_bufq_stm_read(q, stm, &n), "read %" PRIu32, i);
+    if (n <= prev) {
+      grew = false;
+    }
+    prev = n;
+  }
+  ok(grew, "read size grew to %" PRIu64, n);
+
+  // Drain the rest, without exceeding the budget
+  ok(ph_bufq_stm_read_bytes(q, stm, 64 * 1024, &n), "budgeted read");
+  is(64 * 1024, n);
+
+  src.calls = 0;
+  ok(ph_bufq_stm_read_bytes(q, stm, UINT64_MAX, &n), "read to EAGAIN");
+  is(src.size - src.position, 0);
+  ok(src.calls <= 3, "drained in %" PRIu32 " calls", src.calls);
+  is(src.size, ph_bufq_len(q));
+  ok(check_pattern(q, src.size), "data arrived in order");
+
+  // Nothing more to read
+  ok(!ph_bufq_stm_read_bytes(q, stm, UINT64_MAX, &n), "would block");
+  is(EAGAIN, ph_stm_errno(stm));
+
+  ph_bufq_free(q);
+  ph_stm_close(stm);
+}
+
+static void test_stm_read_error(void)
+{
+  struct source src = { 1000, 0, 0, ECONNRESET };
+  ph_stream_t *stm = ph_stm_make(&source_stm_funcs, &src, 0, 0);
+  ph_bufq_t *q = ph_bufq_new(0);
+  uint64_t n = 0;
+
+  // The data comes first, and the error that followed it with the
+  // next call, even though the stream would now report EOF
+  ok(ph_bufq_stm_read_bytes(q, stm, UINT64_MAX, &n), "read the data");
+  is(1000, n);
+  ok(!ph_bufq_stm_read_bytes(q, stm, UINT64_MAX, &n), "then the error");
+  is(ECONNRESET, ph_stm_errno(stm));
+  is(0, n);
+  ok(ph_bufq_stm_read_bytes(q, stm, UINT64_MAX, &n), "then EOF");
+  is(0, n);
+  is(1000, ph_bufq_len(q));
+  ok(check_pattern(q, 1000), "data intact");
+
+  ph_bufq_free(q);
+  ph_stm_close(stm);
+}
+
+static int watermark_calls = 0;
+static bool watermark_above = false;
+
+static void watermark_cb(ph_bufq_t *q, bool above, void *arg)
+{
+  ph_unused_parameter(q);
+  ph_unused_parameter(arg);
+  watermark_calls++;
+  watermark_above = above;
+}
+
+static void test_max_size_and_watermarks(void)
+{
+  ph_bufq_t *q = ph_bufq_new(32 * 1024);
+  char data[20 * 1024];
+  uint64_t n;
+
+  memset(data, 'w', sizeof(data));
+  ph_bufq_set_watermarks(q, 8 * 1024, 24 * 1024);
+  ph_bufq_set_watermark_func(q, watermark_cb, NULL);
+
+  is(PH_OK, ph_bufq_append(q, data, sizeof(data), &n));
+  is(sizeof(data), n);
+  is(0, watermark_calls);
+
+  // Crosses the high watermark
+  is(PH_OK, ph_bufq_append(q, data, 10 * 1024, &n));
+  is(1, watermark_calls);
+  ok(watermark_above && ph_bufq_above_watermark(q), "above high");
+
+  // Only part of this fits
+  is(PH_OK, ph_bufq_append(q, data, 5 * 1024, &n));
+  is(2 * 1024, n);
+  is(32 * 1024, ph_bufq_len(q));
+  is(PH_BUSY, ph_bufq_append(q, data, 1, &n));
+  is(0, n);
+
+  // Still above the low watermark
+  is(20 * 1024, ph_bufq_consume_mem(q, data, sizeof(data)));
+  is(1, watermark_calls);
+
+  is(5 * 1024, ph_bufq_consume_mem(q, data, 5 * 1024));
+  is(2, watermark_calls);
+  ok(!watermark_above && !ph_bufq_above_watermark(q), "below low");
+
+  // Back above, then turning the watermarks off lets go of the queue
+  is(PH_OK, ph_bufq_append(q, data, sizeof(data), &n));
+  is(3, watermark_calls);
+  ph_bufq_set_watermarks(q, 0, 0);
+  is(4, watermark_calls);
+  ok(!watermark_above && !ph_bufq_above_watermark(q), "disabled");
+
+  // and nothing more is heard from it
+  is(20 * 1024, ph_bufq_consume_mem(q, data, sizeof(data)));
+  is(PH_OK, ph_bufq_append(q, data, sizeof(data), &n));
+  is(4, watermark_calls);
+
+  ph_bufq_free(q);
+}
+
+static void test_lazy_and_shrink(void)
+{
+  ph_bufq_t *q = ph_bufq_new(0);
+  char data[100];
+
+  memset(data, 'z', sizeof(data));
+  is(0, ph_bufq_get_resident_size(q));
+
+  is(PH_OK, ph_bufq_append(q, data, sizeof(data), NULL));
+  is(8192, ph_bufq_get_resident_size(q));
+
+  // Nothing to release while there is data to consume
+  is(0, ph_bufq_shrink(q));
+  is(sizeof(data), ph_bufq_consume_mem(q, data, sizeof(data)));
+
+  // The consumed buffer is kept for the next append until we shrink
+  is(8192, ph_bufq_get_resident_size(q));
+  is(8192, ph_bufq_shrink(q));
+  is(0, ph_bufq_get_resident_size(q));
+
+  // and it is allocated again on demand
+  is(PH_OK, ph_bufq_append(q, data, sizeof(data), NULL));
+  is(sizeof(data), ph_bufq_len(q));
+
+  ph_bufq_free(q);
+}
+
 int main(int argc, char **argv)
 {
   ph_unused_parameter(argc);
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(372);
+  plan_tests(448);
 
   test_straddle_edges();
+  test_consume_iov();
+  test_stm_read();
+  test_stm_read_error();
+  test_max_size_and_watermarks();
+  test_lazy_and_shrink();
 
   test_drain_and_gc(8    * 1024);
   test_drain_and_gc(16   * 1024);
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include "tap.h"
+
+// Where the connections go:
+// good accepts them, refused has nothing listening and blackhole
+// silently drops the SYN because its accept queue is full
+static ph_sockaddr_t good, refused, blackhole;
+static int phase = 0;
+
+static uint16_t listen_on_loopback(int backlog, ph_socket_t *fdp)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  ph_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, (struct sockaddr*)&sin, sizeof(sin));
+  if (backlog >= 0) {
+    listen(fd, backlog);
+  }
+  getsockname(fd, (struct sockaddr*)&sin, &len);
+  *fdp = fd;
+  return ntohs(sin.sin_port);
+}
+
+static void make_blackhole(void)
+{
+  ph_socket_t fd, c;
+  int i;
+
+  ph_sockaddr_set_v4(&blackhole, "127.0.0.1", 0,
+      listen_on_loopback(0, &fd));
+
+  // Fill the accept queue; nobody ever accepts these
+  for (i = 0; i < 2; i++) {
+    c = ph_socket_for_addr(&blackhole, SOCK_STREAM, PH_SOCK_NONBLOCK);
+    connect(c, &blackhole.sa.sa, ph_sockaddr_socklen(&blackhole));
+  }
+  usleep(100000);
+}
+
+static void next_phase(void);
+
+static uint64_t elapsed_ms(struct timeval *elapsed)
+{
+  return ph_timeval_to_ns(*elapsed) / PH_NSEC_PER_MSEC;
+}
+
+static void connected(ph_sock_t *sock, int overall_status, int errcode,
+    const ph_sockaddr_t *addr, struct timeval *elapsed, void *arg)
+{
+  uint64_t ms = elapsed_ms(elapsed);
+
+  ph_unused_parameter(arg);
+
+  switch (phase) {
+    case 0:
+      is(PH_SOCK_CONNECT_SUCCESS, overall_status);
+      ok(addr && addr->sa.v4.sin_port == good.sa.v4.sin_port,
+          "stalled address was overtaken");
+      ok(ms >= 200 && ms < 2000, "waited for the attempt delay: %" PRIu64
+          "ms", ms);
+      break;
+    case 1:
+      is(PH_SOCK_CONNECT_SUCCESS, overall_status);
+      ok(ms < 200, "refused address didn't hold us up: %" PRIu64 "ms", ms);
+      break;
+    case 2:
+      is(PH_SOCK_CONNECT_ERRNO, overall_status);
+      is(ETIMEDOUT, errcode);
+      break;
+    case 3:
+      is(PH_SOCK_CONNECT_ERRNO, overall_status);
+      is(ECONNREFUSED, errcode);
+      break;
+    case 4:
+      is(PH_SOCK_CONNECT_SUCCESS, overall_status);
+      break;
+  }
+
+  if (sock) {
+    ph_sock_free(sock);
+  }
+
+  phase++;
+  next_phase();
+}
+
+static void next_phase(void)
+{
+  ph_sockaddr_t addrs[3];
+  struct timeval timeout = { 5, 0 };
+  struct timeval short_timeout = { 0, 300000 };
+
+  switch (phase) {
+    case 0:
+      addrs[0] = blackhole;
+      addrs[1] = good;
+      ph_sock_connect_addrs(addrs, 2, &timeout, connected, NULL);
+      return;
+    case 1:
+      addrs[0] = refused;
+      addrs[1] = refused;
+      addrs[2] = good;
+      ph_sock_connect_addrs(addrs, 3, &timeout, connected, NULL);
+      return;
+    case 2:
+      ph_sock_connect_addrs(&blackhole, 1, &short_timeout, connected, NULL);
+      return;
+    case 3:
+      ph_sock_connect_addrs(&refused, 1, &timeout, connected, NULL);
+      return;
+    case 4:
+      ph_sock_resolve_and_connect("127.0.0.1", ntohs(good.sa.v4.sin_port),
+          0, &timeout, PH_SOCK_CONNECT_RESOLVE_SYSTEM, connected, NULL);
+      return;
+    default:
+      ph_sched_stop();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  ph_socket_t good_fd, refused_fd;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(12);
+
+  is(PH_OK, ph_nbio_init(1));
+
+  ph_sockaddr_set_v4(&good, "127.0.0.1", 0, listen_on_loopback(16, &good_fd));
+  ph_sockaddr_set_v4(&refused, "127.0.0.1", 0,
+      listen_on_loopback(-1, &refused_fd));
+  close(refused_fd);
+  make_blackhole();
+
+  next_phase();
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/dgram.h"
+#include "phenom/counter.h"
+#include "tap.h"
+
+#define NUM_PKTS 100
+#define PKT_SIZE 100
+
+enum { MODE_PLAIN, MODE_OFFLOAD, MODE_DONE };
+static const char *mode_names[] = { "plain", "offload" };
+
+static int mode = MODE_PLAIN;
+static ph_dgram_t *rx, *tx;
+static uint32_t received;
+static bool data_ok;
+static int64_t last_counts[4];
+
+// Returns the change in a dgram counter since the last time we looked
+static int64_t counter_delta(int slot)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, "dgram");
+  int64_t val = ph_counter_scope_get(scope, slot);
+  int64_t delta = val - last_counts[slot];
+
+  ph_counter_scope_delref(scope);
+  last_counts[slot] = val;
+  return delta;
+}
+
+static void fill(char *buf, uint32_t seq)
+{
+  uint32_t i;
+
+  for (i = 0; i < PKT_SIZE; i++) {
+    buf[i] = 'a' + ((seq + i) % 26);
+  }
+}
+
+static void tx_cb(ph_dgram_t *dgram, ph_iomask_t why, void *data)
+{
+  char buf[PKT_SIZE];
+  uint32_t i;
+
+  ph_unused_parameter(data);
+
+  if ((why & PH_IOMASK_WAKEUP) == 0) {
+    return;
+  }
+
+  // All of these are sent together once we return
+  for (i = 0; i < NUM_PKTS; i++) {
+    fill(buf, i);
+    if (ph_dgram_send(dgram, &rx->sockname, buf, sizeof(buf)) != PH_OK) {
+      fail("send: %s", strerror(errno));
+      ph_sched_stop();
+      return;
+    }
+  }
+}
+
+static void start_mode(void)
+{
+  int slot;
+
+  received = 0;
+  data_ok = true;
+  for (slot = 0; slot < 4; slot++) {
+    counter_delta(slot);
+  }
+  ph_dgram_wakeup(tx);
+}
+
+static void finish_mode(void)
+{
+  int64_t recv_calls = counter_delta(0), recv_pkts = counter_delta(1);
+  int64_t send_calls = counter_delta(2), send_pkts = counter_delta(3);
+
+  ok(data_ok && received == NUM_PKTS, "%s: received %" PRIu32
+      " datagrams in order", mode_names[mode], received);
+  is(NUM_PKTS, send_pkts);
+  ok(send_calls <= 2, "%s: sent with %" PRIi64 " calls",
+      mode_names[mode], send_calls);
+  ok(recv_calls < NUM_PKTS / 4, "%s: received %" PRIi64
+      " datagrams with %" PRIi64 " calls", mode_names[mode],
+      recv_pkts, recv_calls);
+}
+
+static void next_mode(void)
+{
+  char why_skip[] = "no segmentation offload";
+  ph_result_t res;
+
+  finish_mode();
+
+  if (++mode == MODE_DONE) {
+    ph_sched_stop();
+    return;
+  }
+
+  ph_dgram_enable(rx, false);
+  ph_dgram_enable(tx, false);
+  res = ph_dgram_set_offload(rx, PH_DGRAM_OFFLOAD_RECV);
+  if (res == PH_OK) {
+    res = ph_dgram_set_offload(tx, PH_DGRAM_OFFLOAD_SEND);
+  }
+  if (res != PH_OK) {
+    ok(errno == ENOSYS, "offload unsupported: %s", strerror(errno));
+    skip(4, why_skip);
+    ph_sched_stop();
+    return;
+  }
+  pass("enabled offload");
+  ph_dgram_enable(rx, true);
+  ph_dgram_enable(tx, true);
+  start_mode();
+}
+
+static void rx_cb(ph_dgram_t *dgram, ph_iomask_t why, void *data)
+{
+  char expect[PKT_SIZE];
+  ph_dgram_msg_t msg;
+
+  ph_unused_parameter(data);
+
+  if (why & PH_IOMASK_ERR) {
+    fail("rx got err %s", strerror(dgram->last_err));
+    ph_sched_stop();
+    return;
+  }
+
+  while (ph_dgram_recv(dgram, &msg)) {
+    fill(expect, received);
+    if (msg.len != PKT_SIZE || memcmp(msg.data, expect, PKT_SIZE) ||
+        msg.peer->family != AF_INET ||
+        msg.peer->sa.v4.sin_port != tx->sockname.sa.v4.sin_port) {
+      data_ok = false;
+    }
+    if (++received == NUM_PKTS) {
+      next_mode();
+      return;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  ph_sockaddr_t addr;
+  char big[4096];
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(15);
+
+  is(PH_OK, ph_nbio_init(1));
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+
+  rx = ph_dgram_new_for_addr(&addr);
+  tx = ph_dgram_new_for_addr(&addr);
+  ok(rx && tx, "made dgrams");
+  ok(rx->sockname.sa.v4.sin_port != 0, "rx is bound");
+
+  memset(big, 'x', sizeof(big));
+  is(PH_ERR, ph_dgram_send(tx, &rx->sockname, big, tx->max_size + 1));
+  is(EMSGSIZE, errno);
+
+  rx->callback = rx_cb;
+  tx->callback = tx_cb;
+  ph_dgram_enable(rx, true);
+  ph_dgram_enable(tx, true);
+
+  start_mode();
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -15,9 +15,15 @@
  */
 
 #include "phenom/memory.h"
+#include "phenom/job.h"
 #include "phenom/counter.h"
 #include "phenom/sysutil.h"
 #include "phenom/printf.h"
+#include "phenom/thread.h"
+#include "phenom/hook.h"
+#include "phenom/configuration.h"
+#include "phenom/json.h"
+#include "phenom/stream.h"
 #include "tap.h"
 
 static void dump_mem_stats(void)
@@ -51,6 +57,634 @@ struct widget {
   int aval;
 };
 
+#define NUM_CACHED 100
+#define CACHED_SIZE 256
+#define NUM_THREADS 4
+#define PER_THREAD 10000
+
+static ph_memtype_t cached_mt;
+static void *objs[NUM_CACHED];
+static void *thread_objs[NUM_THREADS][PER_THREAD];
+static pthread_barrier_t barrier;
+
+static void *free_objs(void *arg)
+{
+  uint32_t i;
+
+  ph_unused_parameter(arg);
+  for (i = 0; i < NUM_CACHED; i++) {
+    ph_mem_free(cached_mt, objs[i]);
+  }
+  return NULL;
+}
+
+// Allocates a batch, then frees the batch of the next thread over
+static void *churn(void *arg)
+{
+  uint32_t me = (uint32_t)(intptr_t)arg;
+  uint32_t other = (me + 1) % NUM_THREADS;
+  uint32_t i;
+
+  for (i = 0; i < PER_THREAD; i++) {
+    thread_objs[me][i] = ph_mem_alloc(cached_mt);
+  }
+  pthread_barrier_wait(&barrier);
+  for (i = 0; i < PER_THREAD; i++) {
+    ph_mem_free(cached_mt, thread_objs[other][i]);
+  }
+  return NULL;
+}
+
+static bool was_handed_out(void *ptr, void **list, uint32_t n)
+{
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    if (list[i] == ptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void test_cached(void)
+{
+  ph_memtype_def_t def = {
+    "memtest2", "cached", CACHED_SIZE,
+    PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_CACHED
+  };
+  void *prior[NUM_CACHED];
+  ph_thread_t *thr[NUM_THREADS];
+  ph_mem_stats_t st;
+  uint32_t i, reused = 0;
+  bool zeroed = true;
+  uint64_t cached;
+
+  cached_mt = ph_memtype_register(&def);
+  is_true(cached_mt != PH_MEMTYPE_INVALID);
+
+  for (i = 0; i < NUM_CACHED; i++) {
+    objs[i] = ph_mem_alloc(cached_mt);
+    memset(objs[i], 'x', CACHED_SIZE);
+  }
+  for (i = 0; i < NUM_CACHED; i++) {
+    ph_mem_free(cached_mt, objs[i]);
+  }
+  memcpy(prior, objs, sizeof(objs));
+
+  ph_mem_stat(cached_mt, &st);
+  is(NUM_CACHED, st.allocs);
+  is(NUM_CACHED, st.frees);
+  is(0, st.bytes);
+  is(NUM_CACHED * CACHED_SIZE, st.cached);
+
+  // They come back from the cache, cleared
+  for (i = 0; i < NUM_CACHED; i++) {
+    objs[i] = ph_mem_alloc(cached_mt);
+    if (was_handed_out(objs[i], prior, NUM_CACHED)) {
+      reused++;
+    }
+    if (((char*)objs[i])[0] != 0 || ((char*)objs[i])[CACHED_SIZE - 1]) {
+      zeroed = false;
+    }
+  }
+  is(NUM_CACHED, reused);
+  ok(zeroed, "reused objects were zeroed");
+  ph_mem_stat(cached_mt, &st);
+  is(2 * NUM_CACHED, st.allocs);
+  is(NUM_CACHED * CACHED_SIZE, st.bytes);
+  is(0, st.cached);
+
+  // Freed on another thread, which hands them to the depot as it exits
+  thr[0] = ph_thread_spawn(free_objs, NULL);
+  ph_thread_join(thr[0], NULL);
+  ph_mem_stat(cached_mt, &st);
+  is(0, st.bytes);
+  is(NUM_CACHED * CACHED_SIZE, st.cached);
+
+  reused = 0;
+  for (i = 0; i < NUM_CACHED; i++) {
+    objs[i] = ph_mem_alloc(cached_mt);
+    if (was_handed_out(objs[i], prior, NUM_CACHED)) {
+      reused++;
+    }
+  }
+  is(NUM_CACHED, reused);
+  ph_mem_stat(cached_mt, &st);
+  is(0, st.cached);
+
+  // Every thread frees what another allocated
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i = 0; i < NUM_THREADS; i++) {
+    thr[i] = ph_thread_spawn(churn, (void*)(intptr_t)i);
+  }
+  for (i = 0; i < NUM_THREADS; i++) {
+    ph_thread_join(thr[i], NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  ph_mem_stat(cached_mt, &st);
+  is(3 * NUM_CACHED + NUM_THREADS * PER_THREAD, st.allocs);
+  is(2 * NUM_CACHED + NUM_THREADS * PER_THREAD, st.frees);
+  is(NUM_CACHED * CACHED_SIZE, st.bytes);
+
+  for (i = 0; i < NUM_CACHED; i++) {
+    ph_mem_free(cached_mt, objs[i]);
+  }
+  ph_mem_stat(cached_mt, &st);
+  is(0, st.bytes);
+  is(st.allocs, st.frees);
+  cached = st.cached;
+  ok(cached >= NUM_CACHED * CACHED_SIZE && cached % CACHED_SIZE == 0,
+      "%" PRIu64 " bytes cached", cached);
+
+  // What sits in the depot for a couple of trim intervals is released
+  for (i = 0; i < 2; i++) {
+    ph_mem_cache_flush();
+    usleep(1100000);
+    ph_mem_free(cached_mt, ph_mem_alloc(cached_mt));
+  }
+  ph_mem_stat(cached_mt, &st);
+  diag("%" PRIu64 " bytes cached after trimming", st.cached);
+  ok(st.cached < cached, "depot gave back unused objects");
+  is(0, st.bytes);
+}
+
+static ph_memtype_t idle_mt;
+
+static void check_idle_cache(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  ph_mem_stats_t st;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  ph_mem_stat(idle_mt, &st);
+  is(0, st.cached);
+  ph_sched_stop();
+}
+
+// Nothing allocates, yet the idle emitter trims the depot
+static void test_idle_trim(void)
+{
+  ph_memtype_def_t def = {
+    "memtest2", "idle", CACHED_SIZE, PH_MEM_FLAGS_CACHED
+  };
+  ph_variant_t *cfg;
+  ph_var_err_t err;
+  ph_mem_stats_t st;
+  ph_job_t timer;
+  uint32_t i;
+
+  idle_mt = ph_memtype_register(&def);
+  for (i = 0; i < NUM_CACHED; i++) {
+    objs[i] = ph_mem_alloc(idle_mt);
+  }
+  for (i = 0; i < NUM_CACHED; i++) {
+    ph_mem_free(idle_mt, objs[i]);
+  }
+  ph_mem_cache_flush();
+  ph_mem_stat(idle_mt, &st);
+  is(NUM_CACHED * CACHED_SIZE, st.cached);
+
+  cfg = ph_json_load_cstr("{\"nbio\": {\"max_sleep\": 50}}", 0, &err);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+
+  is(PH_OK, ph_nbio_init(1));
+  is(PH_OK, ph_job_init(&timer));
+  timer.callback = check_idle_cache;
+  // Two trim intervals, and then some
+  ph_job_set_timer_in_ms(&timer, 2500);
+  is(PH_OK, ph_sched_run());
+}
+
+#define NUM_POOLED 5000
+
+static ph_memtype_t pooled_mt;
+static void *pooled[NUM_POOLED];
+
+static void *free_pooled(void *arg)
+{
+  uint32_t i;
+
+  ph_unused_parameter(arg);
+  for (i = 0; i < NUM_POOLED; i++) {
+    ph_mem_free(pooled_mt, pooled[i]);
+  }
+  return NULL;
+}
+
+static int64_t slab_bytes(void)
+{
+  ph_mem_stats_t st;
+
+  ph_mem_stat(ph_mem_type_by_name("pool", "slab"), &st);
+  return st.bytes;
+}
+
+static void test_size_classes(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "memtest6", "pooled", 0, PH_MEM_FLAGS_SIZE_CLASSES },
+    { "memtest6", "zeroed", 0, PH_MEM_FLAGS_ZERO|PH_MEM_FLAGS_SIZE_CLASSES },
+  };
+  ph_memtype_t mt[2];
+  ph_mem_stats_t st;
+  ph_thread_t *thr;
+  char *a, *b, *z;
+  int64_t slabs;
+  uint32_t i;
+
+  ph_memtype_register_block(2, defs, mt);
+  pooled_mt = mt[0];
+
+  a = ph_mem_alloc_size(mt[0], 20);
+  strcpy(a, "hello");
+  ph_mem_stat(mt[0], &st);
+  is(32, st.bytes);
+  is(1, st.allocs);
+
+  b = ph_mem_realloc(mt[0], a, 30);
+  ok(a == b, "grew within the class");
+  ph_mem_stat(mt[0], &st);
+  is(32, st.bytes);
+  is(1, st.reallocs);
+
+  a = ph_mem_realloc(mt[0], b, 100);
+  ok(a != b, "moved to a bigger class");
+  is_string("hello", a);
+  ph_mem_stat(mt[0], &st);
+  is(112, st.bytes);
+
+  // Too big for a class; from the heap, with a header
+  a = ph_mem_realloc(mt[0], a, 3000);
+  is_string("hello", a);
+  ph_mem_stat(mt[0], &st);
+  is(3000, st.bytes);
+  a = ph_mem_realloc(mt[0], a, 10);
+  is_string("hello", a);
+  ph_mem_stat(mt[0], &st);
+  is(10, st.bytes);
+  ph_mem_free(mt[0], a);
+  ph_mem_stat(mt[0], &st);
+  is(0, st.bytes);
+
+  z = ph_mem_alloc_size(mt[1], 40);
+  ok(z[0] == 0 && z[47] == 0, "zeroed to the end of the class");
+  memset(z, 'x', 40);
+  z = ph_mem_realloc(mt[1], z, 36);
+  z = ph_mem_realloc(mt[1], z, 48);
+  ok(z[35] == 'x' && z[36] == 0 && z[47] == 0, "grown part is zeroed");
+  ph_mem_free(mt[1], z);
+
+  // Enough to need more slabs
+  slabs = slab_bytes();
+  for (i = 0; i < NUM_POOLED; i++) {
+    pooled[i] = ph_mem_alloc_size(mt[0], 64);
+  }
+  ok(slab_bytes() - slabs >= 4 * 65536, "carved from new slabs");
+  ph_mem_stat(mt[0], &st);
+  is(NUM_POOLED * 64, st.bytes);
+
+  // Freed on another thread, and reused here
+  thr = ph_thread_spawn(free_pooled, NULL);
+  ph_thread_join(thr, NULL);
+  ph_mem_stat(mt[0], &st);
+  is(0, st.bytes);
+
+  slabs = slab_bytes();
+  for (i = 0; i < NUM_POOLED; i++) {
+    pooled[i] = ph_mem_alloc_size(mt[0], 64);
+  }
+  is(slabs, slab_bytes());
+  for (i = 0; i < NUM_POOLED; i++) {
+    ph_mem_free(mt[0], pooled[i]);
+  }
+}
+
+#define BENCH_ITERS 2000000
+
+static double elapsed(struct timeval *start)
+{
+  struct timeval now, diff;
+
+  gettimeofday(&now, NULL);
+  timersub(&now, start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+// Times alloc/free pairs with the accounting done as it used to be, by
+// looking up the thread's counter block on every call, and as it is now
+static void bench_accounting(void)
+{
+  ph_memtype_def_t def = { "memtest3", "bench", 64, 0 };
+  ph_memtype_t mt = ph_memtype_register(&def);
+  ph_counter_scope_t *scope;
+  ph_counter_block_t *block;
+  static const uint8_t alloc_slots[2] = { 0, 2 };
+  static const uint8_t free_slots[2] = { 0, 3 };
+  int64_t alloc_values[2] = { 64, 1 }, free_values[2] = { -64, 1 };
+  struct timeval start;
+  double lookup, direct;
+  ph_mem_stats_t st;
+  uint32_t i;
+  void *ptr;
+
+  scope = ph_counter_scope_resolve(NULL, "memory.memtest3.bench");
+  ok(scope != NULL, "resolved the bench memtype scope");
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_ITERS; i++) {
+    ptr = malloc(64);
+    block = ph_counter_block_open(scope);
+    ph_counter_block_bulk_add(block, 2, alloc_slots, alloc_values);
+    ph_counter_block_delref(block);
+    free(ptr);
+    block = ph_counter_block_open(scope);
+    ph_counter_block_bulk_add(block, 2, free_slots, free_values);
+    ph_counter_block_delref(block);
+  }
+  lookup = BENCH_ITERS / elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_ITERS; i++) {
+    ph_mem_free(mt, ph_mem_alloc(mt));
+  }
+  direct = BENCH_ITERS / elapsed(&start);
+
+  diag("per-call block lookup: %.0f allocs/sec", lookup);
+  diag("per-thread block array: %.0f allocs/sec (%.2fx)",
+      direct, direct / lookup);
+
+  ph_mem_stat(mt, &st);
+  is(2 * BENCH_ITERS, st.allocs);
+  is(2 * BENCH_ITERS, st.frees);
+  is(0, st.bytes);
+
+  ph_counter_scope_delref(scope);
+}
+
+static uint32_t pressure[16];
+static uint32_t num_pressure;
+
+static void on_pressure(ph_hook_invocation_t *inv, void *closure,
+    uint8_t nargs, void **args)
+{
+  ph_unused_parameter(inv);
+  ph_unused_parameter(closure);
+  ph_unused_parameter(nargs);
+
+  if (strcmp(args[0], "memtest4") == 0 &&
+      num_pressure < sizeof(pressure) / sizeof(pressure[0])) {
+    pressure[num_pressure++] = *(uint32_t*)args[4];
+  }
+}
+
+static void test_limits(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "memtest4", "a", 100, 0 },
+    { "memtest4", "b", 0, 0 },
+  };
+  ph_memtype_t mt[2];
+  uint8_t soft[] = { 80, 50 };
+  uint8_t bad[] = { 100 };
+  void *ptrs[11];
+  char *buf, *grown;
+  ph_mem_stats_t st;
+  ph_mem_facility_stats_t fac[8];
+  ph_var_err_t err;
+  ph_variant_t *cfg;
+  int i, n;
+  bool found = false;
+
+  ph_memtype_register_block(2, defs, mt);
+  ph_hook_register_cstr(PH_MEM_PRESSURE_HOOK_NAME, on_pressure,
+      NULL, 0, NULL);
+
+  is(PH_ERR, ph_mem_set_limit(mt[0], 1000, 1, bad));
+  is(PH_OK, ph_mem_set_limit(mt[0], 1000, 2, soft));
+  ph_mem_stat(mt[0], &st);
+  is(1000, st.limit);
+
+  for (i = 0; i < 10; i++) {
+    ptrs[i] = ph_mem_alloc(mt[0]);
+  }
+  ok(ptrs[9] != NULL, "allocated up to the limit");
+  is(2, num_pressure);
+  is(50, pressure[0]);
+  is(80, pressure[1]);
+
+  ptrs[10] = ph_mem_alloc(mt[0]);
+  ok(ptrs[10] == NULL, "refused over the limit");
+  ph_mem_stat(mt[0], &st);
+  is(1, st.oom);
+  is(1000, st.bytes);
+  is(3, num_pressure);
+  is(100, pressure[2]);
+
+  ph_mem_free(mt[0], ptrs[9]);
+  is(4, num_pressure);
+  is(80, pressure[3]);
+  for (i = 0; i < 9; i++) {
+    ph_mem_free(mt[0], ptrs[i]);
+  }
+  is(6, num_pressure);
+  is(50, pressure[4]);
+  is(0, pressure[5]);
+
+  is(PH_OK, ph_mem_set_limit(mt[0], 0, 0, NULL));
+  ptrs[0] = ph_mem_alloc(mt[0]);
+  ph_mem_free(mt[0], ptrs[0]);
+  is(6, num_pressure);
+
+  // A facility limit covers variable sized allocations too
+  buf = ph_mem_alloc_size(mt[1], 1000);
+  is(PH_OK, ph_mem_set_facility_limit("memtest4", 2000, 0, NULL));
+  strcpy(buf, "hello");
+  grown = ph_mem_realloc(mt[1], buf, 2500);
+  ok(grown == NULL, "realloc refused");
+  is_string("hello", buf);
+  grown = ph_mem_realloc(mt[1], buf, 1500);
+  ok(grown != NULL, "realloc within the limit");
+  buf = grown;
+
+  n = ph_mem_stat_facility_limits(sizeof(fac) / sizeof(fac[0]), fac);
+  for (i = 0; i < n; i++) {
+    if (strcmp(fac[i].facility, "memtest4") == 0) {
+      found = fac[i].limit == 2000 && fac[i].bytes == 1500;
+    }
+  }
+  ok(found, "facility limit is reported");
+
+  ok(ph_mem_alloc_size(mt[1], 1000) == NULL, "alloc refused");
+  ph_mem_free(mt[1], buf);
+  is(PH_OK, ph_mem_set_facility_limit("memtest4", 0, 0, NULL));
+  n = ph_mem_stat_facility_limits(sizeof(fac) / sizeof(fac[0]), fac);
+  found = false;
+  for (i = 0; i < n; i++) {
+    if (strcmp(fac[i].facility, "memtest4") == 0) {
+      found = true;
+    }
+  }
+  ok(!found, "facility limit removed");
+
+  // Limits from the configuration are picked up when it is set
+  cfg = ph_json_load_cstr("{\"memory\": {\"limits\": "
+      "{\"memtest4/b\": {\"limit\": 4096, \"soft\": [50]}}}}", 0, &err);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+  buf = ph_mem_alloc_size(mt[1], 3000);
+  ph_mem_stat(mt[1], &st);
+  is(4096, st.limit);
+  ok(ph_mem_alloc_size(mt[1], 2000) == NULL, "config limit enforced");
+  ph_mem_free(mt[1], buf);
+
+  // and dropped when it changes
+  cfg = ph_var_object(0);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+  buf = ph_mem_alloc_size(mt[1], 5000);
+  ok(buf != NULL, "config limit removed");
+  ph_mem_stat(mt[1], &st);
+  is(0, st.limit);
+  ph_mem_free(mt[1], buf);
+}
+
+// Dumps the heap profile into a NUL terminated string
+static ph_string_t *dump_prof(ph_memtype_t mt, bool *dumped)
+{
+  ph_string_t *str = ph_string_make_empty(mt, 16384);
+  ph_stream_t *stm = ph_stm_string_open(str);
+
+  *dumped = ph_mem_prof_dump(stm);
+  ph_stm_close(stm);
+  ph_string_append_buf(str, "", 1);
+  return str;
+}
+
+static void test_prof(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "memtest5", "prof", 0, 0 },
+    { "memtest5", "dump", 0, 0 },
+  };
+  ph_memtype_t mt[2];
+  void *ptrs[10];
+  ph_string_t *str;
+  bool dumped;
+  int i;
+
+  ph_memtype_register_block(2, defs, mt);
+
+  str = dump_prof(mt[1], &dumped);
+  ok(!dumped, "nothing to dump while disabled");
+  ph_string_delref(str);
+
+  // Every allocation is at least one interval
+  ph_mem_prof_set_sample_bytes(1);
+  is(1, ph_mem_prof_get_sample_bytes());
+  for (i = 0; i < 10; i++) {
+    ptrs[i] = ph_mem_alloc_size(mt[0], 100);
+  }
+
+  str = dump_prof(mt[1], &dumped);
+  ok(dumped, "dumped");
+  ok(strncmp(str->buf, "heap profile: ", 14) == 0, "header");
+  ok(strstr(str->buf, " @ heap_v2/1\n") != NULL, "sample rate");
+  ok(strstr(str->buf, "\n10: 1000 [10: 1000] @ 0x") != NULL,
+      "allocations from the same stack share a bucket");
+  ok(strstr(str->buf, "\n# memtest5/prof\n") != NULL, "memtype named");
+  ok(strstr(str->buf, "\nMAPPED_LIBRARIES:\n") != NULL, "maps");
+  ph_string_delref(str);
+
+  for (i = 0; i < 4; i++) {
+    ph_mem_free(mt[0], ptrs[i]);
+  }
+  str = dump_prof(mt[1], &dumped);
+  ok(strstr(str->buf, "\n6: 600 [10: 1000] @ 0x") != NULL,
+      "frees are forgotten");
+  ph_string_delref(str);
+
+  // Changing the rate starts over
+  ph_mem_prof_set_sample_bytes(1024 * 1024);
+  str = dump_prof(mt[1], &dumped);
+  ok(dumped, "still enabled");
+  ok(strstr(str->buf, "memtest5/prof") == NULL, "samples discarded");
+  ph_string_delref(str);
+
+  ph_mem_prof_set_sample_bytes(0);
+  for (i = 4; i < 10; i++) {
+    ph_mem_free(mt[0], ptrs[i]);
+  }
+  str = dump_prof(mt[1], &dumped);
+  ok(!dumped, "disabled");
+  ph_string_delref(str);
+}
+
+// Grows buffers the way strings and variant arrays do
+static double grow_buffers(ph_memtype_t mt)
+{
+  struct timeval start;
+  uint32_t i, size;
+  char *buf;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_ITERS / 8; i++) {
+    buf = ph_mem_alloc_size(mt, 16);
+    for (size = 32; size <= 1024; size *= 2) {
+      buf = ph_mem_realloc(mt, buf, size);
+      buf[size - 1] = 0;
+    }
+    ph_mem_free(mt, buf);
+  }
+  return BENCH_ITERS / 8 / elapsed(&start);
+}
+
+// Batches of differently sized allocations, freed together
+static double mixed_sizes(ph_memtype_t mt)
+{
+  struct timeval start;
+  uint32_t i, j;
+  void *ptrs[64];
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < BENCH_ITERS / 64; i++) {
+    for (j = 0; j < 64; j++) {
+      ptrs[j] = ph_mem_alloc_size(mt, 8 + j * 8);
+    }
+    for (j = 0; j < 64; j++) {
+      ph_mem_free(mt, ptrs[j]);
+    }
+  }
+  return BENCH_ITERS / elapsed(&start);
+}
+
+static void bench_size_classes(void)
+{
+  ph_memtype_def_t defs[] = {
+    { "memtest7", "header", 0, 0 },
+    { "memtest7", "classes", 0, PH_MEM_FLAGS_SIZE_CLASSES },
+  };
+  ph_memtype_t mt[2];
+  double header, classes;
+
+  ph_memtype_register_block(2, defs, mt);
+
+  header = grow_buffers(mt[0]);
+  classes = grow_buffers(mt[1]);
+  diag("grow 16 to 1024 bytes, header: %.0f buffers/sec", header);
+  diag("grow 16 to 1024 bytes, size classes: %.0f buffers/sec (%.2fx)",
+      classes, classes / header);
+
+  header = mixed_sizes(mt[0]);
+  classes = mixed_sizes(mt[1]);
+  diag("mixed 8 to 512 bytes, header: %.0f allocs/sec", header);
+  diag("mixed 8 to 512 bytes, size classes: %.0f allocs/sec (%.2fx)",
+      classes, classes / header);
+}
+
 int main(int argc, char** argv)
 {
   uint32_t i;
@@ -59,7 +693,7 @@ int main(int argc, char** argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(46);
+  plan_tests(139);
 
   ph_memtype_def_t defs[] = {
     { "memtest1", "widget", sizeof(struct widget), PH_MEM_FLAGS_ZERO },
@@ -160,6 +794,14 @@ int main(int argc, char** argv)
   is(3, st.frees);
   is(1, st.reallocs);
 
+  test_cached();
+  test_limits();
+  test_prof();
+  test_size_classes();
+  bench_accounting();
+  bench_size_classes();
+  test_idle_trim();
+
   dump_mem_stats();
 
   return exit_status();
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "tap.h"
+#include <signal.h>
+
+static int hups = 0;
+
+static void on_signal(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  ph_job_siginfo_t info;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(data);
+
+  is(PH_IOMASK_SIGNAL, why);
+
+  if (ph_job_get_siginfo(SIGHUP, &info)) {
+    is(SIGHUP, info.signo);
+    ok(info.count >= 1, "got %u SIGHUP", info.count);
+    is(getpid(), info.pid);
+    hups++;
+    // Now send the next one; it has to come back through the emitter
+    kill(getpid(), SIGUSR1);
+    return;
+  }
+
+  ok(ph_job_get_siginfo(SIGUSR1, &info), "got SIGUSR1");
+  is(SIGUSR1, info.signo);
+  ok(!ph_job_get_siginfo(SIGUSR1, &info), "count was reset");
+  is(1, hups);
+
+  ph_sched_stop();
+}
+
+int main(int argc, char **argv)
+{
+  ph_job_t job, other;
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(21);
+
+  is(PH_OK, ph_nbio_init(0));
+  is(PH_OK, ph_job_init(&job));
+  is(PH_OK, ph_job_init(&other));
+  job.callback = on_signal;
+
+  is(PH_ERR, ph_job_set_signal(&job, SIGKILL));
+  is(EINVAL, errno);
+
+  is(PH_OK, ph_job_set_signal(&job, SIGHUP));
+  is(PH_OK, ph_job_set_signal(&job, SIGUSR1));
+  is(PH_EXISTS, ph_job_set_signal(&other, SIGUSR1));
+
+  is(PH_OK, ph_job_set_signal(&other, SIGUSR2));
+  is(PH_OK, ph_job_clear_signal(SIGUSR2));
+  is(PH_NOENT, ph_job_clear_signal(SIGUSR2));
+
+  // Signal is blocked, so this is left pending until the emitter
+  // collects it
+  kill(getpid(), SIGHUP);
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,338 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include "phenom/counter.h"
+#include "phenom/configuration.h"
+#include "tap.h"
+
+#define MSG "hello\n"
+#define MSG_LEN (sizeof(MSG) - 1)
+#define BURST 100
+#define IDLE_RELEASE_MS 100
+
+static ph_sock_t *sock;
+static ph_job_t driver;
+static int peer;
+static int phase = 0;
+static int writes = 0;
+static int64_t last_writev = 0, last_bytes = 0;
+static char readbuf[2 * BURST * MSG_LEN];
+static uint64_t nread = 0;
+static char scratch[16384];
+
+// What the sock callback does with its dispatches
+enum {
+  MODE_BURST,
+  // Write until the write buffer is full
+  MODE_FILL,
+  // Wait for PH_IOMASK_DRAINED
+  MODE_DRAIN,
+  // Don't consume what we read
+  MODE_HOLD,
+  // Consume everything we read
+  MODE_CONSUME,
+};
+static int mode = MODE_BURST;
+static bool got_drained = false;
+static uint64_t peer_wrote = 0, consumed = 0;
+
+static void drain_peer(void)
+{
+  ssize_t n;
+
+  while ((n = read(peer, readbuf + nread, sizeof(readbuf) - nread)) > 0) {
+    nread += n;
+  }
+}
+
+static void discard_peer(void)
+{
+  while (read(peer, scratch, sizeof(scratch)) > 0) {
+    ;
+  }
+}
+
+static void fill_from_peer(void)
+{
+  ssize_t n;
+
+  memset(scratch, 'x', sizeof(scratch));
+  while ((n = write(peer, scratch, sizeof(scratch))) > 0) {
+    peer_wrote += n;
+  }
+}
+
+// Returns the writev calls and bytes since the last time we looked
+static void writev_delta(int64_t *calls, int64_t *bytes)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, "sock");
+  int64_t c = ph_counter_scope_get(scope, 0);
+  int64_t b = ph_counter_scope_get(scope, 1);
+
+  ph_counter_scope_delref(scope);
+  *calls = c - last_writev;
+  *bytes = b - last_bytes;
+  last_writev = c;
+  last_bytes = b;
+}
+
+static void sock_cb(ph_sock_t *s, ph_iomask_t why, void *data)
+{
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("sock got why=%x", why);
+    ph_sched_stop();
+    return;
+  }
+
+  switch (mode) {
+    case MODE_BURST:
+      if (why & PH_IOMASK_WAKEUP) {
+        ph_stm_write(s->stream, MSG, MSG_LEN, NULL);
+        if (++writes % BURST == 0) {
+          // Let the flush happen, then look at what it did
+          ph_job_set_timer_in_ms(&driver, 50);
+        }
+      }
+      return;
+
+    case MODE_FILL:
+      // Until the kernel buffer is full too, each flush will drain
+      // the write buffer and tell us to write some more
+      if (why & (PH_IOMASK_WAKEUP|PH_IOMASK_DRAINED)) {
+        uint64_t n = sizeof(scratch);
+
+        while (n == sizeof(scratch)) {
+          if (!ph_stm_write(s->stream, scratch, sizeof(scratch), &n)) {
+            break;
+          }
+        }
+      }
+      return;
+
+    case MODE_DRAIN:
+      if (why & PH_IOMASK_DRAINED) {
+        got_drained = true;
+      }
+      return;
+
+    case MODE_HOLD:
+      return;
+
+    case MODE_CONSUME:
+      while (ph_bufq_len(s->rbuf)) {
+        consumed += ph_bufq_consume_mem(s->rbuf, scratch, sizeof(scratch));
+      }
+      if (consumed == peer_wrote) {
+        ph_job_set_timer_in_ms(&driver, 10);
+      }
+      return;
+  }
+}
+
+static int64_t sum_counters(const char *scope_name)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, scope_name);
+  int64_t values[32], sum = 0;
+  uint8_t i, n;
+
+  n = ph_counter_scope_get_view(scope, 32, values, NULL);
+  for (i = 0; i < n; i++) {
+    sum += values[i];
+  }
+  ph_counter_scope_delref(scope);
+  return sum;
+}
+
+static void check_stats(void)
+{
+  ph_sock_stats_entry_t top[4];
+
+  is(peer_wrote, sock->stats.bytes_in);
+  ok(sock->stats.bytes_out >= 2 * BURST * MSG_LEN &&
+      sock->stats.writes > 0 && sock->stats.reads > 0,
+      "%" PRIu64 " bytes out in %" PRIu64 " writes",
+      sock->stats.bytes_out, sock->stats.writes);
+  ok(sock->stats.max_wbuf >= ph_bufq_get_max_size(sock->wbuf) / 2,
+      "max_wbuf %" PRIu64, sock->stats.max_wbuf);
+
+  ok(ph_sock_stats_top(top, 4) == 1 && top[0].fd == sock->job.fd &&
+      top[0].stats.bytes_in == peer_wrote, "listed by ph_sock_stats_top");
+
+  is(1, sum_counters("sock.ttfb"));
+  ok(sum_counters("sock.write_drain") > 0, "write drain latencies");
+}
+
+static void burst(void)
+{
+  int i;
+
+  for (i = 0; i < BURST; i++) {
+    ph_sock_wakeup(sock);
+  }
+}
+
+static void drive(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  int64_t calls, bytes;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  switch (phase++) {
+    case 0:
+      // Each wakeup sends its own message
+      writev_delta(&calls, &bytes);
+      burst();
+      return;
+
+    case 1:
+      writev_delta(&calls, &bytes);
+      is(BURST * MSG_LEN, bytes);
+      ok(calls >= BURST / 2, "default policy: %" PRIi64 " writev calls",
+          calls);
+
+      ph_sock_set_write_policy(sock,
+          PH_SOCK_WRITE_COALESCE|PH_SOCK_WRITE_CORK|PH_SOCK_WRITE_NODELAY);
+      is(PH_SOCK_WRITE_COALESCE|PH_SOCK_WRITE_CORK|PH_SOCK_WRITE_NODELAY,
+          sock->write_policy);
+      burst();
+      return;
+
+    case 2:
+      writev_delta(&calls, &bytes);
+      is(BURST * MSG_LEN, bytes);
+      // The wakeups may straddle more than one batch
+      ok(calls <= 3, "coalesced: %" PRIi64 " writev calls, %" PRIi64
+          " bytes per call", calls, bytes / (calls ? calls : 1));
+      ok(ph_bufq_len(sock->wbuf) == 0, "nothing left behind");
+
+      drain_peer();
+      is(2 * BURST * MSG_LEN, nread);
+      ok(!memcmp(readbuf, MSG, MSG_LEN) &&
+          !memcmp(readbuf + nread - MSG_LEN, MSG, MSG_LEN), "content");
+
+      // The peer stops reading while we keep writing
+      mode = MODE_FILL;
+      ph_sock_wakeup(sock);
+      ph_job_set_timer_in_ms(&driver, 100);
+      return;
+
+    case 3:
+      ok(ph_bufq_above_watermark(sock->wbuf), "write buffer filled");
+      ok(ph_bufq_len(sock->wbuf) <= ph_bufq_get_max_size(sock->wbuf),
+          "write buffer held to %" PRIu64 " bytes",
+          ph_bufq_len(sock->wbuf));
+      mode = MODE_DRAIN;
+      // fall through
+
+    case 4:
+      // Read until the sock tells us that it has drained
+      discard_peer();
+      if (!got_drained) {
+        phase = 4;
+        ph_job_set_timer_in_ms(&driver, 10);
+        return;
+      }
+      ok(got_drained, "dispatched with PH_IOMASK_DRAINED");
+
+      // Now the other way around: the peer sends more than we'll hold
+      mode = MODE_HOLD;
+      fill_from_peer();
+      ph_job_set_timer_in_ms(&driver, 100);
+      return;
+
+    case 5:
+      ok(sock->read_paused, "stopped reading");
+      is(ph_bufq_get_max_size(sock->rbuf), ph_bufq_len(sock->rbuf));
+      mode = MODE_CONSUME;
+      ph_sock_wakeup(sock);
+      return;
+
+    case 6:
+      // The rest was left in the kernel until we made room for it
+      is(peer_wrote, consumed);
+      ok(!sock->read_paused, "reading again");
+      // Both buffers are empty, but the sock was busy a moment ago
+      ok(ph_sock_get_resident_size(sock) > 0, "buffers kept while busy");
+      check_stats();
+      ph_job_set_timer_in_ms(&driver, 4 * IDLE_RELEASE_MS);
+      return;
+
+    case 7:
+      // The emitter's collector gave the storage back
+      is(0, ph_sock_get_resident_size(sock));
+      ph_sched_stop();
+      return;
+  }
+}
+
+static void configure(void)
+{
+  ph_variant_t *cfg = ph_var_object(2);
+  ph_variant_t *nbio_cfg = ph_var_object(1);
+  ph_variant_t *sock_cfg = ph_var_object(1);
+
+  // Let the emitter go quiescent quickly, so that its collector runs
+  ph_var_object_set_claim_cstr(nbio_cfg, "max_sleep",
+      ph_var_int(IDLE_RELEASE_MS / 2));
+  ph_var_object_set_claim_cstr(sock_cfg, "idle_release",
+      ph_var_int(IDLE_RELEASE_MS));
+  ph_var_object_set_claim_cstr(cfg, "nbio", nbio_cfg);
+  ph_var_object_set_claim_cstr(cfg, "socket", sock_cfg);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+}
+
+int main(int argc, char **argv)
+{
+  int pair[2];
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(27);
+  configure();
+
+  is(PH_OK, ph_nbio_init(1));
+  ok(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0, "socketpair");
+  peer = pair[1];
+  ph_socket_set_nonblock(pair[0], true);
+  ph_socket_set_nonblock(peer, true);
+
+  sock = ph_sock_new_from_socket(pair[0], NULL, NULL);
+  is(0, ph_sock_get_resident_size(sock));
+  sock->callback = sock_cb;
+  ph_sock_enable(sock, true);
+
+  ph_job_init(&driver);
+  driver.callback = drive;
+  ph_job_set_timer_in_ms(&driver, 10);
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
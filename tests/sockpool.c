@@ -0,0 +1,248 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/sockpool.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define MAX_SERVERS 8
+
+static ph_sock_pool_t *pool;
+static ph_listener_t *lstn;
+static uint16_t port;
+static ph_job_t driver;
+static int phase = 0;
+static int outstanding = 0;
+static ph_sock_t *first_sock;
+static ph_sock_t *servers[MAX_SERVERS];
+
+static void server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+  int i;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    for (i = 0; i < MAX_SERVERS; i++) {
+      if (servers[i] == sock) {
+        servers[i] = NULL;
+      }
+    }
+    ph_sock_free(sock);
+    return;
+  }
+
+  while ((line = ph_sock_read_line(sock)) != NULL) {
+    ph_buf_delref(line);
+    ph_stm_printf(sock->stream, "pong\r\n");
+  }
+}
+
+static void acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  int i;
+
+  ph_unused_parameter(l);
+
+  for (i = 0; i < MAX_SERVERS; i++) {
+    if (!servers[i]) {
+      servers[i] = sock;
+      break;
+    }
+  }
+  sock->callback = server_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void client_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("client got why=%x in phase %d", why, phase);
+    ph_sched_stop();
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (!line) {
+    return;
+  }
+  ph_buf_delref(line);
+
+  // Done with this request; the connection can be reused
+  ph_sock_pool_checkin(sock);
+  if (--outstanding == 0) {
+    ph_job_set_timer_in_ms(&driver, 10);
+  }
+}
+
+static void got_sock(ph_sock_t *sock, int overall_status, int errcode,
+    const ph_sockaddr_t *addr, struct timeval *elapsed, void *arg)
+{
+  ph_unused_parameter(addr);
+  ph_unused_parameter(elapsed);
+  ph_unused_parameter(arg);
+
+  if (overall_status != PH_SOCK_CONNECT_SUCCESS) {
+    fail("checkout failed: %d %d", overall_status, errcode);
+    ph_sched_stop();
+    return;
+  }
+
+  if (phase == 2) {
+    ok(!sock->enabled, "checked out disabled");
+    ok(first_sock == sock, "reused the pooled connection");
+  } else if (!first_sock) {
+    first_sock = sock;
+  }
+
+  sock->callback = client_cb;
+  ph_stm_printf(sock->stream, "ping\r\n");
+  ph_sock_enable(sock, true);
+}
+
+static void checkout(void)
+{
+  outstanding++;
+  ph_sock_pool_checkout(pool, "127.0.0.1", port, NULL, got_sock, NULL);
+}
+
+// Bytes currently allocated for one of the pool's memtypes
+static int64_t live_bytes(const char *name)
+{
+  ph_mem_stats_t stats[8];
+  int i, n;
+
+  n = ph_mem_stat_facility("sockpool", 8, stats);
+  for (i = 0; i < n; i++) {
+    if (!strcmp(stats[i].def->name, name)) {
+      return stats[i].bytes;
+    }
+  }
+  return -1;
+}
+
+static void drive(ph_job_t *job, ph_iomask_t why, void *data)
+{
+  int i;
+
+  ph_unused_parameter(job);
+  ph_unused_parameter(why);
+  ph_unused_parameter(data);
+
+  switch (phase++) {
+    case 0:
+    case 1:
+      checkout();
+      return;
+
+    case 2:
+      // Only one of these will fit back into the pool
+      checkout();
+      checkout();
+      return;
+
+    case 3:
+      // The peer goes away while the connection is idle, and we
+      // check it out before it has been dispatched
+      for (i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i]) {
+          // Closing the fd is deferred; make the FIN go out now
+          ph_sock_shutdown(servers[i], PH_SOCK_SHUT_RDWR);
+          ph_sock_free(servers[i]);
+          servers[i] = NULL;
+        }
+      }
+      checkout();
+      return;
+
+    case 4:
+      // Let the idle timeout expire the last connection
+      ph_job_set_timer_in_ms(&driver, 500);
+      return;
+
+    case 5:
+      is(2, get_counter("sockpool.test", "hits"));
+      is(3, get_counter("sockpool.test", "misses"));
+      is(3, get_counter("sockpool.test", "connects"));
+      is(1, get_counter("sockpool.test", "stale"));
+      is(5, get_counter("sockpool.test", "checkins"));
+      is(1, get_counter("sockpool.test", "evicted"));
+      is(1, get_counter("sockpool.test", "expired"));
+      is(0, live_bytes("dest"));
+      // Leave one behind for ph_sock_pool_free() to close
+      checkout();
+      return;
+
+    case 6:
+      ok(live_bytes("dest") > 0, "pooled a connection");
+      // With one emitter, this all happens before it returns
+      ph_sock_pool_free(pool);
+      is(0, live_bytes("dest"));
+      is(0, live_bytes("shards"));
+      is(0, live_bytes("pool"));
+      ph_sched_stop();
+      return;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  ph_sockaddr_t addr;
+  struct timeval idle = { 0, 200000 };
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  plan_tests(18);
+
+  is(PH_OK, ph_nbio_init(1));
+
+  lstn = ph_listener_new("server", acceptor);
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+  is(PH_OK, ph_listener_bind(lstn, &addr));
+  {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)&sin, &len);
+    port = ntohs(sin.sin_port);
+  }
+  ph_listener_enable(lstn, true);
+
+  pool = ph_sock_pool_new("test", 1, &idle);
+  ok(pool != NULL, "made pool");
+
+  ph_job_init(&driver);
+  driver.callback = drive;
+  ph_job_set_timer_in_ms(&driver, 10);
+
+  is(PH_OK, ph_sched_run());
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
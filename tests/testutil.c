@@ -0,0 +1,115 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/counter.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+bool make_loopback_pair(ph_socket_t *server, ph_socket_t *client)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  ph_socket_t l;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  l = socket(AF_INET, SOCK_STREAM, 0);
+  if (l == -1 || bind(l, (struct sockaddr*)&sin, sizeof(sin)) ||
+      listen(l, 1) || getsockname(l, (struct sockaddr*)&sin, &len)) {
+    return false;
+  }
+
+  *client = socket(AF_INET, SOCK_STREAM, 0);
+  if (*client == -1 ||
+      connect(*client, (struct sockaddr*)&sin, sizeof(sin))) {
+    return false;
+  }
+  *server = accept(l, NULL, NULL);
+  close(l);
+  if (*server == -1) {
+    return false;
+  }
+
+  ph_socket_set_nonblock(*server, true);
+  ph_socket_set_nonblock(*client, true);
+  return true;
+}
+
+double tv_secs(struct timeval tv)
+{
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+void bench_usage_start(struct bench_usage *usage)
+{
+  getrusage(RUSAGE_SELF, &usage->ru);
+  gettimeofday(&usage->wall, NULL);
+}
+
+void bench_usage_report(struct bench_usage *usage, const char *label,
+    uint64_t bytes)
+{
+  struct rusage ru;
+  struct timeval now, diff, utime, stime;
+  double gb = bytes / (1024.0 * 1024.0 * 1024.0);
+
+  getrusage(RUSAGE_SELF, &ru);
+  gettimeofday(&now, NULL);
+  timersub(&now, &usage->wall, &diff);
+  timersub(&ru.ru_utime, &usage->ru.ru_utime, &utime);
+  timersub(&ru.ru_stime, &usage->ru.ru_stime, &stime);
+
+  diag("%-10s %7.1f MB/s  %6.0f ms CPU/GB (user %.0f, sys %.0f)",
+      label, bytes / tv_secs(diff) / (1024 * 1024),
+      (tv_secs(utime) + tv_secs(stime)) * 1000 / gb,
+      tv_secs(utime) * 1000 / gb, tv_secs(stime) * 1000 / gb);
+}
+
+int64_t get_counter(const char *scope_name, const char *name)
+{
+  ph_counter_scope_t *scope = ph_counter_scope_resolve(NULL, scope_name);
+  const char *names[16];
+  int64_t values[16];
+  uint8_t i, n;
+  int64_t res = -1;
+
+  if (!scope) {
+    return -1;
+  }
+  n = ph_counter_scope_get_view(scope, 16, values, names);
+  for (i = 0; i < n; i++) {
+    if (!strcmp(names[i], name)) {
+      res = values[i];
+    }
+  }
+  ph_counter_scope_delref(scope);
+  return res;
+}
+
+bool use_example_cert(SSL_CTX *ctx)
+{
+  // The example certificate is signed with SHA1
+  SSL_CTX_set_security_level(ctx, 0);
+  return SSL_CTX_use_PrivateKey_file(ctx, "examples/server.pem",
+        SSL_FILETYPE_PEM) == 1 &&
+    SSL_CTX_use_certificate_file(ctx, "examples/server.pem",
+        SSL_FILETYPE_PEM) == 1;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TESTS_TESTUTIL_H
+#define TESTS_TESTUTIL_H
+
+/* Helpers shared by the tests and benchmarks */
+
+#include "phenom/sysutil.h"
+#include "phenom/socket.h"
+#include <sys/resource.h>
+
+// Connects a pair of non-blocking TCP sockets over loopback
+bool make_loopback_pair(ph_socket_t *server, ph_socket_t *client);
+
+double tv_secs(struct timeval tv);
+
+// Where a benchmark run started, in wall clock and CPU time
+struct bench_usage {
+  struct timeval wall;
+  struct rusage ru;
+};
+
+void bench_usage_start(struct bench_usage *usage);
+
+// Reports the throughput and CPU cost of moving `bytes` since
+// bench_usage_start()
+void bench_usage_report(struct bench_usage *usage, const char *label,
+    uint64_t bytes);
+
+// Returns the value of a counter, or -1 if there is no such counter
+int64_t get_counter(const char *scope_name, const char *name);
+
+// Gives a server ctx the example key and certificate
+bool use_example_cert(SSL_CTX *ctx);
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -46,6 +46,60 @@ static void record_tick(ph_job_t *job, ph_iomask_t why,
   }
 }
 
+#define CLOCK_ITERS 10000000
+
+static double elapsed_secs(struct timeval start)
+{
+  struct timeval end, diff;
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+  return diff.tv_sec + (diff.tv_usec / 1000000.0);
+}
+
+// Compare the cost of the clock sources used on the hot paths
+static void bench_clocks(void)
+{
+  ph_thread_t *me = ph_thread_self();
+  struct timeval start, tv;
+  uint64_t last = 0, ns;
+  bool monotonic = true;
+  double secs;
+  int i;
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < CLOCK_ITERS; i++) {
+    gettimeofday(&tv, NULL);
+  }
+  secs = elapsed_secs(start);
+  diag("gettimeofday:          %.1fns/call", secs * 1e9 / CLOCK_ITERS);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < CLOCK_ITERS; i++) {
+    ph_thread_refresh_time(me);
+    ns = ph_time_now_ns();
+    if (ns < last) {
+      monotonic = false;
+    }
+    last = ns;
+  }
+  secs = elapsed_secs(start);
+  diag("ph_time_now_ns:        %.1fns/call", secs * 1e9 / CLOCK_ITERS);
+  ok(monotonic, "ph_time_now_ns never goes backwards");
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < CLOCK_ITERS; i++) {
+    ns = ph_time_now_ns();
+  }
+  secs = elapsed_secs(start);
+  diag("ph_time_now_ns cached: %.1fns/call", secs * 1e9 / CLOCK_ITERS);
+
+  tv.tv_sec = 1234;
+  tv.tv_usec = 567890;
+  tv = ph_ns_to_timeval(ph_timeval_to_ns(tv));
+  ok(tv.tv_sec == 1234 && tv.tv_usec == 567890, "timeval round trip");
+}
+
 int main(int argc, char **argv)
 {
   ph_job_t timer;
@@ -53,7 +107,7 @@ int main(int argc, char **argv)
   ph_unused_parameter(argv);
 
   ph_library_init();
-  plan_tests(8);
+  plan_tests(10);
 
   is(PH_OK, ph_nbio_init(0));
   is(PH_OK, ph_job_init(&timer));
@@ -64,6 +118,8 @@ int main(int argc, char **argv)
 
   is(PH_OK, ph_sched_run());
 
+  bench_clocks();
+
   return exit_status();
 }
 
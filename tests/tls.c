@@ -0,0 +1,227 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/counter.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define FILE_SIZE (64 * 1024)
+#define REQ "hello\r\n"
+
+static SSL_CTX *server_ctx, *client_ctx;
+static ph_sock_t *client;
+static int file_fd;
+static bool got_reply;
+static uint64_t file_bytes;
+static bool file_ok = true;
+static bool handshake_ok;
+static int server_handshakes;
+
+static unsigned char pattern(uint64_t off)
+{
+  return (unsigned char)(off % 251);
+}
+
+// Set on server_ctx; the sock has to chain to it
+static void server_info(const SSL *ssl, int where, int ret)
+{
+  ph_unused_parameter(ssl);
+  ph_unused_parameter(ret);
+
+  if (where & SSL_CB_HANDSHAKE_DONE) {
+    server_handshakes++;
+  }
+}
+
+static void server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (!line) {
+    return;
+  }
+  ph_buf_delref(line);
+
+  ph_stm_write(sock->stream, REQ, sizeof(REQ) - 1, NULL);
+  if (ph_sock_sendfile(sock, file_fd, 0, FILE_SIZE) != PH_OK) {
+    fail("sendfile: %s", strerror(errno));
+    ph_sched_stop();
+  }
+}
+
+static void acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->free_ssl_ctx = false;
+  ph_sock_openssl_enable(sock, SSL_new(server_ctx), false, NULL);
+  ph_sock_openssl_set_ktls(sock, true);
+  sock->callback = server_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void client_handshake(ph_sock_t *sock, int res)
+{
+  ph_unused_parameter(sock);
+  handshake_ok = res == 1;
+}
+
+static void client_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  unsigned char buf[4096];
+  ph_buf_t *line;
+  uint64_t i, n;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("client got why=%x", why);
+    ph_sched_stop();
+    return;
+  }
+
+  if (!got_reply) {
+    line = ph_sock_read_line(sock);
+    if (!line) {
+      return;
+    }
+    ph_buf_delref(line);
+    got_reply = true;
+  }
+
+  while ((n = ph_bufq_consume_mem(sock->rbuf, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < n; i++) {
+      if (buf[i] != pattern(file_bytes + i)) {
+        file_ok = false;
+      }
+    }
+    file_bytes += n;
+  }
+  if (file_bytes >= FILE_SIZE) {
+    ph_sched_stop();
+  }
+}
+
+static void make_file(void)
+{
+  char name[] = "/tmp/phenom-tls-XXXXXX";
+  unsigned char buf[FILE_SIZE];
+  uint64_t i;
+
+  for (i = 0; i < FILE_SIZE; i++) {
+    buf[i] = pattern(i);
+  }
+  file_fd = mkstemp(name);
+  unlink(name);
+  ok(file_fd != -1 && write(file_fd, buf, sizeof(buf)) == FILE_SIZE,
+      "made file");
+}
+
+static void connect_client(ph_listener_t *lstn)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  ph_socket_t s;
+  SSL *ssl;
+
+  getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)&sin, &len);
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  ok(connect(s, (struct sockaddr*)&sin, len) == 0, "connected");
+  ph_socket_set_nonblock(s, true);
+
+  client = ph_sock_new_from_socket(s, NULL, NULL);
+  client->free_ssl_ctx = false;
+  ssl = SSL_new(client_ctx);
+  ph_sock_openssl_enable(client, ssl, true, client_handshake);
+
+  // Not offloaded: the handshake hasn't happened yet
+  is(0, ph_openssl_ktls_enable(ssl, client->job.fd));
+  ok(errno == ENOTSUP || errno == ENOSYS, "refused: %s", strerror(errno));
+
+  ph_sock_openssl_set_ktls(client, true);
+  // Held back until the handshake is done
+  ph_stm_write(client->stream, REQ, sizeof(REQ) - 1, NULL);
+  client->callback = client_cb;
+  ph_sock_enable(client, true);
+}
+
+int main(int argc, char **argv)
+{
+  ph_counter_scope_t *scope;
+  ph_listener_t *lstn;
+  ph_sockaddr_t addr;
+  int64_t offloaded, fallback;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  ph_library_init_openssl();
+  plan_tests(13);
+
+  is(PH_OK, ph_nbio_init(1));
+  make_file();
+
+  server_ctx = SSL_CTX_new(SSLv23_server_method());
+  ok(use_example_cert(server_ctx), "loaded key and certificate");
+  SSL_CTX_set_info_callback(server_ctx, server_info);
+  client_ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+  // The sessions that kTLS can take over
+  SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_cipher_list(client_ctx, "ECDHE-RSA-AES128-GCM-SHA256");
+
+  lstn = ph_listener_new("tls", acceptor);
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+  ph_listener_bind(lstn, &addr);
+  ph_listener_enable(lstn, true);
+
+  connect_client(lstn);
+
+  is(PH_OK, ph_sched_run());
+
+  ok(handshake_ok, "handshake completed");
+  ok(server_handshakes > 0, "SSL_CTX info callback was called");
+  ok(got_reply, "request went through");
+  ok(file_ok && file_bytes == FILE_SIZE,
+      "received %" PRIu64 " bytes of file", file_bytes);
+
+  scope = ph_counter_scope_resolve(NULL, "sock");
+  offloaded = ph_counter_scope_get(scope, 4);
+  fallback = ph_counter_scope_get(scope, 5);
+  ph_counter_scope_delref(scope);
+  diag("%" PRIi64 " socks offloaded, %" PRIi64 " fell back",
+      offloaded, fallback);
+  is(2, offloaded + fallback);
+  ok(client->ktls_tx == (offloaded == 2), "client offload state");
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
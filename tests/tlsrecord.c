@@ -0,0 +1,299 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/configuration.h"
+#include "phenom/counter.h"
+#include "phenom/thread.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define SMALL_RECORD 1000
+#define SMALL_BYTES 16384
+#define IDLE_RESET_MS 100
+#define RESPONSE_SIZE 65536
+// Largest ciphertext that a small record could make
+#define SMALL_CIPHERTEXT (SMALL_RECORD + 64)
+// Too small for a full record
+#define SMALL_BUFFER 4096
+
+static SSL_CTX *server_ctx, *client_ctx;
+static struct sockaddr_in addr;
+static char response[RESPONSE_SIZE];
+
+// Lengths of the records that the client has received
+static uint32_t records[256];
+static uint32_t num_records;
+
+// How much of an "s" response has been written so far
+static uint32_t sent = RESPONSE_SIZE;
+
+// ssl_staged_bytes once the client is done with its responses
+static int64_t staged;
+
+// Writes as much of the response as the sock will take
+static void send_rest(ph_sock_t *sock)
+{
+  uint64_t n;
+
+  while (sent < RESPONSE_SIZE &&
+      ph_stm_write(sock->stream, response + sent, RESPONSE_SIZE - sent, &n)) {
+    sent += n;
+  }
+}
+
+// "w" asks for the response in one write, "p" for it in 100 byte pieces,
+// and "s" for it in as many writes as the buffers need
+static void server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+  uint32_t i;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  send_rest(sock);
+  while ((line = ph_sock_read_line(sock)) != NULL) {
+    if (ph_buf_mem(line)[0] == 's') {
+      sent = 0;
+      send_rest(sock);
+    } else if (ph_buf_mem(line)[0] == 'p') {
+      for (i = 0; i < RESPONSE_SIZE; i += 100) {
+        ph_stm_write(sock->stream, response + i,
+            MIN(100, RESPONSE_SIZE - i), NULL);
+      }
+    } else {
+      ph_stm_write(sock->stream, response, RESPONSE_SIZE, NULL);
+    }
+    ph_buf_delref(line);
+  }
+}
+
+static void acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->free_ssl_ctx = false;
+  ph_sock_openssl_enable(sock, SSL_new(server_ctx), false, NULL);
+  sock->callback = server_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void msg_cb(int write_p, int version, int content_type,
+    const void *buf, size_t len, SSL *ssl, void *arg)
+{
+  const uint8_t *hdr = buf;
+
+  ph_unused_parameter(version);
+  ph_unused_parameter(ssl);
+  ph_unused_parameter(arg);
+
+  if (write_p || content_type != SSL3_RT_HEADER || len != 5 ||
+      hdr[0] != SSL3_RT_APPLICATION_DATA ||
+      num_records == sizeof(records) / sizeof(records[0])) {
+    return;
+  }
+  records[num_records++] = (hdr[3] << 8) | hdr[4];
+}
+
+// Makes a request and checks that the response comes back
+static void read_response(SSL *ssl, const char *name, const char *req)
+{
+  static char got[RESPONSE_SIZE];
+  int n, total = 0;
+
+  memset(got, 0, sizeof(got));
+  num_records = 0;
+  SSL_write(ssl, req, strlen(req));
+  while (total < RESPONSE_SIZE) {
+    n = SSL_read(ssl, got + total, RESPONSE_SIZE - total);
+    if (n <= 0) {
+      break;
+    }
+    total += n;
+  }
+  is_int(RESPONSE_SIZE, total);
+  ok(!memcmp(response, got, RESPONSE_SIZE), "%s: data arrived intact", name);
+}
+
+// Makes a request and counts the small and full records of the response
+static void request(SSL *ssl, const char *name, const char *req,
+    uint32_t want_small, uint32_t want_full)
+{
+  uint32_t i, small = 0, full = 0, other = 0;
+
+  read_response(ssl, name, req);
+
+  for (i = 0; i < num_records; i++) {
+    if (records[i] <= SMALL_CIPHERTEXT) {
+      small++;
+    } else if (records[i] > SSL3_RT_MAX_PLAIN_LENGTH) {
+      full++;
+    } else {
+      other++;
+    }
+  }
+  diag("%s: %" PRIu32 " small, %" PRIu32 " full and %" PRIu32
+      " other records", name, small, full, other);
+  ok(small == want_small && full == want_full,
+      "%s: %" PRIu32 " small and %" PRIu32 " full records",
+      name, want_small, want_full);
+  // Only the tail of the response can be neither
+  ok(other <= 1, "%s: at most one partial record", name);
+}
+
+static void configure(int64_t small_record, int64_t max_buffer_size)
+{
+  ph_variant_t *cfg = ph_var_object(1);
+  ph_variant_t *sock_cfg = ph_var_object(4);
+
+  ph_var_object_set_claim_cstr(sock_cfg, "ssl_small_record_size",
+      ph_var_int(small_record));
+  ph_var_object_set_claim_cstr(sock_cfg, "ssl_small_record_bytes",
+      ph_var_int(SMALL_BYTES));
+  ph_var_object_set_claim_cstr(sock_cfg, "ssl_record_idle_reset",
+      ph_var_int(IDLE_RESET_MS));
+  if (max_buffer_size) {
+    ph_var_object_set_claim_cstr(sock_cfg, "max_buffer_size",
+        ph_var_int(max_buffer_size));
+  }
+  ph_var_object_set_claim_cstr(cfg, "socket", sock_cfg);
+  ph_config_set_global(cfg);
+  ph_var_delref(cfg);
+}
+
+// With buffers smaller than a full record, the records shrink to fit
+static void small_buffers(void)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  struct timeval timeout = { 5, 0 };
+  SSL *ssl;
+  uint32_t i, biggest = 0;
+
+  // Ask for full records, which the buffer can't hold
+  configure(0, SMALL_BUFFER);
+  ok(connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0, "connected");
+  // Fail rather than hang if the server stalls
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ssl = SSL_new(client_ctx);
+  SSL_set_fd(ssl, s);
+  SSL_set_msg_callback(ssl, msg_cb);
+  is_int(1, SSL_connect(ssl));
+
+  read_response(ssl, "small buffers", "s\r\n");
+  for (i = 0; i < num_records; i++) {
+    biggest = MAX(biggest, records[i]);
+  }
+  ok(biggest <= SMALL_BUFFER, "largest record was %" PRIu32 " bytes",
+      biggest);
+
+  SSL_free(ssl);
+  close(s);
+}
+
+static void *client(void *arg)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  SSL *ssl;
+  // The first SMALL_BYTES go in small records, and the rest in
+  // full ones but for the tail
+  uint32_t small = (SMALL_BYTES + SMALL_RECORD - 1) / SMALL_RECORD;
+  uint32_t full = (RESPONSE_SIZE - small * SMALL_RECORD) /
+    SSL3_RT_MAX_PLAIN_LENGTH;
+
+  ph_unused_parameter(arg);
+
+  ok(connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0, "connected");
+  ssl = SSL_new(client_ctx);
+  SSL_set_fd(ssl, s);
+  SSL_set_msg_callback(ssl, msg_cb);
+  is_int(1, SSL_connect(ssl));
+
+  request(ssl, "first response", "w\r\n", small, full);
+  // Still busy: straight to full records
+  request(ssl, "second response", "w\r\n", 0,
+      RESPONSE_SIZE / SSL3_RT_MAX_PLAIN_LENGTH);
+  // Small writes are gathered into full records
+  request(ssl, "pieces", "p\r\n", 0, RESPONSE_SIZE / SSL3_RT_MAX_PLAIN_LENGTH);
+  // After a pause we start small again
+  usleep(IDLE_RESET_MS * 3 * 1000);
+  request(ssl, "after idle", "w\r\n", small, full);
+
+  SSL_free(ssl);
+  close(s);
+  // Only the tails of the whole responses, which are gathered into
+  // a record, and the pieces were copied before being encrypted
+  staged = get_counter("sock", "ssl_staged_bytes");
+
+  small_buffers();
+  ph_sched_stop();
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  ph_listener_t *lstn;
+  ph_sockaddr_t laddr;
+  socklen_t len = sizeof(addr);
+  ph_thread_t *thr;
+  uint32_t i;
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  ph_library_init_openssl();
+  plan_tests(27);
+
+  configure(SMALL_RECORD, 0);
+  is(PH_OK, ph_nbio_init(1));
+
+  for (i = 0; i < sizeof(response); i++) {
+    response[i] = 'a' + (i % 26);
+  }
+
+  server_ctx = SSL_CTX_new(SSLv23_server_method());
+  ok(use_example_cert(server_ctx), "loaded key and certificate");
+  // Keep session tickets out of the records we count
+  SSL_CTX_set_num_tickets(server_ctx, 0);
+  client_ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+
+  lstn = ph_listener_new("tlsrecord", acceptor);
+  ph_sockaddr_set_v4(&laddr, "127.0.0.1", 0, 0);
+  ph_listener_bind(lstn, &laddr);
+  getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)&addr, &len);
+  ph_listener_enable(lstn, true);
+
+  thr = ph_thread_spawn(client, NULL);
+  is(PH_OK, ph_sched_run());
+  ph_thread_join(thr, NULL);
+
+  ok(staged >= RESPONSE_SIZE && staged < 2 * RESPONSE_SIZE,
+      "staged %" PRIi64 " bytes", staged);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
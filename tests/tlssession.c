@@ -0,0 +1,213 @@
+/*
+ * Copyright 2013-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phenom/job.h"
+#include "phenom/log.h"
+#include "phenom/sysutil.h"
+#include "phenom/listener.h"
+#include "phenom/counter.h"
+#include "tests/testutil.h"
+#include "tap.h"
+
+#define REQ "hello\r\n"
+
+static SSL_CTX *server_ctx, *ticket_ctx, *id_ctx;
+static uint16_t port;
+
+// Each connection, whether the client should have resumed, and with
+// which client ctx
+static struct {
+  const char *name;
+  SSL_CTX **ctx;
+  bool resumed;
+  bool rotate;
+} steps[] = {
+  { "tls1.3 first", &ticket_ctx, false, false },
+  { "tls1.3 ticket", &ticket_ctx, true, false },
+  { "tls1.3 retired ticket key", &ticket_ctx, false, true },
+  { "tls1.2 first", &id_ctx, false, false },
+  { "tls1.2 session id", &id_ctx, true, false },
+};
+#define NUM_STEPS (sizeof(steps) / sizeof(steps[0]))
+static uint32_t step;
+static bool offered[NUM_STEPS];
+
+static void server_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    ph_sock_free(sock);
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (!line) {
+    return;
+  }
+  ph_buf_delref(line);
+  ph_stm_write(sock->stream, REQ, sizeof(REQ) - 1, NULL);
+}
+
+static void acceptor(ph_listener_t *l, ph_sock_t *sock)
+{
+  ph_unused_parameter(l);
+
+  sock->free_ssl_ctx = false;
+  ph_sock_openssl_enable(sock, SSL_new(server_ctx), false, NULL);
+  sock->callback = server_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void start_step(void);
+
+static void client_cb(ph_sock_t *sock, ph_iomask_t why, void *data)
+{
+  ph_buf_t *line;
+
+  ph_unused_parameter(data);
+
+  if (why & (PH_IOMASK_ERR|PH_IOMASK_TIME)) {
+    fail("%s: client got why=%x", steps[step].name, why);
+    ph_sched_stop();
+    return;
+  }
+
+  line = ph_sock_read_line(sock);
+  if (!line) {
+    return;
+  }
+  ph_buf_delref(line);
+
+  is_int(steps[step].resumed, SSL_session_reused(sock->ssl));
+  diag("%s: %s", steps[step].name,
+      SSL_session_reused(sock->ssl) ? "resumed" : "full handshake");
+  ph_sock_free(sock);
+
+  if (++step == NUM_STEPS) {
+    ph_sched_stop();
+    return;
+  }
+  start_step();
+}
+
+static void connected(ph_sock_t *sock, int overall_status, int errcode,
+    const ph_sockaddr_t *addr, struct timeval *elapsed, void *arg)
+{
+  SSL *ssl;
+
+  ph_unused_parameter(addr);
+  ph_unused_parameter(elapsed);
+  ph_unused_parameter(arg);
+
+  if (overall_status != PH_SOCK_CONNECT_SUCCESS) {
+    fail("%s: connect: %s", steps[step].name, strerror(errcode));
+    ph_sched_stop();
+    return;
+  }
+
+  ssl = SSL_new(*steps[step].ctx);
+  offered[step] = ph_openssl_client_session_resume(ssl, "127.0.0.1", port);
+  sock->free_ssl_ctx = false;
+  ph_sock_openssl_enable(sock, ssl, true, NULL);
+  ph_stm_write(sock->stream, REQ, sizeof(REQ) - 1, NULL);
+  sock->callback = client_cb;
+  ph_sock_enable(sock, true);
+}
+
+static void start_step(void)
+{
+  if (steps[step].rotate) {
+    // Retire the key that issued our ticket
+    ph_openssl_rotate_ticket_keys();
+    ph_openssl_rotate_ticket_keys();
+    ph_openssl_rotate_ticket_keys();
+  }
+  ph_sock_resolve_and_connect("127.0.0.1", port, 0, NULL,
+      PH_SOCK_CONNECT_RESOLVE_SYSTEM, connected, NULL);
+}
+
+static SSL_CTX *make_client_ctx(void)
+{
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  is(PH_OK, ph_openssl_client_session_cache_enable(ctx));
+  return ctx;
+}
+
+int main(int argc, char **argv)
+{
+  ph_listener_t *lstn;
+  ph_sockaddr_t addr;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+
+  ph_unused_parameter(argc);
+  ph_unused_parameter(argv);
+
+  ph_library_init();
+  ph_library_init_openssl();
+  plan_tests(23);
+
+  is(PH_OK, ph_nbio_init(1));
+
+  server_ctx = SSL_CTX_new(SSLv23_server_method());
+  ok(use_example_cert(server_ctx), "loaded key and certificate");
+  is(PH_OK, ph_openssl_server_session_cache_enable(server_ctx));
+
+  ticket_ctx = make_client_ctx();
+  SSL_CTX_set_min_proto_version(ticket_ctx, TLS1_3_VERSION);
+  // Resumption through the server's session cache rather than tickets
+  id_ctx = make_client_ctx();
+  SSL_CTX_set_max_proto_version(id_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(id_ctx, SSL_OP_NO_TICKET);
+
+  lstn = ph_listener_new("tlssession", acceptor);
+  ph_sockaddr_set_v4(&addr, "127.0.0.1", 0, 0);
+  ph_listener_bind(lstn, &addr);
+  getsockname(ph_listener_get_fd(lstn), (struct sockaddr*)&sin, &len);
+  port = ntohs(sin.sin_port);
+  ph_listener_enable(lstn, true);
+
+  start_step();
+
+  is(PH_OK, ph_sched_run());
+  is_int(NUM_STEPS, step);
+
+  ok(!offered[0] && offered[1] && offered[2] && !offered[3] && offered[4],
+      "offered sessions when we had them");
+
+  is(2, get_counter("ssl_session", "client_misses"));
+  is(3, get_counter("ssl_session", "client_hits"));
+  ok(get_counter("ssl_session", "client_stores") >= 4, "client stores");
+  is(1, get_counter("ssl_session", "server_hits"));
+  is(1, get_counter("ssl_session", "tickets_resumed"));
+  is(1, get_counter("ssl_session", "tickets_unknown"));
+  ok(get_counter("ssl_session", "tickets_issued") >= 3, "issued tickets");
+  is(4, get_counter("ssl_session", "key_rotations"));
+
+  // Both ends of every connection
+  is(2 * (int64_t)NUM_STEPS, get_counter("sock", "ssl_handshakes"));
+  is(4, get_counter("sock", "ssl_resumed"));
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */